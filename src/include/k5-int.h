@@ -236,6 +236,7 @@ typedef unsigned char   u_char;
 #define KRB5_CONF_KCM_SOCKET                   "kcm_socket"
 #define KRB5_CONF_KDC                          "kdc"
 #define KRB5_CONF_KDCDEFAULTS                  "kdcdefaults"
+#define KRB5_CONF_KDC_CONNECTION_IDLE_TIMEOUT  "kdc_connection_idle_timeout"
 #define KRB5_CONF_KDC_DEFAULT_OPTIONS          "kdc_default_options"
 #define KRB5_CONF_KDC_LISTEN                   "kdc_listen"
 #define KRB5_CONF_KDC_MAX_DGRAM_REPLY_SIZE     "kdc_max_dgram_reply_size"
@@ -272,6 +273,7 @@ typedef unsigned char   u_char;
 #define KRB5_CONF_MAX_LIFE                     "max_life"
 #define KRB5_CONF_MAX_READERS                  "max_readers"
 #define KRB5_CONF_MAX_RENEWABLE_LIFE           "max_renewable_life"
+#define KRB5_CONF_MEM_RCACHE_MAX_RECORDS       "mem_rcache_max_records"
 #define KRB5_CONF_MODULE                       "module"
 #define KRB5_CONF_NOADDRESSES                  "noaddresses"
 #define KRB5_CONF_NOSYNC                       "nosync"
@@ -616,19 +618,45 @@ krb5_error_code krb5_unlock_file(krb5_context, int);
 krb5_error_code krb5_sendto_kdc(krb5_context, const krb5_data *,
                                 const krb5_data *, krb5_data *, int *, int);
 
+/* A request for k5_sendto_kdc_multi(). */
+typedef struct {
+    const krb5_data *message;
+    const krb5_data *realm;
+    int no_udp;
+    int use_master;             /* in/out, as for krb5_sendto_kdc() */
+    krb5_data reply;            /* out */
+    krb5_error_code code;       /* out */
+} k5_kdc_request;
+
+/*
+ * Send each of reqs to a KDC for its realm as krb5_sendto_kdc() would, with
+ * all of the exchanges in progress concurrently.  Set the reply or error code
+ * of each request.  Return an error only if the requests could not be
+ * attempted at all.
+ */
+krb5_error_code k5_sendto_kdc_multi(krb5_context context,
+                                    k5_kdc_request *reqs, size_t count);
+
 krb5_error_code krb5int_init_context_kdc(krb5_context *);
 
+/* The number of derived keys which can be cached on a krb5_key. */
+#define K5_DERIVED_KEY_SLOTS 16
+
 struct derived_key {
     krb5_data constant;
     krb5_key dkey;
-    struct derived_key *next;
 };
 
 /* Internal structure of an opaque key identifier */
 struct krb5_key_st {
     krb5_keyblock keyblock;
     int refcount;
-    struct derived_key *derived;
+    /*
+     * Cache of derived keys, so that a krb5_key can be shared between threads.
+     * Slots are filled in order and published with k5_atomic_cas_ptr(), and
+     * entries are not freed until the key is.
+     */
+    struct derived_key *derived[K5_DERIVED_KEY_SLOTS];
     /*
      * Cache of data private to the cipher implementation, which we
      * don't want to have to recompute for every operation.  This may
@@ -1245,6 +1273,15 @@ struct _krb5_context {
     /* TLS module vtable (if loaded) */
     struct k5_tls_vtable_st *tls;
 
+    /* KDC connections kept open for reuse by sendto_kdc.c */
+    struct sendto_conncache *kdc_conncache;
+
+    /* Keys which recently decrypted tickets in rd_req_dec.c */
+    struct rd_req_keycache *rd_req_keycache;
+
+    /* KCM daemon connection kept open for reuse by cc_kcm.c */
+    struct kcmio *kcm_idle_io;
+
     /* error detail info */
     struct errinfo err;
     char *err_fmt;
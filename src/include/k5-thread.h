@@ -393,6 +393,88 @@ static inline void k5_mutex_unlock(k5_mutex_t *m)
 #define k5_assert_locked        k5_mutex_assert_locked
 #define k5_assert_unlocked      k5_mutex_assert_unlocked
 
+/*
+ * Atomic operations, for publishing data to other threads without a mutex.
+ * k5_atomic_incr() and k5_atomic_decr() return the new value.
+ * k5_atomic_load_ptr() has acquire semantics.  k5_atomic_cas_ptr() replaces
+ * *ptr with newval if it is equal to oldval, with release semantics, and returns
+ * true if it did so.  Without a known atomics implementation these are plain
+ * operations, and objects using them must not be shared between threads.
+ */
+#if defined(__GNUC__) && defined(__ATOMIC_ACQUIRE)
+
+static inline int k5_atomic_incr(int *ptr)
+{
+    return __atomic_add_fetch(ptr, 1, __ATOMIC_RELAXED);
+}
+
+static inline int k5_atomic_decr(int *ptr)
+{
+    return __atomic_sub_fetch(ptr, 1, __ATOMIC_ACQ_REL);
+}
+
+static inline void *k5_atomic_load_ptr(void *const *ptr)
+{
+    return __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+}
+
+static inline int k5_atomic_cas_ptr(void **ptr, void *oldval, void *newval)
+{
+    return __atomic_compare_exchange_n(ptr, &oldval, newval, 0, __ATOMIC_ACQ_REL,
+                                       __ATOMIC_ACQUIRE);
+}
+
+#elif defined(_WIN32)
+
+static inline int k5_atomic_incr(int *ptr)
+{
+    return InterlockedIncrement((LONG volatile *)ptr);
+}
+
+static inline int k5_atomic_decr(int *ptr)
+{
+    return InterlockedDecrement((LONG volatile *)ptr);
+}
+
+static inline void *k5_atomic_load_ptr(void *const *ptr)
+{
+    return InterlockedCompareExchangePointer((PVOID volatile *)ptr, NULL,
+                                             NULL);
+}
+
+static inline int k5_atomic_cas_ptr(void **ptr, void *oldval, void *newval)
+{
+    return InterlockedCompareExchangePointer(ptr, newval, oldval) ==
+        oldval;
+}
+
+#else
+
+static inline int k5_atomic_incr(int *ptr)
+{
+    return ++*ptr;
+}
+
+static inline int k5_atomic_decr(int *ptr)
+{
+    return --*ptr;
+}
+
+static inline void *k5_atomic_load_ptr(void *const *ptr)
+{
+    return *ptr;
+}
+
+static inline int k5_atomic_cas_ptr(void **ptr, void *oldval, void *newval)
+{
+    if (*ptr != oldval)
+        return 0;
+    *ptr = newval;
+    return 1;
+}
+
+#endif
+
 /* Thread-specific data; implemented in a support file, because we'll
    need to keep track of some global data for cleanup purposes.
 
@@ -404,6 +486,7 @@ typedef enum {
     K5_KEY_GSS_KRB5_CCACHE_NAME,
     K5_KEY_GSS_KRB5_ERROR_MESSAGE,
     K5_KEY_GSS_SPNEGO_STATUS,
+    K5_KEY_CRYPTO_PRNG,
 #if defined(__MACH__) && defined(__APPLE__)
     K5_KEY_IPC_CONNECTION_INFO,
 #endif
@@ -92,13 +92,34 @@ typedef k5_tls_status
 typedef void
 (*k5_tls_free_handle_fn)(krb5_context context, k5_tls_handle handle);
 
-/* All functions are mandatory unless they are all null, in which case the
- * caller should assume that TLS is unsupported. */
+/*
+ * Serialize the TLS session negotiated for handle into *session_out, for later
+ * resumption with set_session.  Return 0 with an empty *session_out if there
+ * is no resumable session.
+ */
+typedef krb5_error_code
+(*k5_tls_get_session_fn)(krb5_context context, k5_tls_handle handle,
+                         krb5_data *session_out);
+
+/*
+ * Attempt to resume a serialized TLS session on a handle which has not yet
+ * been used for writing or reading.  If the session cannot be resumed, a full
+ * handshake will be performed.
+ */
+typedef krb5_error_code
+(*k5_tls_set_session_fn)(krb5_context context, k5_tls_handle handle,
+                         const krb5_data *session);
+
+/* All functions except get_session and set_session are mandatory unless they
+ * are all null, in which case the caller should assume that TLS is
+ * unsupported. */
 typedef struct k5_tls_vtable_st {
     k5_tls_setup_fn setup;
     k5_tls_write_fn write;
     k5_tls_read_fn read;
     k5_tls_free_handle_fn free_handle;
+    k5_tls_get_session_fn get_session;
+    k5_tls_set_session_fn set_session;
 } *k5_tls_vtable;
 
 #endif /* K5_TLS_H */
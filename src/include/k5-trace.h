@@ -105,6 +105,9 @@ void krb5int_trace(krb5_context context, const char *fmt, ...);
 
 #endif /* DISABLE_TRACING */
 
+#define TRACE_CC_COMPACT(c, cache, count)                               \
+    TRACE(c, "Compacted {ccache}, discarding {int} removed entries",   \
+          cache, count)
 #define TRACE_CC_DESTROY(c, cache)                      \
     TRACE(c, "Destroying ccache {ccache}", cache)
 #define TRACE_CC_GEN_NEW(c, cache)                                      \
@@ -354,6 +357,9 @@ void krb5int_trace(krb5_context context, const char *fmt, ...);
     TRACE(c, "Read DCE-style AP-REP, time {long}.{int}, seqnum {int}", \
           (long) ctime, (int) cusec, (int) seqnum)
 
+#define TRACE_RC_MEM_PERSIST_ERROR(c, fname, err)                      \
+    TRACE(c, "Error writing replay cache file {str}: {kerr}", fname, err)
+
 #define TRACE_RD_REQ_DECRYPT_ANY(c, princ, keyblock)                \
     TRACE(c, "Decrypted AP-REQ with server principal {princ}: "     \
           "{keyblock}", princ, keyblock)
@@ -399,6 +405,10 @@ void krb5int_trace(krb5_context context, const char *fmt, ...);
     TRACE(c, "Initiating TCP connection to {raddr}", raddr)
 #define TRACE_SENDTO_KDC_TCP_DISCONNECT(c, raddr)               \
     TRACE(c, "Terminating TCP connection to {raddr}", raddr)
+#define TRACE_SENDTO_KDC_TCP_KEEP(c, raddr)                     \
+    TRACE(c, "Keeping TCP connection to {raddr} open for reuse", raddr)
+#define TRACE_SENDTO_KDC_TCP_REUSE(c, raddr)                    \
+    TRACE(c, "Reusing TCP connection to {raddr}", raddr)
 #define TRACE_SENDTO_KDC_TCP_ERROR_CONNECT(c, raddr, err)               \
     TRACE(c, "TCP error connecting to {raddr}: {errno}", raddr, err)
 #define TRACE_SENDTO_KDC_TCP_ERROR_RECV(c, raddr, err)                  \
@@ -444,6 +454,8 @@ void krb5int_trace(krb5_context context, const char *fmt, ...);
           "not for \"{str}\"", hostname)
 #define TRACE_TLS_SERVER_NAME_MATCH(c, hostname)                        \
     TRACE(c, "TLS certificate name matched \"{str}\"", hostname)
+#define TRACE_TLS_SESSION_RESUMED(c)            \
+    TRACE(c, "Resumed TLS session")
 
 #define TRACE_TKT_CREDS(c, creds, cache)                            \
     TRACE(c, "Getting credentials {creds} using ccache {ccache}",   \
@@ -1230,6 +1230,7 @@ process_tcp_response(void *arg, krb5_error_code code, krb5_data *response)
 
     /* Queue outgoing response. */
     store_32_be(response->length, state->conn->lenbuf);
+    SG_SET(&state->conn->sgbuf[0], state->conn->lenbuf, 4);
     SG_SET(&state->conn->sgbuf[1], response->data, response->length);
     state->conn->sgp = state->conn->sgbuf;
     state->conn->sgnum = 2;
@@ -1373,6 +1374,7 @@ process_tcp_connection_write(verto_ctx *ctx, verto_ev *ev)
     SOCKET_WRITEV_TEMP tmp;
     ssize_t nwrote;
     int sock;
+    verto_ev *newev;
 
     conn = verto_get_private(ev);
     sock = verto_get_fd(ev);
@@ -1401,9 +1403,23 @@ process_tcp_connection_write(verto_ctx *ctx, verto_ev *ev)
             return;
     }
 
-    /* Finished sending.  We should go back to reading, though if we
-     * sent a FIELD_TOOLONG error in reply to a length with the high
-     * bit set, RFC 4120 says we have to close the TCP stream. */
+    /* Finished sending.  Go back to reading so that the client can send
+     * another request on this connection, unless we sent a FIELD_TOOLONG
+     * error in reply to a length with the high bit set, in which case RFC
+     * 4120 says we have to close the TCP stream. */
+    if (conn->sgnum == 0 && conn->msglen <= conn->bufsiz - 4) {
+        krb5_free_data(get_context(conn->handle), conn->response);
+        conn->response = NULL;
+        conn->offset = 0;
+        conn->start_time = time(0);
+        SG_SET(&conn->sgbuf[1], 0, 0);
+        newev = make_event(ctx, VERTO_EV_FLAG_IO_READ | VERTO_EV_FLAG_PERSIST,
+                           process_tcp_connection_read, sock, conn);
+        if (newev != NULL) {
+            verto_set_private(ev, NULL, NULL); /* Keep the fd and conn. */
+            remove_event_from_set(ev);
+        }
+    }
     verto_del(ev);
 }
 
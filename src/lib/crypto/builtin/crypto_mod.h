@@ -34,6 +34,72 @@
 #define CRYPTO_MOD_H
 
 #include <aes/aes.h>
+#include <sha1/shs.h>
 #include <sha2/sha2.h>
 
+/* Incremental hash state for the hash functions with a k5_hash_ops. */
+union k5_hash_ctx {
+    SHS_INFO sha1;
+    SHA256_CTX sha256;
+    SHA384_CTX sha384;
+};
+
+/* Chaining value of a hash function, for compressing single blocks. */
+union k5_hash_chain {
+    SHS_LONG sha1[5];
+    uint32_t sha256[8];
+    uint64_t sha384[8];
+};
+
+/*
+ * Incremental hash operations for a hash provider.  final writes
+ * hash->hashsize bytes to out.  get_chain gets the chaining value of a
+ * context which has processed a whole number of blocks; compress compresses
+ * one block from blocks[i] into *chains[i] for i from 0 to n - 1, possibly
+ * in parallel; and put_chain writes the first hash->hashsize bytes of a
+ * chaining value to out, as final would.
+ */
+struct k5_hash_ops {
+    const struct krb5_hash_provider *hash;
+    void (*init)(union k5_hash_ctx *ctx);
+    void (*update)(union k5_hash_ctx *ctx, const void *data,
+                   unsigned int len);
+    void (*final)(union k5_hash_ctx *ctx, unsigned char *out);
+    void (*get_chain)(const union k5_hash_ctx *ctx,
+                      union k5_hash_chain *chain);
+    void (*compress)(union k5_hash_chain *const *chains,
+                     const unsigned char *const *blocks, size_t n);
+    void (*put_chain)(const union k5_hash_chain *chain, unsigned char *out);
+};
+
+extern const struct k5_hash_ops k5_sha1_ops;
+extern const struct k5_hash_ops k5_sha256_ops;
+extern const struct k5_hash_ops k5_sha384_ops;
+
+/*
+ * HMAC state for a key, with the inner and outer padded key blocks already
+ * hashed.  Computing an HMAC from this state saves two compression function
+ * calls, which is half of the work per PBKDF2 iteration.
+ */
+struct k5_hmac_state {
+    const struct k5_hash_ops *ops;
+    union k5_hash_ctx inner, outer;
+};
+
+/* Initialize state for HMAC with hash and keyblock.  Return
+ * KRB5_CRYPTO_INTERNAL if hash has no k5_hash_ops. */
+krb5_error_code k5_hmac_init_state(const struct krb5_hash_provider *hash,
+                                   const krb5_keyblock *keyblock,
+                                   struct k5_hmac_state *state);
+
+/* Compute an HMAC over data using state, which is not modified. */
+krb5_error_code k5_hmac_from_state(const struct k5_hmac_state *state,
+                                   const krb5_crypto_iov *data,
+                                   size_t num_data, krb5_data *output);
+
+/* Finish an HMAC given ctx, a copy of state->inner which has been updated
+ * with the input data.  Write hashsize bytes to out and zap ctx. */
+void k5_hmac_final(const struct k5_hmac_state *state, union k5_hash_ctx *ctx,
+                   unsigned char *out);
+
 #endif /* CRYPTO_MOD_H */
@@ -31,12 +31,16 @@
  * Private per-key data to cache after first generation.  We don't
  * want to mess with the imported AES implementation too much, so
  * we'll just use two copies of its context, one for encryption and
- * one for decryption, and use the #rounds field as a flag for whether
- * we've initialized each half.
+ * one for decryption.  Both are expanded before the cache is published on
+ * the key, so that threads sharing the key only read it.
  */
 struct aes_key_info_cache {
     aes_ctx enc_ctx, dec_ctx;
     krb5_boolean aesni;
+#ifdef AESNI_INTRIN
+    krb5_boolean intrin;
+    unsigned char enc_sched[15 * 16], dec_sched[15 * 16];
+#endif
 };
 #define CACHE(X) ((struct aes_key_info_cache *)((X)->cache))
 
@@ -80,10 +84,8 @@ aesni_supported(krb5_key key)
 }
 
 static void
-aesni_expand_enc_key(krb5_key key)
+aesni_expand_enc_key(krb5_key key, struct aes_key_info_cache *cache)
 {
-    struct aes_key_info_cache *cache = CACHE(key);
-
     if (key->keyblock.length == 16)
         k5_iEncExpandKey128(key->keyblock.contents, cache->enc_ctx.k_sch);
     else
@@ -92,10 +94,8 @@ aesni_expand_enc_key(krb5_key key)
 }
 
 static void
-aesni_expand_dec_key(krb5_key key)
+aesni_expand_dec_key(krb5_key key, struct aes_key_info_cache *cache)
 {
-    struct aes_key_info_cache *cache = CACHE(key);
-
     if (key->keyblock.length == 16)
         k5_iDecExpandKey128(key->keyblock.contents, cache->dec_ctx.k_sch);
     else
@@ -141,64 +141,382 @@ aesni_dec(krb5_key key, unsigned char *data, size_t nblocks, unsigned char *iv)
 
 #define aesni_supported_by_cpu() FALSE
 #define aesni_supported(key) FALSE
-#define aesni_expand_enc_key(key)
-#define aesni_expand_dec_key(key)
+#define aesni_expand_enc_key(key, cache)
+#define aesni_expand_dec_key(key, cache)
 #define aesni_enc(key, data, nblocks, iv)
 #define aesni_dec(key, data, nblocks, iv)
 
 #endif
 
-/* out = out ^ in */
+#ifdef AESNI_INTRIN
+
+/*
+ * Use AES-NI intrinsics when possible.  Unlike the assembly functions above,
+ * this code decrypts eight CBC blocks at a time (using VAES when the CPU
+ * supports it), and can interleave the CBC encryption of several independent
+ * messages, whose blocks are chained separately.
+ */
+
+#include <cpuid.h>
+#include <immintrin.h>
+
+static k5_once_t intrin_once = K5_ONCE_INIT;
+static krb5_boolean intrin_available, vaes_available;
+
+static void
+check_intrin(void)
+{
+    unsigned int a, b, c, d;
+
+    if (!__get_cpuid(1, &a, &b, &c, &d) || !(c & (1 << 25)))
+        return;
+    intrin_available = TRUE;
+#ifdef AES_VAES
+    {
+        unsigned int xcr0, xcr0_hi;
+
+        /* VAES on YMM registers needs AVX2 and OS support for saving them. */
+        if (!(c & (1 << 27)) || !(c & (1 << 28)) ||
+            __get_cpuid_max(0, NULL) < 7)
+            return;
+        __asm__("xgetbv" : "=a" (xcr0), "=d" (xcr0_hi) : "c" (0));
+        if ((xcr0 & 6) != 6)
+            return;
+        __cpuid_count(7, 0, a, b, c, d);
+        vaes_available = (b & (1 << 5)) && (c & (1 << 9));
+    }
+#endif
+}
+
+static inline krb5_boolean
+intrin_supported_by_cpu(void)
+{
+    (void)k5_once(&intrin_once, check_intrin);
+    return intrin_available;
+}
+
+static inline krb5_boolean
+intrin_supported(krb5_key key)
+{
+    return CACHE(key)->intrin;
+}
+
+#define NROUNDS(key) ((key)->keyblock.length == 16 ? 10 : 14)
+
+/* Set round key i from round key i - n and the key assist vector t. */
+#define KEXP(i, n, t)                                                   \
+    do {                                                                \
+        __m128i k_ = rk[(i) - (n)];                                     \
+        k_ = _mm_xor_si128(k_, _mm_slli_si128(k_, 4));                  \
+        k_ = _mm_xor_si128(k_, _mm_slli_si128(k_, 4));                  \
+        k_ = _mm_xor_si128(k_, _mm_slli_si128(k_, 4));                  \
+        rk[i] = _mm_xor_si128(k_, t);                                   \
+    } while (0)
+#define KEXP_A(i, n, rcon)                                              \
+    KEXP(i, n, _mm_shuffle_epi32(_mm_aeskeygenassist_si128(rk[(i) - 1], \
+                                                           rcon), 0xFF))
+#define KEXP_B(i)                                                       \
+    KEXP(i, 2, _mm_shuffle_epi32(_mm_aeskeygenassist_si128(rk[(i) - 1], \
+                                                           0), 0xAA))
+
+/* Compute the encryption and decryption key schedules for key into cache. */
+__attribute__((target("aes,sse2")))
+static void
+intrin_expand_keys(krb5_key key, struct aes_key_info_cache *cache)
+{
+    const unsigned char *kp = key->keyblock.contents;
+    __m128i rk[15];
+    int i, nr = NROUNDS(key);
+
+    rk[0] = _mm_loadu_si128((const __m128i *)kp);
+    if (nr == 10) {
+        KEXP_A(1, 1, 0x01);
+        KEXP_A(2, 1, 0x02);
+        KEXP_A(3, 1, 0x04);
+        KEXP_A(4, 1, 0x08);
+        KEXP_A(5, 1, 0x10);
+        KEXP_A(6, 1, 0x20);
+        KEXP_A(7, 1, 0x40);
+        KEXP_A(8, 1, 0x80);
+        KEXP_A(9, 1, 0x1B);
+        KEXP_A(10, 1, 0x36);
+    } else {
+        rk[1] = _mm_loadu_si128((const __m128i *)(kp + 16));
+        KEXP_A(2, 2, 0x01);
+        KEXP_B(3);
+        KEXP_A(4, 2, 0x02);
+        KEXP_B(5);
+        KEXP_A(6, 2, 0x04);
+        KEXP_B(7);
+        KEXP_A(8, 2, 0x08);
+        KEXP_B(9);
+        KEXP_A(10, 2, 0x10);
+        KEXP_B(11);
+        KEXP_A(12, 2, 0x20);
+        KEXP_B(13);
+        KEXP_A(14, 2, 0x40);
+    }
+
+    /* The decryption schedule is the reverse of the encryption schedule, with
+     * InvMixColumns applied to the inner round keys. */
+    for (i = 0; i <= nr; i++) {
+        _mm_storeu_si128((__m128i *)&cache->enc_sched[i * BLOCK_SIZE], rk[i]);
+        _mm_storeu_si128((__m128i *)&cache->dec_sched[i * BLOCK_SIZE],
+                         (i == 0 || i == nr) ? rk[nr - i] :
+                         _mm_aesimc_si128(rk[nr - i]));
+    }
+    zap(rk, sizeof(rk));
+}
+
+/*
+ * CBC encrypt nsteps consecutive blocks of each of n independent chains in
+ * place, at ptrs[i] with chaining values ivs[i].  Interleaving the chains
+ * hides the latency of the AES round instructions.  Inline into the callers
+ * below, so that the loops over the chains are unrolled.
+ */
+__attribute__((target("aes,sse2"), always_inline))
 static inline void
-xorblock(const unsigned char *in, unsigned char *out)
+intrin_enc_chains(const unsigned char *sched, int nr,
+                  unsigned char *const *ptrs, unsigned char *const *ivs,
+                  size_t nsteps, size_t n)
 {
-    size_t q;
+    __m128i rk[15], v[8];
+    size_t i, s;
+    int r;
 
-    for (q = 0; q < BLOCK_SIZE; q += 4)
-        store_32_n(load_32_n(out + q) ^ load_32_n(in + q), out + q);
+    for (r = 0; r <= nr; r++)
+        rk[r] = _mm_loadu_si128((const __m128i *)&sched[r * BLOCK_SIZE]);
+    for (i = 0; i < n; i++)
+        v[i] = _mm_loadu_si128((const __m128i *)ivs[i]);
+    for (s = 0; s < nsteps; s++) {
+        for (i = 0; i < n; i++) {
+            v[i] = _mm_xor_si128(v[i], _mm_loadu_si128((const __m128i *)
+                                                       &ptrs[i][s * 16]));
+            v[i] = _mm_xor_si128(v[i], rk[0]);
+        }
+        for (r = 1; r < nr; r++) {
+            for (i = 0; i < n; i++)
+                v[i] = _mm_aesenc_si128(v[i], rk[r]);
+        }
+        for (i = 0; i < n; i++) {
+            v[i] = _mm_aesenclast_si128(v[i], rk[nr]);
+            _mm_storeu_si128((__m128i *)&ptrs[i][s * 16], v[i]);
+        }
+    }
+    for (i = 0; i < n; i++)
+        _mm_storeu_si128((__m128i *)ivs[i], v[i]);
 }
 
-static inline krb5_error_code
-init_key_cache(krb5_key key)
+#define DEFINE_ENC_CHAINS(n)                                            \
+    __attribute__((target("aes,sse2")))                                 \
+    static void                                                         \
+    intrin_enc_chains##n(const unsigned char *sched, int nr,            \
+                         unsigned char *const *ptrs,                    \
+                         unsigned char *const *ivs, size_t nsteps)      \
+    {                                                                   \
+        intrin_enc_chains(sched, nr, ptrs, ivs, nsteps, n);             \
+    }
+DEFINE_ENC_CHAINS(1)
+DEFINE_ENC_CHAINS(2)
+DEFINE_ENC_CHAINS(3)
+DEFINE_ENC_CHAINS(4)
+DEFINE_ENC_CHAINS(5)
+DEFINE_ENC_CHAINS(6)
+DEFINE_ENC_CHAINS(7)
+DEFINE_ENC_CHAINS(8)
+
+typedef void (*enc_chains_fn)(const unsigned char *, int,
+                              unsigned char *const *, unsigned char *const *,
+                              size_t);
+static const enc_chains_fn enc_chains_fns[8] = {
+    intrin_enc_chains1, intrin_enc_chains2, intrin_enc_chains3,
+    intrin_enc_chains4, intrin_enc_chains5, intrin_enc_chains6,
+    intrin_enc_chains7, intrin_enc_chains8
+};
+
+static inline void
+intrin_enc(krb5_key key, unsigned char *data, size_t nblocks,
+           unsigned char *iv)
 {
-    if (key->cache != NULL)
-        return 0;
-    key->cache = malloc(sizeof(struct aes_key_info_cache));
-    if (key->cache == NULL)
-        return ENOMEM;
-    CACHE(key)->enc_ctx.n_rnd = CACHE(key)->dec_ctx.n_rnd = 0;
-    CACHE(key)->aesni = aesni_supported_by_cpu();
-    return 0;
+    intrin_enc_chains1(CACHE(key)->enc_sched, NROUNDS(key), &data, &iv,
+                       nblocks);
+}
+
+/* CBC decrypt nblocks blocks of data in place, eight blocks at a time. */
+__attribute__((target("aes,sse2")))
+static void
+intrin_dec8(const unsigned char *sched, int nr, unsigned char *data,
+            size_t nblocks, unsigned char *iv)
+{
+    __m128i rk[15], c[8], v[8], prev;
+    size_t i;
+    int r;
+
+    for (r = 0; r <= nr; r++)
+        rk[r] = _mm_loadu_si128((const __m128i *)&sched[r * BLOCK_SIZE]);
+    prev = _mm_loadu_si128((const __m128i *)iv);
+    for (; nblocks >= 8; nblocks -= 8, data += 8 * BLOCK_SIZE) {
+        for (i = 0; i < 8; i++) {
+            c[i] = _mm_loadu_si128((const __m128i *)&data[i * BLOCK_SIZE]);
+            v[i] = _mm_xor_si128(c[i], rk[0]);
+        }
+        for (r = 1; r < nr; r++) {
+            for (i = 0; i < 8; i++)
+                v[i] = _mm_aesdec_si128(v[i], rk[r]);
+        }
+        for (i = 0; i < 8; i++) {
+            v[i] = _mm_aesdeclast_si128(v[i], rk[nr]);
+            v[i] = _mm_xor_si128(v[i], (i == 0) ? prev : c[i - 1]);
+            _mm_storeu_si128((__m128i *)&data[i * BLOCK_SIZE], v[i]);
+        }
+        prev = c[7];
+    }
+    for (; nblocks > 0; nblocks--, data += BLOCK_SIZE) {
+        c[0] = _mm_loadu_si128((const __m128i *)data);
+        v[0] = _mm_xor_si128(c[0], rk[0]);
+        for (r = 1; r < nr; r++)
+            v[0] = _mm_aesdec_si128(v[0], rk[r]);
+        v[0] = _mm_xor_si128(_mm_aesdeclast_si128(v[0], rk[nr]), prev);
+        _mm_storeu_si128((__m128i *)data, v[0]);
+        prev = c[0];
+    }
+    _mm_storeu_si128((__m128i *)iv, prev);
+}
+
+#ifdef AES_VAES
+
+/* CBC decrypt nblocks blocks of data in place, two blocks per instruction
+ * and eight blocks at a time. */
+__attribute__((target("vaes,avx2,aes")))
+static void
+vaes_dec8(const unsigned char *sched, int nr, unsigned char *data,
+          size_t nblocks, unsigned char *iv)
+{
+    __m256i rk[15], c[4], p[4], v[4];
+    __m128i prev;
+    size_t i;
+    int r;
+
+    for (r = 0; r <= nr; r++) {
+        rk[r] = _mm256_broadcastsi128_si256(
+            _mm_loadu_si128((const __m128i *)&sched[r * BLOCK_SIZE]));
+    }
+    prev = _mm_loadu_si128((const __m128i *)iv);
+    for (; nblocks >= 8; nblocks -= 8, data += 8 * BLOCK_SIZE) {
+        /* Load the ciphertext pairs and the preceding blocks they are
+         * chained with, before any output is stored. */
+        for (i = 0; i < 4; i++) {
+            c[i] = _mm256_loadu_si256((const __m256i *)&data[i * 32]);
+            v[i] = _mm256_xor_si256(c[i], rk[0]);
+        }
+        p[0] = _mm256_inserti128_si256(_mm256_castsi128_si256(prev),
+                                       _mm256_castsi256_si128(c[0]), 1);
+        for (i = 1; i < 4; i++)
+            p[i] = _mm256_loadu_si256((const __m256i *)&data[i * 32 - 16]);
+        for (r = 1; r < nr; r++) {
+            for (i = 0; i < 4; i++)
+                v[i] = _mm256_aesdec_epi128(v[i], rk[r]);
+        }
+        for (i = 0; i < 4; i++) {
+            v[i] = _mm256_aesdeclast_epi128(v[i], rk[nr]);
+            v[i] = _mm256_xor_si256(v[i], p[i]);
+            _mm256_storeu_si256((__m256i *)&data[i * 32], v[i]);
+        }
+        prev = _mm256_extracti128_si256(c[3], 1);
+    }
+    _mm_storeu_si128((__m128i *)iv, prev);
+    /* Avoid an AVX-SSE transition penalty in intrin_dec8() or the caller;
+     * the compiler does not always do this before a tail call. */
+    _mm256_zeroupper();
+    if (nblocks > 0)
+        intrin_dec8(sched, nr, data, nblocks, iv);
 }
 
+#else /* not AES_VAES */
+#define vaes_dec8 intrin_dec8
+#endif
+
 static inline void
-expand_enc_key(krb5_key key)
+intrin_dec(krb5_key key, unsigned char *data, size_t nblocks,
+           unsigned char *iv)
 {
-    if (CACHE(key)->enc_ctx.n_rnd)
-        return;
-    if (aesni_supported(key))
-        aesni_expand_enc_key(key);
-    else if (aes_enc_key(key->keyblock.contents, key->keyblock.length,
-                         &CACHE(key)->enc_ctx) != aes_good)
-        abort();
+    if (vaes_available && nblocks >= 8)
+        vaes_dec8(CACHE(key)->dec_sched, NROUNDS(key), data, nblocks, iv);
+    else
+        intrin_dec8(CACHE(key)->dec_sched, NROUNDS(key), data, nblocks, iv);
 }
 
+#else /* not AESNI_INTRIN */
+
+#define intrin_supported_by_cpu() FALSE
+#define intrin_supported(key) FALSE
+#define intrin_expand_keys(key, cache)
+#define intrin_enc(key, data, nblocks, iv)
+#define intrin_dec(key, data, nblocks, iv)
+
+#endif
+
+/* out = out ^ in */
 static inline void
-expand_dec_key(krb5_key key)
+xorblock(const unsigned char *in, unsigned char *out)
+{
+    size_t q;
+
+    for (q = 0; q < BLOCK_SIZE; q += 4)
+        store_32_n(load_32_n(out + q) ^ load_32_n(in + q), out + q);
+}
+
+/* Compute both key schedules for key into cache. */
+static void
+expand_keys(krb5_key key, struct aes_key_info_cache *cache)
 {
-    if (CACHE(key)->dec_ctx.n_rnd)
+#ifdef AESNI_INTRIN
+    if (cache->intrin) {
+        intrin_expand_keys(key, cache);
         return;
-    if (aesni_supported(key))
-        aesni_expand_dec_key(key);
-    else if (aes_dec_key(key->keyblock.contents, key->keyblock.length,
-                         &CACHE(key)->dec_ctx) != aes_good)
+    }
+#endif
+    if (cache->aesni) {
+        aesni_expand_enc_key(key, cache);
+        aesni_expand_dec_key(key, cache);
+    } else if (aes_enc_key(key->keyblock.contents, key->keyblock.length,
+                           &cache->enc_ctx) != aes_good ||
+               aes_dec_key(key->keyblock.contents, key->keyblock.length,
+                           &cache->dec_ctx) != aes_good) {
         abort();
+    }
+}
+
+/* Create and publish the cache for key if it does not yet exist.  If another
+ * thread sharing key publishes its cache first, discard ours. */
+static inline krb5_error_code
+init_key_cache(krb5_key key)
+{
+    struct aes_key_info_cache *cache;
+
+    if (k5_atomic_load_ptr(&key->cache) != NULL)
+        return 0;
+    cache = malloc(sizeof(*cache));
+    if (cache == NULL)
+        return ENOMEM;
+    cache->aesni = aesni_supported_by_cpu();
+#ifdef AESNI_INTRIN
+    cache->intrin = intrin_supported_by_cpu();
+#endif
+    expand_keys(key, cache);
+    if (!k5_atomic_cas_ptr(&key->cache, NULL, cache))
+        zapfree(cache, sizeof(*cache));
+    return 0;
 }
 
 /* CBC encrypt nblocks blocks of data in place, using and updating iv. */
 static inline void
 cbc_enc(krb5_key key, unsigned char *data, size_t nblocks, unsigned char *iv)
 {
+    if (intrin_supported(key)) {
+        intrin_enc(key, data, nblocks, iv);
+        return;
+    }
     if (aesni_supported(key)) {
         aesni_enc(key, data, nblocks, iv);
         return;
@@ -217,6 +535,10 @@ cbc_dec(krb5_key key, unsigned char *data, size_t nblocks, unsigned char *iv)
 {
     unsigned char last_cipherblock[BLOCK_SIZE];
 
+    if (intrin_supported(key)) {
+        intrin_dec(key, data, nblocks, iv);
+        return;
+    }
     if (aesni_supported(key)) {
         aesni_dec(key, data, nblocks, iv);
         return;
@@ -243,7 +565,6 @@ krb5int_aes_encrypt(krb5_key key, const krb5_data *ivec, krb5_crypto_iov *data,
 
     if (init_key_cache(key))
         return ENOMEM;
-    expand_enc_key(key);
 
     k5_iov_cursor_init(&cursor, data, num_data, BLOCK_SIZE, FALSE);
 
@@ -300,12 +621,12 @@ krb5int_aes_decrypt(krb5_key key, const krb5_data *ivec, krb5_crypto_iov *data,
 {
     unsigned char iv[BLOCK_SIZE], dummy_iv[BLOCK_SIZE], block[BLOCK_SIZE];
     unsigned char blockN2[BLOCK_SIZE], blockN1[BLOCK_SIZE];
-    size_t input_length, last_len, nblocks, ncontig;
+    unsigned char blocks[8 * BLOCK_SIZE];
+    size_t input_length, last_len, nblocks, ncontig, i;
     struct iov_cursor cursor;
 
     if (init_key_cache(key))
         return ENOMEM;
-    expand_dec_key(key);
 
     k5_iov_cursor_init(&cursor, data, num_data, BLOCK_SIZE, FALSE);
 
@@ -335,10 +656,14 @@ krb5int_aes_decrypt(krb5_key key, const krb5_data *ivec, krb5_crypto_iov *data,
             iov_cursor_advance(&cursor, ncontig);
             nblocks -= ncontig;
         } else {
-            k5_iov_cursor_get(&cursor, block);
-            cbc_dec(key, block, 1, iv);
-            k5_iov_cursor_put(&cursor, block);
-            nblocks--;
+            /* Gather up to eight blocks so they can be decrypted together. */
+            ncontig = (nblocks - 2 > 8) ? 8 : nblocks - 2;
+            for (i = 0; i < ncontig; i++)
+                k5_iov_cursor_get(&cursor, blocks + i * BLOCK_SIZE);
+            cbc_dec(key, blocks, ncontig, iv);
+            for (i = 0; i < ncontig; i++)
+                k5_iov_cursor_put(&cursor, blocks + i * BLOCK_SIZE);
+            nblocks -= ncontig;
         }
     }
 
@@ -365,6 +690,428 @@ krb5int_aes_decrypt(krb5_key key, const krb5_data *ivec, krb5_crypto_iov *data,
     return 0;
 }
 
+#if defined(AESNI_INTRIN) && defined(SHA_NI)
+
+/*
+ * Single-pass encrypt-then-mac for the aes-sha2 enctypes using HMAC-SHA-256.
+ * CBC encryption is limited by the latency of the AES instructions, which
+ * leaves the CPU room to execute the SHA instructions of the HMAC at the same
+ * time if the two are interleaved in one loop.  The HMAC input is the cipher
+ * state followed by the SIGN_IOV iovs in order, so an hmac_walk hashes the
+ * iovs up to the position the cipher has reached, and runs of contiguous
+ * blocks are hashed within the stitched loop.  (Decryption is not limited
+ * this way, so it gains nothing from stitching.)
+ */
+
+struct hmac_walk {
+    SHA256_CTX *ctx;
+    const krb5_crypto_iov *data;
+    size_t iov, pos;            /* hashed up to here */
+};
+
+/* Hash w's iovs up to position pos of iov i, or to the end if i is the iov
+ * count. */
+static void
+hmac_walk_to(struct hmac_walk *w, size_t i, size_t pos)
+{
+    const krb5_crypto_iov *iov;
+    size_t end;
+
+    while (w->iov < i || (w->iov == i && w->pos < pos)) {
+        iov = &w->data[w->iov];
+        end = (w->iov == i) ? pos : iov->data.length;
+        if (SIGN_IOV(iov) && end > w->pos)
+            k5_sha256_update(w->ctx, iov->data.data + w->pos, end - w->pos);
+        if (w->iov == i) {
+            w->pos = pos;
+        } else {
+            w->iov++;
+            w->pos = 0;
+        }
+    }
+}
+
+/* Add nblocks blocks compressed outside of k5_sha256_update() to the byte
+ * count of m. */
+static void
+sha256_count_blocks(SHA256_CTX *m, size_t nblocks)
+{
+    unsigned int old_sz = m->sz[0];
+
+    m->sz[0] += nblocks * SHA256_BLOCK_SIZE * 8;
+    if (m->sz[0] < old_sz)
+        m->sz[1]++;
+}
+
+/* Return the number of AES blocks needed to bring m to a SHA-256 block
+ * boundary, or SIZE_MAX if it can't be done with whole AES blocks. */
+static size_t
+sha256_lead_blocks(const SHA256_CTX *m)
+{
+    size_t offset = (m->sz[0] / 8) % SHA256_BLOCK_SIZE;
+
+    if (offset % BLOCK_SIZE != 0)
+        return SIZE_MAX;
+    return (SHA256_BLOCK_SIZE - offset) % SHA256_BLOCK_SIZE / BLOCK_SIZE;
+}
+
+/* CBC encrypt ngroups groups of four blocks of data in place, updating iv,
+ * and compress the ciphertext of each group into the SHA-256 state words in
+ * counter while the next group is encrypted. */
+__attribute__((target("aes,sha,sse4.1,ssse3")))
+static void
+stitch_enc(const unsigned char *sched, int nr, unsigned char *data,
+           size_t ngroups, unsigned char *iv, uint32_t counter[8])
+{
+    const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+                                         0x0405060700010203ULL);
+    __m128i rk[15], v, c[4], msg[4], abef, cdgh, abef_save, cdgh_save, tmp;
+    size_t k;
+    int i, r;
+
+    for (r = 0; r <= nr; r++)
+        rk[r] = _mm_loadu_si128((const __m128i *)&sched[r * BLOCK_SIZE]);
+    v = _mm_loadu_si128((const __m128i *)iv);
+    SHA256_NI_LOAD(counter, abef, cdgh, tmp);
+
+    for (k = 0; k <= ngroups; k++, data += 4 * BLOCK_SIZE) {
+        if (k > 0) {
+            for (i = 0; i < 4; i++)
+                msg[i] = _mm_shuffle_epi8(c[i], bswap);
+        }
+        if (k < ngroups) {
+            for (i = 0; i < 4; i++) {
+                v = _mm_xor_si128(v, _mm_loadu_si128((const __m128i *)
+                                                     &data[i * BLOCK_SIZE]));
+                v = _mm_xor_si128(v, rk[0]);
+                for (r = 1; r < nr; r++)
+                    v = _mm_aesenc_si128(v, rk[r]);
+                v = _mm_aesenclast_si128(v, rk[nr]);
+                _mm_storeu_si128((__m128i *)&data[i * BLOCK_SIZE], v);
+                c[i] = v;
+            }
+        }
+        if (k > 0) {
+            abef_save = abef;
+            cdgh_save = cdgh;
+            SHA256_NI_ROUNDS(abef, cdgh, msg, tmp);
+            abef = _mm_add_epi32(abef, abef_save);
+            cdgh = _mm_add_epi32(cdgh, cdgh_save);
+        }
+    }
+
+    _mm_storeu_si128((__m128i *)iv, v);
+    SHA256_NI_STORE(counter, abef, cdgh, tmp);
+}
+
+/* CBC encrypt nblocks contiguous blocks of data in place, updating iv, and
+ * hash the ciphertext into m. */
+static void
+stitch_encrypt(krb5_key key, unsigned char *data, size_t nblocks,
+               unsigned char *iv, SHA256_CTX *m)
+{
+    size_t n, ngroups;
+
+    /* Use the stitched loop once the hash is at a block boundary. */
+    n = sha256_lead_blocks(m);
+    n = (n > nblocks) ? nblocks : n;
+    if (n > 0) {
+        intrin_enc(key, data, n, iv);
+        k5_sha256_update(m, data, n * BLOCK_SIZE);
+        data += n * BLOCK_SIZE;
+        nblocks -= n;
+    }
+    ngroups = nblocks / 4;
+    if (ngroups > 0) {
+        stitch_enc(CACHE(key)->enc_sched, NROUNDS(key), data, ngroups, iv,
+                   m->counter);
+        sha256_count_blocks(m, ngroups);
+        data += ngroups * 4 * BLOCK_SIZE;
+        nblocks -= ngroups * 4;
+    }
+    if (nblocks > 0) {
+        intrin_enc(key, data, nblocks, iv);
+        k5_sha256_update(m, data, nblocks * BLOCK_SIZE);
+    }
+}
+
+/* Encrypt data with CBC-CTS as krb5int_aes_encrypt() does, hashing the
+ * ciphertext with w. */
+static void
+cts_hmac_encrypt(krb5_key key, unsigned char *iv, struct iov_cursor *cursor,
+                 size_t nblocks, struct hmac_walk *w)
+{
+    unsigned char block[BLOCK_SIZE];
+    unsigned char blockN2[BLOCK_SIZE], blockN1[BLOCK_SIZE];
+    size_t ncontig;
+
+    while (nblocks > 2) {
+        ncontig = iov_cursor_contig_blocks(cursor);
+        if (ncontig > 0) {
+            /* Hash up to this run of blocks, then encrypt and hash the run
+             * together.  Don't touch the last two blocks. */
+            ncontig = (ncontig > nblocks - 2) ? nblocks - 2 : ncontig;
+            hmac_walk_to(w, cursor->out_iov, cursor->out_pos);
+            stitch_encrypt(key, iov_cursor_ptr(cursor), ncontig, iv, w->ctx);
+            iov_cursor_advance(cursor, ncontig);
+            w->iov = cursor->out_iov;
+            w->pos = cursor->out_pos;
+            nblocks -= ncontig;
+        } else {
+            k5_iov_cursor_get(cursor, block);
+            intrin_enc(key, block, 1, iv);
+            k5_iov_cursor_put(cursor, block);
+            hmac_walk_to(w, cursor->out_iov, cursor->out_pos);
+            nblocks--;
+        }
+    }
+
+    /* Encrypt the last two blocks as krb5int_aes_encrypt() does. */
+    k5_iov_cursor_get(cursor, blockN2);
+    k5_iov_cursor_get(cursor, blockN1);
+    intrin_enc(key, blockN2, 1, iv);
+    intrin_enc(key, blockN1, 1, iv);
+    k5_iov_cursor_put(cursor, blockN1);
+    k5_iov_cursor_put(cursor, blockN2);
+    hmac_walk_to(w, cursor->iov_count, 0);
+}
+
+krb5_error_code
+krb5int_cts_hmac_encrypt(const struct krb5_enc_provider *enc,
+                         const struct krb5_hash_provider *hash, krb5_key ke,
+                         const krb5_data *ki, const krb5_data *ivec,
+                         krb5_crypto_iov *data, size_t num_data,
+                         krb5_data *cksum)
+{
+    krb5_error_code ret;
+    struct k5_hmac_state state;
+    union k5_hash_ctx ctx;
+    struct hmac_walk w;
+    struct iov_cursor cursor;
+    krb5_keyblock kb;
+    unsigned char iv[BLOCK_SIZE];
+    size_t input_length, nblocks;
+
+    if (enc != &krb5int_enc_aes128 && enc != &krb5int_enc_aes256)
+        return ENOTSUP;
+    if (hash != &krb5int_hash_sha256 || !k5_sha256_ni_supported())
+        return ENOTSUP;
+    ret = init_key_cache(ke);
+    if (ret)
+        return ret;
+    if (!intrin_supported(ke))
+        return ENOTSUP;
+    input_length = iov_total_length(data, num_data, FALSE);
+    nblocks = (input_length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (nblocks <= 2)
+        return ENOTSUP;
+    if (cksum->length < hash->hashsize)
+        return KRB5_BAD_MSIZE;
+
+    kb.length = ki->length;
+    kb.contents = (uint8_t *)ki->data;
+    if (k5_hmac_init_state(hash, &kb, &state) != 0)
+        return ENOTSUP;
+
+    if (ivec != NULL)
+        memcpy(iv, ivec->data, BLOCK_SIZE);
+    else
+        memset(iv, 0, BLOCK_SIZE);
+    ctx = state.inner;
+    k5_sha256_update(&ctx.sha256, iv, BLOCK_SIZE);
+    w.ctx = &ctx.sha256;
+    w.data = data;
+    w.iov = w.pos = 0;
+
+    k5_iov_cursor_init(&cursor, data, num_data, BLOCK_SIZE, FALSE);
+    cts_hmac_encrypt(ke, iv, &cursor, nblocks, &w);
+    k5_hmac_final(&state, &ctx, (unsigned char *)cksum->data);
+    cksum->length = hash->hashsize;
+
+    if (ivec != NULL)
+        memcpy(ivec->data, iv, BLOCK_SIZE);
+    zap(&state, sizeof(state));
+    return 0;
+}
+
+#else /* not (AESNI_INTRIN and SHA_NI) */
+
+krb5_error_code
+krb5int_cts_hmac_encrypt(const struct krb5_enc_provider *enc,
+                         const struct krb5_hash_provider *hash, krb5_key ke,
+                         const krb5_data *ki, const krb5_data *ivec,
+                         krb5_crypto_iov *data, size_t num_data,
+                         krb5_data *cksum)
+{
+    return ENOTSUP;
+}
+
+#endif /* not (AESNI_INTRIN and SHA_NI) */
+
+#ifdef AESNI_INTRIN
+
+/*
+ * State of one message being encrypted by aes_encrypt_multi().  Each step
+ * encrypts the run blocks at ptr, which are either contiguous blocks of the
+ * message or a single block copied into one of the buffers here.
+ */
+struct enc_lane {
+    const struct crypt_msg *msg;
+    struct iov_cursor cursor;
+    size_t nblocks;             /* blocks left before the last two */
+    int tail;                   /* last two blocks encrypted so far */
+    unsigned char *ptr;
+    size_t run;
+    krb5_boolean staged;        /* ptr is lane->block */
+    unsigned char iv[BLOCK_SIZE], block[BLOCK_SIZE];
+    unsigned char blockN2[BLOCK_SIZE], blockN1[BLOCK_SIZE];
+};
+
+/* Start encrypting msg in lane.  Return FALSE if msg is shorter than two
+ * blocks, and therefore isn't encrypted with CBC-CTS. */
+static krb5_boolean
+lane_start(struct enc_lane *lane, const struct crypt_msg *msg)
+{
+    size_t nblocks;
+
+    nblocks = iov_total_length(msg->data, msg->num_data, FALSE);
+    nblocks = (nblocks + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (nblocks < 2)
+        return FALSE;
+    lane->msg = msg;
+    k5_iov_cursor_init(&lane->cursor, msg->data, msg->num_data, BLOCK_SIZE,
+                       FALSE);
+    lane->nblocks = nblocks - 2;
+    lane->tail = 0;
+    if (msg->ivec != NULL)
+        memcpy(lane->iv, msg->ivec->data, BLOCK_SIZE);
+    else
+        memset(lane->iv, 0, BLOCK_SIZE);
+    return TRUE;
+}
+
+/* Set lane->ptr and lane->run to the next blocks to encrypt. */
+static void
+lane_next(struct enc_lane *lane)
+{
+    size_t ncontig;
+
+    lane->run = 1;
+    lane->staged = FALSE;
+    if (lane->nblocks > 0) {
+        /* Encrypt contiguous blocks in place if we can, but don't touch the
+         * last two blocks. */
+        ncontig = iov_cursor_contig_blocks(&lane->cursor);
+        if (ncontig > 0) {
+            lane->ptr = iov_cursor_ptr(&lane->cursor);
+            lane->run = (ncontig > lane->nblocks) ? lane->nblocks : ncontig;
+        } else {
+            k5_iov_cursor_get(&lane->cursor, lane->block);
+            lane->ptr = lane->block;
+            lane->staged = TRUE;
+        }
+    } else if (lane->tail == 0) {
+        k5_iov_cursor_get(&lane->cursor, lane->blockN2);
+        k5_iov_cursor_get(&lane->cursor, lane->blockN1);
+        lane->ptr = lane->blockN2;
+    } else {
+        lane->ptr = lane->blockN1;
+    }
+}
+
+/* Finish a step of nsteps blocks in lane.  Return TRUE if the lane's message
+ * is now encrypted. */
+static krb5_boolean
+lane_finish(struct enc_lane *lane, size_t nsteps)
+{
+    if (lane->nblocks > 0) {
+        if (lane->staged)
+            k5_iov_cursor_put(&lane->cursor, lane->block);
+        else
+            iov_cursor_advance(&lane->cursor, nsteps);
+        lane->nblocks -= nsteps;
+        return FALSE;
+    }
+    if (lane->tail++ == 0)
+        return FALSE;
+
+    /* Put the last two blocks back in reverse order, possibly truncating the
+     * encrypted second-to-last block. */
+    k5_iov_cursor_put(&lane->cursor, lane->blockN1);
+    k5_iov_cursor_put(&lane->cursor, lane->blockN2);
+    if (lane->msg->ivec != NULL)
+        memcpy(lane->msg->ivec->data, lane->iv, BLOCK_SIZE);
+    return TRUE;
+}
+
+#define NLANES 8
+
+/* Encrypt count messages with key, interleaving up to eight messages at a
+ * time. */
+static krb5_error_code
+aes_encrypt_multi(krb5_key key, const struct crypt_msg *msgs, size_t count)
+{
+    struct enc_lane lanes[NLANES];
+    unsigned char *ptrs[NLANES], *ivs[NLANES];
+    size_t i, nactive = 0, next = 0, nsteps;
+    krb5_error_code ret;
+
+    if (init_key_cache(key))
+        return ENOMEM;
+    if (count == 1 || !intrin_supported(key)) {
+        for (i = 0; i < count; i++) {
+            ret = krb5int_aes_encrypt(key, msgs[i].ivec, msgs[i].data,
+                                      msgs[i].num_data);
+            if (ret)
+                return ret;
+        }
+        return 0;
+    }
+
+    for (;;) {
+        /* Start the next messages in any free lanes. */
+        while (nactive < NLANES && next < count) {
+            if (lane_start(&lanes[nactive], &msgs[next])) {
+                nactive++;
+            } else {
+                ret = krb5int_aes_encrypt(key, msgs[next].ivec,
+                                          msgs[next].data,
+                                          msgs[next].num_data);
+                if (ret)
+                    return ret;
+            }
+            next++;
+        }
+        if (nactive == 0)
+            break;
+
+        /* Advance every lane by as many blocks as they all have ready. */
+        nsteps = SIZE_MAX;
+        for (i = 0; i < nactive; i++) {
+            lane_next(&lanes[i]);
+            ptrs[i] = lanes[i].ptr;
+            ivs[i] = lanes[i].iv;
+            if (lanes[i].run < nsteps)
+                nsteps = lanes[i].run;
+        }
+        enc_chains_fns[nactive - 1](CACHE(key)->enc_sched, NROUNDS(key),
+                                    ptrs, ivs, nsteps);
+
+        /* Retire finished lanes, moving the last lane into each one. */
+        for (i = 0; i < nactive;) {
+            if (lane_finish(&lanes[i], nsteps))
+                lanes[i] = lanes[--nactive];
+            else
+                i++;
+        }
+    }
+    return 0;
+}
+
+#else /* not AESNI_INTRIN */
+#define aes_encrypt_multi NULL
+#endif
+
 static krb5_error_code
 aes_init_state(const krb5_keyblock *key, krb5_keyusage usage,
                krb5_data *state)
@@ -391,7 +1138,8 @@ const struct krb5_enc_provider krb5int_enc_aes128 = {
     NULL,
     aes_init_state,
     krb5int_default_free_state,
-    aes_key_cleanup
+    aes_key_cleanup,
+    aes_encrypt_multi
 };
 
 const struct krb5_enc_provider krb5int_enc_aes256 = {
@@ -402,5 +1150,6 @@ const struct krb5_enc_provider krb5int_enc_aes256 = {
     NULL,
     aes_init_state,
     krb5int_default_free_state,
-    aes_key_cleanup
+    aes_key_cleanup,
+    aes_encrypt_multi
 };
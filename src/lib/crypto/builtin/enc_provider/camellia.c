@@ -30,8 +30,9 @@
 /*
  * Private per-key data to cache after first generation.  We don't want to mess
  * with the imported Camellia implementation too much, so we'll just use two
- * copies of its context, one for encryption and one for decryption, and use
- * the keybitlen field as a flag for whether we've initialized each half.
+ * copies of its context, one for encryption and one for decryption.  Both are
+ * expanded before the cache is published on the key, so that threads sharing
+ * the key only read it.
  */
 struct camellia_key_info_cache {
     camellia_ctx enc_ctx, dec_ctx;
@@ -48,36 +49,26 @@ xorblock(const unsigned char *in, unsigned char *out)
         store_32_n(load_32_n(out + q) ^ load_32_n(in + q), out + q);
 }
 
+/* Create and publish the cache for key if it does not yet exist.  If another
+ * thread sharing key publishes its cache first, discard ours. */
 static inline krb5_error_code
 init_key_cache(krb5_key key)
 {
-    if (key->cache != NULL)
+    struct camellia_key_info_cache *cache;
+
+    if (k5_atomic_load_ptr(&key->cache) != NULL)
         return 0;
-    key->cache = malloc(sizeof(struct camellia_key_info_cache));
-    if (key->cache == NULL)
+    cache = malloc(sizeof(*cache));
+    if (cache == NULL)
         return ENOMEM;
-    CACHE(key)->enc_ctx.keybitlen = CACHE(key)->dec_ctx.keybitlen = 0;
-    return 0;
-}
-
-static inline void
-expand_enc_key(krb5_key key)
-{
-    if (CACHE(key)->enc_ctx.keybitlen)
-        return;
     if (camellia_enc_key(key->keyblock.contents, key->keyblock.length,
-                         &CACHE(key)->enc_ctx) != camellia_good)
-        abort();
-}
-
-static inline void
-expand_dec_key(krb5_key key)
-{
-    if (CACHE(key)->dec_ctx.keybitlen)
-        return;
-    if (camellia_dec_key(key->keyblock.contents, key->keyblock.length,
-                         &CACHE(key)->dec_ctx) != camellia_good)
+                         &cache->enc_ctx) != camellia_good ||
+        camellia_dec_key(key->keyblock.contents, key->keyblock.length,
+                         &cache->dec_ctx) != camellia_good)
         abort();
+    if (!k5_atomic_cas_ptr(&key->cache, NULL, cache))
+        zapfree(cache, sizeof(*cache));
+    return 0;
 }
 
 /* CBC encrypt nblocks blocks of data in place, using and updating iv. */
@@ -122,7 +113,6 @@ krb5int_camellia_encrypt(krb5_key key, const krb5_data *ivec,
 
     if (init_key_cache(key))
         return ENOMEM;
-    expand_enc_key(key);
 
     k5_iov_cursor_init(&cursor, data, num_data, BLOCK_SIZE, FALSE);
 
@@ -184,7 +174,6 @@ krb5int_camellia_decrypt(krb5_key key, const krb5_data *ivec,
 
     if (init_key_cache(key))
         return ENOMEM;
-    expand_dec_key(key);
 
     k5_iov_cursor_init(&cursor, data, num_data, BLOCK_SIZE, FALSE);
 
@@ -257,7 +246,6 @@ krb5int_camellia_cbc_mac(krb5_key key, const krb5_crypto_iov *data,
 
     if (init_key_cache(key))
         return ENOMEM;
-    expand_enc_key(key);
 
     if (ivec != NULL)
         memcpy(iv, ivec->data, BLOCK_SIZE);
@@ -60,3 +60,61 @@ const struct krb5_hash_provider krb5int_hash_sha1 = {
     SHS_DATASIZE,
     k5_sha1_hash
 };
+
+static void
+sha1_init(union k5_hash_ctx *ctx)
+{
+    shsInit(&ctx->sha1);
+}
+
+static void
+sha1_update(union k5_hash_ctx *ctx, const void *data, unsigned int len)
+{
+    shsUpdate(&ctx->sha1, data, len);
+}
+
+static void
+sha1_final(union k5_hash_ctx *ctx, unsigned char *out)
+{
+    unsigned int i;
+
+    shsFinal(&ctx->sha1);
+    for (i = 0; i < sizeof(ctx->sha1.digest) / sizeof(ctx->sha1.digest[0]);
+         i++)
+        store_32_be(ctx->sha1.digest[i], &out[i * 4]);
+}
+
+static void
+sha1_get_chain(const union k5_hash_ctx *ctx, union k5_hash_chain *chain)
+{
+    memcpy(chain->sha1, ctx->sha1.digest, sizeof(chain->sha1));
+}
+
+static void
+sha1_compress(union k5_hash_chain *const *chains,
+              const unsigned char *const *blocks, size_t n)
+{
+    SHS_LONG *digests[8];
+    size_t i, j, len;
+
+    for (i = 0; i < n; i += len) {
+        len = (n - i < 8) ? n - i : 8;
+        for (j = 0; j < len; j++)
+            digests[j] = chains[i + j]->sha1;
+        shsCompressMulti(digests, blocks + i, len);
+    }
+}
+
+static void
+sha1_put_chain(const union k5_hash_chain *chain, unsigned char *out)
+{
+    unsigned int i;
+
+    for (i = 0; i < sizeof(chain->sha1) / sizeof(chain->sha1[0]); i++)
+        store_32_be(chain->sha1[i], &out[i * 4]);
+}
+
+const struct k5_hash_ops k5_sha1_ops = {
+    &krb5int_hash_sha1, sha1_init, sha1_update, sha1_final, sha1_get_chain,
+    sha1_compress, sha1_put_chain
+};
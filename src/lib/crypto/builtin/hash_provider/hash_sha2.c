@@ -86,3 +86,110 @@ const struct krb5_hash_provider krb5int_hash_sha384 = {
     SHA384_BLOCK_SIZE,
     k5_sha384_hash
 };
+
+static void
+sha256_init(union k5_hash_ctx *ctx)
+{
+    k5_sha256_init(&ctx->sha256);
+}
+
+static void
+sha256_update(union k5_hash_ctx *ctx, const void *data, unsigned int len)
+{
+    k5_sha256_update(&ctx->sha256, data, len);
+}
+
+static void
+sha256_final(union k5_hash_ctx *ctx, unsigned char *out)
+{
+    k5_sha256_final(out, &ctx->sha256);
+}
+
+static void
+sha384_init(union k5_hash_ctx *ctx)
+{
+    k5_sha384_init(&ctx->sha384);
+}
+
+static void
+sha384_update(union k5_hash_ctx *ctx, const void *data, unsigned int len)
+{
+    k5_sha384_update(&ctx->sha384, data, len);
+}
+
+static void
+sha384_final(union k5_hash_ctx *ctx, unsigned char *out)
+{
+    k5_sha384_final(out, &ctx->sha384);
+}
+
+static void
+sha256_get_chain(const union k5_hash_ctx *ctx, union k5_hash_chain *chain)
+{
+    memcpy(chain->sha256, ctx->sha256.counter, sizeof(chain->sha256));
+}
+
+static void
+sha256_compress(union k5_hash_chain *const *chains,
+                const unsigned char *const *blocks, size_t n)
+{
+    uint32_t *counters[8];
+    size_t i, j, len;
+
+    for (i = 0; i < n; i += len) {
+        len = (n - i < 8) ? n - i : 8;
+        for (j = 0; j < len; j++)
+            counters[j] = chains[i + j]->sha256;
+        k5_sha256_compress_multi(counters, blocks + i, len);
+    }
+}
+
+static void
+sha256_put_chain(const union k5_hash_chain *chain, unsigned char *out)
+{
+    int i;
+
+    for (i = 0; i < 8; i++)
+        store_32_be(chain->sha256[i], out + i * 4);
+}
+
+static void
+sha384_get_chain(const union k5_hash_ctx *ctx, union k5_hash_chain *chain)
+{
+    memcpy(chain->sha384, ctx->sha384.counter, sizeof(chain->sha384));
+}
+
+static void
+sha384_compress(union k5_hash_chain *const *chains,
+                const unsigned char *const *blocks, size_t n)
+{
+    uint64_t *counters[8];
+    size_t i, j, len;
+
+    for (i = 0; i < n; i += len) {
+        len = (n - i < 8) ? n - i : 8;
+        for (j = 0; j < len; j++)
+            counters[j] = chains[i + j]->sha384;
+        k5_sha512_compress_multi(counters, blocks + i, len);
+    }
+}
+
+static void
+sha384_put_chain(const union k5_hash_chain *chain, unsigned char *out)
+{
+    int i;
+
+    /* SHA-384 output is the first six words of the chaining value. */
+    for (i = 0; i < 6; i++)
+        store_64_be(chain->sha384[i], out + i * 8);
+}
+
+const struct k5_hash_ops k5_sha256_ops = {
+    &krb5int_hash_sha256, sha256_init, sha256_update, sha256_final,
+    sha256_get_chain, sha256_compress, sha256_put_chain
+};
+
+const struct k5_hash_ops k5_sha384_ops = {
+    &krb5int_hash_sha384, sha384_init, sha384_update, sha384_final,
+    sha384_get_chain, sha384_compress, sha384_put_chain
+};
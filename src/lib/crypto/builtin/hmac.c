@@ -47,11 +47,11 @@
  * and text is the data being protected
  */
 
-krb5_error_code
-krb5int_hmac_keyblock(const struct krb5_hash_provider *hash,
-                      const krb5_keyblock *keyblock,
-                      const krb5_crypto_iov *data, size_t num_data,
-                      krb5_data *output)
+/* Compute an HMAC using only the hash function of hash. */
+static krb5_error_code
+hmac_generic(const struct krb5_hash_provider *hash,
+             const krb5_keyblock *keyblock, const krb5_crypto_iov *data,
+             size_t num_data, krb5_data *output)
 {
     unsigned char *xorkey = NULL, *ihash = NULL;
     unsigned int i;
@@ -111,6 +111,103 @@ cleanup:
     return ret;
 }
 
+static const struct k5_hash_ops *const hash_ops_list[] = {
+    &k5_sha1_ops, &k5_sha256_ops, &k5_sha384_ops
+};
+
+krb5_error_code
+k5_hmac_init_state(const struct krb5_hash_provider *hash,
+                   const krb5_keyblock *keyblock, struct k5_hmac_state *state)
+{
+    const struct k5_hash_ops *ops = NULL;
+    unsigned char xorkey[SHA384_BLOCK_SIZE];
+    size_t i;
+
+    for (i = 0; i < sizeof(hash_ops_list) / sizeof(*hash_ops_list); i++) {
+        if (hash_ops_list[i]->hash == hash)
+            ops = hash_ops_list[i];
+    }
+    if (ops == NULL || hash->blocksize > sizeof(xorkey) ||
+        keyblock->length > hash->blocksize)
+        return KRB5_CRYPTO_INTERNAL;
+    state->ops = ops;
+
+    /* Hash the inner padded key. */
+    memset(xorkey, 0x36, hash->blocksize);
+    for (i = 0; i < keyblock->length; i++)
+        xorkey[i] ^= keyblock->contents[i];
+    ops->init(&state->inner);
+    ops->update(&state->inner, xorkey, hash->blocksize);
+
+    /* Hash the outer padded key. */
+    memset(xorkey, 0x5c, hash->blocksize);
+    for (i = 0; i < keyblock->length; i++)
+        xorkey[i] ^= keyblock->contents[i];
+    ops->init(&state->outer);
+    ops->update(&state->outer, xorkey, hash->blocksize);
+
+    zap(xorkey, sizeof(xorkey));
+    return 0;
+}
+
+krb5_error_code
+k5_hmac_from_state(const struct k5_hmac_state *state,
+                   const krb5_crypto_iov *data, size_t num_data,
+                   krb5_data *output)
+{
+    const struct k5_hash_ops *ops = state->ops;
+    size_t hashsize = ops->hash->hashsize;
+    union k5_hash_ctx ctx;
+    size_t i;
+
+    if (output->length < hashsize)
+        return KRB5_BAD_MSIZE;
+
+    /* Continue the inner hash over the input data. */
+    ctx = state->inner;
+    for (i = 0; i < num_data; i++) {
+        if (SIGN_IOV(&data[i]))
+            ops->update(&ctx, data[i].data.data, data[i].data.length);
+    }
+    k5_hmac_final(state, &ctx, (unsigned char *)output->data);
+    output->length = hashsize;
+    return 0;
+}
+
+void
+k5_hmac_final(const struct k5_hmac_state *state, union k5_hash_ctx *ctx,
+              unsigned char *out)
+{
+    const struct k5_hash_ops *ops = state->ops;
+    unsigned char ihash[SHA384_DIGEST_LENGTH];
+
+    ops->final(ctx, ihash);
+
+    /* Continue the outer hash over the inner hash value. */
+    *ctx = state->outer;
+    ops->update(ctx, ihash, ops->hash->hashsize);
+    ops->final(ctx, out);
+
+    zap(ctx, sizeof(*ctx));
+    zap(ihash, sizeof(ihash));
+}
+
+krb5_error_code
+krb5int_hmac_keyblock(const struct krb5_hash_provider *hash,
+                      const krb5_keyblock *keyblock,
+                      const krb5_crypto_iov *data, size_t num_data,
+                      krb5_data *output)
+{
+    struct k5_hmac_state state;
+    krb5_error_code ret;
+
+    if (k5_hmac_init_state(hash, keyblock, &state) != 0)
+        return hmac_generic(hash, keyblock, data, num_data, output);
+    ret = k5_hmac_from_state(&state, data, num_data, output);
+    zap(&state, sizeof(state));
+    return ret;
+}
+
 krb5_error_code
 krb5int_hmac(const struct krb5_hash_provider *hash, krb5_key key,
              const krb5_crypto_iov *data, size_t num_data,
@@ -118,3 +215,153 @@ krb5int_hmac(const struct krb5_hash_provider *hash, krb5_key key,
 {
     return krb5int_hmac_keyblock(hash, &key->keyblock, data, num_data, output);
 }
+
+/*
+ * For batched HMACs with hashes with k5_hash_ops, the padded key blocks are
+ * hashed once.  The signed data of each short message, followed by the hash
+ * padding, is laid out in up to LANE_BLOCKS blocks, and the inner hashes of
+ * the messages are computed in parallel lanes, one block at a time.  The
+ * outer hash of every message is a single block after the padded key block,
+ * so those are also computed in parallel.  Longer messages are hashed one at
+ * a time from the saved state.
+ */
+
+#define MAX_BLOCK_SIZE SHA384_BLOCK_SIZE
+#define LANE_BLOCKS 4
+#define MAX_LANES 8
+
+struct hmac_lane {
+    union k5_hash_chain chain;
+    unsigned char blocks[LANE_BLOCKS * MAX_BLOCK_SIZE];
+    size_t nblocks;
+    krb5_data *output;
+};
+
+/* Lay out the signed data of msg and the hash padding in lane, as they would
+ * follow the inner padded key block.  Return false if they don't fit. */
+static krb5_boolean
+init_lane(struct hmac_lane *lane, const struct k5_hmac_state *state,
+          struct cksum_msg *msg)
+{
+    const struct k5_hash_ops *ops = state->ops;
+    size_t bsize = ops->hash->blocksize, len = 0, i;
+    unsigned char *p;
+
+    for (i = 0; i < msg->num_data; i++) {
+        if (SIGN_IOV(&msg->data[i]))
+            len += msg->data[i].data.length;
+    }
+
+    /* The padding is at least a 0x80 byte and a length field of bsize / 8
+     * bytes. */
+    if (len > LANE_BLOCKS * bsize - 1 - bsize / 8)
+        return FALSE;
+    lane->nblocks = (len + 1 + bsize / 8 + bsize - 1) / bsize;
+
+    memset(lane->blocks, 0, lane->nblocks * bsize);
+    p = lane->blocks;
+    for (i = 0; i < msg->num_data; i++) {
+        if (SIGN_IOV(&msg->data[i]) && msg->data[i].data.length > 0) {
+            memcpy(p, msg->data[i].data.data, msg->data[i].data.length);
+            p += msg->data[i].data.length;
+        }
+    }
+    *p = 0x80;
+    store_32_be((bsize + len) * 8, lane->blocks + lane->nblocks * bsize - 4);
+
+    ops->get_chain(&state->inner, &lane->chain);
+    lane->output = &msg->output;
+    return TRUE;
+}
+
+/* Compute the HMACs of the n messages laid out in lanes. */
+static void
+hash_lanes(const struct k5_hmac_state *state, struct hmac_lane *lanes,
+           size_t n)
+{
+    const struct k5_hash_ops *ops = state->ops;
+    size_t bsize = ops->hash->blocksize, hsize = ops->hash->hashsize, b, l, m;
+    union k5_hash_chain *chains[MAX_LANES];
+    const unsigned char *blocks[MAX_LANES];
+    krb5_data *out;
+
+    /* Compute the inner hashes, compressing block b of each lane which has
+     * one. */
+    for (b = 0; b < LANE_BLOCKS; b++) {
+        m = 0;
+        for (l = 0; l < n; l++) {
+            if (lanes[l].nblocks > b) {
+                chains[m] = &lanes[l].chain;
+                blocks[m++] = lanes[l].blocks + b * bsize;
+            }
+        }
+        if (m == 0)
+            break;
+        ops->compress(chains, blocks, m);
+    }
+
+    /* Compute the outer hashes over the inner hash values. */
+    for (l = 0; l < n; l++) {
+        memset(lanes[l].blocks, 0, bsize);
+        ops->put_chain(&lanes[l].chain, lanes[l].blocks);
+        lanes[l].blocks[hsize] = 0x80;
+        store_32_be((bsize + hsize) * 8, lanes[l].blocks + bsize - 4);
+        ops->get_chain(&state->outer, &lanes[l].chain);
+        chains[l] = &lanes[l].chain;
+        blocks[l] = lanes[l].blocks;
+    }
+    ops->compress(chains, blocks, n);
+
+    for (l = 0; l < n; l++) {
+        out = lanes[l].output;
+        ops->put_chain(&lanes[l].chain, (unsigned char *)out->data);
+        out->length = hsize;
+    }
+}
+
+krb5_error_code
+krb5int_hmac_keyblock_multi(const struct krb5_hash_provider *hash,
+                            const krb5_keyblock *keyblock,
+                            struct cksum_msg *msgs, size_t count)
+{
+    struct k5_hmac_state state;
+    struct hmac_lane lanes[MAX_LANES];
+    krb5_error_code ret = 0;
+    size_t i, n = 0;
+
+    for (i = 0; i < count; i++) {
+        if (msgs[i].output.length < hash->hashsize)
+            return KRB5_BAD_MSIZE;
+    }
+
+    if (k5_hmac_init_state(hash, keyblock, &state) != 0) {
+        for (i = 0; i < count && ret == 0; i++) {
+            ret = hmac_generic(hash, keyblock, msgs[i].data, msgs[i].num_data,
+                               &msgs[i].output);
+        }
+        return ret;
+    }
+
+    for (i = 0; i < count && ret == 0; i++) {
+        if (!init_lane(&lanes[n], &state, &msgs[i])) {
+            ret = k5_hmac_from_state(&state, msgs[i].data, msgs[i].num_data,
+                                     &msgs[i].output);
+        } else if (++n == MAX_LANES) {
+            hash_lanes(&state, lanes, n);
+            n = 0;
+        }
+    }
+    if (ret == 0 && n > 0)
+        hash_lanes(&state, lanes, n);
+
+    zap(lanes, sizeof(lanes));
+    zap(&state, sizeof(state));
+    return ret;
+}
+
+krb5_error_code
+krb5int_hmac_multi(const struct krb5_hash_provider *hash, krb5_key key,
+                   struct cksum_msg *msgs, size_t count)
+{
+    return krb5int_hmac_keyblock_multi(hash, &key->keyblock, msgs, count);
+}
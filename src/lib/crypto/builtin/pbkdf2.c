@@ -185,18 +185,17 @@ pbkdf2(const struct krb5_hash_provider *hash, krb5_keyblock *pass,
     return 0;
 }
 
-krb5_error_code
-krb5int_pbkdf2_hmac(const struct krb5_hash_provider *hash,
-                    const krb5_data *out, unsigned long count,
-                    const krb5_data *pass, const krb5_data *salt)
+/* Set *keyblock to the HMAC key for pass, pre-hashing pass into tmp (of
+ * length 128) if it is longer than the hash block size. */
+static krb5_error_code
+pass_keyblock(const struct krb5_hash_provider *hash, const krb5_data *pass,
+              char *tmp, krb5_keyblock *keyblock)
 {
-    krb5_keyblock keyblock;
-    char tmp[128];
     krb5_data d;
     krb5_crypto_iov iov;
     krb5_error_code err;
 
-    assert(hash->hashsize <= sizeof(tmp));
+    assert(hash->hashsize <= 128);
     if (pass->length > hash->blocksize) {
         d = make_data(tmp, hash->hashsize);
         iov.flags = KRB5_CRYPTO_TYPE_DATA;
@@ -204,14 +203,251 @@ krb5int_pbkdf2_hmac(const struct krb5_hash_provider *hash,
         err = hash->hash(&iov, 1, &d);
         if (err)
             return err;
-        keyblock.length = d.length;
-        keyblock.contents = (krb5_octet *) d.data;
+        keyblock->length = d.length;
+        keyblock->contents = (krb5_octet *) d.data;
     } else {
-        keyblock.length = pass->length;
-        keyblock.contents = (krb5_octet *) pass->data;
+        keyblock->length = pass->length;
+        keyblock->contents = (krb5_octet *) pass->data;
     }
-    keyblock.enctype = ENCTYPE_NULL;
+    keyblock->enctype = ENCTYPE_NULL;
+    return 0;
+}
 
-    err = pbkdf2(hash, &keyblock, salt, count, out);
-    return err;
+/* Compute the outputs of the n jobs at jobs[idx[0]] through jobs[idx[n-1]]
+ * one at a time. */
+static void
+pbkdf2_generic(struct pbkdf2_job *jobs, const size_t *idx, size_t n)
+{
+    struct pbkdf2_job *job;
+    krb5_keyblock keyblock;
+    char tmp[128];
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        job = &jobs[idx[i]];
+        job->code = pass_keyblock(job->hash, &job->password, tmp, &keyblock);
+        if (job->code == 0) {
+            job->code = pbkdf2(job->hash, &keyblock, &job->salt, job->count,
+                               &job->out);
+        }
+    }
+    zap(tmp, sizeof(tmp));
+}
+
+/*
+ * For hashes with k5_hash_ops, all of the output blocks of jobs with the same
+ * hash and count are computed together, one lane per block.  After U_1, each
+ * HMAC in the iteration hashes a single block of input after the padded key
+ * block: U_j-1 (or the inner hash output) followed by the hash padding for a
+ * message of one block plus the hash output size.  Each lane keeps that block
+ * and the chaining values after the inner and outer padded key blocks, so each
+ * iteration is two compressions per lane, which the hash ops can compute for
+ * several lanes in parallel.
+ */
+
+#define MAX_BLOCK_SIZE SHA384_BLOCK_SIZE
+#define MAX_HASH_SIZE SHA384_DIGEST_LENGTH
+
+struct lane {
+    union k5_hash_chain work;           /* chaining value being computed */
+    union k5_hash_chain inner, outer;   /* after the padded key blocks */
+    unsigned char block[MAX_BLOCK_SIZE]; /* last block of the HMAC input */
+    unsigned char t[MAX_HASH_SIZE];     /* XOR of U_1 through U_j */
+};
+
+/* Set up lane to compute output block i of job, using state for the job's
+ * password. */
+static krb5_error_code
+init_lane(struct lane *lane, const struct k5_hmac_state *state,
+          const struct pbkdf2_job *job, uint32_t i)
+{
+    const struct k5_hash_ops *ops = state->ops;
+    size_t hlen = ops->hash->hashsize, bsize = ops->hash->blocksize;
+    unsigned char ibytes[4];
+    krb5_crypto_iov iov[2];
+    krb5_data out;
+
+    ops->get_chain(&state->inner, &lane->inner);
+    ops->get_chain(&state->outer, &lane->outer);
+
+    /* Compute U_1 = PRF(P, S || INT(i)). */
+    store_32_be(i, ibytes);
+    iov[0].flags = iov[1].flags = KRB5_CRYPTO_TYPE_DATA;
+    iov[0].data = job->salt;
+    iov[1].data = make_data(ibytes, 4);
+    out = make_data(lane->t, hlen);
+    if (k5_hmac_from_state(state, iov, 2, &out) != 0)
+        return KRB5_CRYPTO_INTERNAL;
+
+    memset(lane->block, 0, bsize);
+    memcpy(lane->block, lane->t, hlen);
+    lane->block[hlen] = 0x80;
+    store_32_be((bsize + hlen) * 8, lane->block + bsize - 4);
+    return 0;
+}
+
+/* Compute U_2 through U_count for each of the n lanes. */
+static void
+iterate_lanes(const struct k5_hash_ops *ops, struct lane *lanes,
+              union k5_hash_chain **chains, const unsigned char **blocks,
+              size_t n, unsigned long count)
+{
+    size_t hlen = ops->hash->hashsize, l, k;
+    unsigned long c;
+
+    for (l = 0; l < n; l++) {
+        chains[l] = &lanes[l].work;
+        blocks[l] = lanes[l].block;
+    }
+    for (c = 2; c <= count; c++) {
+        for (l = 0; l < n; l++)
+            lanes[l].work = lanes[l].inner;
+        ops->compress(chains, blocks, n);
+        for (l = 0; l < n; l++) {
+            ops->put_chain(&lanes[l].work, lanes[l].block);
+            lanes[l].work = lanes[l].outer;
+        }
+        ops->compress(chains, blocks, n);
+        for (l = 0; l < n; l++) {
+            ops->put_chain(&lanes[l].work, lanes[l].block);
+            for (k = 0; k < hlen; k++)
+                lanes[l].t[k] ^= lanes[l].block[k];
+        }
+    }
+}
+
+/* Compute the outputs of the n jobs at jobs[idx[0]] through jobs[idx[n-1]],
+ * which have the same hash and count. */
+static void
+pbkdf2_group(struct pbkdf2_job *jobs, const size_t *idx, size_t n)
+{
+    const struct krb5_hash_provider *hash = jobs[idx[0]].hash;
+    size_t hlen = hash->hashsize, nlanes = 0, i, l, len, off;
+    struct pbkdf2_job *job;
+    struct k5_hmac_state state;
+    struct lane *lanes = NULL;
+    union k5_hash_chain **chains = NULL;
+    const unsigned char **blocks = NULL;
+    krb5_keyblock keyblock;
+    char tmp[128];
+    uint32_t b;
+    krb5_error_code ret;
+
+    /* Use the generic HMAC code for hashes without k5_hash_ops. */
+    memset(&keyblock, 0, sizeof(keyblock));
+    if (k5_hmac_init_state(hash, &keyblock, &state) != 0) {
+        pbkdf2_generic(jobs, idx, n);
+        return;
+    }
+
+    for (i = 0; i < n; i++) {
+        job = &jobs[idx[i]];
+        if (job->out.length == 0 || job->out.length / hlen > 0xffffffff)
+            abort();
+        nlanes += (job->out.length + hlen - 1) / hlen;
+    }
+
+    lanes = k5calloc(nlanes, sizeof(*lanes), &ret);
+    if (lanes == NULL)
+        goto cleanup;
+    chains = k5calloc(nlanes, sizeof(*chains), &ret);
+    if (chains == NULL)
+        goto cleanup;
+    blocks = k5calloc(nlanes, sizeof(*blocks), &ret);
+    if (blocks == NULL)
+        goto cleanup;
+
+    /* If a job can't be set up, leave its lanes zeroed; they are iterated
+     * with the others, but their output is discarded. */
+    l = 0;
+    for (i = 0; i < n; i++) {
+        job = &jobs[idx[i]];
+        job->code = pass_keyblock(hash, &job->password, tmp, &keyblock);
+        if (job->code == 0)
+            job->code = k5_hmac_init_state(hash, &keyblock, &state);
+        for (b = 1; b <= (job->out.length + hlen - 1) / hlen; b++, l++) {
+            if (job->code == 0)
+                job->code = init_lane(&lanes[l], &state, job, b);
+        }
+    }
+
+    iterate_lanes(state.ops, lanes, chains, blocks, nlanes,
+                  jobs[idx[0]].count);
+
+    l = 0;
+    for (i = 0; i < n; i++) {
+        job = &jobs[idx[i]];
+        for (off = 0; off < job->out.length; off += hlen, l++) {
+            len = job->out.length - off;
+            if (job->code == 0) {
+                memcpy(job->out.data + off, lanes[l].t,
+                       len < hlen ? len : hlen);
+            }
+        }
+    }
+
+cleanup:
+    zap(&state, sizeof(state));
+    zap(tmp, sizeof(tmp));
+    if (lanes != NULL)
+        zapfree(lanes, nlanes * sizeof(*lanes));
+    free(chains);
+    free(blocks);
+    if (ret) {
+        for (i = 0; i < n; i++)
+            jobs[idx[i]].code = ret;
+    }
+}
+
+krb5_error_code
+krb5int_pbkdf2_hmac_multi(struct pbkdf2_job *jobs, size_t njobs)
+{
+    krb5_error_code ret = 0;
+    krb5_boolean *done;
+    size_t *idx, i, j, n;
+
+    done = k5calloc(njobs + 1, sizeof(*done), &ret);
+    idx = k5calloc(njobs + 1, sizeof(*idx), &ret);
+    if (done == NULL || idx == NULL) {
+        for (i = 0; i < njobs; i++)
+            jobs[i].code = ret;
+        goto cleanup;
+    }
+
+    /* Compute each set of jobs with the same hash and count together. */
+    for (i = 0; i < njobs; i++) {
+        if (done[i])
+            continue;
+        n = 0;
+        for (j = i; j < njobs; j++) {
+            if (!done[j] && jobs[j].hash == jobs[i].hash &&
+                jobs[j].count == jobs[i].count) {
+                idx[n++] = j;
+                done[j] = TRUE;
+            }
+        }
+        pbkdf2_group(jobs, idx, n);
+    }
+    for (i = 0; i < njobs && ret == 0; i++)
+        ret = jobs[i].code;
+
+cleanup:
+    free(done);
+    free(idx);
+    return ret;
+}
+
+krb5_error_code
+krb5int_pbkdf2_hmac(const struct krb5_hash_provider *hash,
+                    const krb5_data *out, unsigned long count,
+                    const krb5_data *pass, const krb5_data *salt)
+{
+    struct pbkdf2_job job;
+
+    job.hash = hash;
+    job.count = count;
+    job.password = *pass;
+    job.salt = *salt;
+    job.out = *out;
+    return krb5int_pbkdf2_hmac_multi(&job, 1);
 }
@@ -99,12 +99,115 @@ void shsInit(SHS_INFO *shsInfo)
 
 static void SHSTransform (SHS_LONG *digest, const SHS_LONG *data);
 
+#ifdef SHA_NI
+
+/* Use the x86 SHA extensions when the CPU supports them. */
+
+#include <cpuid.h>
+#include <immintrin.h>
+
+static k5_once_t shani_once = K5_ONCE_INIT;
+static krb5_boolean shani_available;
+
+static void check_shani(void)
+{
+    unsigned int a, b, c, d;
+
+    /* SSSE3 and SSE4.1 are needed for shuffles and extracts. */
+    if (!__get_cpuid(1, &a, &b, &c, &d) || !(c & (1 << 9)) ||
+        !(c & (1 << 19)) || __get_cpuid_max(0, NULL) < 7)
+        return;
+    __cpuid_count(7, 0, a, b, c, d);
+    shani_available = (b & (1 << 29)) != 0;
+}
+
+static inline krb5_boolean shani_supported(void)
+{
+    (void)k5_once(&shani_once, check_shani);
+    return shani_available;
+}
+
+/* Compute the expanded data for group g (rounds 4g to 4g+3) in msg[g % 4],
+   which holds the data for group g-4 on entry, and perform the group's
+   four rounds.  prev holds the ABCD value before the previous group, from
+   which sha1nexte computes E. */
+#define SHANI_GROUP(g)                                                  \
+    do {                                                                \
+        if ((g) >= 4) {                                                 \
+            tmp = _mm_sha1msg1_epu32(msg[(g) & 3], msg[((g) + 1) & 3]); \
+            tmp = _mm_xor_si128(tmp, msg[((g) + 2) & 3]);               \
+            msg[(g) & 3] = _mm_sha1msg2_epu32(tmp, msg[((g) + 3) & 3]); \
+        }                                                               \
+        if ((g) == 0)                                                   \
+            e = _mm_add_epi32(e, msg[0]);                               \
+        else                                                            \
+            e = _mm_sha1nexte_epu32(prev, msg[(g) & 3]);                \
+        prev = abcd;                                                    \
+        abcd = _mm_sha1rnds4_epu32(abcd, e, (g) / 5);                   \
+    } while (0)
+
+__attribute__((target("sha,sse4.1,ssse3")))
+static void shani_transform(SHS_LONG *digest, const SHS_LONG *data)
+{
+    __m128i abcd, abcd_save, e, e_save, prev, tmp, msg[4];
+    int i;
+
+    /* The SHA instructions want A in the most significant word. */
+    abcd = _mm_shuffle_epi32(_mm_loadu_si128((__m128i *)digest), 0x1B);
+    e = _mm_set_epi32(digest[4], 0, 0, 0);
+    abcd_save = abcd;
+    e_save = e;
+    for (i = 0; i < 4; i++) {
+        msg[i] = _mm_loadu_si128((const __m128i *)(data + i * 4));
+        msg[i] = _mm_shuffle_epi32(msg[i], 0x1B);
+    }
+    prev = abcd;
+
+    SHANI_GROUP(0);
+    SHANI_GROUP(1);
+    SHANI_GROUP(2);
+    SHANI_GROUP(3);
+    SHANI_GROUP(4);
+    SHANI_GROUP(5);
+    SHANI_GROUP(6);
+    SHANI_GROUP(7);
+    SHANI_GROUP(8);
+    SHANI_GROUP(9);
+    SHANI_GROUP(10);
+    SHANI_GROUP(11);
+    SHANI_GROUP(12);
+    SHANI_GROUP(13);
+    SHANI_GROUP(14);
+    SHANI_GROUP(15);
+    SHANI_GROUP(16);
+    SHANI_GROUP(17);
+    SHANI_GROUP(18);
+    SHANI_GROUP(19);
+
+    e = _mm_sha1nexte_epu32(prev, e_save);
+    abcd = _mm_add_epi32(abcd, abcd_save);
+    _mm_storeu_si128((__m128i *)digest, _mm_shuffle_epi32(abcd, 0x1B));
+    digest[4] = _mm_extract_epi32(e, 3);
+}
+
+#else /* not SHA_NI */
+
+#define shani_supported() FALSE
+#define shani_transform(digest, data)
+
+#endif /* not SHA_NI */
+
 static
 void SHSTransform(SHS_LONG *digest, const SHS_LONG *data)
 {
     SHS_LONG A, B, C, D, E;     /* Local vars */
     SHS_LONG eData[ 16 ];       /* Expanded data */
 
+    if (shani_supported()) {
+        shani_transform(digest, data);
+        return;
+    }
+
     /* Set up first buffer and local data buffer */
     A = digest[ 0 ];
     B = digest[ 1 ];
@@ -239,6 +342,152 @@ void SHSTransform(SHS_LONG *digest, const SHS_LONG *data)
     digest[ 4 ] &= 0xffffffff;
 }
 
+#ifdef SHA_AVX2
+
+/* Compress eight blocks into eight independent digests at once using AVX2.
+   This is only faster when the caller has several short messages to hash
+   at the same time, as PBKDF2 does with its output blocks. */
+
+#include <cpuid.h>
+#include <immintrin.h>
+
+static k5_once_t avx2_once = K5_ONCE_INIT;
+static krb5_boolean avx2_available;
+
+static void check_avx2(void)
+{
+    unsigned int a, b, c, d, xcr0, xcr0_hi;
+
+    /* Check for OSXSAVE and AVX, and that the OS saves the YMM registers. */
+    if (!__get_cpuid(1, &a, &b, &c, &d) || !(c & (1 << 27)) ||
+        !(c & (1 << 28)) || __get_cpuid_max(0, NULL) < 7)
+        return;
+    __asm__("xgetbv" : "=a" (xcr0), "=d" (xcr0_hi) : "c" (0));
+    if ((xcr0 & 6) != 6)
+        return;
+    __cpuid_count(7, 0, a, b, c, d);
+    avx2_available = (b & (1 << 5)) != 0;
+}
+
+static inline krb5_boolean avx2_supported(void)
+{
+    (void)k5_once(&avx2_once, check_avx2);
+    return avx2_available;
+}
+
+#define VADD(a, b)      _mm256_add_epi32(a, b)
+#define VXOR(a, b)      _mm256_xor_si256(a, b)
+#define VAND(a, b)      _mm256_and_si256(a, b)
+#define VOR(a, b)       _mm256_or_si256(a, b)
+#define VROTL(n, x)     VOR(_mm256_slli_epi32(x, n),        \
+                            _mm256_srli_epi32(x, 32 - (n)))
+#define vf1(x, y, z)    VXOR(z, VAND(x, VXOR(y, z)))
+#define vf2(x, y, z)    VXOR(VXOR(x, y), z)
+#define vf3(x, y, z)    VOR(VAND(x, y), VAND(z, VOR(x, y)))
+
+/* Compress blocks[j] into digests[j] for j from 0 to 7. */
+__attribute__((target("avx2")))
+static void avx2_transform8(SHS_LONG *const *digests,
+                            const SHS_BYTE *const *blocks)
+{
+    __m256i st[5], w[16], a, b, c, d, e, f, k, temp;
+    SHS_LONG lanes[8];
+    int i, j;
+
+    for (i = 0; i < 5; i++)
+        st[i] = _mm256_set_epi32(digests[7][i], digests[6][i],
+                                 digests[5][i], digests[4][i],
+                                 digests[3][i], digests[2][i],
+                                 digests[1][i], digests[0][i]);
+    for (i = 0; i < 16; i++) {
+        for (j = 0; j < 8; j++)
+            lanes[j] = load_32_be(blocks[j] + i * 4);
+        w[i] = _mm256_loadu_si256((const __m256i *)lanes);
+    }
+
+    a = st[0];
+    b = st[1];
+    c = st[2];
+    d = st[3];
+    e = st[4];
+    for (i = 0; i < 80; i++) {
+        if (i >= 16) {
+            temp = VXOR(VXOR(w[(i - 3) & 15], w[(i - 8) & 15]),
+                        VXOR(w[(i - 14) & 15], w[i & 15]));
+            w[i & 15] = VROTL(1, temp);
+        }
+        if (i < 20) {
+            f = vf1(b, c, d);
+            k = _mm256_set1_epi32(K1);
+        } else if (i < 40) {
+            f = vf2(b, c, d);
+            k = _mm256_set1_epi32(K2);
+        } else if (i < 60) {
+            f = vf3(b, c, d);
+            k = _mm256_set1_epi32(K3);
+        } else {
+            f = vf2(b, c, d);
+            k = _mm256_set1_epi32(K4);
+        }
+        temp = VADD(VADD(VROTL(5, a), f), VADD(VADD(e, k), w[i & 15]));
+        e = d;
+        d = c;
+        c = VROTL(30, b);
+        b = a;
+        a = temp;
+    }
+    st[0] = VADD(st[0], a);
+    st[1] = VADD(st[1], b);
+    st[2] = VADD(st[2], c);
+    st[3] = VADD(st[3], d);
+    st[4] = VADD(st[4], e);
+
+    for (i = 0; i < 5; i++) {
+        _mm256_storeu_si256((__m256i *)lanes, st[i]);
+        for (j = 0; j < 8; j++)
+            digests[j][i] = lanes[j];
+    }
+}
+
+#else /* not SHA_AVX2 */
+
+#define avx2_supported() FALSE
+#define avx2_transform8(digests, blocks)
+
+#endif /* not SHA_AVX2 */
+
+/* Compress one block into each of n digests */
+
+void shsCompressMulti(SHS_LONG *const *digests, const SHS_BYTE *const *blocks,
+                      size_t n)
+{
+    SHS_LONG *d8[8], spare[5], data[16];
+    const SHS_BYTE *b8[8];
+    size_t i = 0, j, len;
+
+    /* Eight AVX2 lanes cost about as much as three or four scalar
+       compressions, so only use them for four or more blocks.  With eight
+       lanes, AVX2 is about as fast per block as SHA-NI, so prefer SHA-NI if
+       available. */
+    if (avx2_supported() && !shani_supported()) {
+        for (; n - i >= 4; i += len) {
+            /* Fill any unused lanes with a spare digest. */
+            len = (n - i < 8) ? n - i : 8;
+            for (j = 0; j < 8; j++) {
+                d8[j] = (j < len) ? digests[i + j] : spare;
+                b8[j] = (j < len) ? blocks[i + j] : blocks[i];
+            }
+            avx2_transform8(d8, b8);
+        }
+    }
+
+    for (; i < n; i++) {
+        for (j = 0; j < 16; j++)
+            data[j] = load_32_be(blocks[i] + j * 4);
+        SHSTransform(digests[i], data);
+    }
+}
+
 /* Update SHS for a block of data */
 
 void shsUpdate(SHS_INFO *shsInfo, const SHS_BYTE *buffer, unsigned int count)
@@ -31,6 +31,12 @@ void shsInit(SHS_INFO *shsInfo);
 void shsUpdate(SHS_INFO *shsInfo, const SHS_BYTE *buffer, unsigned int count);
 void shsFinal(SHS_INFO *shsInfo);
 
+/* Compress one SHS_DATASIZE-byte block from blocks[i] into digests[i], for i
+   from 0 to n - 1, without updating any bit counts.  When possible, several
+   of the compressions are computed in parallel. */
+void shsCompressMulti(SHS_LONG *const *digests, const SHS_BYTE *const *blocks,
+                      size_t n);
+
 
 /* Keyed Message digest functions (hmac_sha.c) */
 krb5_error_code hmac_sha(krb5_octet *text,
@@ -75,4 +75,94 @@ void k5_sha512_init(SHA512_CTX *);
 void k5_sha512_update(SHA512_CTX *, const void *, size_t);
 void k5_sha512_final(void *, SHA512_CTX *);
 
+/*
+ * Compress one block from blocks[i] into the state words counters[i], for i
+ * from 0 to n - 1, without updating any byte counts.  Blocks are 64 bytes for
+ * SHA-256 and 128 bytes for SHA-384 and SHA-512.  When possible, several of
+ * the compressions are computed in parallel.
+ */
+void k5_sha256_compress_multi(uint32_t *const *counters,
+                              const unsigned char *const *blocks, size_t n);
+void k5_sha512_compress_multi(uint64_t *const *counters,
+                              const unsigned char *const *blocks, size_t n);
+
+#ifdef SHA_NI
+
+/*
+ * For code which computes SHA-256 with the x86 SHA extensions interleaved with
+ * other work, such as the single-pass encrypt-then-mac in the AES provider.
+ * Callers must include <immintrin.h> and use a target of at least
+ * "sha,sse4.1,ssse3", and may only use these if k5_sha256_ni_supported()
+ * returns true.
+ */
+extern const uint32_t k5_sha256_constants[64];
+krb5_boolean k5_sha256_ni_supported(void);
+
+/* Load the state words in counter as the ABEF and CDGH vectors which
+ * sha256rnds2 operates on, or store them back. */
+#define SHA256_NI_LOAD(counter, abef, cdgh, tmp)                        \
+    do {                                                                \
+        tmp = _mm_shuffle_epi32(_mm_loadu_si128((__m128i *)&(counter)[0]), \
+                                0xB1);                                  \
+        cdgh = _mm_shuffle_epi32(_mm_loadu_si128((__m128i *)&(counter)[4]), \
+                                 0x1B);                                 \
+        abef = _mm_alignr_epi8(tmp, cdgh, 8);                           \
+        cdgh = _mm_blend_epi16(cdgh, tmp, 0xF0);                        \
+    } while (0)
+#define SHA256_NI_STORE(counter, abef, cdgh, tmp)                       \
+    do {                                                                \
+        tmp = _mm_shuffle_epi32(abef, 0x1B);                            \
+        cdgh = _mm_shuffle_epi32(cdgh, 0xB1);                           \
+        _mm_storeu_si128((__m128i *)&(counter)[0],                      \
+                         _mm_blend_epi16(tmp, cdgh, 0xF0));             \
+        _mm_storeu_si128((__m128i *)&(counter)[4],                      \
+                         _mm_alignr_epi8(cdgh, tmp, 8));                \
+    } while (0)
+
+/*
+ * Compute the message schedule words for group g (rounds 4g to 4g+3) in
+ * msg[g % 4], which holds the words for group g-4 on entry, and perform the
+ * group's four rounds.
+ */
+#define SHA256_NI_GROUP(g, abef, cdgh, msg, tmp)                        \
+    do {                                                                \
+        if ((g) >= 4) {                                                 \
+            tmp = _mm_sha256msg1_epu32(msg[(g) & 3], msg[((g) + 1) & 3]); \
+            tmp = _mm_add_epi32(tmp, _mm_alignr_epi8(msg[((g) + 3) & 3], \
+                                                     msg[((g) + 2) & 3], \
+                                                     4));               \
+            msg[(g) & 3] = _mm_sha256msg2_epu32(tmp, msg[((g) + 3) & 3]); \
+        }                                                               \
+        tmp = _mm_add_epi32(msg[(g) & 3],                               \
+                            _mm_loadu_si128((const __m128i *)           \
+                                            &k5_sha256_constants[(g) * 4])); \
+        cdgh = _mm_sha256rnds2_epu32(cdgh, abef, tmp);                  \
+        abef = _mm_sha256rnds2_epu32(abef, cdgh,                        \
+                                     _mm_shuffle_epi32(tmp, 0x0E));     \
+    } while (0)
+
+/* Compress the big-endian message words in msg[0..3] into abef and cdgh,
+ * without the final addition of the previous state. */
+#define SHA256_NI_ROUNDS(abef, cdgh, msg, tmp)                          \
+    do {                                                                \
+        SHA256_NI_GROUP(0, abef, cdgh, msg, tmp);                       \
+        SHA256_NI_GROUP(1, abef, cdgh, msg, tmp);                       \
+        SHA256_NI_GROUP(2, abef, cdgh, msg, tmp);                       \
+        SHA256_NI_GROUP(3, abef, cdgh, msg, tmp);                       \
+        SHA256_NI_GROUP(4, abef, cdgh, msg, tmp);                       \
+        SHA256_NI_GROUP(5, abef, cdgh, msg, tmp);                       \
+        SHA256_NI_GROUP(6, abef, cdgh, msg, tmp);                       \
+        SHA256_NI_GROUP(7, abef, cdgh, msg, tmp);                       \
+        SHA256_NI_GROUP(8, abef, cdgh, msg, tmp);                       \
+        SHA256_NI_GROUP(9, abef, cdgh, msg, tmp);                       \
+        SHA256_NI_GROUP(10, abef, cdgh, msg, tmp);                      \
+        SHA256_NI_GROUP(11, abef, cdgh, msg, tmp);                      \
+        SHA256_NI_GROUP(12, abef, cdgh, msg, tmp);                      \
+        SHA256_NI_GROUP(13, abef, cdgh, msg, tmp);                      \
+        SHA256_NI_GROUP(14, abef, cdgh, msg, tmp);                      \
+        SHA256_NI_GROUP(15, abef, cdgh, msg, tmp);                      \
+    } while (0)
+
+#endif /* SHA_NI */
+
 #endif /* SHA2_H */
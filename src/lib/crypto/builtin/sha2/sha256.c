@@ -36,10 +36,6 @@
 #include <k5-int.h>
 #include "sha2.h"
 
-#ifdef K5_BE
-#define WORDS_BIGENDIAN
-#endif
-
 #ifndef min
 #define min(a,b) (((a)>(b))?(b):(a))
 #endif
@@ -83,7 +79,7 @@ cshift (uint32_t x, unsigned int n)
 #define G m->counter[6]
 #define H m->counter[7]
 
-static const uint32_t constant_256[64] = {
+const uint32_t k5_sha256_constants[64] = {
     0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
     0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
     0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
@@ -142,7 +138,7 @@ calc(SHA256_CTX *m, uint32_t *in)
     for (i = 0; i < 64; i++) {
 	uint32_t T1, T2;
 
-	T1 = HH + Sigma1(EE) + Ch(EE, FF, GG) + constant_256[i] + data[i];
+	T1 = HH + Sigma1(EE) + Ch(EE, FF, GG) + k5_sha256_constants[i] + data[i];
 	T2 = Sigma0(AA) + Maj(AA,BB,CC);
 			
 	HH = GG;
@@ -165,61 +161,115 @@ calc(SHA256_CTX *m, uint32_t *in)
     H += HH;
 }
 
-/*
- * From `Performance analysis of MD5' by Joseph D. Touch <touch@isi.edu>
- */
+#ifdef SHA_NI
 
-#if !defined(WORDS_BIGENDIAN) || defined(_CRAY)
-static inline uint32_t
-swap_uint32_t(uint32_t t)
+/* Use the x86 SHA extensions when the CPU supports them. */
+
+#include <cpuid.h>
+#include <immintrin.h>
+
+static k5_once_t shani_once = K5_ONCE_INIT;
+static krb5_boolean shani_available;
+
+static void
+check_shani(void)
 {
-#define ROL(x,n) ((x)<<(n))|((x)>>(32-(n)))
-    uint32_t temp1, temp2;
-
-    temp1   = cshift(t, 16);
-    temp2   = temp1 >> 8;
-    temp1  &= 0x00ff00ff;
-    temp2  &= 0x00ff00ff;
-    temp1 <<= 8;
-    return temp1 | temp2;
+    unsigned int a, b, c, d;
+
+    /* SSSE3 and SSE4.1 are needed for byte shuffles and blends. */
+    if (!__get_cpuid(1, &a, &b, &c, &d) || !(c & (1 << 9)) ||
+        !(c & (1 << 19)) || __get_cpuid_max(0, NULL) < 7)
+        return;
+    __cpuid_count(7, 0, a, b, c, d);
+    shani_available = (b & (1 << 29)) != 0;
 }
-#endif
 
-struct x32 {
-    unsigned int a:32;
-    unsigned int b:32;
-};
+krb5_boolean
+k5_sha256_ni_supported(void)
+{
+    (void)k5_once(&shani_once, check_shani);
+    return shani_available;
+}
+
+/* Process nblocks 64-byte blocks from p into the state words in counter. */
+__attribute__((target("sha,sse4.1,ssse3")))
+static void
+shani_blocks(uint32_t counter[8], const unsigned char *p, size_t nblocks)
+{
+    const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL,
+                                         0x0405060700010203ULL);
+    __m128i abef, cdgh, abef_save, cdgh_save, tmp, msg[4];
+    int i;
+
+    SHA256_NI_LOAD(counter, abef, cdgh, tmp);
+
+    for (; nblocks > 0; nblocks--, p += 64) {
+        abef_save = abef;
+        cdgh_save = cdgh;
+        for (i = 0; i < 4; i++) {
+            msg[i] = _mm_loadu_si128((const __m128i *)(p + i * 16));
+            msg[i] = _mm_shuffle_epi8(msg[i], bswap);
+        }
+        SHA256_NI_ROUNDS(abef, cdgh, msg, tmp);
+        abef = _mm_add_epi32(abef, abef_save);
+        cdgh = _mm_add_epi32(cdgh, cdgh_save);
+    }
+
+    SHA256_NI_STORE(counter, abef, cdgh, tmp);
+}
+
+#else /* not SHA_NI */
+
+#define k5_sha256_ni_supported() FALSE
+#define shani_blocks(counter, p, nblocks)
+
+#endif /* not SHA_NI */
+
+/* Process nblocks 64-byte blocks from p. */
+static void
+process_blocks(SHA256_CTX *m, const unsigned char *p, size_t nblocks)
+{
+    uint32_t current[16];
+    int i;
+
+    if (k5_sha256_ni_supported()) {
+        shani_blocks(m->counter, p, nblocks);
+        return;
+    }
+    for (; nblocks > 0; nblocks--, p += 64) {
+        for (i = 0; i < 16; i++)
+            current[i] = load_32_be(p + i * 4);
+        calc(m, current);
+    }
+}
 
 void
 k5_sha256_update(SHA256_CTX *m, const void *v, size_t len)
 {
     const unsigned char *p = v;
     size_t old_sz = m->sz[0];
-    size_t offset;
+    size_t offset, l, nblocks;
 
     m->sz[0] += len * 8;
     if (m->sz[0] < old_sz)
 	++m->sz[1];
     offset = (old_sz / 8) % 64;
     while(len > 0){
-	size_t l = min(len, 64 - offset);
+	if (offset == 0 && len >= 64) {
+	    /* Process whole blocks directly from the input. */
+	    nblocks = len / 64;
+	    process_blocks(m, p, nblocks);
+	    p += nblocks * 64;
+	    len -= nblocks * 64;
+	    continue;
+	}
+	l = min(len, 64 - offset);
 	memcpy(m->save + offset, p, l);
 	offset += l;
 	p += l;
 	len -= l;
 	if(offset == 64){
-#if !defined(WORDS_BIGENDIAN) || defined(_CRAY)
-	    int i;
-	    uint32_t current[16];
-	    struct x32 *u = (struct x32*)(void*)m->save;
-	    for(i = 0; i < 8; i++){
-		current[2*i+0] = swap_uint32_t(u[i].a);
-		current[2*i+1] = swap_uint32_t(u[i].b);
-	    }
-	    calc(m, current);
-#else
-	    calc(m, (uint32_t*)(void*)m->save);
-#endif
+	    process_blocks(m, m->save, 1);
 	    offset = 0;
 	}
     }
@@ -256,6 +306,160 @@ k5_sha256_final(void *res, SHA256_CTX *m)
     }
 }
 
+#ifdef SHA_AVX2
+
+/*
+ * Compress eight blocks into eight independent states at once using AVX2.
+ * This is only faster when the caller has several short messages to hash
+ * at the same time, as PBKDF2 does with its output blocks.
+ */
+
+#include <cpuid.h>
+#include <immintrin.h>
+
+static k5_once_t avx2_once = K5_ONCE_INIT;
+static krb5_boolean avx2_available;
+
+static void
+check_avx2(void)
+{
+    unsigned int a, b, c, d, xcr0, xcr0_hi;
+
+    /* Check for OSXSAVE and AVX, and that the OS saves the YMM registers. */
+    if (!__get_cpuid(1, &a, &b, &c, &d) || !(c & (1 << 27)) ||
+        !(c & (1 << 28)) || __get_cpuid_max(0, NULL) < 7)
+        return;
+    __asm__("xgetbv" : "=a" (xcr0), "=d" (xcr0_hi) : "c" (0));
+    if ((xcr0 & 6) != 6)
+        return;
+    __cpuid_count(7, 0, a, b, c, d);
+    avx2_available = (b & (1 << 5)) != 0;
+}
+
+static inline krb5_boolean
+avx2_supported(void)
+{
+    (void)k5_once(&avx2_once, check_avx2);
+    return avx2_available;
+}
+
+#define VADD(a, b) _mm256_add_epi32(a, b)
+#define VXOR(a, b) _mm256_xor_si256(a, b)
+#define VROTR(x, n) _mm256_or_si256(_mm256_srli_epi32(x, n),      \
+                                    _mm256_slli_epi32(x, 32 - (n)))
+#define VSigma0(x) VXOR(VXOR(VROTR(x, 2), VROTR(x, 13)), VROTR(x, 22))
+#define VSigma1(x) VXOR(VXOR(VROTR(x, 6), VROTR(x, 11)), VROTR(x, 25))
+#define Vsigma0(x) VXOR(VXOR(VROTR(x, 7), VROTR(x, 18)),          \
+                        _mm256_srli_epi32(x, 3))
+#define Vsigma1(x) VXOR(VXOR(VROTR(x, 17), VROTR(x, 19)),         \
+                        _mm256_srli_epi32(x, 10))
+#define VCh(x, y, z) VXOR(_mm256_and_si256(x, VXOR(y, z)), z)
+#define VMaj(x, y, z) _mm256_or_si256(_mm256_and_si256(x, y),             \
+                                      _mm256_and_si256(z,                 \
+                                                       _mm256_or_si256(x, y)))
+
+/* Compress blocks[j] into counters[j] for j from 0 to 7. */
+__attribute__((target("avx2")))
+static void
+avx2_blocks8(uint32_t *const *counters, const unsigned char *const *blocks)
+{
+    __m256i st[8], w[16], a, b, c, d, e, f, g, h, t1, t2;
+    uint32_t lanes[8];
+    int i, j;
+
+    for (i = 0; i < 8; i++)
+        st[i] = _mm256_set_epi32(counters[7][i], counters[6][i],
+                                 counters[5][i], counters[4][i],
+                                 counters[3][i], counters[2][i],
+                                 counters[1][i], counters[0][i]);
+    for (i = 0; i < 16; i++) {
+        for (j = 0; j < 8; j++)
+            lanes[j] = load_32_be(blocks[j] + i * 4);
+        w[i] = _mm256_loadu_si256((const __m256i *)lanes);
+    }
+
+    a = st[0];
+    b = st[1];
+    c = st[2];
+    d = st[3];
+    e = st[4];
+    f = st[5];
+    g = st[6];
+    h = st[7];
+    for (i = 0; i < 64; i++) {
+        if (i >= 16) {
+            w[i & 15] = VADD(VADD(Vsigma1(w[(i - 2) & 15]),
+                                  w[(i - 7) & 15]),
+                             VADD(Vsigma0(w[(i - 15) & 15]), w[i & 15]));
+        }
+        t1 = VADD(VADD(h, VSigma1(e)), VADD(VCh(e, f, g), w[i & 15]));
+        t1 = VADD(t1, _mm256_set1_epi32(k5_sha256_constants[i]));
+        t2 = VADD(VSigma0(a), VMaj(a, b, c));
+        h = g;
+        g = f;
+        f = e;
+        e = VADD(d, t1);
+        d = c;
+        c = b;
+        b = a;
+        a = VADD(t1, t2);
+    }
+    st[0] = VADD(st[0], a);
+    st[1] = VADD(st[1], b);
+    st[2] = VADD(st[2], c);
+    st[3] = VADD(st[3], d);
+    st[4] = VADD(st[4], e);
+    st[5] = VADD(st[5], f);
+    st[6] = VADD(st[6], g);
+    st[7] = VADD(st[7], h);
+
+    for (i = 0; i < 8; i++) {
+        _mm256_storeu_si256((__m256i *)lanes, st[i]);
+        for (j = 0; j < 8; j++)
+            counters[j][i] = lanes[j];
+    }
+}
+
+#else /* not SHA_AVX2 */
+
+#define avx2_supported() FALSE
+#define avx2_blocks8(counters, blocks)
+
+#endif /* not SHA_AVX2 */
+
+void
+k5_sha256_compress_multi(uint32_t *const *counters,
+                         const unsigned char *const *blocks, size_t n)
+{
+    SHA256_CTX m;
+    uint32_t *c8[8], spare[8];
+    const unsigned char *b8[8];
+    size_t i = 0, j, len;
+
+    /*
+     * Eight AVX2 lanes cost about as much as three or four scalar
+     * compressions, so only use them for four or more blocks.  A SHA-NI
+     * compression is faster per block than AVX2, so prefer it if available.
+     */
+    if (avx2_supported() && !k5_sha256_ni_supported()) {
+        for (; n - i >= 4; i += len) {
+            /* Fill any unused lanes with a spare state. */
+            len = (n - i < 8) ? n - i : 8;
+            for (j = 0; j < 8; j++) {
+                c8[j] = (j < len) ? counters[i + j] : spare;
+                b8[j] = (j < len) ? blocks[i + j] : blocks[i];
+            }
+            avx2_blocks8(c8, b8);
+        }
+    }
+
+    for (; i < n; i++) {
+        memcpy(m.counter, counters[i], sizeof(m.counter));
+        process_blocks(&m, blocks[i], 1);
+        memcpy(counters[i], m.counter, sizeof(m.counter));
+    }
+}
+
 krb5_error_code
 k5_sha256(const krb5_data *in, size_t n, uint8_t out[K5_SHA256_HASHLEN])
 {
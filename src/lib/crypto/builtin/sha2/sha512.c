@@ -275,6 +275,157 @@ k5_sha512_final (void *res, SHA512_CTX *m)
     }
 }
 
+#ifdef SHA_AVX2
+
+/*
+ * Compress four blocks into four independent states at once using AVX2.
+ * This is only faster when the caller has several short messages to hash
+ * at the same time, as PBKDF2 does with its output blocks.
+ */
+
+#include <cpuid.h>
+#include <immintrin.h>
+
+static k5_once_t avx2_once = K5_ONCE_INIT;
+static krb5_boolean avx2_available;
+
+static void
+check_avx2(void)
+{
+    unsigned int a, b, c, d, xcr0, xcr0_hi;
+
+    /* Check for OSXSAVE and AVX, and that the OS saves the YMM registers. */
+    if (!__get_cpuid(1, &a, &b, &c, &d) || !(c & (1 << 27)) ||
+        !(c & (1 << 28)) || __get_cpuid_max(0, NULL) < 7)
+        return;
+    __asm__("xgetbv" : "=a" (xcr0), "=d" (xcr0_hi) : "c" (0));
+    if ((xcr0 & 6) != 6)
+        return;
+    __cpuid_count(7, 0, a, b, c, d);
+    avx2_available = (b & (1 << 5)) != 0;
+}
+
+static inline krb5_boolean
+avx2_supported(void)
+{
+    (void)k5_once(&avx2_once, check_avx2);
+    return avx2_available;
+}
+
+#define VADD(a, b) _mm256_add_epi64(a, b)
+#define VXOR(a, b) _mm256_xor_si256(a, b)
+#define VROTR(x, n) _mm256_or_si256(_mm256_srli_epi64(x, n),      \
+                                    _mm256_slli_epi64(x, 64 - (n)))
+#define VSigma0(x) VXOR(VXOR(VROTR(x, 28), VROTR(x, 34)), VROTR(x, 39))
+#define VSigma1(x) VXOR(VXOR(VROTR(x, 14), VROTR(x, 18)), VROTR(x, 41))
+#define Vsigma0(x) VXOR(VXOR(VROTR(x, 1), VROTR(x, 8)),           \
+                        _mm256_srli_epi64(x, 7))
+#define Vsigma1(x) VXOR(VXOR(VROTR(x, 19), VROTR(x, 61)),         \
+                        _mm256_srli_epi64(x, 6))
+#define VCh(x, y, z) VXOR(_mm256_and_si256(x, VXOR(y, z)), z)
+#define VMaj(x, y, z) _mm256_or_si256(_mm256_and_si256(x, y),             \
+                                      _mm256_and_si256(z,                 \
+                                                       _mm256_or_si256(x, y)))
+
+/* Compress blocks[j] into counters[j] for j from 0 to 3. */
+__attribute__((target("avx2")))
+static void
+avx2_blocks4(uint64_t *const *counters, const unsigned char *const *blocks)
+{
+    __m256i st[8], w[16], a, b, c, d, e, f, g, h, t1, t2;
+    uint64_t lanes[4];
+    int i, j;
+
+    for (i = 0; i < 8; i++)
+        st[i] = _mm256_set_epi64x(counters[3][i], counters[2][i],
+                                  counters[1][i], counters[0][i]);
+    for (i = 0; i < 16; i++) {
+        for (j = 0; j < 4; j++)
+            lanes[j] = load_64_be(blocks[j] + i * 8);
+        w[i] = _mm256_loadu_si256((const __m256i *)lanes);
+    }
+
+    a = st[0];
+    b = st[1];
+    c = st[2];
+    d = st[3];
+    e = st[4];
+    f = st[5];
+    g = st[6];
+    h = st[7];
+    for (i = 0; i < 80; i++) {
+        if (i >= 16) {
+            w[i & 15] = VADD(VADD(Vsigma1(w[(i - 2) & 15]),
+                                  w[(i - 7) & 15]),
+                             VADD(Vsigma0(w[(i - 15) & 15]), w[i & 15]));
+        }
+        t1 = VADD(VADD(h, VSigma1(e)), VADD(VCh(e, f, g), w[i & 15]));
+        t1 = VADD(t1, _mm256_set1_epi64x(constant_512[i]));
+        t2 = VADD(VSigma0(a), VMaj(a, b, c));
+        h = g;
+        g = f;
+        f = e;
+        e = VADD(d, t1);
+        d = c;
+        c = b;
+        b = a;
+        a = VADD(t1, t2);
+    }
+    st[0] = VADD(st[0], a);
+    st[1] = VADD(st[1], b);
+    st[2] = VADD(st[2], c);
+    st[3] = VADD(st[3], d);
+    st[4] = VADD(st[4], e);
+    st[5] = VADD(st[5], f);
+    st[6] = VADD(st[6], g);
+    st[7] = VADD(st[7], h);
+
+    for (i = 0; i < 8; i++) {
+        _mm256_storeu_si256((__m256i *)lanes, st[i]);
+        for (j = 0; j < 4; j++)
+            counters[j][i] = lanes[j];
+    }
+}
+
+#else /* not SHA_AVX2 */
+
+#define avx2_supported() FALSE
+#define avx2_blocks4(counters, blocks)
+
+#endif /* not SHA_AVX2 */
+
+void
+k5_sha512_compress_multi(uint64_t *const *counters,
+                         const unsigned char *const *blocks, size_t n)
+{
+    SHA512_CTX m;
+    uint64_t *c4[4], spare[8], current[16];
+    const unsigned char *b4[4];
+    size_t i = 0, j, len;
+
+    /* Four AVX2 lanes cost a little more than one scalar compression, so use
+     * them for two or more blocks. */
+    if (avx2_supported()) {
+        for (; n - i >= 2; i += len) {
+            /* Fill any unused lanes with a spare state. */
+            len = (n - i < 4) ? n - i : 4;
+            for (j = 0; j < 4; j++) {
+                c4[j] = (j < len) ? counters[i + j] : spare;
+                b4[j] = (j < len) ? blocks[i + j] : blocks[i];
+            }
+            avx2_blocks4(c4, b4);
+        }
+    }
+
+    for (; i < n; i++) {
+        memcpy(m.counter, counters[i], sizeof(m.counter));
+        for (j = 0; j < 16; j++)
+            current[j] = load_64_be(blocks[i] + j * 8);
+        calc(&m, current);
+        memcpy(counters[i], m.counter, sizeof(m.counter));
+    }
+}
+
 void
 k5_sha384_init (SHA384_CTX *m)
 {
@@ -0,0 +1,778 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/* lib/crypto/crypto_tests/t_bench.c - crypto benchmark suite */
+/*
+ * Copyright (C) 2020 by the Massachusetts Institute of Technology.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in
+ *   the documentation and/or other materials provided with the
+ *   distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * This program measures the performance of the crypto library over all
+ * supported enctypes, for regression tracking and for comparing enctypes and
+ * crypto back ends.  Usage:
+ *
+ *     ./t_bench [-t msec] [-n count] [-g group] [-e enctype] [-s size]
+ *
+ * Each benchmark is run for at least -t milliseconds (default 100), or
+ * exactly -n times.  -g, -e, and -s restrict the run to one group (enc,
+ * cksum, s2k, or prf), enctype, or message size.  The groups are:
+ *
+ *   enc    encryption and decryption of messages from 16 bytes to 1MB, with
+ *          the krb5_c and krb5_k APIs, contiguous and IOV layouts, and the
+ *          batched krb5_k_{en,de}crypt_iov_multi() functions
+ *   cksum  checksum generation and verification with the mandatory checksum
+ *          type of each enctype
+ *   s2k    string-to-key at several iteration counts, singly and batched
+ *   prf    krb5_c_prf(), krb5_k_prf(), and krb5_c_fx_cf2_simple()
+ *
+ * Results are written to stdout as tab-separated values, preceded by comment
+ * lines beginning with "#" which identify the crypto back end.  Cycle counts
+ * come from the processor timestamp counter where available, and are "-"
+ * otherwise.  The back end is chosen at build time, so compare back ends by
+ * running this program from a build of each.
+ */
+
+#include "k5-int.h"
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define HAVE_TSC
+#endif
+
+#ifndef CRYPTO_IMPL
+#define CRYPTO_IMPL "unknown"
+#endif
+
+/* Messages per call for the batched functions. */
+#define NMULTI 8
+
+/* Data chunks and sign-only bytes in the scatter-gather IOV layout. */
+#define NCHUNKS 4
+#define SIGN_LEN 16
+
+static const krb5_enctype enctypes[] = {
+    ENCTYPE_DES3_CBC_SHA1,
+    ENCTYPE_ARCFOUR_HMAC,
+    ENCTYPE_AES128_CTS_HMAC_SHA1_96,
+    ENCTYPE_AES256_CTS_HMAC_SHA1_96,
+    ENCTYPE_AES128_CTS_HMAC_SHA256_128,
+    ENCTYPE_AES256_CTS_HMAC_SHA384_192,
+    ENCTYPE_CAMELLIA128_CTS_CMAC,
+    ENCTYPE_CAMELLIA256_CTS_CMAC
+};
+
+static const size_t sizes[] = {
+    16, 64, 256, 1024, 4096, 16384, 65536, 1024 * 1024
+};
+
+static const unsigned int s2k_iter_counts[] = { 4096, 32768, 131072 };
+
+/* Settings from the command line. */
+static double min_time = 0.1;
+static unsigned long fixed_count;
+static const char *only_group;
+static krb5_enctype only_enctype = ENCTYPE_NULL;
+static size_t only_size;
+
+struct bench {
+    int api;                    /* 'c' or 'k' */
+    krb5_enctype enctype;
+    char ename[64];
+    krb5_keyblock kb;
+    krb5_key key;
+    size_t size;
+
+    /* Contiguous buffers. */
+    krb5_data plain;
+    krb5_enc_data enc;
+    krb5_cksumtype cksumtype;
+    krb5_checksum cksum;
+
+    /* IOV arrays for nmsgs messages, all stored in the msgs buffer.  saved
+     * holds a copy of the encrypted messages for decryption. */
+    krb5_crypto_iov iov[NMULTI][NCHUNKS + 5];
+    krb5_crypto_iov *iovs[NMULTI];
+    size_t niov[NMULTI];
+    size_t nmsgs;
+    unsigned char *msgs, *saved;
+    size_t msgs_len;
+
+    /* String-to-key inputs. */
+    krb5_enctype s2k_enctypes[NMULTI];
+    krb5_data s2k_strings[NMULTI];
+    krb5_data s2k_salts[NMULTI];
+    krb5_data s2k_params;
+    const krb5_data *s2k_paramps[NMULTI];
+    unsigned char s2k_params_buf[4];
+    krb5_keyblock s2k_keys[NMULTI];
+
+    /* PRF buffers. */
+    krb5_data prf_in, prf_out;
+};
+
+typedef krb5_error_code (*bench_fn)(struct bench *b);
+
+static void
+check(krb5_error_code ret)
+{
+    if (ret) {
+        fprintf(stderr, "t_bench: %s\n", error_message(ret));
+        exit(1);
+    }
+}
+
+static void *
+xcalloc(size_t n)
+{
+    void *ptr = calloc(1, n == 0 ? 1 : n);
+
+    if (ptr == NULL)
+        abort();
+    return ptr;
+}
+
+static double
+get_time(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static uint64_t
+get_cycles(void)
+{
+#ifdef HAVE_TSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+/* Call restore (if not NULL) and fn count times, and add the elapsed time
+ * and cycles to *sec_out and *cycles_out. */
+static krb5_error_code
+time_calls(struct bench *b, bench_fn restore, bench_fn fn,
+           unsigned long count, double *sec_out, uint64_t *cycles_out)
+{
+    krb5_error_code ret = 0;
+    unsigned long i;
+    double start;
+    uint64_t start_cycles;
+
+    start = get_time();
+    start_cycles = get_cycles();
+    for (i = 0; i < count && !ret; i++) {
+        if (restore != NULL)
+            restore(b);
+        if (fn != NULL)
+            ret = fn(b);
+    }
+    *cycles_out = get_cycles() - start_cycles;
+    *sec_out = get_time() - start;
+    return ret;
+}
+
+/*
+ * Time calls to fn and print a result line.  Each call performs nops
+ * operations on size bytes each (size is 0 for operations without a message
+ * size).  If restore is not NULL, it is called before each call to fn to
+ * reset the inputs, and its cost is measured separately and subtracted.
+ */
+static void
+run_case(struct bench *b, const char *group, const char *op,
+         const char *layout, const char *param, size_t size, size_t nops,
+         bench_fn restore, bench_fn fn)
+{
+    krb5_error_code ret;
+    unsigned long count = 1;
+    double sec, base_sec, ops;
+    uint64_t cycles, base_cycles;
+    char sizebuf[32], mbbuf[32], cpbbuf[32], cpobuf[32];
+
+    /* Make one untimed call to check that the operation works, and to
+     * initialize any cached state. */
+    if (restore != NULL)
+        restore(b);
+    ret = fn(b);
+    if (ret) {
+        fprintf(stderr, "t_bench: skipping %s %s %s: %s\n", group, b->ename,
+                op, error_message(ret));
+        return;
+    }
+
+    if (fixed_count) {
+        count = fixed_count;
+        check(time_calls(b, restore, fn, count, &sec, &cycles));
+    } else {
+        for (;;) {
+            check(time_calls(b, restore, fn, count, &sec, &cycles));
+            if (sec >= min_time)
+                break;
+            /* Aim ten percent past min_time, at most ten times as many
+             * calls as the last try. */
+            if (sec <= 0 || sec * 10 < min_time)
+                count *= 10;
+            else
+                count = count * (min_time * 1.1 / sec) + 1;
+        }
+    }
+
+    if (restore != NULL) {
+        check(time_calls(b, restore, NULL, count, &base_sec, &base_cycles));
+        sec = (sec > base_sec) ? sec - base_sec : 0;
+        cycles = (cycles > base_cycles) ? cycles - base_cycles : 0;
+    }
+
+    ops = (double)count * nops;
+    strlcpy(sizebuf, "-", sizeof(sizebuf));
+    strlcpy(mbbuf, "-", sizeof(mbbuf));
+    strlcpy(cpbbuf, "-", sizeof(cpbbuf));
+    strlcpy(cpobuf, "-", sizeof(cpobuf));
+    if (size > 0) {
+        snprintf(sizebuf, sizeof(sizebuf), "%lu", (unsigned long)size);
+        if (sec > 0) {
+            snprintf(mbbuf, sizeof(mbbuf), "%.2f",
+                     ops * size / sec / 1000000.0);
+        }
+    }
+#ifdef HAVE_TSC
+    if (size > 0)
+        snprintf(cpbbuf, sizeof(cpbbuf), "%.2f", cycles / (ops * size));
+    snprintf(cpobuf, sizeof(cpobuf), "%.0f", cycles / ops);
+#endif
+    printf("%s\t%s\t%s\t%c\t%s\t%s\t%s\t%.0f\t%.6f\t%.1f\t%s\t%s\t%s\n",
+           group, b->ename, op, b->api, layout, sizebuf, param, ops, sec,
+           (sec > 0) ? ops / sec : 0, mbbuf, cpbbuf, cpobuf);
+    fflush(stdout);
+}
+
+/* Encryption and decryption benchmarks. */
+
+static krb5_error_code
+encrypt_contig(struct bench *b)
+{
+    if (b->api == 'c')
+        return krb5_c_encrypt(NULL, &b->kb, 0, NULL, &b->plain, &b->enc);
+    return krb5_k_encrypt(NULL, b->key, 0, NULL, &b->plain, &b->enc);
+}
+
+static krb5_error_code
+decrypt_contig(struct bench *b)
+{
+    /* Decryption output may include padding. */
+    b->plain.length = b->enc.ciphertext.length;
+    if (b->api == 'c')
+        return krb5_c_decrypt(NULL, &b->kb, 0, NULL, &b->enc, &b->plain);
+    return krb5_k_decrypt(NULL, b->key, 0, NULL, &b->enc, &b->plain);
+}
+
+static krb5_error_code
+encrypt_iov(struct bench *b)
+{
+    if (b->api == 'c') {
+        return krb5_c_encrypt_iov(NULL, &b->kb, 0, NULL, b->iovs[0],
+                                  b->niov[0]);
+    }
+    return krb5_k_encrypt_iov(NULL, b->key, 0, NULL, b->iovs[0], b->niov[0]);
+}
+
+static krb5_error_code
+decrypt_iov(struct bench *b)
+{
+    if (b->api == 'c') {
+        return krb5_c_decrypt_iov(NULL, &b->kb, 0, NULL, b->iovs[0],
+                                  b->niov[0]);
+    }
+    return krb5_k_decrypt_iov(NULL, b->key, 0, NULL, b->iovs[0], b->niov[0]);
+}
+
+static krb5_error_code
+encrypt_iov_multi(struct bench *b)
+{
+    return krb5_k_encrypt_iov_multi(NULL, b->key, 0, b->nmsgs, NULL, b->iovs,
+                                    b->niov, NULL);
+}
+
+static krb5_error_code
+decrypt_iov_multi(struct bench *b)
+{
+    return krb5_k_decrypt_iov_multi(NULL, b->key, 0, b->nmsgs, NULL, b->iovs,
+                                    b->niov, NULL);
+}
+
+/* Restore the encrypted messages after an in-place decryption. */
+static krb5_error_code
+restore_msgs(struct bench *b)
+{
+    memcpy(b->msgs, b->saved, b->msgs_len);
+    return 0;
+}
+
+/* Set up nmsgs IOV messages of b->size bytes.  If sgl is true, divide the
+ * data into NCHUNKS buffers and add a sign-only buffer. */
+static void
+setup_iov(struct bench *b, size_t nmsgs, krb5_boolean sgl)
+{
+    unsigned int header_len, trailer_len, padding_len;
+    size_t msg_len, i, j, n, chunk, pos;
+    unsigned char *p;
+
+    check(krb5_c_crypto_length(NULL, b->enctype, KRB5_CRYPTO_TYPE_HEADER,
+                               &header_len));
+    check(krb5_c_crypto_length(NULL, b->enctype, KRB5_CRYPTO_TYPE_TRAILER,
+                               &trailer_len));
+    check(krb5_c_padding_length(NULL, b->enctype, b->size, &padding_len));
+    msg_len = header_len + (sgl ? SIGN_LEN : 0) + b->size + padding_len +
+        trailer_len;
+
+    free(b->msgs);
+    free(b->saved);
+    b->nmsgs = nmsgs;
+    b->msgs_len = nmsgs * msg_len;
+    b->msgs = xcalloc(b->msgs_len);
+    b->saved = xcalloc(b->msgs_len);
+
+    for (i = 0; i < nmsgs; i++) {
+        p = b->msgs + i * msg_len;
+        n = 0;
+        b->iov[i][n].flags = KRB5_CRYPTO_TYPE_HEADER;
+        b->iov[i][n].data = make_data(p, header_len);
+        p += header_len;
+        n++;
+        if (sgl) {
+            b->iov[i][n].flags = KRB5_CRYPTO_TYPE_SIGN_ONLY;
+            b->iov[i][n].data = make_data(p, SIGN_LEN);
+            p += SIGN_LEN;
+            n++;
+            chunk = b->size / NCHUNKS;
+            for (j = 0, pos = 0; j < NCHUNKS; j++, pos += chunk) {
+                b->iov[i][n].flags = KRB5_CRYPTO_TYPE_DATA;
+                b->iov[i][n].data = make_data(p + pos, (j == NCHUNKS - 1) ?
+                                              b->size - pos : chunk);
+                n++;
+            }
+        } else {
+            b->iov[i][n].flags = KRB5_CRYPTO_TYPE_DATA;
+            b->iov[i][n].data = make_data(p, b->size);
+            n++;
+        }
+        p += b->size;
+        b->iov[i][n].flags = KRB5_CRYPTO_TYPE_PADDING;
+        b->iov[i][n].data = make_data(p, padding_len);
+        p += padding_len;
+        n++;
+        b->iov[i][n].flags = KRB5_CRYPTO_TYPE_TRAILER;
+        b->iov[i][n].data = make_data(p, trailer_len);
+        n++;
+        b->iovs[i] = b->iov[i];
+        b->niov[i] = n;
+    }
+}
+
+/* Run the encryption and decryption benchmarks for one layout. */
+static void
+run_iov_cases(struct bench *b, const char *layout, size_t nmsgs,
+              krb5_boolean sgl, bench_fn encrypt_fn, bench_fn decrypt_fn)
+{
+    setup_iov(b, nmsgs, sgl);
+    run_case(b, "enc", "encrypt", layout, "-", b->size, nmsgs, NULL,
+             encrypt_fn);
+
+    /* Save a valid ciphertext to restore before each decryption. */
+    if (encrypt_fn(b) != 0)
+        return;
+    memcpy(b->saved, b->msgs, b->msgs_len);
+    run_case(b, "enc", "decrypt", layout, "-", b->size, nmsgs, restore_msgs,
+             decrypt_fn);
+}
+
+static void
+bench_enc(struct bench *b)
+{
+    size_t outlen;
+    const int *api, apis[] = { 'c', 'k', 0 };
+
+    check(krb5_c_encrypt_length(NULL, b->enctype, b->size, &outlen));
+    b->plain = make_data(xcalloc(outlen), b->size);
+    b->enc.enctype = b->enctype;
+    b->enc.ciphertext = make_data(xcalloc(outlen), outlen);
+
+    for (api = apis; *api; api++) {
+        b->api = *api;
+        b->plain.length = b->size;
+        run_case(b, "enc", "encrypt", "contig", "-", b->size, 1, NULL,
+                 encrypt_contig);
+        if (encrypt_contig(b) == 0) {
+            run_case(b, "enc", "decrypt", "contig", "-", b->size, 1, NULL,
+                     decrypt_contig);
+        }
+        run_iov_cases(b, "iov", 1, FALSE, encrypt_iov, decrypt_iov);
+        run_iov_cases(b, "iov-sgl", 1, TRUE, encrypt_iov, decrypt_iov);
+        if (b->api == 'k') {
+            run_iov_cases(b, "iov-multi", NMULTI, FALSE, encrypt_iov_multi,
+                          decrypt_iov_multi);
+        }
+    }
+
+    free(b->plain.data);
+    free(b->enc.ciphertext.data);
+    free(b->msgs);
+    free(b->saved);
+    b->msgs = b->saved = NULL;
+}
+
+/* Checksum benchmarks. */
+
+static krb5_error_code
+make_cksum_contig(struct bench *b)
+{
+    krb5_error_code ret;
+    krb5_checksum sum;
+
+    if (b->api == 'c') {
+        ret = krb5_c_make_checksum(NULL, b->cksumtype, &b->kb, 0, &b->plain,
+                                   &sum);
+    } else {
+        ret = krb5_k_make_checksum(NULL, b->cksumtype, b->key, 0, &b->plain,
+                                   &sum);
+    }
+    if (!ret)
+        krb5_free_checksum_contents(NULL, &sum);
+    return ret;
+}
+
+static krb5_error_code
+verify_cksum_contig(struct bench *b)
+{
+    krb5_error_code ret;
+    krb5_boolean valid;
+
+    if (b->api == 'c') {
+        ret = krb5_c_verify_checksum(NULL, &b->kb, 0, &b->plain, &b->cksum,
+                                     &valid);
+    } else {
+        ret = krb5_k_verify_checksum(NULL, b->key, 0, &b->plain, &b->cksum,
+                                     &valid);
+    }
+    if (!ret && !valid)
+        ret = KRB5KRB_AP_ERR_BAD_INTEGRITY;
+    return ret;
+}
+
+static krb5_error_code
+make_cksum_iov(struct bench *b)
+{
+    if (b->api == 'c') {
+        return krb5_c_make_checksum_iov(NULL, b->cksumtype, &b->kb, 0,
+                                        b->iovs[0], b->niov[0]);
+    }
+    return krb5_k_make_checksum_iov(NULL, b->cksumtype, b->key, 0, b->iovs[0],
+                                    b->niov[0]);
+}
+
+static krb5_error_code
+verify_cksum_iov(struct bench *b)
+{
+    krb5_error_code ret;
+    krb5_boolean valid;
+
+    if (b->api == 'c') {
+        ret = krb5_c_verify_checksum_iov(NULL, b->cksumtype, &b->kb, 0,
+                                         b->iovs[0], b->niov[0], &valid);
+    } else {
+        ret = krb5_k_verify_checksum_iov(NULL, b->cksumtype, b->key, 0,
+                                         b->iovs[0], b->niov[0], &valid);
+    }
+    if (!ret && !valid)
+        ret = KRB5KRB_AP_ERR_BAD_INTEGRITY;
+    return ret;
+}
+
+static void
+bench_cksum(struct bench *b)
+{
+    size_t cklen;
+    const int *api, apis[] = { 'c', 'k', 0 };
+
+    check(krb5int_c_mandatory_cksumtype(NULL, b->enctype, &b->cksumtype));
+    check(krb5_c_checksum_length(NULL, b->cksumtype, &cklen));
+    b->plain = make_data(xcalloc(b->size), b->size);
+    if (krb5_c_make_checksum(NULL, b->cksumtype, &b->kb, 0, &b->plain,
+                             &b->cksum) != 0) {
+        fprintf(stderr, "t_bench: skipping cksum %s\n", b->ename);
+        free(b->plain.data);
+        return;
+    }
+
+    /* Lay out the IOV checksum message as the data followed by the
+     * checksum. */
+    b->msgs = xcalloc(b->size + cklen);
+    b->iov[0][0].flags = KRB5_CRYPTO_TYPE_DATA;
+    b->iov[0][0].data = make_data(b->msgs, b->size);
+    b->iov[0][1].flags = KRB5_CRYPTO_TYPE_CHECKSUM;
+    b->iov[0][1].data = make_data(b->msgs + b->size, cklen);
+    b->iovs[0] = b->iov[0];
+    b->niov[0] = 2;
+
+    for (api = apis; *api; api++) {
+        b->api = *api;
+        run_case(b, "cksum", "make", "contig", "-", b->size, 1, NULL,
+                 make_cksum_contig);
+        run_case(b, "cksum", "verify", "contig", "-", b->size, 1, NULL,
+                 verify_cksum_contig);
+        run_case(b, "cksum", "make", "iov", "-", b->size, 1, NULL,
+                 make_cksum_iov);
+        run_case(b, "cksum", "verify", "iov", "-", b->size, 1, NULL,
+                 verify_cksum_iov);
+    }
+
+    krb5_free_checksum_contents(NULL, &b->cksum);
+    free(b->plain.data);
+    free(b->msgs);
+    b->msgs = NULL;
+}
+
+/* String-to-key benchmarks. */
+
+static krb5_error_code
+s2k_single(struct bench *b)
+{
+    krb5_error_code ret;
+
+    ret = krb5_c_string_to_key_with_params(NULL, b->enctype,
+                                           &b->s2k_strings[0],
+                                           &b->s2k_salts[0],
+                                           b->s2k_paramps[0],
+                                           &b->s2k_keys[0]);
+    if (!ret)
+        krb5_free_keyblock_contents(NULL, &b->s2k_keys[0]);
+    return ret;
+}
+
+static krb5_error_code
+s2k_multi(struct bench *b)
+{
+    krb5_error_code ret;
+    size_t i;
+
+    ret = krb5_c_string_to_key_multi(NULL, NMULTI, b->s2k_enctypes,
+                                     b->s2k_strings, b->s2k_salts,
+                                     b->s2k_paramps, 1, b->s2k_keys, NULL);
+    for (i = 0; i < NMULTI; i++)
+        krb5_free_keyblock_contents(NULL, &b->s2k_keys[i]);
+    return ret;
+}
+
+/* Return true if enctype's string-to-key parameter is an iteration count. */
+static krb5_boolean
+s2k_has_iter_count(krb5_enctype enctype)
+{
+    switch (enctype) {
+    case ENCTYPE_AES128_CTS_HMAC_SHA1_96:
+    case ENCTYPE_AES256_CTS_HMAC_SHA1_96:
+    case ENCTYPE_AES128_CTS_HMAC_SHA256_128:
+    case ENCTYPE_AES256_CTS_HMAC_SHA384_192:
+    case ENCTYPE_CAMELLIA128_CTS_CMAC:
+    case ENCTYPE_CAMELLIA256_CTS_CMAC:
+        return TRUE;
+    default:
+        return FALSE;
+    }
+}
+
+static void
+bench_s2k(struct bench *b)
+{
+    size_t i, n;
+    char param[32];
+
+    b->api = 'c';
+    for (i = 0; i < NMULTI; i++) {
+        b->s2k_enctypes[i] = b->enctype;
+        b->s2k_strings[i] = string2data("password");
+        b->s2k_salts[i] = string2data("ATHENA.MIT.EDUraeburn");
+        b->s2k_paramps[i] = NULL;
+    }
+
+    if (!s2k_has_iter_count(b->enctype)) {
+        run_case(b, "s2k", "s2k", "-", "-", 0, 1, NULL, s2k_single);
+        run_case(b, "s2k", "s2k-multi", "-", "-", 0, NMULTI, NULL,
+                 s2k_multi);
+        return;
+    }
+
+    b->s2k_params = make_data(b->s2k_params_buf, 4);
+    for (i = 0; i < NMULTI; i++)
+        b->s2k_paramps[i] = &b->s2k_params;
+    for (n = 0; n < sizeof(s2k_iter_counts) / sizeof(*s2k_iter_counts); n++) {
+        store_32_be(s2k_iter_counts[n], b->s2k_params_buf);
+        snprintf(param, sizeof(param), "iter=%u", s2k_iter_counts[n]);
+        run_case(b, "s2k", "s2k", "-", param, 0, 1, NULL, s2k_single);
+        run_case(b, "s2k", "s2k-multi", "-", param, 0, NMULTI, NULL,
+                 s2k_multi);
+    }
+}
+
+/* PRF and cf2 benchmarks. */
+
+static krb5_error_code
+prf(struct bench *b)
+{
+    if (b->api == 'c')
+        return krb5_c_prf(NULL, &b->kb, &b->prf_in, &b->prf_out);
+    return krb5_k_prf(NULL, b->key, &b->prf_in, &b->prf_out);
+}
+
+static krb5_error_code
+cf2(struct bench *b)
+{
+    krb5_error_code ret;
+    krb5_keyblock *out;
+
+    ret = krb5_c_fx_cf2_simple(NULL, &b->kb, "a", &b->kb, "b", &out);
+    if (!ret)
+        krb5_free_keyblock(NULL, out);
+    return ret;
+}
+
+static void
+bench_prf(struct bench *b)
+{
+    size_t prflen;
+
+    check(krb5_c_prf_length(NULL, b->enctype, &prflen));
+    b->prf_in = string2data("0123456789abcdef");
+    b->prf_out = make_data(xcalloc(prflen), prflen);
+
+    b->api = 'c';
+    run_case(b, "prf", "prf", "-", "-", 0, 1, NULL, prf);
+    b->api = 'k';
+    run_case(b, "prf", "prf", "-", "-", 0, 1, NULL, prf);
+    b->api = 'c';
+    run_case(b, "prf", "cf2", "-", "-", 0, 1, NULL, cf2);
+
+    free(b->prf_out.data);
+}
+
+static krb5_boolean
+want_group(const char *group)
+{
+    return only_group == NULL || strcmp(only_group, group) == 0;
+}
+
+static void
+usage(void)
+{
+    fprintf(stderr, "Usage: t_bench [-t msec] [-n count] [-g group] "
+            "[-e enctype] [-s size]\n");
+    exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+    struct bench b;
+    krb5_data seed = string2data("notrandom");
+    size_t i, j;
+    int c;
+
+    while ((c = getopt(argc, argv, "t:n:g:e:s:")) != -1) {
+        switch (c) {
+        case 't':
+            min_time = atof(optarg) / 1000.0;
+            break;
+        case 'n':
+            fixed_count = strtoul(optarg, NULL, 10);
+            break;
+        case 'g':
+            only_group = optarg;
+            break;
+        case 'e':
+            if (krb5_string_to_enctype(optarg, &only_enctype) != 0) {
+                fprintf(stderr, "t_bench: unknown enctype %s\n", optarg);
+                exit(1);
+            }
+            break;
+        case 's':
+            only_size = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind != argc)
+        usage();
+
+    initialize_krb5_error_table();
+    check(krb5_c_random_seed(NULL, &seed));
+
+    printf("# t_bench backend=%s tsc=%s\n", CRYPTO_IMPL,
+#ifdef HAVE_TSC
+           "yes"
+#else
+           "no"
+#endif
+        );
+    printf("group\tenctype\top\tapi\tlayout\tsize\tparam\tops\tseconds\t"
+           "ops_per_sec\tmb_per_sec\tcycles_per_byte\tcycles_per_op\n");
+
+    memset(&b, 0, sizeof(b));
+    for (i = 0; i < sizeof(enctypes) / sizeof(*enctypes); i++) {
+        b.enctype = enctypes[i];
+        if (only_enctype != ENCTYPE_NULL && b.enctype != only_enctype)
+            continue;
+        if (!krb5_c_valid_enctype(b.enctype))
+            continue;
+        check(krb5_enctype_to_name(b.enctype, FALSE, b.ename,
+                                   sizeof(b.ename)));
+        if (krb5_c_make_random_key(NULL, b.enctype, &b.kb) != 0) {
+            fprintf(stderr, "t_bench: skipping %s\n", b.ename);
+            continue;
+        }
+        check(krb5_k_create_key(NULL, &b.kb, &b.key));
+
+        for (j = 0; j < sizeof(sizes) / sizeof(*sizes); j++) {
+            b.size = sizes[j];
+            if (only_size != 0 && b.size != only_size)
+                continue;
+            if (want_group("enc"))
+                bench_enc(&b);
+            if (want_group("cksum"))
+                bench_cksum(&b);
+        }
+        b.size = 0;
+        if (want_group("s2k"))
+            bench_s2k(&b);
+        if (want_group("prf"))
+            bench_prf(&b);
+
+        krb5_k_free_key(NULL, b.key);
+        krb5_free_keyblock_contents(NULL, &b.kb);
+    }
+    return 0;
+}
@@ -178,6 +178,109 @@ printhex(const char *head, void *data, size_t len)
     printf("\n");
 }
 
+/*
+ * Verify checksums of messages of various lengths together with
+ * krb5_k_verify_checksum_iov_multi, starting with the test plaintext and
+ * splitting some messages across data and sign-only iovs.  Corrupt some of the
+ * checksums and truncate the last, and check each result against
+ * krb5_k_verify_checksum_iov.  Return 0 if all of the results match.
+ */
+#define NMSGS 21
+
+static int
+test_multi(const struct test *test, const krb5_keyblock *kbp)
+{
+    krb5_error_code ret, codes[NMSGS];
+    krb5_key key = NULL;
+    krb5_crypto_iov iovs[NMSGS][3], *iovp[NMSGS];
+    krb5_boolean valid[NMSGS], single_valid;
+    krb5_checksum cksum;
+    size_t num_data[NMSGS], len, i, j;
+    char *bufs[NMSGS], cksums[NMSGS][64];
+    int status = 0;
+
+    if (kbp != NULL) {
+        ret = krb5_k_create_key(NULL, kbp, &key);
+        assert(!ret);
+    }
+
+    for (i = 0; i < NMSGS; i++) {
+        len = (i == 0) ? test->plaintext.length : i * 37;
+        bufs[i] = malloc(len + 1);
+        assert(bufs[i] != NULL);
+        if (i == 0)
+            memcpy(bufs[i], test->plaintext.data, len);
+        for (j = 0; i > 0 && j < len; j++)
+            bufs[i][j] = i + j;
+
+        iovs[i][0].flags = KRB5_CRYPTO_TYPE_DATA;
+        iovs[i][0].data = make_data(bufs[i], len);
+        iovs[i][1].flags = KRB5_CRYPTO_TYPE_CHECKSUM;
+        iovs[i][1].data = make_data(cksums[i], test->cksum.length);
+        num_data[i] = 2;
+        if (i % 3 == 2) {
+            iovs[i][0].data.length = len / 2;
+            iovs[i][2].flags = KRB5_CRYPTO_TYPE_SIGN_ONLY;
+            iovs[i][2].data = make_data(bufs[i] + len / 2, len - len / 2);
+            num_data[i] = 3;
+        }
+        iovp[i] = iovs[i];
+
+        if (i == 0) {
+            memcpy(cksums[i], test->cksum.data, test->cksum.length);
+        } else {
+            ret = krb5_k_make_checksum_iov(NULL, test->sumtype, key,
+                                           test->usage, iovs[i], num_data[i]);
+            assert(!ret);
+        }
+        if (i % 4 == 3)
+            cksums[i][i % test->cksum.length] ^= 1;
+    }
+
+    /* Verify all of the messages but the last, not asking for codes. */
+    ret = krb5_k_verify_checksum_iov_multi(NULL, test->sumtype, key,
+                                           test->usage, NMSGS - 1,
+                                           (const krb5_crypto_iov *const *)
+                                           iovp, num_data, valid, NULL);
+    assert(!ret);
+
+    /* Verify them again with the last checksum truncated. */
+    iovs[NMSGS - 1][1].data.length--;
+    ret = krb5_k_verify_checksum_iov_multi(NULL, test->sumtype, key,
+                                           test->usage, NMSGS,
+                                           (const krb5_crypto_iov *const *)
+                                           iovp, num_data, valid, codes);
+    assert(ret == KRB5_BAD_MSIZE);
+    assert(codes[NMSGS - 1] == KRB5_BAD_MSIZE && !valid[NMSGS - 1]);
+    for (i = 0; i < NMSGS - 1; i++) {
+        ret = krb5_k_verify_checksum_iov(NULL, test->sumtype, key,
+                                         test->usage, iovs[i], num_data[i],
+                                         &single_valid);
+        assert(!ret && !codes[i]);
+        if (valid[i] != single_valid || valid[i] != (i % 4 != 3))
+            status = 1;
+    }
+
+    /* Check that a checksum type of 0 works when the key has a mandatory
+     * type matching the test. */
+    if (kbp != NULL &&
+        krb5int_c_mandatory_cksumtype(NULL, kbp->enctype,
+                                      &cksum.checksum_type) == 0 &&
+        cksum.checksum_type == test->sumtype) {
+        ret = krb5_k_verify_checksum_iov_multi(NULL, 0, key, test->usage, 1,
+                                               (const krb5_crypto_iov *const *)
+                                               iovp, num_data, valid, NULL);
+        assert(!ret);
+        if (!valid[0])
+            status = 1;
+    }
+
+    for (i = 0; i < NMSGS; i++)
+        free(bufs[i]);
+    krb5_k_free_key(NULL, key);
+    return status;
+}
+
 int
 main(int argc, char **argv)
 {
@@ -253,6 +356,14 @@ main(int argc, char **argv)
             }
         }
 
+        /* Test that batched verification gives the same results. */
+        if (test_multi(test, kbp) != 0) {
+            printf("test %d multi verify failed\n", (int)i);
+            status = 1;
+            if (!verbose)
+                break;
+        }
+
         krb5_free_checksum_contents(context, &cksum);
         assert(cksum.length == 0);
     }
@@ -87,6 +87,115 @@ display(const char *msg, const krb5_data *d)
     printf("\n");
 }
 
+/*
+ * Encrypt messages of various lengths together with krb5_k_encrypt_iov_multi,
+ * splitting the data of some of them across two iovs and giving some of them
+ * cipher states, and check that each decrypts correctly on its own and
+ * leaves the same cipher state.
+ */
+#define NMSGS 21
+
+static void
+test_multi(krb5_context context, krb5_keyblock *keyblock, krb5_key key)
+{
+    krb5_enctype enctype = keyblock->enctype;
+    krb5_crypto_iov iovs[NMSGS][6], *iovp[NMSGS];
+    krb5_data states[NMSGS], dstate, *statep[NMSGS];
+    krb5_error_code codes[NMSGS];
+    size_t num_data[NMSGS], len;
+    char *bufs[NMSGS];
+    unsigned int hlen, tlen, plen;
+    int i, j, n;
+
+    for (i = 0; i < NMSGS; i++) {
+        len = i * 19;
+        test("Getting lengths",
+             krb5_c_crypto_length(context, enctype, KRB5_CRYPTO_TYPE_HEADER,
+                                  &hlen));
+        test("Getting lengths",
+             krb5_c_crypto_length(context, enctype, KRB5_CRYPTO_TYPE_TRAILER,
+                                  &tlen));
+        test("Getting lengths",
+             krb5_c_padding_length(context, enctype, len, &plen));
+        bufs[i] = malloc(hlen + len + plen + tlen);
+        if (bufs[i] == NULL)
+            abort();
+
+        /* Split the data in two at an odd offset for every third message. */
+        n = 0;
+        iovs[i][n].flags = KRB5_CRYPTO_TYPE_HEADER;
+        iovs[i][n++].data = make_data(bufs[i], hlen);
+        if (i % 3 == 0 && len > 0) {
+            iovs[i][n].flags = KRB5_CRYPTO_TYPE_DATA;
+            iovs[i][n++].data = make_data(bufs[i] + hlen, len / 2 + 1);
+            iovs[i][n].flags = KRB5_CRYPTO_TYPE_DATA;
+            iovs[i][n++].data = make_data(bufs[i] + hlen + len / 2 + 1,
+                                          len - len / 2 - 1);
+        } else {
+            iovs[i][n].flags = KRB5_CRYPTO_TYPE_DATA;
+            iovs[i][n++].data = make_data(bufs[i] + hlen, len);
+        }
+        iovs[i][n].flags = KRB5_CRYPTO_TYPE_PADDING;
+        iovs[i][n++].data = make_data(bufs[i] + hlen + len, plen);
+        iovs[i][n].flags = KRB5_CRYPTO_TYPE_TRAILER;
+        iovs[i][n++].data = make_data(bufs[i] + hlen + len + plen, tlen);
+        num_data[i] = n;
+        iovp[i] = iovs[i];
+        for (j = 0; j < (int)len; j++)
+            bufs[i][hlen + j] = i + j;
+
+        statep[i] = NULL;
+        if (i % 2) {
+            test("init_state",
+                 krb5_c_init_state(context, keyblock, 7, &states[i]));
+            statep[i] = &states[i];
+        }
+    }
+
+    test("multi iov encrypting",
+         krb5_k_encrypt_iov_multi(context, key, 7, NMSGS,
+                                  (const krb5_data *const *)statep, iovp,
+                                  num_data, codes));
+    for (i = 0; i < NMSGS; i++) {
+        test("multi iov encrypting", codes[i]);
+        if (i % 2) {
+            test("init_state",
+                 krb5_c_init_state(context, keyblock, 7, &dstate));
+            test("iov decrypting",
+                 krb5_k_decrypt_iov(context, key, 7, &dstate, iovs[i],
+                                    num_data[i]));
+            test("Comparing states", compare_results(&states[i], &dstate));
+            krb5_c_free_state(context, keyblock, &dstate);
+            krb5_c_free_state(context, keyblock, &states[i]);
+        } else {
+            test("iov decrypting",
+                 krb5_k_decrypt_iov(context, key, 7, NULL, iovs[i],
+                                    num_data[i]));
+        }
+        len = i * 19;
+        for (j = 0; j < (int)len; j++) {
+            if (bufs[i][hlen + j] != (char)(i + j))
+                test("Comparing results", 1);
+        }
+    }
+
+    /* Encrypt again without states and decrypt the messages together. */
+    test("multi iov encrypting",
+         krb5_k_encrypt_iov_multi(context, key, 7, NMSGS, NULL, iovp,
+                                  num_data, NULL));
+    test("multi iov decrypting",
+         krb5_k_decrypt_iov_multi(context, key, 7, NMSGS, NULL, iovp,
+                                  num_data, codes));
+    for (i = 0; i < NMSGS; i++) {
+        len = i * 19;
+        for (j = 0; j < (int)len; j++) {
+            if (bufs[i][hlen + j] != (char)(i + j))
+                test("Comparing results", 1);
+        }
+        free(bufs[i]);
+    }
+}
+
 int
 main ()
 {
@@ -232,6 +341,8 @@ main ()
                  krb5_k_decrypt_iov(context, key, 7, 0, iov, 5));
             test("Comparing results",
                  compare_results(&in, &iov[1].data));
+
+            test_multi(context, keyblock, key);
         }
 
         enc_out.ciphertext.length = out.length;
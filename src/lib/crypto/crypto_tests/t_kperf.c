@@ -31,34 +31,116 @@
  *
  *     ./t_kperf ce aes128-cts 10 100000
  *     ./t_kperf kv aes256-cts 1024 10000
+ *     ./t_kperf kd aes256-sha2 64 10000 8
  *
  * The first usage encrypts ('e') a hundred thousand ten-byte blobs
  * with aes128-cts, using the non-caching APIs ('c').  The second
  * usage verifies ('v') ten thousand checksums over 1K blobs with the
  * first available keyed checksum type for aes256-cts, using the
- * caching APIs ('k').  Run commands under "time" to measure how much
- * time is used by the operations.
+ * caching APIs ('k').  The third usage decrypts ten thousand 64-byte
+ * messages in each of eight threads, all sharing one krb5_key.  Run
+ * commands under "time" to measure how much time is used by the
+ * operations.
+ *
+ * Operations rotate among NUSAGES key usages, so that several derived
+ * keys are cached on the key (and, with threads, derived concurrently).
+ * Decryption and verification results are checked.
  */
 
 #include "k5-int.h"
+#ifdef ENABLE_THREADS
+#include <pthread.h>
+#endif
+
+#define NUSAGES 4
+
+static int intf, op, blocksize, num_blocks;
+static krb5_keyblock kblock;
+static krb5_key key;
+static krb5_enctype enctype;
+static krb5_cksumtype cktype;
+static size_t outlen, cklen;
+
+/* Ciphertexts and checksums of a zero-filled block for each usage. */
+static krb5_enc_data ciphertexts[NUSAGES];
+static krb5_checksum sums[NUSAGES];
+
+/* Perform num_blocks operations, with buffers private to this call. */
+static void *
+run_ops(void *unused)
+{
+    krb5_error_code ret = 0;
+    krb5_data block;
+    krb5_enc_data outblock;
+    krb5_checksum sum;
+    krb5_boolean val = TRUE;
+    krb5_keyusage usage;
+    int i;
+
+    /* Decryption output may include padding, so make block big enough. */
+    block.length = blocksize;
+    block.data = calloc(1, outlen);
+    outblock.enctype = enctype;
+    outblock.ciphertext.length = outlen;
+    outblock.ciphertext.data = calloc(1, outlen);
+    sum.checksum_type = cktype;
+    sum.length = cklen;
+    sum.contents = calloc(1, cklen);
+    assert(block.data != NULL && outblock.ciphertext.data != NULL &&
+           sum.contents != NULL);
+
+    for (i = 0; i < num_blocks; i++) {
+        usage = i % NUSAGES;
+        if (intf == 'c') {
+            if (op == 'e') {
+                ret = krb5_c_encrypt(NULL, &kblock, usage, NULL, &block,
+                                     &outblock);
+            } else if (op == 'd') {
+                block.length = outlen;
+                ret = krb5_c_decrypt(NULL, &kblock, usage, NULL,
+                                     &ciphertexts[usage], &block);
+            } else if (op == 'm') {
+                ret = krb5_c_make_checksum(NULL, cktype, &kblock, usage,
+                                           &block, &sum);
+            } else if (op == 'v') {
+                ret = krb5_c_verify_checksum(NULL, &kblock, usage, &block,
+                                             &sums[usage], &val);
+            }
+        } else {
+            if (op == 'e') {
+                ret = krb5_k_encrypt(NULL, key, usage, NULL, &block,
+                                     &outblock);
+            } else if (op == 'd') {
+                block.length = outlen;
+                ret = krb5_k_decrypt(NULL, key, usage, NULL,
+                                     &ciphertexts[usage], &block);
+            } else if (op == 'm') {
+                ret = krb5_k_make_checksum(NULL, cktype, key, usage, &block,
+                                           &sum);
+            } else if (op == 'v') {
+                ret = krb5_k_verify_checksum(NULL, key, usage, &block,
+                                             &sums[usage], &val);
+            }
+        }
+        assert(!ret && val);
+    }
+
+    free(block.data);
+    free(outblock.ciphertext.data);
+    free(sum.contents);
+    return NULL;
+}
 
 int
 main(int argc, char **argv)
 {
     krb5_error_code ret;
-    krb5_keyblock kblock;
-    krb5_key key;
-    krb5_enctype enctype;
-    krb5_cksumtype cktype;
-    int blocksize, num_blocks, intf, op, i;
-    size_t outlen, cklen;
     krb5_data block;
-    krb5_enc_data outblock;
-    krb5_checksum sum;
-    krb5_boolean val;
+    int i, nthreads = 1;
 
-    if (argc != 5) {
-        fprintf(stderr, "Usage: t_kperf {c|k}{e|d|m|v} type size nblocks\n");
+    if (argc != 5 && argc != 6) {
+        fprintf(stderr, "Usage: t_kperf {c|k}{e|d|m|v} type size nblocks "
+                "[nthreads]\n");
         exit(1);
     }
     intf = argv[1][0];
@@ -68,6 +150,9 @@ main(int argc, char **argv)
     assert(!ret);
     blocksize = atoi(argv[3]);
     num_blocks = atoi(argv[4]);
+    if (argc == 6)
+        nthreads = atoi(argv[5]);
+    assert(nthreads >= 1);
 
     block.data = "notrandom";
     block.length = 9;
@@ -76,48 +161,57 @@ main(int argc, char **argv)
     krb5_c_make_random_key(NULL, enctype, &kblock);
     krb5_k_create_key(NULL, &kblock, &key);
 
-    block.length = blocksize;
-    block.data = calloc(1, blocksize);
-
     krb5_c_encrypt_length(NULL, enctype, blocksize, &outlen);
-    outblock.enctype = enctype;
-    outblock.ciphertext.length = outlen;
-    outblock.ciphertext.data = calloc(1, outlen);
-
     krb5int_c_mandatory_cksumtype(NULL, enctype, &cktype);
     krb5_c_checksum_length(NULL, cktype, &cklen);
-    sum.checksum_type = cktype;
-    sum.length = cklen;
-    sum.contents = calloc(1, cklen);
 
     /*
      * Decrypting typically involves copying the output after checking the
-     * hash, so we need to create a valid ciphertext to correctly measure its
-     * performance.
+     * hash, so we need to create valid ciphertexts to correctly measure its
+     * performance.  Verification likewise needs valid checksums.
      */
-    if (op == 'd')
-        krb5_c_encrypt(NULL, &kblock, 0, NULL, &block, &outblock);
+    block.length = blocksize;
+    block.data = calloc(1, blocksize);
+    assert(block.data != NULL);
+    for (i = 0; i < NUSAGES; i++) {
+        ciphertexts[i].enctype = enctype;
+        ciphertexts[i].ciphertext.length = outlen;
+        ciphertexts[i].ciphertext.data = calloc(1, outlen);
+        assert(ciphertexts[i].ciphertext.data != NULL);
+        ret = krb5_c_encrypt(NULL, &kblock, i, NULL, &block, &ciphertexts[i]);
+        assert(!ret);
+        ret = krb5_c_make_checksum(NULL, cktype, &kblock, i, &block,
+                                   &sums[i]);
+        assert(!ret);
+    }
 
-    for (i = 0; i < num_blocks; i++) {
-        if (intf == 'c') {
-            if (op == 'e')
-                krb5_c_encrypt(NULL, &kblock, 0, NULL, &block, &outblock);
-            else if (op == 'd')
-                krb5_c_decrypt(NULL, &kblock, 0, NULL, &outblock, &block);
-            else if (op == 'm')
-                krb5_c_make_checksum(NULL, cktype, &kblock, 0, &block, &sum);
-            else if (op == 'v')
-                krb5_c_verify_checksum(NULL, &kblock, 0, &block, &sum, &val);
-        } else {
-            if (op == 'e')
-                krb5_k_encrypt(NULL, key, 0, NULL, &block, &outblock);
-            else if (op == 'd')
-                krb5_k_decrypt(NULL, key, 0, NULL, &outblock, &block);
-            else if (op == 'm')
-                krb5_k_make_checksum(NULL, cktype, key, 0, &block, &sum);
-            else if (op == 'v')
-                krb5_k_verify_checksum(NULL, key, 0, &block, &sum, &val);
+    if (nthreads == 1) {
+        run_ops(NULL);
+    } else {
+#ifdef ENABLE_THREADS
+        pthread_t *threads = calloc(nthreads, sizeof(*threads));
+
+        assert(threads != NULL);
+        for (i = 0; i < nthreads; i++) {
+            if (pthread_create(&threads[i], NULL, run_ops, NULL) != 0)
+                abort();
         }
+        for (i = 0; i < nthreads; i++)
+            pthread_join(threads[i], NULL);
+        free(threads);
+#else
+        /* Without thread support, run each thread's operations in turn. */
+        for (i = 0; i < nthreads; i++)
+            run_ops(NULL);
+#endif
+    }
+
+    for (i = 0; i < NUSAGES; i++) {
+        free(ciphertexts[i].ciphertext.data);
+        krb5_free_checksum_contents(NULL, &sums[i]);
     }
+    free(block.data);
+    krb5_k_free_key(NULL, key);
+    krb5_free_keyblock_contents(NULL, &kblock);
     return 0;
 }
@@ -52,6 +52,17 @@ struct test sha256_tests[] = {
         0xe5,0xc0,0x26,0x93,0x0c,0x3e,0x60,0x39,
         0xa3,0x3c,0xe4,0x59,0x64,0xff,0x21,0x67,
         0xf6,0xec,0xed,0xd4,0x19,0xdb,0x06,0xc1 }},
+    { "",
+      { 0xe3,0xb0,0xc4,0x42,0x98,0xfc,0x1c,0x14,
+        0x9a,0xfb,0xf4,0xc8,0x99,0x6f,0xb9,0x24,
+        0x27,0xae,0x41,0xe4,0x64,0x9b,0x93,0x4c,
+        0xa4,0x95,0x99,0x1b,0x78,0x52,0xb8,0x55 }},
+    { "abcdefghbcdefghicdefghijdefghijkefghijklfghijklmghijklmnhijklmno"
+      "ijklmnopjklmnopqklmnopqrlmnopqrsmnopqrstnopqrstu",
+      { 0xcf,0x5b,0x16,0xa7,0x78,0xaf,0x83,0x80,
+        0x03,0x6c,0xe5,0x9e,0x7b,0x04,0x92,0x37,
+        0x0b,0x24,0x9b,0x11,0xe8,0xf0,0x7a,0x51,
+        0xaf,0xac,0x45,0x03,0x7a,0xfe,0xe9,0xd1 }},
     { ONE_MILLION_A,
       { 0xcd,0xc7,0x6e,0x5c,0x99,0x14,0xfb,0x92,
         0x81,0xa1,0xc7,0xe2,0x84,0xd7,0x3e,0x67,
@@ -76,6 +87,20 @@ struct test sha384_tests[] = {
 	0x2f,0xa0,0x80,0x86,0xe3,0xb0,0xf7,0x12,
 	0xfc,0xc7,0xc7,0x1a,0x55,0x7e,0x2d,0xb9,
 	0x66,0xc3,0xe9,0xfa,0x91,0x74,0x60,0x39 }},
+    { "",
+      { 0x38,0xb0,0x60,0xa7,0x51,0xac,0x96,0x38,
+	0x4c,0xd9,0x32,0x7e,0xb1,0xb1,0xe3,0x6a,
+	0x21,0xfd,0xb7,0x11,0x14,0xbe,0x07,0x43,
+	0x4c,0x0c,0xc7,0xbf,0x63,0xf6,0xe1,0xda,
+	0x27,0x4e,0xde,0xbf,0xe7,0x6f,0x65,0xfb,
+	0xd5,0x1a,0xd2,0xf1,0x48,0x98,0xb9,0x5b }},
+    { "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
+      { 0x33,0x91,0xfd,0xdd,0xfc,0x8d,0xc7,0x39,
+	0x37,0x07,0xa6,0x5b,0x1b,0x47,0x09,0x39,
+	0x7c,0xf8,0xb1,0xd1,0x62,0xaf,0x05,0xab,
+	0xfe,0x8f,0x45,0x0d,0xe5,0xf3,0x6b,0xc6,
+	0xb0,0x45,0x5a,0x85,0x20,0xbc,0x4e,0x6f,
+	0x5f,0xe9,0x5b,0x1f,0xe3,0xc8,0x45,0x2b }},
     { ONE_MILLION_A,
       { 0x9d,0x0e,0x18,0x09,0x71,0x64,0x74,0xcb,
 	0x08,0x6e,0x83,0x4e,0x31,0x0a,0x4a,0x1c,
@@ -136,10 +161,54 @@ hash_test(const struct krb5_hash_provider *hash, struct test *tests)
     return 0;
 }
 
+/*
+ * Check that hashing inputs of up to four blocks gives the same result when
+ * the input is split into three iovs at a range of positions, to exercise
+ * the partial and whole block paths of the implementation.
+ */
+static int
+split_test(const struct krb5_hash_provider *hash)
+{
+    unsigned char buf[512];
+    krb5_crypto_iov iov[3];
+    krb5_data whole, split;
+    size_t len, i, j, k;
+
+    assert(hash->blocksize * 4 <= sizeof(buf));
+    for (i = 0; i < sizeof(buf); i++)
+	buf[i] = i * 7 + 1;
+    if (alloc_data(&whole, hash->hashsize) || alloc_data(&split,
+							hash->hashsize))
+	abort();
+    for (k = 0; k < 3; k++)
+	iov[k].flags = KRB5_CRYPTO_TYPE_DATA;
+    for (len = 0; len <= hash->blocksize * 4; len += 3) {
+	iov[0].data = make_data(buf, len);
+	if (hash->hash(iov, 1, &whole) != 0)
+	    abort();
+	for (i = 0; i <= len; i += 5) {
+	    for (j = i; j <= len; j += 11) {
+		iov[0].data = make_data(buf, i);
+		iov[1].data = make_data(buf + i, j - i);
+		iov[2].data = make_data(buf + j, len - j);
+		if (hash->hash(iov, 3, &split) != 0)
+		    abort();
+		if (memcmp(whole.data, split.data, hash->hashsize) != 0)
+		    abort();
+	    }
+	}
+    }
+    free(whole.data);
+    free(split.data);
+    return 0;
+}
+
 int
 main()
 {
     hash_test(&krb5int_hash_sha256, sha256_tests);
     hash_test(&krb5int_hash_sha384, sha384_tests);
+    split_test(&krb5int_hash_sha256);
+    split_test(&krb5int_hash_sha384);
     return 0;
 }
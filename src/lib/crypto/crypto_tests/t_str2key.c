@@ -456,6 +456,57 @@ printhex(const char *head, void *data, size_t len)
 
 extern int k5_allow_weak_pbkdf2iter;
 
+#define NTESTS (sizeof(test_cases) / sizeof(*test_cases))
+
+/*
+ * Convert two copies of each successful test case at once with
+ * krb5_c_string_to_key_multi(), so that every hash function has several
+ * PBKDF2 lanes, and check the results.
+ */
+static int
+test_multi(krb5_context context, unsigned int nthreads)
+{
+    krb5_enctype enctypes[NTESTS * 2];
+    krb5_data strings[NTESTS * 2], salts[NTESTS * 2];
+    const krb5_data *params[NTESTS * 2];
+    krb5_keyblock keys[NTESTS * 2];
+    krb5_error_code ret, codes[NTESTS * 2];
+    struct test *tests[NTESTS * 2];
+    size_t i, n = 0;
+    int status = 0;
+
+    k5_allow_weak_pbkdf2iter = TRUE;
+    for (i = 0; i < NTESTS * 2; i++) {
+        tests[n] = &test_cases[i % NTESTS];
+        if (tests[n]->expected_err != 0)
+            continue;
+        enctypes[n] = tests[n]->enctype;
+        strings[n] = string2data(tests[n]->string);
+        salts[n] = tests[n]->salt;
+        params[n] = &tests[n]->params;
+        n++;
+    }
+
+    ret = krb5_c_string_to_key_multi(context, n, enctypes, strings, salts,
+                                     params, nthreads, keys, codes);
+    if (ret) {
+        com_err("t_str2key", ret, "in krb5_c_string_to_key_multi");
+        exit(1);
+    }
+    for (i = 0; i < n; i++) {
+        assert(codes[i] == 0);
+        assert(keys[i].length == tests[i]->expected_key.length);
+        if (memcmp(keys[i].contents, tests[i]->expected_key.data,
+                   keys[i].length) != 0) {
+            printf("str2key multi test %d (%u threads) failed\n",
+                   (int)(tests[i] - test_cases), nthreads);
+            status = 1;
+        }
+        krb5_free_keyblock_contents(context, &keys[i]);
+    }
+    return status;
+}
+
 int
 main(int argc, char **argv)
 {
@@ -510,5 +561,8 @@ main(int argc, char **argv)
         }
         krb5_free_keyblock(context, keyblock);
     }
+
+    if (test_multi(context, 1) != 0 || test_multi(context, 3) != 0)
+        status = 1;
     return status;
 }
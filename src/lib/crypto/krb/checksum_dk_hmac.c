@@ -29,23 +29,32 @@
 
 #define K5CLENGTH 5 /* 32 bit net byte order integer + one byte seed */
 
+/* Derive the checksum key for usage from key. */
+static krb5_error_code
+derive_checksum_key(const struct krb5_cksumtypes *ctp, krb5_key key,
+                    krb5_keyusage usage, krb5_key *kc_out)
+{
+    unsigned char constantdata[K5CLENGTH];
+    krb5_data datain;
+
+    datain = make_data(constantdata, K5CLENGTH);
+    store_32_be(usage, constantdata);
+    constantdata[4] = (char) 0x99;
+    return krb5int_derive_key(ctp->enc, NULL, key, kc_out, &datain,
+                              DERIVE_RFC3961);
+}
+
 krb5_error_code
 krb5int_dk_checksum(const struct krb5_cksumtypes *ctp,
                     krb5_key key, krb5_keyusage usage,
                     const krb5_crypto_iov *data, size_t num_data,
                     krb5_data *output)
 {
-    const struct krb5_enc_provider *enc = ctp->enc;
     krb5_error_code ret;
-    unsigned char constantdata[K5CLENGTH];
-    krb5_data datain;
     krb5_key kc;
 
     /* Derive the key. */
-    datain = make_data(constantdata, K5CLENGTH);
-    store_32_be(usage, constantdata);
-    constantdata[4] = (char) 0x99;
-    ret = krb5int_derive_key(enc, NULL, key, &kc, &datain, DERIVE_RFC3961);
+    ret = derive_checksum_key(ctp, key, usage, &kc);
     if (ret)
         return ret;
 
@@ -57,3 +66,27 @@ krb5int_dk_checksum(const struct krb5_cksumtypes *ctp,
     krb5_k_free_key(NULL, kc);
     return ret;
 }
+
+krb5_error_code
+krb5int_dk_checksum_multi(const struct krb5_cksumtypes *ctp,
+                          krb5_key key, krb5_keyusage usage,
+                          struct cksum_msg *msgs, size_t count)
+{
+    krb5_error_code ret;
+    krb5_key kc;
+    size_t i;
+
+    /* Derive the key once for all of the messages. */
+    ret = derive_checksum_key(ctp, key, usage, &kc);
+    if (ret)
+        return ret;
+
+    ret = krb5int_hmac_multi(ctp->hash, kc, msgs, count);
+    if (ret) {
+        for (i = 0; i < count; i++)
+            memset(msgs[i].output.data, 0, msgs[i].output.length);
+    }
+
+    krb5_k_free_key(NULL, kc);
+    return ret;
+}
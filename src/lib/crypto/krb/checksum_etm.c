@@ -32,34 +32,71 @@
 
 #include "crypto_int.h"
 
+/* Derive the checksum key for usage from key into kc, allocating it. */
+static krb5_error_code
+derive_checksum_key(const struct krb5_cksumtypes *ctp, krb5_key key,
+                    krb5_keyusage usage, krb5_data *kc)
+{
+    krb5_error_code ret;
+    uint8_t label[5];
+    krb5_data label_data = make_data(label, 5);
+
+    *kc = empty_data();
+    store_32_be(usage, label);
+    label[4] = 0x99;
+    ret = alloc_data(kc, ctp->hash->hashsize / 2);
+    if (ret)
+        return ret;
+    ret = krb5int_derive_random(ctp->enc, ctp->hash, key, kc, &label_data,
+                                DERIVE_SP800_108_HMAC);
+    if (ret) {
+        zapfree(kc->data, kc->length);
+        *kc = empty_data();
+    }
+    return ret;
+}
+
 krb5_error_code
 krb5int_etm_checksum(const struct krb5_cksumtypes *ctp, krb5_key key,
                      krb5_keyusage usage, const krb5_crypto_iov *data,
                      size_t num_data, krb5_data *output)
 {
     krb5_error_code ret;
-    uint8_t label[5];
-    krb5_data label_data = make_data(label, 5), kc = empty_data();
+    krb5_data kc;
     krb5_keyblock kb = { 0 };
 
     /* Derive the checksum key. */
-    store_32_be(usage, label);
-    label[4] = 0x99;
-    label_data = make_data(label, 5);
-    ret = alloc_data(&kc, ctp->hash->hashsize / 2);
-    if (ret)
-        goto cleanup;
-    ret = krb5int_derive_random(ctp->enc, ctp->hash, key, &kc, &label_data,
-                                DERIVE_SP800_108_HMAC);
+    ret = derive_checksum_key(ctp, key, usage, &kc);
     if (ret)
-        goto cleanup;
+        return ret;
 
     /* Compute an HMAC with kc over the data. */
     kb.length = kc.length;
     kb.contents = (uint8_t *)kc.data;
     ret = krb5int_hmac_keyblock(ctp->hash, &kb, data, num_data, output);
 
-cleanup:
+    zapfree(kc.data, kc.length);
+    return ret;
+}
+
+krb5_error_code
+krb5int_etm_checksum_multi(const struct krb5_cksumtypes *ctp, krb5_key key,
+                           krb5_keyusage usage, struct cksum_msg *msgs,
+                           size_t count)
+{
+    krb5_error_code ret;
+    krb5_data kc;
+    krb5_keyblock kb = { 0 };
+
+    /* Derive the checksum key once for all of the messages. */
+    ret = derive_checksum_key(ctp, key, usage, &kc);
+    if (ret)
+        return ret;
+
+    kb.length = kc.length;
+    kb.contents = (uint8_t *)kc.data;
+    ret = krb5int_hmac_keyblock_multi(ctp->hash, &kb, msgs, count);
+
     zapfree(kc.data, kc.length);
     return ret;
 }
@@ -31,74 +31,74 @@ const struct krb5_cksumtypes krb5int_cksumtypes_list[] = {
     { CKSUMTYPE_RSA_MD4,
       "md4", { 0 }, "RSA-MD4",
       NULL, &krb5int_hash_md4,
-      krb5int_unkeyed_checksum, NULL,
+      krb5int_unkeyed_checksum, NULL, NULL,
       16, 16, CKSUM_UNKEYED },
 
     { CKSUMTYPE_RSA_MD5,
       "md5", { 0 }, "RSA-MD5",
       NULL, &krb5int_hash_md5,
-      krb5int_unkeyed_checksum, NULL,
+      krb5int_unkeyed_checksum, NULL, NULL,
       16, 16, CKSUM_UNKEYED },
 
     { CKSUMTYPE_NIST_SHA,
       "sha", { 0 }, "NIST-SHA",
       NULL, &krb5int_hash_sha1,
-      krb5int_unkeyed_checksum, NULL,
+      krb5int_unkeyed_checksum, NULL, NULL,
       20, 20, CKSUM_UNKEYED },
 
     { CKSUMTYPE_HMAC_SHA1_DES3,
       "hmac-sha1-des3", { "hmac-sha1-des3-kd" }, "HMAC-SHA1 DES3 key",
       &krb5int_enc_des3, &krb5int_hash_sha1,
-      krb5int_dk_checksum, NULL,
+      krb5int_dk_checksum, NULL, krb5int_dk_checksum_multi,
       20, 20, 0 },
 
     { CKSUMTYPE_HMAC_MD5_ARCFOUR,
       "hmac-md5-rc4", { "hmac-md5-enc", "hmac-md5-earcfour" },
       "Microsoft HMAC MD5",
       NULL, &krb5int_hash_md5,
-      krb5int_hmacmd5_checksum, NULL,
+      krb5int_hmacmd5_checksum, NULL, NULL,
       16, 16, 0 },
 
     { CKSUMTYPE_HMAC_SHA1_96_AES128,
       "hmac-sha1-96-aes128", { 0 }, "HMAC-SHA1 AES128 key",
       &krb5int_enc_aes128, &krb5int_hash_sha1,
-      krb5int_dk_checksum, NULL,
+      krb5int_dk_checksum, NULL, krb5int_dk_checksum_multi,
       20, 12, 0 },
 
     { CKSUMTYPE_HMAC_SHA1_96_AES256,
       "hmac-sha1-96-aes256", { 0 }, "HMAC-SHA1 AES256 key",
       &krb5int_enc_aes256, &krb5int_hash_sha1,
-      krb5int_dk_checksum, NULL,
+      krb5int_dk_checksum, NULL, krb5int_dk_checksum_multi,
       20, 12, 0 },
 
     { CKSUMTYPE_MD5_HMAC_ARCFOUR,
       "md5-hmac-rc4", { 0 }, "Microsoft MD5 HMAC",
       &krb5int_enc_arcfour, &krb5int_hash_md5,
-      krb5int_hmacmd5_checksum, NULL,
+      krb5int_hmacmd5_checksum, NULL, NULL,
       16, 16, 0 },
 
     { CKSUMTYPE_CMAC_CAMELLIA128,
       "cmac-camellia128", { 0 }, "CMAC Camellia128 key",
       &krb5int_enc_camellia128, NULL,
-      krb5int_dk_cmac_checksum, NULL,
+      krb5int_dk_cmac_checksum, NULL, NULL,
       16, 16, 0 },
 
     { CKSUMTYPE_CMAC_CAMELLIA256,
       "cmac-camellia256", { 0 }, "CMAC Camellia256 key",
       &krb5int_enc_camellia256, NULL,
-      krb5int_dk_cmac_checksum, NULL,
+      krb5int_dk_cmac_checksum, NULL, NULL,
       16, 16, 0 },
 
     { CKSUMTYPE_HMAC_SHA256_128_AES128,
       "hmac-sha256-128-aes128", { 0 }, "HMAC-SHA256 AES128 key",
       &krb5int_enc_aes128, &krb5int_hash_sha256,
-      krb5int_etm_checksum, NULL,
+      krb5int_etm_checksum, NULL, krb5int_etm_checksum_multi,
       32, 16, 0 },
 
     { CKSUMTYPE_HMAC_SHA384_192_AES256,
       "hmac-sha384-192-aes256", { 0 }, "HMAC-SHA384 AES256 key",
       &krb5int_enc_aes256, &krb5int_hash_sha384,
-      krb5int_etm_checksum, NULL,
+      krb5int_etm_checksum, NULL, krb5int_etm_checksum_multi,
       48, 24, 0 },
 };
 
@@ -32,6 +32,25 @@
 
 #include <k5-int.h>
 
+/* One message of a batched encryption, with its cipher state (or NULL) and
+ * iov list. */
+struct crypt_msg {
+    const krb5_data *ivec;
+    krb5_crypto_iov *data;
+    size_t num_data;
+};
+
+/* Batched encryption functions work on groups of up to this many messages. */
+#define CRYPT_MULTI_MAX 16
+
+/* One message of a batched checksum computation, with its iov list and a
+ * caller-allocated output buffer. */
+struct cksum_msg {
+    const krb5_crypto_iov *data;
+    size_t num_data;
+    krb5_data output;
+};
+
 /* Enc providers and hash providers specify well-known ciphers and hashes to be
  * implemented by the crypto module. */
 
@@ -58,6 +77,12 @@ struct krb5_enc_provider {
 
     /* May be NULL if there is no key-derived data cached.  */
     void (*key_cleanup)(krb5_key key);
+
+    /* May be NULL.  Encrypt several independent messages with key, as encrypt
+     * would for each one, interleaving the work across messages. */
+    krb5_error_code (*encrypt_multi)(krb5_key key,
+                                     const struct crypt_msg *msgs,
+                                     size_t count);
 };
 
 struct krb5_hash_provider {
@@ -82,6 +107,15 @@ typedef krb5_error_code (*crypt_func)(const struct krb5_keytypes *ktp,
                                       const krb5_data *ivec,
                                       krb5_crypto_iov *data, size_t num_data);
 
+/* Encrypt count messages with key, setting codes[i] to the result for each
+ * one and returning the first error. */
+typedef krb5_error_code (*crypt_multi_func)(const struct krb5_keytypes *ktp,
+                                            krb5_key key,
+                                            krb5_keyusage keyusage,
+                                            const struct crypt_msg *msgs,
+                                            size_t count,
+                                            krb5_error_code *codes);
+
 typedef krb5_error_code (*str2key_func)(const struct krb5_keytypes *ktp,
                                         const krb5_data *string,
                                         const krb5_data *salt,
@@ -106,6 +140,7 @@ struct krb5_keytypes {
     crypto_length_func crypto_length;
     crypt_func encrypt;
     crypt_func decrypt;
+    crypt_multi_func encrypt_multi; /* may be NULL */
     str2key_func str2key;
     rand2key_func rand2key;
     prf_func prf;
@@ -157,6 +192,17 @@ typedef krb5_error_code (*verify_func)(const struct krb5_cksumtypes *ctp,
                                        const krb5_data *input,
                                        krb5_boolean *valid);
 
+/*
+ * Compute checksums over count messages with the same key and usage, as
+ * checksum would for each one, storing each result into msgs[i].output (which
+ * will already be allocated with ctp->compute_size bytes).  Work which
+ * depends only on the key and usage, such as key derivation, is done once.
+ */
+typedef krb5_error_code
+(*checksum_multi_func)(const struct krb5_cksumtypes *ctp, krb5_key key,
+                       krb5_keyusage usage, struct cksum_msg *msgs,
+                       size_t count);
+
 struct krb5_cksumtypes {
     krb5_cksumtype ctype;
     char *name;
@@ -166,6 +212,7 @@ struct krb5_cksumtypes {
     const struct krb5_hash_provider *hash;
     checksum_func checksum;
     verify_func verify;         /* NULL means recompute checksum and compare */
+    checksum_multi_func checksum_multi; /* may be NULL */
     unsigned int compute_size;  /* Allocation size for checksum computation */
     unsigned int output_size;   /* Possibly truncated output size */
     krb5_flags flags;
@@ -217,6 +264,21 @@ krb5_error_code krb5int_etm_encrypt(const struct krb5_keytypes *ktp,
                                     const krb5_data *ivec,
                                     krb5_crypto_iov *data, size_t num_data);
 
+/* Batched encrypt */
+krb5_error_code krb5int_dk_encrypt_multi(const struct krb5_keytypes *ktp,
+                                         krb5_key key, krb5_keyusage usage,
+                                         const struct crypt_msg *msgs,
+                                         size_t count, krb5_error_code *codes);
+krb5_error_code krb5int_etm_encrypt_multi(const struct krb5_keytypes *ktp,
+                                          krb5_key key, krb5_keyusage usage,
+                                          const struct crypt_msg *msgs,
+                                          size_t count,
+                                          krb5_error_code *codes);
+krb5_error_code krb5int_enc_encrypt_multi(const struct krb5_enc_provider *enc,
+                                          krb5_key key,
+                                          const struct crypt_msg *msgs,
+                                          size_t count);
+
 /* Decrypt */
 krb5_error_code krb5int_raw_decrypt(const struct krb5_keytypes *ktp,
                                     krb5_key key, krb5_keyusage usage,
@@ -273,6 +335,25 @@ krb5_error_code krb5int_aes2_string_to_key(const struct krb5_keytypes *enc,
                                            const krb5_data *params,
                                            krb5_keyblock *key);
 
+/* A string-to-key computation for krb5int_pbkdf2_string_to_key_multi().  The
+ * caller allocates key->contents. */
+struct s2k_request {
+    const struct krb5_keytypes *ktp;
+    const krb5_data *string;
+    const krb5_data *salt;
+    const krb5_data *params;
+    krb5_keyblock *key;
+    krb5_error_code code;       /* result */
+};
+
+/* Return true if ktp's string-to-key function is based on PBKDF2. */
+krb5_boolean krb5int_pbkdf2_enctype(const struct krb5_keytypes *ktp);
+
+/* Perform the n requests in reqs, whose enctypes must be based on PBKDF2,
+ * using up to nthreads threads.  Set the code field of each request. */
+void krb5int_pbkdf2_string_to_key_multi(struct s2k_request *reqs, size_t n,
+                                        unsigned int nthreads);
+
 /* Random to key */
 krb5_error_code k5_rand2key_direct(const krb5_data *randombits,
                                    krb5_keyblock *keyblock);
@@ -321,6 +402,16 @@ krb5_error_code krb5int_etm_checksum(const struct krb5_cksumtypes *ctp,
                                      const krb5_crypto_iov *data,
                                      size_t num_data, krb5_data *output);
 
+/* Batched checksum */
+krb5_error_code krb5int_dk_checksum_multi(const struct krb5_cksumtypes *ctp,
+                                          krb5_key key, krb5_keyusage usage,
+                                          struct cksum_msg *msgs,
+                                          size_t count);
+krb5_error_code krb5int_etm_checksum_multi(const struct krb5_cksumtypes *ctp,
+                                           krb5_key key, krb5_keyusage usage,
+                                           struct cksum_msg *msgs,
+                                           size_t count);
+
 /*** Key derivation functions ***/
 
 enum deriv_alg {
@@ -460,6 +551,21 @@ krb5_error_code krb5int_hmac_keyblock(const struct krb5_hash_provider *hash,
                                       const krb5_crypto_iov *data,
                                       size_t num_data, krb5_data *output);
 
+/*
+ * Compute the HMACs of count messages using the provided hash function and
+ * key, storing each result into msgs[i].output (caller-allocated).  Modules
+ * may set up the keyed hash state once and hash the messages together.
+ */
+krb5_error_code krb5int_hmac_multi(const struct krb5_hash_provider *hash,
+                                   krb5_key key, struct cksum_msg *msgs,
+                                   size_t count);
+
+/* As above, using a keyblock as the key input. */
+krb5_error_code
+krb5int_hmac_keyblock_multi(const struct krb5_hash_provider *hash,
+                            const krb5_keyblock *keyblock,
+                            struct cksum_msg *msgs, size_t count);
+
 /*
  * Compute the PBKDF2 (see RFC 2898) of password and salt, with the specified
  * count, using HMAC with the specified hash as the pseudo-random function,
@@ -470,6 +576,40 @@ krb5_error_code krb5int_pbkdf2_hmac(const struct krb5_hash_provider *hash,
                                     const krb5_data *password,
                                     const krb5_data *salt);
 
+/* A PBKDF2 computation for krb5int_pbkdf2_hmac_multi(). */
+struct pbkdf2_job {
+    const struct krb5_hash_provider *hash;
+    unsigned long count;
+    krb5_data password;
+    krb5_data salt;
+    krb5_data out;              /* caller-allocated */
+    krb5_error_code code;       /* result of this job */
+};
+
+/*
+ * Compute the PBKDF2 outputs of the njobs jobs in jobs, which may use
+ * different hash functions and counts, setting the code field of each job.
+ * Modules may compute the output blocks of jobs with the same hash function
+ * and count together.  Return the first nonzero job code, or 0.
+ */
+krb5_error_code krb5int_pbkdf2_hmac_multi(struct pbkdf2_job *jobs,
+                                          size_t njobs);
+
+/*
+ * Encrypt data in place with the enc provider enc, key ke, and cipher state
+ * ivec (updated), and compute the HMAC of the initial cipher state and the
+ * ciphertext with hash and the key ki, as the encrypt-then-mac enctypes do,
+ * in a single pass over the data.  Store hash->hashsize bytes of HMAC output
+ * into cksum (caller-allocated).  Return ENOTSUP without modifying data or
+ * ivec if the module can't do this for these parameters.
+ */
+krb5_error_code krb5int_cts_hmac_encrypt(const struct krb5_enc_provider *enc,
+                                         const struct krb5_hash_provider *hash,
+                                         krb5_key ke, const krb5_data *ki,
+                                         const krb5_data *ivec,
+                                         krb5_crypto_iov *data,
+                                         size_t num_data, krb5_data *cksum);
+
 /* The following are used by test programs and are just handler functions from
  * the AES and Camellia enc providers. */
 krb5_error_code krb5int_aes_encrypt(krb5_key key, const krb5_data *ivec,
@@ -62,3 +62,27 @@ krb5_c_decrypt_iov(krb5_context context, const krb5_keyblock *keyblock,
     krb5_k_free_key(context, key);
     return ret;
 }
+
+krb5_error_code KRB5_CALLCONV
+krb5_k_decrypt_iov_multi(krb5_context context, krb5_key key,
+                         krb5_keyusage usage, size_t count,
+                         const krb5_data *const *cipher_states,
+                         krb5_crypto_iov *const *data, const size_t *num_data,
+                         krb5_error_code *codes)
+{
+    krb5_error_code ret = 0, code;
+    size_t i;
+
+    /* CBC decryption is already performed several blocks at a time within
+     * each message, so the messages are decrypted one after another. */
+    for (i = 0; i < count; i++) {
+        code = krb5_k_decrypt_iov(context, key, usage,
+                                  (cipher_states == NULL) ? NULL :
+                                  cipher_states[i], data[i], num_data[i]);
+        if (codes != NULL)
+            codes[i] = code;
+        if (ret == 0)
+            ret = code;
+    }
+    return ret;
+}
@@ -27,26 +27,41 @@
 
 #include "crypto_int.h"
 
+/* Return a new reference to the cached key derived from key with constant,
+ * or NULL if there is none. */
 static krb5_key
-find_cached_dkey(struct derived_key *list, const krb5_data *constant)
+find_cached_dkey(krb5_key key, const krb5_data *constant)
 {
-    for (; list; list = list->next) {
-        if (data_eq(list->constant, *constant)) {
-            krb5_k_reference_key(NULL, list->dkey);
-            return list->dkey;
+    struct derived_key *dk;
+    int i;
+
+    for (i = 0; i < K5_DERIVED_KEY_SLOTS; i++) {
+        dk = k5_atomic_load_ptr((void **)&key->derived[i]);
+        if (dk == NULL)
+            break;
+        if (data_eq(dk->constant, *constant)) {
+            krb5_k_reference_key(NULL, dk->dkey);
+            return dk->dkey;
         }
     }
     return NULL;
 }
 
+/*
+ * Create a key from dkeyblock and cache it as the key derived from key with
+ * constant, unless another thread has cached one first.  Return a new
+ * reference to the cached key in *cached_dkey.  If the cache is full, return
+ * the key without caching it.
+ */
 static krb5_error_code
 add_cached_dkey(krb5_key key, const krb5_data *constant,
                 const krb5_keyblock *dkeyblock, krb5_key *cached_dkey)
 {
     krb5_key dkey;
-    krb5_error_code ret;
-    struct derived_key *dkent = NULL;
+    krb5_error_code ret = ENOMEM;
+    struct derived_key *dkent = NULL, *dk;
     char *data = NULL;
+    int i;
 
     /* Allocate fields for the new entry. */
     dkent = malloc(sizeof(*dkent));
@@ -58,23 +73,36 @@ add_cached_dkey(krb5_key key, const krb5_data *constant,
     ret = krb5_k_create_key(NULL, dkeyblock, &dkey);
     if (ret != 0)
         goto cleanup;
-
-    /* Add the new entry to the list. */
     dkent->dkey = dkey;
     dkent->constant.data = data;
     dkent->constant.length = constant->length;
-    dkent->next = key->derived;
-    key->derived = dkent;
 
-    /* Return a "copy" of the cached key. */
-    krb5_k_reference_key(NULL, dkey);
+    /* Publish the entry in the first free slot, checking the slots filled
+     * since our lookup in case another thread cached the same constant. */
+    for (i = 0; i < K5_DERIVED_KEY_SLOTS; i++) {
+        if (k5_atomic_cas_ptr((void **)&key->derived[i], NULL, dkent)) {
+            /* Return a "copy" of the cached key. */
+            krb5_k_reference_key(NULL, dkey);
+            dkent = NULL;
+            data = NULL;
+            break;
+        }
+        dk = k5_atomic_load_ptr((void **)&key->derived[i]);
+        if (data_eq(dk->constant, *constant)) {
+            krb5_k_free_key(NULL, dkey);
+            dkey = dk->dkey;
+            krb5_k_reference_key(NULL, dkey);
+            break;
+        }
+    }
+
+    /* If the cache is full, the caller gets the only reference to dkey. */
     *cached_dkey = dkey;
-    return 0;
 
 cleanup:
     free(dkent);
     free(data);
-    return ENOMEM;
+    return ret;
 }
 
 static krb5_error_code
@@ -324,7 +352,7 @@ krb5int_derive_key(const struct krb5_enc_provider *enc,
     *outkey = NULL;
 
     /* Check for a cached result. */
-    dkey = find_cached_dkey(inkey->derived, in_constant);
+    dkey = find_cached_dkey(inkey, in_constant);
     if (dkey != NULL) {
         *outkey = dkey;
         return 0;
@@ -65,21 +65,19 @@ krb5int_aes_crypto_length(const struct krb5_keytypes *ktp,
     }
 }
 
-krb5_error_code
-krb5int_dk_encrypt(const struct krb5_keytypes *ktp, krb5_key key,
-                   krb5_keyusage usage, const krb5_data *ivec,
-                   krb5_crypto_iov *data, size_t num_data)
+/*
+ * Validate the header, trailer, and padding of a message to be encrypted, set
+ * the padding length, and generate the confounder.  Place the trailer iov in
+ * *trailer_out.
+ */
+static krb5_error_code
+dk_prepare(const struct krb5_keytypes *ktp, krb5_crypto_iov *data,
+           size_t num_data, krb5_crypto_iov **trailer_out)
 {
     const struct krb5_enc_provider *enc = ktp->enc;
-    const struct krb5_hash_provider *hash = ktp->hash;
-    krb5_error_code ret;
-    unsigned char constantdata[K5CLENGTH];
-    krb5_data d1, d2;
     krb5_crypto_iov *header, *trailer, *padding;
-    krb5_key ke = NULL, ki = NULL;
     size_t i;
     unsigned int blocksize, hmacsize, plainlen = 0, padsize = 0;
-    unsigned char *cksum = NULL;
 
     /* E(Confounder | Plaintext | Pad) | Checksum */
 
@@ -118,9 +116,46 @@ krb5int_dk_encrypt(const struct krb5_keytypes *ktp, krb5_key key,
         padding->data.length = padsize;
     }
 
-    cksum = k5alloc(hash->hashsize, &ret);
-    if (ret != 0)
-        goto cleanup;
+    /* Generate confounder. */
+
+    header->data.length = enc->block_size;
+
+    *trailer_out = trailer;
+    return krb5_c_random_make_octets(/* XXX */ NULL, &header->data);
+}
+
+krb5_error_code
+krb5int_dk_encrypt(const struct krb5_keytypes *ktp, krb5_key key,
+                   krb5_keyusage usage, const krb5_data *ivec,
+                   krb5_crypto_iov *data, size_t num_data)
+{
+    struct crypt_msg msg;
+    krb5_error_code code;
+
+    msg.ivec = ivec;
+    msg.data = data;
+    msg.num_data = num_data;
+    return krb5int_dk_encrypt_multi(ktp, key, usage, &msg, 1, &code);
+}
+
+krb5_error_code
+krb5int_dk_encrypt_multi(const struct krb5_keytypes *ktp, krb5_key key,
+                         krb5_keyusage usage, const struct crypt_msg *msgs,
+                         size_t count, krb5_error_code *codes)
+{
+    const struct krb5_enc_provider *enc = ktp->enc;
+    const struct krb5_hash_provider *hash = ktp->hash;
+    krb5_error_code ret;
+    unsigned char constantdata[K5CLENGTH];
+    krb5_data d1, d2;
+    krb5_crypto_iov *trailer;
+    krb5_key ke = NULL, ki = NULL;
+    struct crypt_msg batch[CRYPT_MULTI_MAX];
+    size_t i, j, n, start, idx[CRYPT_MULTI_MAX];
+    unsigned int hmacsize;
+    unsigned char *cksum = NULL;
+
+    hmacsize = ktp->crypto_length(ktp, KRB5_CRYPTO_TYPE_TRAILER);
 
     /* Derive the keys. */
 
@@ -132,41 +167,54 @@ krb5int_dk_encrypt(const struct krb5_keytypes *ktp, krb5_key key,
     d1.data[4] = 0xAA;
 
     ret = krb5int_derive_key(enc, NULL, key, &ke, &d1, DERIVE_RFC3961);
-    if (ret != 0)
-        goto cleanup;
-
-    d1.data[4] = 0x55;
-
-    ret = krb5int_derive_key(enc, NULL, key, &ki, &d1, DERIVE_RFC3961);
-    if (ret != 0)
+    if (ret == 0) {
+        d1.data[4] = 0x55;
+        ret = krb5int_derive_key(enc, NULL, key, &ki, &d1, DERIVE_RFC3961);
+    }
+    if (ret == 0)
+        cksum = k5alloc(hash->hashsize, &ret);
+    if (ret != 0) {
+        for (i = 0; i < count; i++)
+            codes[i] = ret;
         goto cleanup;
+    }
 
-    /* Generate confounder. */
+    for (start = 0; start < count; start += CRYPT_MULTI_MAX) {
+        /* Hash the plaintext of each message and fill in its trailer. */
+        n = 0;
+        for (i = start; i < count && i < start + CRYPT_MULTI_MAX; i++) {
+            codes[i] = dk_prepare(ktp, msgs[i].data, msgs[i].num_data,
+                                  &trailer);
+            if (codes[i] != 0)
+                continue;
 
-    header->data.length = enc->block_size;
+            d2.length = hash->hashsize;
+            d2.data = (char *)cksum;
 
-    ret = krb5_c_random_make_octets(/* XXX */ NULL, &header->data);
-    if (ret != 0)
-        goto cleanup;
+            codes[i] = krb5int_hmac(hash, ki, msgs[i].data,
+                                    msgs[i].num_data, &d2);
+            if (codes[i] != 0)
+                continue;
 
-    /* Hash the plaintext. */
-    d2.length = hash->hashsize;
-    d2.data = (char *)cksum;
+            /* Possibly truncate the hash */
+            assert(hmacsize <= d2.length);
 
-    ret = krb5int_hmac(hash, ki, data, num_data, &d2);
-    if (ret != 0)
-        goto cleanup;
+            memcpy(trailer->data.data, cksum, hmacsize);
+            trailer->data.length = hmacsize;
 
-    /* Encrypt the plaintext (header | data | padding) */
-    ret = enc->encrypt(ke, ivec, data, num_data);
-    if (ret != 0)
-        goto cleanup;
+            batch[n] = msgs[i];
+            idx[n++] = i;
+        }
 
-    /* Possibly truncate the hash */
-    assert(hmacsize <= d2.length);
+        /* Encrypt the plaintexts (header | data | padding) together. */
+        ret = krb5int_enc_encrypt_multi(enc, ke, batch, n);
+        for (j = 0; j < n; j++)
+            codes[idx[j]] = ret;
+    }
 
-    memcpy(trailer->data.data, cksum, hmacsize);
-    trailer->data.length = hmacsize;
+    ret = 0;
+    for (i = 0; i < count && ret == 0; i++)
+        ret = codes[i];
 
 cleanup:
     krb5_k_free_key(NULL, ke);
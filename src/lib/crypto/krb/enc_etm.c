@@ -133,17 +133,15 @@ cleanup:
     return ret;
 }
 
-krb5_error_code
-krb5int_etm_encrypt(const struct krb5_keytypes *ktp, krb5_key key,
-                    krb5_keyusage usage, const krb5_data *ivec,
-                    krb5_crypto_iov *data, size_t num_data)
+/* Validate the header and trailer of a message to be encrypted, zero out its
+ * padding length, and generate its confounder.  Place the trailer iov in
+ * *trailer_out. */
+static krb5_error_code
+etm_prepare(const struct krb5_keytypes *ktp, krb5_crypto_iov *data,
+            size_t num_data, krb5_crypto_iov **trailer_out)
 {
     const struct krb5_enc_provider *enc = ktp->enc;
-    krb5_error_code ret;
-    krb5_data ivcopy = empty_data(), cksum = empty_data();
     krb5_crypto_iov *header, *trailer, *padding;
-    krb5_key ke = NULL;
-    krb5_data ki = empty_data();
     unsigned int trailer_len;
 
     /* E(Confounder | Plaintext) | Checksum(IV | ciphertext) */
@@ -161,48 +159,159 @@ krb5int_etm_encrypt(const struct krb5_keytypes *ktp, krb5_key key,
     if (padding != NULL)
         padding->data.length = 0;
 
-    if (ivec != NULL) {
-        ret = alloc_data(&ivcopy, ivec->length);
-        if (ret)
-            goto cleanup;
-        memcpy(ivcopy.data, ivec->data, ivec->length);
-    }
-
-    /* Derive the encryption and integrity keys. */
-    ret = derive_keys(ktp, key, usage, &ke, &ki);
-    if (ret)
-        goto cleanup;
-
     /* Generate confounder. */
     header->data.length = enc->block_size;
-    ret = krb5_c_random_make_octets(NULL, &header->data);
-    if (ret)
-        goto cleanup;
+    *trailer_out = trailer;
+    return krb5_c_random_make_octets(NULL, &header->data);
+}
 
-    /* Encrypt the plaintext (header | data). */
-    ret = enc->encrypt(ke, (ivec == NULL) ? NULL : &ivcopy, data, num_data);
-    if (ret)
-        goto cleanup;
+/* Fill in trailer with the checksum cksum, truncated to the trailer length,
+ * and free cksum. */
+static void
+set_trailer(const struct krb5_keytypes *ktp, krb5_data *cksum,
+            krb5_crypto_iov *trailer)
+{
+    unsigned int trailer_len;
+
+    trailer_len = ktp->crypto_length(ktp, KRB5_CRYPTO_TYPE_TRAILER);
+    assert(trailer_len <= cksum->length);
+    memcpy(trailer->data.data, cksum->data, trailer_len);
+    trailer->data.length = trailer_len;
+    free(cksum->data);
+    *cksum = empty_data();
+}
+
+/* HMAC the IV and ciphertext of a message encrypted with the original cipher
+ * state ivec, and fill in its trailer. */
+static krb5_error_code
+etm_finish(const struct krb5_keytypes *ktp, const krb5_data *ki,
+           const krb5_data *ivec, krb5_crypto_iov *data, size_t num_data,
+           krb5_crypto_iov *trailer)
+{
+    krb5_error_code ret;
+    krb5_data cksum = empty_data();
 
     /* HMAC the IV, confounder, and ciphertext with sign-only data. */
-    ret = hmac_ivec_data(ktp, &ki, ivec, data, num_data, &cksum);
+    ret = hmac_ivec_data(ktp, ki, ivec, data, num_data, &cksum);
     if (ret)
-        goto cleanup;
+        return ret;
+    set_trailer(ktp, &cksum, trailer);
+    return 0;
+}
 
-    /* Truncate the HMAC checksum to the trailer length. */
-    assert(trailer_len <= cksum.length);
-    memcpy(trailer->data.data, cksum.data, trailer_len);
-    trailer->data.length = trailer_len;
+/* Encrypt a message and fill in its trailer in one pass, if the crypto module
+ * can.  Return ENOTSUP if it can't. */
+static krb5_error_code
+etm_one_pass(const struct krb5_keytypes *ktp, krb5_key ke, const krb5_data *ki,
+             const struct crypt_msg *m, krb5_crypto_iov *trailer)
+{
+    krb5_error_code ret;
+    krb5_data cksum;
 
-    /* Copy out the updated ivec if desired. */
-    if (ivec != NULL)
-        memcpy(ivec->data, ivcopy.data, ivcopy.length);
+    ret = alloc_data(&cksum, ktp->hash->hashsize);
+    if (ret)
+        return ret;
+    ret = krb5int_cts_hmac_encrypt(ktp->enc, ktp->hash, ke, ki, m->ivec,
+                                   m->data, m->num_data, &cksum);
+    if (ret) {
+        free(cksum.data);
+        return ret;
+    }
+    set_trailer(ktp, &cksum, trailer);
+    return 0;
+}
+
+krb5_error_code
+krb5int_etm_encrypt(const struct krb5_keytypes *ktp, krb5_key key,
+                    krb5_keyusage usage, const krb5_data *ivec,
+                    krb5_crypto_iov *data, size_t num_data)
+{
+    struct crypt_msg msg;
+    krb5_error_code code;
+
+    msg.ivec = ivec;
+    msg.data = data;
+    msg.num_data = num_data;
+    return krb5int_etm_encrypt_multi(ktp, key, usage, &msg, 1, &code);
+}
+
+krb5_error_code
+krb5int_etm_encrypt_multi(const struct krb5_keytypes *ktp, krb5_key key,
+                          krb5_keyusage usage, const struct crypt_msg *msgs,
+                          size_t count, krb5_error_code *codes)
+{
+    krb5_error_code ret;
+    krb5_crypto_iov *trailers[CRYPT_MULTI_MAX];
+    krb5_data ivcopies[CRYPT_MULTI_MAX];
+    struct crypt_msg batch[CRYPT_MULTI_MAX];
+    const struct crypt_msg *m;
+    krb5_key ke = NULL;
+    krb5_data ki = empty_data();
+    size_t i, j, n, start, idx[CRYPT_MULTI_MAX];
+
+    /* Derive the encryption and integrity keys. */
+    ret = derive_keys(ktp, key, usage, &ke, &ki);
+    if (ret) {
+        for (i = 0; i < count; i++)
+            codes[i] = ret;
+        return ret;
+    }
+
+    for (start = 0; start < count; start += CRYPT_MULTI_MAX) {
+        n = 0;
+        for (i = start; i < count && i < start + CRYPT_MULTI_MAX; i++) {
+            m = &msgs[i];
+            codes[i] = etm_prepare(ktp, m->data, m->num_data, &trailers[n]);
+            if (codes[i])
+                continue;
+
+            /* Interleaving several messages keeps the cipher busy, but a lone
+             * message can be hashed while it is encrypted instead. */
+            if (count == 1) {
+                codes[i] = etm_one_pass(ktp, ke, &ki, m, trailers[n]);
+                if (codes[i] != ENOTSUP)
+                    continue;
+            }
+
+            /* Encrypt with a copy of the ivec, as the HMAC needs the
+             * original. */
+            ivcopies[n] = empty_data();
+            if (m->ivec != NULL) {
+                codes[i] = alloc_data(&ivcopies[n], m->ivec->length);
+                if (codes[i])
+                    continue;
+                memcpy(ivcopies[n].data, m->ivec->data, m->ivec->length);
+            }
+
+            batch[n] = *m;
+            batch[n].ivec = (m->ivec == NULL) ? NULL : &ivcopies[n];
+            idx[n++] = i;
+        }
+
+        /* Encrypt the plaintexts (header | data) together. */
+        ret = krb5int_enc_encrypt_multi(ktp->enc, ke, batch, n);
+
+        for (j = 0; j < n; j++) {
+            m = &msgs[idx[j]];
+            codes[idx[j]] = ret;
+            if (ret == 0) {
+                codes[idx[j]] = etm_finish(ktp, &ki, m->ivec, m->data,
+                                           m->num_data, trailers[j]);
+            }
+
+            /* Copy out the updated ivec if desired. */
+            if (codes[idx[j]] == 0 && m->ivec != NULL)
+                memcpy(m->ivec->data, ivcopies[j].data, ivcopies[j].length);
+            zapfree(ivcopies[j].data, ivcopies[j].length);
+        }
+    }
+
+    ret = 0;
+    for (i = 0; i < count && ret == 0; i++)
+        ret = codes[i];
 
-cleanup:
     krb5_k_free_key(NULL, ke);
     zapfree(ki.data, ki.length);
-    free(cksum.data);
-    zapfree(ivcopy.data, ivcopy.length);
     return ret;
 }
 
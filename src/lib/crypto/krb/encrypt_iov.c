@@ -56,3 +56,68 @@ krb5_c_encrypt_iov(krb5_context context, const krb5_keyblock *keyblock,
     krb5_k_free_key(context, key);
     return ret;
 }
+
+krb5_error_code
+krb5int_enc_encrypt_multi(const struct krb5_enc_provider *enc, krb5_key key,
+                          const struct crypt_msg *msgs, size_t count)
+{
+    krb5_error_code ret;
+    size_t i;
+
+    if (count == 0)
+        return 0;
+    if (enc->encrypt_multi != NULL)
+        return enc->encrypt_multi(key, msgs, count);
+    for (i = 0; i < count; i++) {
+        ret = enc->encrypt(key, msgs[i].ivec, msgs[i].data, msgs[i].num_data);
+        if (ret)
+            return ret;
+    }
+    return 0;
+}
+
+krb5_error_code KRB5_CALLCONV
+krb5_k_encrypt_iov_multi(krb5_context context, krb5_key key,
+                         krb5_keyusage usage, size_t count,
+                         const krb5_data *const *cipher_states,
+                         krb5_crypto_iov *const *data, const size_t *num_data,
+                         krb5_error_code *codes)
+{
+    const struct krb5_keytypes *ktp;
+    struct crypt_msg msgs[CRYPT_MULTI_MAX];
+    krb5_error_code ret = 0, results[CRYPT_MULTI_MAX];
+    size_t i, n, start;
+
+    ktp = find_enctype(key->keyblock.enctype);
+    for (start = 0; start < count; start += n) {
+        n = count - start;
+        if (n > CRYPT_MULTI_MAX)
+            n = CRYPT_MULTI_MAX;
+        for (i = 0; i < n; i++) {
+            msgs[i].ivec = (cipher_states == NULL) ? NULL :
+                cipher_states[start + i];
+            msgs[i].data = data[start + i];
+            msgs[i].num_data = num_data[start + i];
+        }
+
+        if (ktp == NULL) {
+            for (i = 0; i < n; i++)
+                results[i] = KRB5_BAD_ENCTYPE;
+        } else if (ktp->encrypt_multi != NULL) {
+            (void)ktp->encrypt_multi(ktp, key, usage, msgs, n, results);
+        } else {
+            for (i = 0; i < n; i++) {
+                results[i] = ktp->encrypt(ktp, key, usage, msgs[i].ivec,
+                                          msgs[i].data, msgs[i].num_data);
+            }
+        }
+
+        for (i = 0; i < n; i++) {
+            if (codes != NULL)
+                codes[start + i] = results[i];
+            if (ret == 0)
+                ret = results[i];
+        }
+    }
+    return ret;
+}
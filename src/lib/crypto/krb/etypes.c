@@ -40,6 +40,7 @@ const struct krb5_keytypes krb5int_enctypes_list[] = {
       &krb5int_enc_des3, NULL,
       16,
       krb5int_raw_crypto_length, krb5int_raw_encrypt, krb5int_raw_decrypt,
+      NULL, /* encrypt_multi */
       krb5int_dk_string_to_key, k5_rand2key_des3,
       NULL, /*PRF*/
       0,
@@ -51,6 +52,7 @@ const struct krb5_keytypes krb5int_enctypes_list[] = {
       &krb5int_enc_des3, &krb5int_hash_sha1,
       16,
       krb5int_dk_crypto_length, krb5int_dk_encrypt, krb5int_dk_decrypt,
+      krb5int_dk_encrypt_multi,
       krb5int_dk_string_to_key, k5_rand2key_des3,
       krb5int_dk_prf,
       CKSUMTYPE_HMAC_SHA1_DES3,
@@ -65,7 +67,8 @@ const struct krb5_keytypes krb5int_enctypes_list[] = {
       &krb5int_hash_md5,
       20,
       krb5int_arcfour_crypto_length, krb5int_arcfour_encrypt,
-      krb5int_arcfour_decrypt, krb5int_arcfour_string_to_key,
+      krb5int_arcfour_decrypt, NULL, /* encrypt_multi */
+      krb5int_arcfour_string_to_key,
       k5_rand2key_direct, krb5int_arcfour_prf,
       CKSUMTYPE_HMAC_MD5_ARCFOUR,
       ETYPE_DEPRECATED, 64 },
@@ -76,7 +79,8 @@ const struct krb5_keytypes krb5int_enctypes_list[] = {
       &krb5int_hash_md5,
       20,
       krb5int_arcfour_crypto_length, krb5int_arcfour_encrypt,
-      krb5int_arcfour_decrypt, krb5int_arcfour_string_to_key,
+      krb5int_arcfour_decrypt, NULL, /* encrypt_multi */
+      krb5int_arcfour_string_to_key,
       k5_rand2key_direct, krb5int_arcfour_prf,
       CKSUMTYPE_HMAC_MD5_ARCFOUR,
       ETYPE_WEAK | ETYPE_DEPRECATED, 40
@@ -88,6 +92,7 @@ const struct krb5_keytypes krb5int_enctypes_list[] = {
       &krb5int_enc_aes128, &krb5int_hash_sha1,
       16,
       krb5int_aes_crypto_length, krb5int_dk_encrypt, krb5int_dk_decrypt,
+      krb5int_dk_encrypt_multi,
       krb5int_aes_string_to_key, k5_rand2key_direct,
       krb5int_dk_prf,
       CKSUMTYPE_HMAC_SHA1_96_AES128,
@@ -98,6 +103,7 @@ const struct krb5_keytypes krb5int_enctypes_list[] = {
       &krb5int_enc_aes256, &krb5int_hash_sha1,
       16,
       krb5int_aes_crypto_length, krb5int_dk_encrypt, krb5int_dk_decrypt,
+      krb5int_dk_encrypt_multi,
       krb5int_aes_string_to_key, k5_rand2key_direct,
       krb5int_dk_prf,
       CKSUMTYPE_HMAC_SHA1_96_AES256,
@@ -110,6 +116,7 @@ const struct krb5_keytypes krb5int_enctypes_list[] = {
       16,
       krb5int_camellia_crypto_length,
       krb5int_dk_cmac_encrypt, krb5int_dk_cmac_decrypt,
+      NULL, /* encrypt_multi */
       krb5int_camellia_string_to_key, k5_rand2key_direct,
       krb5int_dk_cmac_prf,
       CKSUMTYPE_CMAC_CAMELLIA128,
@@ -121,6 +128,7 @@ const struct krb5_keytypes krb5int_enctypes_list[] = {
       16,
       krb5int_camellia_crypto_length,
       krb5int_dk_cmac_encrypt, krb5int_dk_cmac_decrypt,
+      NULL, /* encrypt_multi */
       krb5int_camellia_string_to_key, k5_rand2key_direct,
       krb5int_dk_cmac_prf,
       CKSUMTYPE_CMAC_CAMELLIA256,
@@ -132,6 +140,7 @@ const struct krb5_keytypes krb5int_enctypes_list[] = {
       &krb5int_enc_aes128, &krb5int_hash_sha256,
       32,
       krb5int_aes2_crypto_length, krb5int_etm_encrypt, krb5int_etm_decrypt,
+      krb5int_etm_encrypt_multi,
       krb5int_aes2_string_to_key, k5_rand2key_direct,
       krb5int_aes2_prf,
       CKSUMTYPE_HMAC_SHA256_128_AES128,
@@ -142,6 +151,7 @@ const struct krb5_keytypes krb5int_enctypes_list[] = {
       &krb5int_enc_aes256, &krb5int_hash_sha384,
       48,
       krb5int_aes2_crypto_length, krb5int_etm_encrypt, krb5int_etm_decrypt,
+      krb5int_etm_encrypt_multi,
       krb5int_aes2_string_to_key, k5_rand2key_direct,
       krb5int_aes2_prf,
       CKSUMTYPE_HMAC_SHA384_192_AES256,
@@ -51,7 +51,7 @@ krb5_k_create_key(krb5_context context, const krb5_keyblock *key_data,
         goto cleanup;
 
     key->refcount = 1;
-    key->derived = NULL;
+    memset(key->derived, 0, sizeof(key->derived));
     key->cache = NULL;
     *out = key;
     return 0;
@@ -65,7 +65,7 @@ void KRB5_CALLCONV
 krb5_k_reference_key(krb5_context context, krb5_key key)
 {
     if (key)
-        key->refcount++;
+        k5_atomic_incr(&key->refcount);
 }
 
 /* Free the memory used by a krb5_key. */
@@ -74,13 +74,14 @@ krb5_k_free_key(krb5_context context, krb5_key key)
 {
     struct derived_key *dk;
     const struct krb5_keytypes *ktp;
+    int i;
 
-    if (key == NULL || --key->refcount > 0)
+    if (key == NULL || k5_atomic_decr(&key->refcount) > 0)
         return;
 
     /* Free the derived key cache. */
-    while ((dk = key->derived) != NULL) {
-        key->derived = dk->next;
+    for (i = 0; i < K5_DERIVED_KEY_SLOTS && key->derived[i] != NULL; i++) {
+        dk = key->derived[i];
         free(dk->constant.data);
         krb5_k_free_key(context, dk->dkey);
         free(dk);
@@ -101,12 +101,17 @@
 #define SHA256_HASHSIZE (256/8)
 
 /* Genarator - block cipher in CTR mode */
-struct fortuna_state
+struct fortuna_generator
 {
-    /* Generator state. */
     unsigned char counter[AES256_BLOCKSIZE];
     unsigned char key[AES256_KEYSIZE];
     aes_ctx ciph;
+};
+
+struct fortuna_state
+{
+    /* Generator state. */
+    struct fortuna_generator gen;
 
     /* Accumulator state. */
     SHA256_CTX pool[NUM_POOLS];
@@ -161,31 +166,31 @@ init_state(struct fortuna_state *st)
         shad256_init(&st->pool[i]);
 }
 
-/* Increment st->counter using least significant byte first. */
+/* Increment gen->counter using least significant byte first. */
 static void
-inc_counter(struct fortuna_state *st)
+inc_counter(struct fortuna_generator *gen)
 {
     uint64_t val;
 
-    val = load_64_le(st->counter) + 1;
-    store_64_le(val, st->counter);
+    val = load_64_le(gen->counter) + 1;
+    store_64_le(val, gen->counter);
     if (val == 0) {
-        val = load_64_le(st->counter + 8) + 1;
-        store_64_le(val, st->counter + 8);
+        val = load_64_le(gen->counter + 8) + 1;
+        store_64_le(val, gen->counter + 8);
     }
 }
 
-/* Encrypt and increment st->counter in the current cipher context. */
+/* Encrypt and increment gen->counter in the current cipher context. */
 static void
-encrypt_counter(struct fortuna_state *st, unsigned char *dst)
+encrypt_counter(struct fortuna_generator *gen, unsigned char *dst)
 {
-    krb5int_aes_enc_blk(st->counter, dst, &st->ciph);
-    inc_counter(st);
+    krb5int_aes_enc_blk(gen->counter, dst, &gen->ciph);
+    inc_counter(gen);
 }
 
 /* Reseed the generator based on hopefully non-guessable input. */
 static void
-generator_reseed(struct fortuna_state *st, const unsigned char *data,
+generator_reseed(struct fortuna_generator *gen, const unsigned char *data,
                  size_t len)
 {
     SHA256_CTX ctx;
@@ -193,35 +198,36 @@ generator_reseed(struct fortuna_state *st, const unsigned char *data,
     /* Calculate SHA[d]-256(key||s) and make that the new key.  Depend on the
      * SHA-256 hash size being the AES-256 key size. */
     shad256_init(&ctx);
-    shad256_update(&ctx, st->key, AES256_KEYSIZE);
+    shad256_update(&ctx, gen->key, AES256_KEYSIZE);
     shad256_update(&ctx, data, len);
-    shad256_result(&ctx, st->key);
+    shad256_result(&ctx, gen->key);
     zap(&ctx, sizeof(ctx));
-    krb5int_aes_enc_key(st->key, AES256_KEYSIZE, &st->ciph);
+    krb5int_aes_enc_key(gen->key, AES256_KEYSIZE, &gen->ciph);
 
     /* Increment counter. */
-    inc_counter(st);
+    inc_counter(gen);
 }
 
 /* Generate two blocks in counter mode and replace the key with the result. */
 static void
-change_key(struct fortuna_state *st)
+change_key(struct fortuna_generator *gen)
 {
-    encrypt_counter(st, st->key);
-    encrypt_counter(st, st->key + AES256_BLOCKSIZE);
-    krb5int_aes_enc_key(st->key, AES256_KEYSIZE, &st->ciph);
+    encrypt_counter(gen, gen->key);
+    encrypt_counter(gen, gen->key + AES256_BLOCKSIZE);
+    krb5int_aes_enc_key(gen->key, AES256_KEYSIZE, &gen->ciph);
 }
 
 /* Output pseudo-random data from the generator. */
 static void
-generator_output(struct fortuna_state *st, unsigned char *dst, size_t len)
+generator_output(struct fortuna_generator *gen, unsigned char *dst,
+                 size_t len)
 {
     unsigned char result[AES256_BLOCKSIZE];
     size_t n, count = 0;
 
     while (len > 0) {
         /* Produce bytes and copy the result into dst. */
-        encrypt_counter(st, result);
+        encrypt_counter(gen, result);
         n = (len < AES256_BLOCKSIZE) ? len : AES256_BLOCKSIZE;
         memcpy(dst, result, n);
         dst += n;
@@ -230,14 +236,14 @@ generator_output(struct fortuna_state *st, unsigned char *dst, size_t len)
         /* Each time we reach MAX_BYTES_PER_KEY bytes, change the key. */
         count += AES256_BLOCKSIZE;
         if (count >= MAX_BYTES_PER_KEY) {
-            change_key(st);
+            change_key(gen);
             count = 0;
         }
     }
     zap(result, sizeof(result));
 
     /* Change the key after each request. */
-    change_key(st);
+    change_key(gen);
 }
 
 /* Reseed the generator using the accumulator pools. */
@@ -266,7 +272,7 @@ accumulator_reseed(struct fortuna_state *st)
         shad256_update(&ctx, hash_result, SHA256_HASHSIZE);
     }
     shad256_result(&ctx, hash_result);
-    generator_reseed(st, hash_result, SHA256_HASHSIZE);
+    generator_reseed(&st->gen, hash_result, SHA256_HASHSIZE);
     zap(hash_result, SHA256_HASHSIZE);
     zap(&ctx, sizeof(ctx));
 
@@ -301,9 +307,6 @@ accumulator_add_event(struct fortuna_state *st, const unsigned char *data,
     shad256_update(pool, data, len);
 }
 
-/* Limit dependencies for test program. */
-#ifndef TEST
-
 /* Return true if RESEED_INTERVAL microseconds have passed since the last
  * reseed. */
 static krb5_boolean
@@ -330,25 +333,206 @@ enough_time_passed(struct fortuna_state *st)
     return ok;
 }
 
+/*
+ * Threads generate output from their own generators, which are keyed from the
+ * main generator and rekeyed whenever the main generator is reseeded, so that
+ * most requests do not need to take fortuna_lock.  This requires lock-free
+ * atomic access to the reseed generation count.
+ */
+#if defined(__GCC_ATOMIC_INT_LOCK_FREE) && __GCC_ATOMIC_INT_LOCK_FREE == 2
+#define THREAD_GENERATORS
+#endif
+
+#ifdef _WIN32
+typedef DWORD prng_pid_t;
+#define get_pid() GetCurrentProcessId()
+#else
+typedef pid_t prng_pid_t;
+#define get_pid() getpid()
+#endif
+
+static k5_mutex_t fortuna_lock = K5_MUTEX_PARTIAL_INITIALIZER;
+static struct fortuna_state main_state;
+static prng_pid_t last_pid;
+static krb5_boolean have_entropy = FALSE;
+
+/* Incremented (with fortuna_lock held) each time the main generator is
+ * reseeded or the PRNG is cleaned up. */
+static unsigned int reseed_generation;
+
+static void
+note_reseed(void)
+{
+#ifdef THREAD_GENERATORS
+    __atomic_add_fetch(&reseed_generation, 1, __ATOMIC_RELEASE);
+#else
+    reseed_generation++;
+#endif
+}
+
 static void
 accumulator_output(struct fortuna_state *st, unsigned char *dst, size_t len)
 {
     /* Reseed the generator with data from pools if we have accumulated enough
      * data and enough time has passed since the last accumulator reseed. */
-    if (st->pool0_bytes >= MIN_POOL_LEN && enough_time_passed(st))
+    if (st->pool0_bytes >= MIN_POOL_LEN && enough_time_passed(st)) {
         accumulator_reseed(st);
+        note_reseed();
+    }
 
-    generator_output(st, dst, len);
+    generator_output(&st->gen, dst, len);
 }
 
-static k5_mutex_t fortuna_lock = K5_MUTEX_PARTIAL_INITIALIZER;
-static struct fortuna_state main_state;
-#ifdef _WIN32
-static DWORD last_pid;
-#else
-static pid_t last_pid;
-#endif
-static krb5_boolean have_entropy = FALSE;
+/* Output from the main generator, first making sure that the output differs
+ * from the parent's if we have forked.  fortuna_lock must be held. */
+static void
+main_output(prng_pid_t pid, unsigned char *dst, size_t len)
+{
+    unsigned char pidbuf[4];
+
+    if (pid != last_pid) {
+        /* We forked; make sure child's PRNG stream differs from parent's. */
+        store_32_be(pid, pidbuf);
+        generator_reseed(&main_state.gen, pidbuf, 4);
+        last_pid = pid;
+        note_reseed();
+    }
+
+    accumulator_output(&main_state, dst, len);
+}
+
+static krb5_error_code
+no_entropy_error(krb5_context context)
+{
+    if (context != NULL) {
+        k5_set_error(&context->err, KRB5_CRYPTO_INTERNAL,
+                     _("Random number generator could not be seeded"));
+    }
+    return KRB5_CRYPTO_INTERNAL;
+}
+
+#ifdef THREAD_GENERATORS
+
+/* Small requests are served from a buffer of this many bytes of generator
+ * output, so that the key change after each generator request is amortized
+ * across many of them. */
+#define THREAD_BUFFER_LEN 512
+
+/* Rekey a thread generator from the main generator after it has produced
+ * this many bytes, so that accumulator reseeds of the main generator are
+ * eventually picked up by every thread. */
+#define THREAD_RESEED_BYTES (1 << 16)
+
+struct thread_state {
+    struct fortuna_generator gen;
+
+    /* The process and reseed generation at the time gen was keyed. */
+    prng_pid_t pid;
+    unsigned int generation;
+
+    /* Bytes output by gen since it was keyed. */
+    size_t count;
+
+    /* Generator output not yet returned to the caller, buf[pos] through the
+     * end of buf.  Bytes are zeroed as they are consumed. */
+    unsigned char buf[THREAD_BUFFER_LEN];
+    size_t pos;
+};
+
+static void
+free_thread_state(void *ptr)
+{
+    zapfree(ptr, sizeof(struct thread_state));
+}
+
+/* Return the calling thread's generator state, creating it if necessary.
+ * Return NULL if it cannot be created. */
+static struct thread_state *
+get_thread_state(void)
+{
+    struct thread_state *ts;
+
+    ts = k5_getspecific(K5_KEY_CRYPTO_PRNG);
+    if (ts != NULL)
+        return ts;
+
+    ts = calloc(1, sizeof(*ts));
+    if (ts == NULL)
+        return NULL;
+    ts->pos = THREAD_BUFFER_LEN;
+    /* Make sure the new state is keyed before first use. */
+    ts->count = THREAD_RESEED_BYTES;
+    if (k5_setspecific(K5_KEY_CRYPTO_PRNG, ts) != 0) {
+        free(ts);
+        return NULL;
+    }
+    return ts;
+}
+
+/* Key ts->gen with output from the main generator, discarding any buffered
+ * output.  Return false if the PRNG has not been seeded. */
+static krb5_boolean
+rekey_thread_state(struct thread_state *ts, prng_pid_t pid)
+{
+    unsigned char seed[AES256_KEYSIZE];
+    unsigned int generation;
+
+    zap(ts->buf, ts->pos);
+    ts->pos = THREAD_BUFFER_LEN;
+
+    k5_mutex_lock(&fortuna_lock);
+    if (!have_entropy) {
+        k5_mutex_unlock(&fortuna_lock);
+        return FALSE;
+    }
+    main_output(pid, seed, sizeof(seed));
+    generation = reseed_generation;
+    k5_mutex_unlock(&fortuna_lock);
+
+    generator_reseed(&ts->gen, seed, sizeof(seed));
+    zap(seed, sizeof(seed));
+    ts->pid = pid;
+    ts->generation = generation;
+    ts->count = 0;
+    return TRUE;
+}
+
+/* Output pseudo-random data from the thread generator in ts. */
+static void
+thread_output(struct thread_state *ts, unsigned char *dst, size_t len)
+{
+    if (len > THREAD_BUFFER_LEN / 2) {
+        generator_output(&ts->gen, dst, len);
+        ts->count += len;
+        return;
+    }
+
+    /* Refill the buffer if it cannot satisfy the request, discarding what is
+     * left of it. */
+    if (THREAD_BUFFER_LEN - ts->pos < len) {
+        generator_output(&ts->gen, ts->buf, THREAD_BUFFER_LEN);
+        ts->count += THREAD_BUFFER_LEN;
+        ts->pos = 0;
+    }
+    memcpy(dst, ts->buf + ts->pos, len);
+    zap(ts->buf + ts->pos, len);
+    ts->pos += len;
+}
+
+/* Return true if ts was keyed in this process since the last reseed of the
+ * main generator, and has not yet output THREAD_RESEED_BYTES since then. */
+static inline krb5_boolean
+thread_state_current(struct thread_state *ts, prng_pid_t pid)
+{
+    return ts->pid == pid && ts->count < THREAD_RESEED_BYTES &&
+        ts->generation == __atomic_load_n(&reseed_generation,
+                                          __ATOMIC_ACQUIRE);
+}
+
+#endif /* THREAD_GENERATORS */
+
+/* Limit dependencies for test program. */
+#ifndef TEST
 
 int
 k5_prng_init(void)
@@ -359,15 +543,18 @@ k5_prng_init(void)
     ret = k5_mutex_finish_init(&fortuna_lock);
     if (ret)
         return ret;
+#ifdef THREAD_GENERATORS
+    ret = k5_key_register(K5_KEY_CRYPTO_PRNG, free_thread_state);
+    if (ret) {
+        k5_mutex_destroy(&fortuna_lock);
+        return ret;
+    }
+#endif
 
     init_state(&main_state);
-#ifdef _WIN32
-    last_pid = GetCurrentProcessId();
-#else
-    last_pid = getpid();
-#endif
+    last_pid = get_pid();
     if (k5_get_os_entropy(osbuf, sizeof(osbuf), 0)) {
-        generator_reseed(&main_state, osbuf, sizeof(osbuf));
+        generator_reseed(&main_state.gen, osbuf, sizeof(osbuf));
         have_entropy = TRUE;
     }
 
@@ -377,7 +564,12 @@ k5_prng_init(void)
 void
 k5_prng_cleanup(void)
 {
+#ifdef THREAD_GENERATORS
+    /* This frees the generator states of all threads. */
+    k5_key_delete(K5_KEY_CRYPTO_PRNG);
+#endif
     have_entropy = FALSE;
+    note_reseed();
     zap(&main_state, sizeof(main_state));
     k5_mutex_destroy(&fortuna_lock);
 }
@@ -396,9 +588,10 @@ krb5_c_random_add_entropy(krb5_context context, unsigned int randsource,
         randsource == KRB5_C_RANDSOURCE_TRUSTEDPARTY) {
         /* These sources contain enough entropy that we should use them
          * immediately, so that they benefit the next request. */
-        generator_reseed(&main_state, (unsigned char *)indata->data,
+        generator_reseed(&main_state.gen, (unsigned char *)indata->data,
                          indata->length);
         have_entropy = TRUE;
+        note_reseed();
     } else {
         /* Other sources should just go into the pools and be used according to
          * the accumulator logic. */
@@ -412,33 +605,33 @@ krb5_c_random_add_entropy(krb5_context context, unsigned int randsource,
 krb5_error_code KRB5_CALLCONV
 krb5_c_random_make_octets(krb5_context context, krb5_data *outdata)
 {
-#ifdef _WIN32
-    DWORD pid = GetCurrentProcessId();
-#else
-    pid_t pid = getpid();
+    krb5_error_code ret;
+    prng_pid_t pid = get_pid();
+#ifdef THREAD_GENERATORS
+    struct thread_state *ts;
 #endif
-    unsigned char pidbuf[4];
 
-    k5_mutex_lock(&fortuna_lock);
+    /* Make sure the thread-specific data key is registered. */
+    ret = krb5int_crypto_init();
+    if (ret)
+        return ret;
 
-    if (!have_entropy) {
-        k5_mutex_unlock(&fortuna_lock);
-        if (context != NULL) {
-            k5_set_error(&context->err, KRB5_CRYPTO_INTERNAL,
-                         _("Random number generator could not be seeded"));
-        }
-        return KRB5_CRYPTO_INTERNAL;
+#ifdef THREAD_GENERATORS
+    ts = get_thread_state();
+    if (ts != NULL) {
+        if (!thread_state_current(ts, pid) && !rekey_thread_state(ts, pid))
+            return no_entropy_error(context);
+        thread_output(ts, (unsigned char *)outdata->data, outdata->length);
+        return 0;
     }
+#endif
 
-    if (pid != last_pid) {
-        /* We forked; make sure child's PRNG stream differs from parent's. */
-        store_32_be(pid, pidbuf);
-        generator_reseed(&main_state, pidbuf, 4);
-        last_pid = pid;
+    k5_mutex_lock(&fortuna_lock);
+    if (!have_entropy) {
+        k5_mutex_unlock(&fortuna_lock);
+        return no_entropy_error(context);
     }
-
-    accumulator_output(&main_state, (unsigned char *)outdata->data,
-                       outdata->length);
+    main_output(pid, (unsigned char *)outdata->data, outdata->length);
     k5_mutex_unlock(&fortuna_lock);
     return 0;
 }
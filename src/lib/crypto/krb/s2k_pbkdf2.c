@@ -105,19 +105,22 @@ cleanup:
 
 krb5_boolean k5_allow_weak_pbkdf2iter = FALSE;
 
+/*
+ * Set up job to compute the PBKDF2 output for a string-to-key into
+ * key->contents.  If pepper is given, the PBKDF2 salt is allocated in
+ * *sandp, which the caller must free.
+ */
 static krb5_error_code
-pbkdf2_string_to_key(const struct krb5_keytypes *ktp, const krb5_data *string,
-                     const krb5_data *salt, const krb5_data *pepper,
-                     const krb5_data *params, krb5_keyblock *key,
-                     enum deriv_alg deriv_alg, unsigned long def_iter_count)
+pbkdf2_prepare(const struct krb5_keytypes *ktp, const krb5_data *string,
+               const krb5_data *salt, const krb5_data *pepper,
+               const krb5_data *params, krb5_keyblock *key,
+               unsigned long def_iter_count, struct pbkdf2_job *job,
+               krb5_data *sandp)
 {
-    const struct krb5_hash_provider *hash;
     unsigned long iter_count;
-    krb5_data out;
-    static const krb5_data usage = { KV5M_DATA, 8, "kerberos" };
-    krb5_key tempkey = NULL;
     krb5_error_code err;
-    krb5_data sandp = empty_data();
+
+    *sandp = empty_data();
 
     if (params) {
         unsigned char *p = (unsigned char *) params->data;
@@ -140,43 +143,77 @@ pbkdf2_string_to_key(const struct krb5_keytypes *ktp, const krb5_data *string,
         return KRB5_ERR_BAD_S2K_PARAMS;
 
     /* Use the output keyblock contents for temporary space. */
-    out.data = (char *) key->contents;
-    out.length = key->length;
-    if (out.length != 16 && out.length != 32)
+    job->out.data = (char *) key->contents;
+    job->out.length = key->length;
+    if (job->out.length != 16 && job->out.length != 32)
         return KRB5_CRYPTO_INTERNAL;
 
     if (pepper != NULL) {
-        err = alloc_data(&sandp, pepper->length + 1 + salt->length);
+        err = alloc_data(sandp, pepper->length + 1 + salt->length);
         if (err)
             return err;
 
         if (pepper->length > 0)
-            memcpy(sandp.data, pepper->data, pepper->length);
-        sandp.data[pepper->length] = '\0';
+            memcpy(sandp->data, pepper->data, pepper->length);
+        sandp->data[pepper->length] = '\0';
         if (salt->length > 0)
-            memcpy(&sandp.data[pepper->length + 1], salt->data, salt->length);
+            memcpy(&sandp->data[pepper->length + 1], salt->data, salt->length);
 
-        salt = &sandp;
+        salt = sandp;
     }
 
-    hash = (ktp->hash != NULL) ? ktp->hash : &krb5int_hash_sha1;
-    err = krb5int_pbkdf2_hmac(hash, &out, iter_count, string, salt);
-    if (err)
-        goto cleanup;
+    job->hash = (ktp->hash != NULL) ? ktp->hash : &krb5int_hash_sha1;
+    job->count = iter_count;
+    job->password = *string;
+    job->salt = *salt;
+    return 0;
+}
+
+/* Derive the final key in place from the PBKDF2 output in key->contents. */
+static krb5_error_code
+pbkdf2_finish(const struct krb5_keytypes *ktp, krb5_keyblock *key,
+              enum deriv_alg deriv_alg)
+{
+    static const krb5_data usage = { KV5M_DATA, 8, "kerberos" };
+    krb5_key tempkey = NULL;
+    krb5_error_code err;
 
     err = krb5_k_create_key (NULL, key, &tempkey);
     if (err)
-        goto cleanup;
+        return err;
 
     err = krb5int_derive_keyblock(ktp->enc, ktp->hash, tempkey, key, &usage,
                                   deriv_alg);
+    krb5_k_free_key (NULL, tempkey);
+    return err;
+}
+
+static krb5_error_code
+pbkdf2_string_to_key(const struct krb5_keytypes *ktp, const krb5_data *string,
+                     const krb5_data *salt, const krb5_data *pepper,
+                     const krb5_data *params, krb5_keyblock *key,
+                     enum deriv_alg deriv_alg, unsigned long def_iter_count)
+{
+    struct pbkdf2_job job;
+    krb5_data sandp;
+    krb5_error_code err;
+
+    err = pbkdf2_prepare(ktp, string, salt, pepper, params, key,
+                         def_iter_count, &job, &sandp);
+    if (err)
+        goto cleanup;
+
+    err = krb5int_pbkdf2_hmac(job.hash, &job.out, job.count, &job.password,
+                              &job.salt);
+    if (err)
+        goto cleanup;
+
+    err = pbkdf2_finish(ktp, key, deriv_alg);
 
 cleanup:
-    if (sandp.data)
-        free(sandp.data);
+    free(sandp.data);
     if (err)
-        memset (out.data, 0, out.length);
-    krb5_k_free_key (NULL, tempkey);
+        memset(key->contents, 0, key->length);
     return err;
 }
 
@@ -214,3 +251,237 @@ krb5int_aes2_string_to_key(const struct krb5_keytypes *ktp,
     return pbkdf2_string_to_key(ktp, string, salt, &pepper, params, key,
                                 DERIVE_SP800_108_HMAC, 32768);
 }
+
+/* The parameters of each PBKDF2-based string-to-key function. */
+static const struct pbkdf2_s2k_type {
+    str2key_func str2key;
+    krb5_boolean pepper;        /* use the enctype name as pepper */
+    enum deriv_alg deriv_alg;
+    unsigned long def_iter_count;
+} pbkdf2_s2k_types[] = {
+    { krb5int_aes_string_to_key, FALSE, DERIVE_RFC3961, 4096 },
+    { krb5int_camellia_string_to_key, TRUE, DERIVE_SP800_108_CMAC, 32768 },
+    { krb5int_aes2_string_to_key, TRUE, DERIVE_SP800_108_HMAC, 32768 },
+};
+
+static const struct pbkdf2_s2k_type *
+find_s2k_type(const struct krb5_keytypes *ktp)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(pbkdf2_s2k_types) / sizeof(*pbkdf2_s2k_types);
+         i++) {
+        if (pbkdf2_s2k_types[i].str2key == ktp->str2key)
+            return &pbkdf2_s2k_types[i];
+    }
+    return NULL;
+}
+
+krb5_boolean
+krb5int_pbkdf2_enctype(const struct krb5_keytypes *ktp)
+{
+    return find_s2k_type(ktp) != NULL;
+}
+
+/* A request being processed by krb5int_pbkdf2_string_to_key_multi(). */
+struct s2k_job {
+    struct s2k_request *req;
+    const struct pbkdf2_s2k_type *type;
+    struct pbkdf2_job job;
+    krb5_data sandp;
+};
+
+/* Order jobs by hash function and count, so that jobs which can be computed
+ * together are adjacent. */
+static int
+compare_jobs(const void *a, const void *b)
+{
+    const struct pbkdf2_job *ja = &((const struct s2k_job *)a)->job;
+    const struct pbkdf2_job *jb = &((const struct s2k_job *)b)->job;
+    int cmp;
+
+    cmp = strcmp(ja->hash->hash_name, jb->hash->hash_name);
+    if (cmp != 0)
+        return cmp;
+    return (ja->count > jb->count) - (ja->count < jb->count);
+}
+
+/* A contiguous range of jobs computed by one thread. */
+struct job_slice {
+    struct pbkdf2_job *jobs;
+    size_t njobs;
+};
+
+static void *
+run_slice(void *arg)
+{
+    struct job_slice *slice = arg;
+
+    (void)krb5int_pbkdf2_hmac_multi(slice->jobs, slice->njobs);
+    return NULL;
+}
+
+#define MAX_S2K_THREADS 64
+
+#if defined(ENABLE_THREADS) && HAVE_PTHREAD
+
+#ifdef USE_CONDITIONAL_PTHREADS
+/* Only create threads if the pthread library is loaded. */
+#pragma weak pthread_create
+#pragma weak pthread_join
+int krb5int_pthread_loaded(void);
+#define threads_loaded() krb5int_pthread_loaded()
+#else
+#define threads_loaded() TRUE
+#endif
+
+/* Compute slices 1 through nslices - 1 in new threads, and slice 0 in this
+ * one.  If a thread cannot be created, compute its slice here instead. */
+static void
+run_slices(struct job_slice *slices, size_t nslices)
+{
+    pthread_t threads[MAX_S2K_THREADS];
+    krb5_boolean started[MAX_S2K_THREADS];
+    size_t i;
+
+    for (i = 1; i < nslices; i++) {
+        started[i] = threads_loaded() &&
+            pthread_create(&threads[i], NULL, run_slice, &slices[i]) == 0;
+    }
+    run_slice(&slices[0]);
+    for (i = 1; i < nslices; i++) {
+        if (started[i])
+            (void)pthread_join(threads[i], NULL);
+        else
+            run_slice(&slices[i]);
+    }
+}
+
+#else /* not (ENABLE_THREADS && HAVE_PTHREAD) */
+
+static void
+run_slices(struct job_slice *slices, size_t nslices)
+{
+    size_t i;
+
+    for (i = 0; i < nslices; i++)
+        run_slice(&slices[i]);
+}
+
+#endif /* not (ENABLE_THREADS && HAVE_PTHREAD) */
+
+/*
+ * Divide the njobs jobs (in order) into at most nthreads slices of roughly
+ * equal cost, and compute the PBKDF2 outputs, setting the code of each job.
+ */
+static void
+compute_jobs(struct pbkdf2_job *jobs, size_t njobs, unsigned int nthreads)
+{
+    struct job_slice slices[MAX_S2K_THREADS];
+    uint64_t total = 0, cost = 0, *costs = NULL;
+    size_t i, nslices;
+
+    if (nthreads > MAX_S2K_THREADS)
+        nthreads = MAX_S2K_THREADS;
+    if (nthreads > njobs)
+        nthreads = njobs;
+    if (nthreads > 1)
+        costs = calloc(njobs, sizeof(*costs));
+    if (costs == NULL) {
+        slices[0].jobs = jobs;
+        slices[0].njobs = njobs;
+        run_slices(slices, 1);
+        return;
+    }
+
+    /* The cost of a job is its number of output blocks times its count. */
+    for (i = 0; i < njobs; i++) {
+        costs[i] = (uint64_t)jobs[i].count *
+            ((jobs[i].out.length + jobs[i].hash->hashsize - 1) /
+             jobs[i].hash->hashsize);
+        total += costs[i];
+    }
+
+    /* End each slice once it reaches its share of the total cost. */
+    nslices = 0;
+    slices[0].jobs = jobs;
+    slices[0].njobs = 0;
+    for (i = 0; i < njobs; i++) {
+        slices[nslices].njobs++;
+        cost += costs[i];
+        if (i + 1 < njobs && nslices + 1 < nthreads &&
+            cost * nthreads >= total * (nslices + 1)) {
+            nslices++;
+            slices[nslices].jobs = &jobs[i + 1];
+            slices[nslices].njobs = 0;
+        }
+    }
+    nslices++;
+    free(costs);
+
+    run_slices(slices, nslices);
+}
+
+void
+krb5int_pbkdf2_string_to_key_multi(struct s2k_request *reqs, size_t n,
+                                   unsigned int nthreads)
+{
+    krb5_error_code ret;
+    struct s2k_job *sjobs = NULL;
+    struct pbkdf2_job *jobs = NULL;
+    krb5_data pepper, *pepperp;
+    struct s2k_request *req;
+    size_t i, njobs = 0;
+
+    sjobs = k5calloc(n, sizeof(*sjobs), &ret);
+    if (sjobs == NULL)
+        goto cleanup;
+    jobs = k5calloc(n, sizeof(*jobs), &ret);
+    if (jobs == NULL)
+        goto cleanup;
+
+    for (i = 0; i < n; i++) {
+        req = &reqs[i];
+        sjobs[njobs].req = req;
+        sjobs[njobs].type = find_s2k_type(req->ktp);
+        if (sjobs[njobs].type == NULL) {
+            req->code = KRB5_CRYPTO_INTERNAL;
+            continue;
+        }
+        pepper = string2data(req->ktp->name);
+        pepperp = sjobs[njobs].type->pepper ? &pepper : NULL;
+        req->code = pbkdf2_prepare(req->ktp, req->string, req->salt, pepperp,
+                                   req->params, req->key,
+                                   sjobs[njobs].type->def_iter_count,
+                                   &sjobs[njobs].job, &sjobs[njobs].sandp);
+        if (req->code == 0)
+            njobs++;
+        else
+            free(sjobs[njobs].sandp.data);
+    }
+
+    qsort(sjobs, njobs, sizeof(*sjobs), compare_jobs);
+    for (i = 0; i < njobs; i++)
+        jobs[i] = sjobs[i].job;
+    compute_jobs(jobs, njobs, nthreads);
+
+    for (i = 0; i < njobs; i++) {
+        req = sjobs[i].req;
+        req->code = jobs[i].code;
+        if (req->code == 0)
+            req->code = pbkdf2_finish(req->ktp, req->key,
+                                      sjobs[i].type->deriv_alg);
+        if (req->code != 0)
+            memset(req->key->contents, 0, req->key->length);
+        free(sjobs[i].sandp.data);
+    }
+    ret = 0;
+
+cleanup:
+    if (ret) {
+        for (i = 0; i < n; i++)
+            reqs[i].code = ret;
+    }
+    free(sjobs);
+    free(jobs);
+}
@@ -36,14 +36,13 @@ krb5_c_string_to_key(krb5_context context, krb5_enctype enctype,
                                             NULL, key);
 }
 
-krb5_error_code KRB5_CALLCONV
-krb5_c_string_to_key_with_params(krb5_context context, krb5_enctype enctype,
-                                 const krb5_data *string,
-                                 const krb5_data *salt,
-                                 const krb5_data *params, krb5_keyblock *key)
+/* Look up enctype and allocate key->contents for a string-to-key into key.
+ * Replace *salt with empty if it is null. */
+static krb5_error_code
+begin_s2k(krb5_enctype enctype, const krb5_data **salt,
+          const krb5_data *empty, krb5_keyblock *key,
+          const struct krb5_keytypes **ktp_out)
 {
-    krb5_error_code ret;
-    krb5_data empty = empty_data();
     const struct krb5_keytypes *ktp;
     size_t keylength;
 
@@ -53,11 +52,11 @@ krb5_c_string_to_key_with_params(krb5_context context, krb5_enctype enctype,
     keylength = ktp->enc->keylength;
 
     /* For compatibility with past behavior, treat a null salt as empty. */
-    if (salt == NULL)
-        salt = &empty;
+    if (*salt == NULL)
+        *salt = empty;
 
     /* Fail gracefully if someone is using the old AFS string-to-key hack. */
-    if (salt->length == SALT_TYPE_AFS_LENGTH)
+    if ((*salt)->length == SALT_TYPE_AFS_LENGTH)
         return EINVAL;
 
     key->contents = malloc(keylength);
@@ -67,13 +66,108 @@ krb5_c_string_to_key_with_params(krb5_context context, krb5_enctype enctype,
     key->magic = KV5M_KEYBLOCK;
     key->enctype = enctype;
     key->length = keylength;
+    *ktp_out = ktp;
+    return 0;
+}
 
-    ret = (*ktp->str2key)(ktp, string, salt, params, key);
-    if (ret) {
-        zapfree(key->contents, keylength);
+/* Free key->contents if ret indicates that the string-to-key failed. */
+static void
+end_s2k(krb5_keyblock *key, krb5_error_code ret)
+{
+    if (ret && key->contents != NULL) {
+        zapfree(key->contents, key->length);
         key->length = 0;
         key->contents = NULL;
     }
+}
+
+krb5_error_code KRB5_CALLCONV
+krb5_c_string_to_key_with_params(krb5_context context, krb5_enctype enctype,
+                                 const krb5_data *string,
+                                 const krb5_data *salt,
+                                 const krb5_data *params, krb5_keyblock *key)
+{
+    krb5_error_code ret;
+    krb5_data empty = empty_data();
+    const struct krb5_keytypes *ktp;
+
+    ret = begin_s2k(enctype, &salt, &empty, key, &ktp);
+    if (ret)
+        return ret;
+
+    ret = (*ktp->str2key)(ktp, string, salt, params, key);
+    end_s2k(key, ret);
+    return ret;
+}
+
+krb5_error_code KRB5_CALLCONV
+krb5_c_string_to_key_multi(krb5_context context, size_t count,
+                           const krb5_enctype *enctypes,
+                           const krb5_data *strings, const krb5_data *salts,
+                           const krb5_data *const *params,
+                           unsigned int nthreads, krb5_keyblock *keys,
+                           krb5_error_code *codes)
+{
+    krb5_error_code ret, *results = NULL;
+    krb5_data empty = empty_data();
+    const struct krb5_keytypes *ktp;
+    struct s2k_request *reqs = NULL;
+    const krb5_data *salt, *p;
+    size_t i, n = 0;
+
+    for (i = 0; i < count; i++) {
+        keys[i].contents = NULL;
+        keys[i].length = 0;
+    }
+    results = k5calloc(count + 1, sizeof(*results), &ret);
+    if (results == NULL)
+        goto cleanup;
+    reqs = k5calloc(count + 1, sizeof(*reqs), &ret);
+    if (reqs == NULL)
+        goto cleanup;
+
+    /* Compute the keys for enctypes not based on PBKDF2 right away, and
+     * collect the others into a batch. */
+    for (i = 0; i < count; i++) {
+        salt = (salts != NULL) ? &salts[i] : NULL;
+        p = (params != NULL) ? params[i] : NULL;
+        ret = begin_s2k(enctypes[i], &salt, &empty, &keys[i], &ktp);
+        if (ret == 0 && krb5int_pbkdf2_enctype(ktp)) {
+            reqs[n].ktp = ktp;
+            reqs[n].string = &strings[i];
+            reqs[n].salt = salt;
+            reqs[n].params = p;
+            reqs[n].key = &keys[i];
+            n++;
+            continue;
+        }
+        if (ret == 0)
+            ret = (*ktp->str2key)(ktp, &strings[i], salt, p, &keys[i]);
+        end_s2k(&keys[i], ret);
+        results[i] = ret;
+    }
 
+    krb5int_pbkdf2_string_to_key_multi(reqs, n, nthreads);
+    for (i = 0; i < n; i++) {
+        end_s2k(reqs[i].key, reqs[i].code);
+        results[reqs[i].key - keys] = reqs[i].code;
+    }
+
+    /* Return the error for the first entry which failed, if any. */
+    ret = 0;
+    for (i = 0; i < count; i++) {
+        if (codes != NULL)
+            codes[i] = results[i];
+        if (ret == 0)
+            ret = results[i];
+    }
+
+cleanup:
+    if (results == NULL || reqs == NULL) {
+        for (i = 0; codes != NULL && i < count; i++)
+            codes[i] = ret;
+    }
+    free(results);
+    free(reqs);
     return ret;
 }
@@ -91,7 +91,7 @@ head_tail_test(struct fortuna_state *st)
 
     memset(buffer, 0, len);
 
-    generator_output(st, buffer, len);
+    generator_output(&st->gen, buffer, len);
     for (i = 0; i < len; i++) {
         c = buffer[i];
         for (bit = 0; bit < 8 && c; bit++) {
@@ -112,6 +112,132 @@ head_tail_test(struct fortuna_state *st)
     }
 }
 
+#if defined(THREAD_GENERATORS) && defined(ENABLE_THREADS) && HAVE_PTHREAD
+
+/* The main thread and a worker thread take turns through numbered steps. */
+static pthread_mutex_t step_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t step_cond = PTHREAD_COND_INITIALIZER;
+static int step;
+
+static void
+set_step(int n)
+{
+    pthread_mutex_lock(&step_lock);
+    step = n;
+    pthread_cond_broadcast(&step_cond);
+    pthread_mutex_unlock(&step_lock);
+}
+
+static void
+wait_step(int n)
+{
+    pthread_mutex_lock(&step_lock);
+    while (step < n)
+        pthread_cond_wait(&step_cond, &step_lock);
+    pthread_mutex_unlock(&step_lock);
+}
+
+/* Generate output from the calling thread's generator as
+ * krb5_c_random_make_octets() does, and return the thread's state. */
+static struct thread_state *
+thread_random(unsigned char *buf, size_t len)
+{
+    struct thread_state *ts = get_thread_state();
+    prng_pid_t pid = get_pid();
+
+    assert(ts != NULL);
+    if (!thread_state_current(ts, pid))
+        assert(rekey_thread_state(ts, pid));
+    thread_output(ts, buf, len);
+    return ts;
+}
+
+static void *
+worker(void *arg)
+{
+    struct thread_state *ts;
+    unsigned char buf[THREAD_BUFFER_LEN], key[AES256_KEYSIZE];
+    prng_pid_t pid = get_pid();
+
+    /* Key this thread's generator, then let the main thread reseed. */
+    ts = thread_random(buf, 32);
+    assert(ts->generation == reseed_generation);
+    set_step(1);
+    wait_step(2);
+
+    /* This thread's generator must be rekeyed after the reseed. */
+    assert(!thread_state_current(ts, pid));
+    memcpy(key, ts->gen.key, sizeof(key));
+    ts = thread_random(buf, 32);
+    assert(ts->generation == reseed_generation);
+    assert(memcmp(key, ts->gen.key, sizeof(key)) != 0);
+
+    /* It must also be rekeyed after THREAD_RESEED_BYTES of output. */
+    while (ts->count < THREAD_RESEED_BYTES) {
+        assert(thread_state_current(ts, pid));
+        thread_output(ts, buf, sizeof(buf));
+    }
+    assert(!thread_state_current(ts, pid));
+    ts = thread_random(buf, 32);
+    assert(ts->count == THREAD_BUFFER_LEN);
+
+    /* Keep this thread alive while the main thread deletes the key. */
+    set_step(3);
+    wait_step(4);
+    assert(k5_getspecific(K5_KEY_CRYPTO_PRNG) == NULL);
+    return NULL;
+}
+
+/* Check that a reseed of the main generator is seen by another thread's
+ * generator, and that deleting the thread-specific data key frees the
+ * generator states of all threads. */
+static void
+thread_test(void)
+{
+    pthread_t thread;
+    struct thread_state *ts;
+    unsigned char buf[32];
+
+    assert(k5_mutex_finish_init(&fortuna_lock) == 0);
+    assert(k5_key_register(K5_KEY_CRYPTO_PRNG, free_thread_state) == 0);
+    init_state(&main_state);
+    generator_reseed(&main_state.gen, (unsigned char *)"test", 4);
+    have_entropy = TRUE;
+    last_pid = get_pid();
+
+    assert(pthread_create(&thread, NULL, worker, NULL) == 0);
+    wait_step(1);
+
+    /* Reseed the main generator as krb5_c_random_add_entropy() does. */
+    ts = thread_random(buf, sizeof(buf));
+    k5_mutex_lock(&fortuna_lock);
+    generator_reseed(&main_state.gen, (unsigned char *)"reseed", 6);
+    note_reseed();
+    k5_mutex_unlock(&fortuna_lock);
+    assert(!thread_state_current(ts, get_pid()));
+    set_step(2);
+
+    wait_step(3);
+    k5_key_delete(K5_KEY_CRYPTO_PRNG);
+    assert(k5_key_register(K5_KEY_CRYPTO_PRNG, free_thread_state) == 0);
+    assert(k5_getspecific(K5_KEY_CRYPTO_PRNG) == NULL);
+    set_step(4);
+    assert(pthread_join(thread, NULL) == 0);
+
+    k5_key_delete(K5_KEY_CRYPTO_PRNG);
+    zap(&main_state, sizeof(main_state));
+    k5_mutex_destroy(&fortuna_lock);
+}
+
+#else /* not (THREAD_GENERATORS && ENABLE_THREADS && HAVE_PTHREAD) */
+
+static void
+thread_test(void)
+{
+}
+
+#endif /* not (THREAD_GENERATORS && ENABLE_THREADS && HAVE_PTHREAD) */
+
 int
 main(int argc, char **argv)
 {
@@ -122,22 +248,22 @@ main(int argc, char **argv)
 
     /* Seed the generator with a known state. */
     init_state(&test_state);
-    generator_reseed(st, (unsigned char *)"test", 4);
+    generator_reseed(&st->gen, (unsigned char *)"test", 4);
 
     /* Generate two pieces of output; key should change for each request. */
-    generator_output(st, buf, 32);
+    generator_output(&st->gen, buf, 32);
     display(buf, 32);
-    generator_output(st, buf, 32);
+    generator_output(&st->gen, buf, 32);
     display(buf, 32);
 
     /* Generate a lot of output to test key changes during request. */
-    generator_output(st, buf, sizeof(buf));
+    generator_output(&st->gen, buf, sizeof(buf));
     display(buf, 32);
     display(buf + sizeof(buf) - 32, 32);
 
     /* Reseed the generator and generate more output. */
-    generator_reseed(st, (unsigned char *)"retest", 6);
-    generator_output(st, buf, 32);
+    generator_reseed(&st->gen, (unsigned char *)"retest", 6);
+    generator_output(&st->gen, buf, 32);
     display(buf, 32);
 
     /* Add sample data to accumulator pools. */
@@ -150,21 +276,23 @@ main(int argc, char **argv)
 
     /* Exercise accumulator reseeds. */
     accumulator_reseed(st);
-    generator_output(st, buf, 32);
+    generator_output(&st->gen, buf, 32);
     display(buf, 32);
     accumulator_reseed(st);
-    generator_output(st, buf, 32);
+    generator_output(&st->gen, buf, 32);
     display(buf, 32);
     accumulator_reseed(st);
-    generator_output(st, buf, 32);
+    generator_output(&st->gen, buf, 32);
     display(buf, 32);
     for (i = 0; i < 1000; i++)
         accumulator_reseed(st);
     assert(st->reseed_count == 1003);
-    generator_output(st, buf, 32);
+    generator_output(&st->gen, buf, 32);
     display(buf, 32);
 
     head_tail_test(st);
+
+    thread_test();
     return 0;
 }
 
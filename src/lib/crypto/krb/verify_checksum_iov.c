@@ -99,3 +99,125 @@ krb5_c_verify_checksum_iov(krb5_context context,
     krb5_k_free_key(context, key);
     return ret;
 }
+
+/* Verify the n messages in msgs, whose checksum iovs are cksums[0] through
+ * cksums[n - 1], storing the results into valid and codes. */
+static void
+verify_group(krb5_context context, const struct krb5_cksumtypes *ctp,
+             krb5_key key, krb5_keyusage usage, struct cksum_msg *msgs,
+             krb5_crypto_iov *const *cksums, size_t n, krb5_boolean *valid,
+             krb5_error_code *codes)
+{
+    krb5_error_code ret;
+    size_t i;
+
+    if (n == 0)
+        return;
+
+    /* Without a batched checksum function, verify the messages in turn. */
+    if (ctp->checksum_multi == NULL || ctp->verify != NULL) {
+        for (i = 0; i < n; i++) {
+            codes[i] = krb5_k_verify_checksum_iov(context, ctp->ctype, key,
+                                                  usage, msgs[i].data,
+                                                  msgs[i].num_data, &valid[i]);
+        }
+        return;
+    }
+
+    ret = ctp->checksum_multi(ctp, key, usage, msgs, n);
+    for (i = 0; i < n; i++) {
+        codes[i] = ret;
+        valid[i] = (ret == 0 &&
+                    k5_bcmp(msgs[i].output.data, cksums[i]->data.data,
+                            ctp->output_size) == 0);
+    }
+}
+
+krb5_error_code KRB5_CALLCONV
+krb5_k_verify_checksum_iov_multi(krb5_context context,
+                                 krb5_cksumtype checksum_type, krb5_key key,
+                                 krb5_keyusage usage, size_t count,
+                                 const krb5_crypto_iov *const *data,
+                                 const size_t *num_data, krb5_boolean *valid,
+                                 krb5_error_code *codes)
+{
+    const struct krb5_cksumtypes *ctp;
+    struct cksum_msg msgs[CRYPT_MULTI_MAX];
+    krb5_crypto_iov *cksums[CRYPT_MULTI_MAX], *checksum;
+    krb5_error_code ret = 0, err, results[CRYPT_MULTI_MAX];
+    krb5_error_code group_results[CRYPT_MULTI_MAX];
+    krb5_boolean group_valid[CRYPT_MULTI_MAX];
+    size_t i, j, n, m, start, idx[CRYPT_MULTI_MAX];
+    char *computed = NULL;
+
+    for (i = 0; i < count; i++)
+        valid[i] = FALSE;
+
+    /* Look up the checksum type and check the key once for all messages. */
+    if (checksum_type == 0) {
+        err = krb5int_c_mandatory_cksumtype(context, key->keyblock.enctype,
+                                            &checksum_type);
+        if (err != 0)
+            goto fail_all;
+    }
+    ctp = find_cksumtype(checksum_type);
+    if (ctp == NULL) {
+        err = KRB5_BAD_ENCTYPE;
+        goto fail_all;
+    }
+    err = verify_key(ctp, key);
+    if (err != 0)
+        goto fail_all;
+    computed = k5calloc(CRYPT_MULTI_MAX, ctp->compute_size, &err);
+    if (computed == NULL)
+        goto fail_all;
+
+    for (start = 0; start < count; start += n) {
+        n = count - start;
+        if (n > CRYPT_MULTI_MAX)
+            n = CRYPT_MULTI_MAX;
+
+        /* Gather the messages which have a checksum of the right size. */
+        m = 0;
+        for (i = 0; i < n; i++) {
+            checksum = krb5int_c_locate_iov((krb5_crypto_iov *)data[start + i],
+                                            num_data[start + i],
+                                            KRB5_CRYPTO_TYPE_CHECKSUM);
+            if (checksum == NULL ||
+                checksum->data.length != ctp->output_size) {
+                results[i] = KRB5_BAD_MSIZE;
+                continue;
+            }
+            msgs[m].data = data[start + i];
+            msgs[m].num_data = num_data[start + i];
+            msgs[m].output = make_data(computed + m * ctp->compute_size,
+                                       ctp->compute_size);
+            cksums[m] = checksum;
+            idx[m++] = i;
+        }
+
+        verify_group(context, ctp, key, usage, msgs, cksums, m, group_valid,
+                     group_results);
+        for (j = 0; j < m; j++) {
+            results[idx[j]] = group_results[j];
+            valid[start + idx[j]] = group_valid[j];
+        }
+
+        for (i = 0; i < n; i++) {
+            if (codes != NULL)
+                codes[start + i] = results[i];
+            if (ret == 0)
+                ret = results[i];
+        }
+    }
+
+    zapfree(computed, CRYPT_MULTI_MAX * ctp->compute_size);
+    return ret;
+
+fail_all:
+    if (codes != NULL) {
+        for (i = 0; i < count; i++)
+            codes[i] = err;
+    }
+    return err;
+}
@@ -35,6 +35,8 @@
 
 #include <openssl/crypto.h>
 #include <openssl/aes.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
 #include <openssl/sha.h>
 
 /* 1.1 standardizes constructor and destructor names, renaming
@@ -51,4 +53,28 @@
 #define k5_sha256_update SHA256_Update
 #define k5_sha256_final SHA256_Final
 
+/*
+ * Per-key context caching (keycache.c).  The enc providers of this module
+ * use k5_ossl_key_cleanup() as their key_cleanup function.
+ *
+ * k5_ossl_get_cipher() returns a context for the key, set up to encrypt or
+ * decrypt with iv (zero if NULL) and without padding, or NULL on failure.
+ * k5_ossl_get_hmac() returns an HMAC context initialized with keyblock (the
+ * key of key, if key is not NULL) and md.  Contexts are returned with the
+ * corresponding put function after use.
+ */
+EVP_CIPHER_CTX *k5_ossl_get_cipher(krb5_key key, const EVP_CIPHER *cipher,
+                                   int enc, const unsigned char *iv);
+void k5_ossl_put_cipher(krb5_key key, EVP_CIPHER_CTX *ctx, int enc);
+HMAC_CTX *k5_ossl_get_hmac(krb5_key key, const krb5_keyblock *keyblock,
+                           const EVP_MD *md);
+void k5_ossl_put_hmac(krb5_key key, HMAC_CTX *ctx, const EVP_MD *md);
+void k5_ossl_key_cleanup(krb5_key key);
+
+/* Encrypt or decrypt len bytes from in to out with ciphertext stealing,
+ * using a CBC context from k5_ossl_get_cipher() and updating ivec. */
+krb5_error_code k5_ossl_cts(EVP_CIPHER_CTX *ctx, int enc,
+                            const unsigned char *in, unsigned char *out,
+                            size_t len, unsigned char ivec[16]);
+
 #endif /* CRYPTO_MOD_H */
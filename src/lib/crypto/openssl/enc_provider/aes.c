@@ -26,25 +26,8 @@
 
 #include "crypto_int.h"
 #include <openssl/evp.h>
-#include <openssl/aes.h>
-#include <openssl/modes.h>
-
-/* proto's */
-static krb5_error_code
-cbc_enc(krb5_key key, const krb5_data *ivec, krb5_crypto_iov *data,
-        size_t num_data);
-static krb5_error_code
-cbc_decr(krb5_key key, const krb5_data *ivec, krb5_crypto_iov *data,
-         size_t num_data);
-static krb5_error_code
-cts_encr(krb5_key key, const krb5_data *ivec, krb5_crypto_iov *data,
-         size_t num_data, size_t dlen);
-static krb5_error_code
-cts_decr(krb5_key key, const krb5_data *ivec, krb5_crypto_iov *data,
-         size_t num_data, size_t dlen);
 
 #define BLOCK_SIZE 16
-#define NUM_BITS 8
 #define IV_CTS_BUF_SIZE 16 /* 16 - hardcoded in CRYPTO_cts128_en/decrypt */
 
 static const EVP_CIPHER *
@@ -58,84 +41,44 @@ map_mode(unsigned int len)
         return NULL;
 }
 
-/* Encrypt one block using CBC. */
+/* Encrypt or decrypt one block using CBC. */
 static krb5_error_code
-cbc_enc(krb5_key key, const krb5_data *ivec, krb5_crypto_iov *data,
-        size_t num_data)
+cbc_crypt(krb5_key key, const krb5_data *ivec, krb5_crypto_iov *data,
+          size_t num_data, int enc)
 {
     int             ret, olen = BLOCK_SIZE;
     unsigned char   iblock[BLOCK_SIZE], oblock[BLOCK_SIZE];
     EVP_CIPHER_CTX  *ctx;
     struct iov_cursor cursor;
 
-    ctx = EVP_CIPHER_CTX_new();
-    if (ctx == NULL)
-        return ENOMEM;
-
-    ret = EVP_EncryptInit_ex(ctx, map_mode(key->keyblock.length),
-                             NULL, key->keyblock.contents, (ivec) ? (unsigned char*)ivec->data : NULL);
-    if (ret == 0) {
-        EVP_CIPHER_CTX_free(ctx);
-        return KRB5_CRYPTO_INTERNAL;
-    }
-
-    k5_iov_cursor_init(&cursor, data, num_data, BLOCK_SIZE, FALSE);
-    k5_iov_cursor_get(&cursor, iblock);
-    EVP_CIPHER_CTX_set_padding(ctx,0);
-    ret = EVP_EncryptUpdate(ctx, oblock, &olen, iblock, BLOCK_SIZE);
-    if (ret == 1)
-        k5_iov_cursor_put(&cursor, oblock);
-    EVP_CIPHER_CTX_free(ctx);
-
-    zap(iblock, BLOCK_SIZE);
-    zap(oblock, BLOCK_SIZE);
-    return (ret == 1) ? 0 : KRB5_CRYPTO_INTERNAL;
-}
-
-/* Decrypt one block using CBC. */
-static krb5_error_code
-cbc_decr(krb5_key key, const krb5_data *ivec, krb5_crypto_iov *data,
-         size_t num_data)
-{
-    int              ret = 0, olen = BLOCK_SIZE;
-    unsigned char    iblock[BLOCK_SIZE], oblock[BLOCK_SIZE];
-    EVP_CIPHER_CTX   *ctx;
-    struct iov_cursor cursor;
-
-    ctx = EVP_CIPHER_CTX_new();
+    ctx = k5_ossl_get_cipher(key, map_mode(key->keyblock.length), enc,
+                             (ivec) ? (unsigned char *)ivec->data : NULL);
     if (ctx == NULL)
-        return ENOMEM;
-
-    ret = EVP_DecryptInit_ex(ctx, map_mode(key->keyblock.length),
-                             NULL, key->keyblock.contents, (ivec) ? (unsigned char*)ivec->data : NULL);
-    if (ret == 0) {
-        EVP_CIPHER_CTX_free(ctx);
         return KRB5_CRYPTO_INTERNAL;
-    }
 
     k5_iov_cursor_init(&cursor, data, num_data, BLOCK_SIZE, FALSE);
     k5_iov_cursor_get(&cursor, iblock);
-    EVP_CIPHER_CTX_set_padding(ctx,0);
-    ret = EVP_DecryptUpdate(ctx, oblock, &olen, iblock, BLOCK_SIZE);
+    ret = EVP_CipherUpdate(ctx, oblock, &olen, iblock, BLOCK_SIZE);
     if (ret == 1)
         k5_iov_cursor_put(&cursor, oblock);
-    EVP_CIPHER_CTX_free(ctx);
+    k5_ossl_put_cipher(key, ctx, enc);
 
     zap(iblock, BLOCK_SIZE);
     zap(oblock, BLOCK_SIZE);
     return (ret == 1) ? 0 : KRB5_CRYPTO_INTERNAL;
 }
 
+/* Encrypt or decrypt dlen bytes (more than one block) using CBC with
+ * ciphertext stealing. */
 static krb5_error_code
-cts_encr(krb5_key key, const krb5_data *ivec, krb5_crypto_iov *data,
-         size_t num_data, size_t dlen)
+cts_crypt(krb5_key key, const krb5_data *ivec, krb5_crypto_iov *data,
+          size_t num_data, size_t dlen, int enc)
 {
-    int                    ret = 0;
-    size_t                 size = 0;
+    krb5_error_code        ret;
     unsigned char         *oblock = NULL, *dbuf = NULL;
     unsigned char          iv_cts[IV_CTS_BUF_SIZE];
     struct iov_cursor      cursor;
-    AES_KEY                enck;
+    EVP_CIPHER_CTX        *ctx;
 
     memset(iv_cts,0,sizeof(iv_cts));
     if (ivec && ivec->data){
@@ -154,75 +97,24 @@ cts_encr(krb5_key key, const krb5_data *ivec, krb5_crypto_iov *data,
         return ENOMEM;
     }
 
-    k5_iov_cursor_init(&cursor, data, num_data, dlen, FALSE);
-    k5_iov_cursor_get(&cursor, dbuf);
-
-    AES_set_encrypt_key(key->keyblock.contents,
-                        NUM_BITS * key->keyblock.length, &enck);
-
-    size = CRYPTO_cts128_encrypt((unsigned char *)dbuf, oblock, dlen, &enck,
-                                 iv_cts, (cbc128_f)AES_cbc_encrypt);
-    if (size <= 0)
+    ctx = k5_ossl_get_cipher(key, map_mode(key->keyblock.length), enc, NULL);
+    if (ctx == NULL) {
         ret = KRB5_CRYPTO_INTERNAL;
-    else
-        k5_iov_cursor_put(&cursor, oblock);
-
-    if (!ret && ivec && ivec->data)
-        memcpy(ivec->data, iv_cts, sizeof(iv_cts));
-
-    zap(oblock, dlen);
-    zap(dbuf, dlen);
-    OPENSSL_free(oblock);
-    OPENSSL_free(dbuf);
-
-    return ret;
-}
-
-static krb5_error_code
-cts_decr(krb5_key key, const krb5_data *ivec, krb5_crypto_iov *data,
-         size_t num_data, size_t dlen)
-{
-    int                    ret = 0;
-    size_t                 size = 0;
-    unsigned char         *oblock = NULL;
-    unsigned char         *dbuf = NULL;
-    unsigned char          iv_cts[IV_CTS_BUF_SIZE];
-    struct iov_cursor      cursor;
-    AES_KEY                deck;
-
-    memset(iv_cts,0,sizeof(iv_cts));
-    if (ivec && ivec->data){
-        if (ivec->length != sizeof(iv_cts))
-            return KRB5_CRYPTO_INTERNAL;
-        memcpy(iv_cts, ivec->data,ivec->length);
+        goto cleanup;
     }
 
-    oblock = OPENSSL_malloc(dlen);
-    if (!oblock)
-        return ENOMEM;
-    dbuf = OPENSSL_malloc(dlen);
-    if (!dbuf){
-        OPENSSL_free(oblock);
-        return ENOMEM;
-    }
-
-    AES_set_decrypt_key(key->keyblock.contents,
-                        NUM_BITS * key->keyblock.length, &deck);
-
     k5_iov_cursor_init(&cursor, data, num_data, dlen, FALSE);
     k5_iov_cursor_get(&cursor, dbuf);
 
-    size = CRYPTO_cts128_decrypt((unsigned char *)dbuf, oblock,
-                                 dlen, &deck,
-                                 iv_cts, (cbc128_f)AES_cbc_encrypt);
-    if (size <= 0)
-        ret = KRB5_CRYPTO_INTERNAL;
-    else
+    ret = k5_ossl_cts(ctx, enc, dbuf, oblock, dlen, iv_cts);
+    k5_ossl_put_cipher(key, ctx, enc);
+    if (!ret)
         k5_iov_cursor_put(&cursor, oblock);
 
     if (!ret && ivec && ivec->data)
         memcpy(ivec->data, iv_cts, sizeof(iv_cts));
 
+cleanup:
     zap(oblock, dlen);
     zap(dbuf, dlen);
     OPENSSL_free(oblock);
@@ -243,9 +135,9 @@ krb5int_aes_encrypt(krb5_key key, const krb5_data *ivec,
     if (nblocks == 1) {
         if (input_length != BLOCK_SIZE)
             return KRB5_BAD_MSIZE;
-        ret = cbc_enc(key, ivec, data, num_data);
+        ret = cbc_crypt(key, ivec, data, num_data, 1);
     } else if (nblocks > 1) {
-        ret = cts_encr(key, ivec, data, num_data, input_length);
+        ret = cts_crypt(key, ivec, data, num_data, input_length, 1);
     }
 
     return ret;
@@ -263,14 +155,26 @@ krb5int_aes_decrypt(krb5_key key, const krb5_data *ivec,
     if (nblocks == 1) {
         if (input_length != BLOCK_SIZE)
             return KRB5_BAD_MSIZE;
-        ret = cbc_decr(key, ivec, data, num_data);
+        ret = cbc_crypt(key, ivec, data, num_data, 0);
     } else if (nblocks > 1) {
-        ret = cts_decr(key, ivec, data, num_data, input_length);
+        ret = cts_crypt(key, ivec, data, num_data, input_length, 0);
     }
 
     return ret;
 }
 
+/* OpenSSL's stitched AES-CBC-HMAC ciphers only implement the TLS record
+ * format, so there is no single-pass implementation here. */
+krb5_error_code
+krb5int_cts_hmac_encrypt(const struct krb5_enc_provider *enc,
+                         const struct krb5_hash_provider *hash, krb5_key ke,
+                         const krb5_data *ki, const krb5_data *ivec,
+                         krb5_crypto_iov *data, size_t num_data,
+                         krb5_data *cksum)
+{
+    return ENOTSUP;
+}
+
 static krb5_error_code
 krb5int_aes_init_state (const krb5_keyblock *key, krb5_keyusage usage,
                         krb5_data *state)
@@ -289,7 +193,8 @@ const struct krb5_enc_provider krb5int_enc_aes128 = {
     krb5int_aes_decrypt,
     NULL,
     krb5int_aes_init_state,
-    krb5int_default_free_state
+    krb5int_default_free_state,
+    k5_ossl_key_cleanup
 };
 
 const struct krb5_enc_provider krb5int_enc_aes256 = {
@@ -299,5 +204,6 @@ const struct krb5_enc_provider krb5int_enc_aes256 = {
     krb5int_aes_decrypt,
     NULL,
     krb5int_aes_init_state,
-    krb5int_default_free_state
+    krb5int_default_free_state,
+    k5_ossl_key_cleanup
 };
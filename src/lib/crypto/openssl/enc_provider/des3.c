@@ -180,5 +180,6 @@ const struct krb5_enc_provider krb5int_enc_des3 = {
     k5_des3_decrypt,
     NULL,
     krb5int_des_init_state,
-    krb5int_default_free_state
+    krb5int_default_free_state,
+    k5_ossl_key_cleanup
 };
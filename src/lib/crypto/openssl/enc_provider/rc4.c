@@ -161,5 +161,6 @@ const struct krb5_enc_provider krb5int_enc_arcfour = {
     k5_arcfour_docrypt,
     NULL,
     k5_arcfour_init_state,
-    k5_arcfour_free_state
+    k5_arcfour_free_state,
+    k5_ossl_key_cleanup
 };
@@ -55,33 +55,6 @@
 #include <openssl/hmac.h>
 #include <openssl/evp.h>
 
-#if OPENSSL_VERSION_NUMBER < 0x10100000L
-
-/* OpenSSL 1.1 makes HMAC_CTX opaque, while 1.0 does not have pointer
- * constructors or destructors. */
-
-#define HMAC_CTX_new compat_hmac_ctx_new
-static HMAC_CTX *
-compat_hmac_ctx_new()
-{
-    HMAC_CTX *ctx;
-
-    ctx = calloc(1, sizeof(*ctx));
-    if (ctx != NULL)
-        HMAC_CTX_init(ctx);
-    return ctx;
-}
-
-#define HMAC_CTX_free compat_hmac_ctx_free
-static void
-compat_hmac_ctx_free(HMAC_CTX *ctx)
-{
-    HMAC_CTX_cleanup(ctx);
-    free(ctx);
-}
-
-#endif /* OPENSSL_VERSION_NUMBER < 0x10100000L */
-
 /*
  * the HMAC transform looks like:
  *
@@ -111,54 +84,107 @@ map_digest(const struct krb5_hash_provider *hash)
         return NULL;
 }
 
-krb5_error_code
-krb5int_hmac_keyblock(const struct krb5_hash_provider *hash,
-                      const krb5_keyblock *keyblock,
-                      const krb5_crypto_iov *data, size_t num_data,
-                      krb5_data *output)
+/* Compute the HMACs of count messages using keyblock, which is the key of key
+ * if key is not NULL, in which case a cached HMAC context for key may be
+ * used.  One HMAC context is set up and reused for all of the messages. */
+static krb5_error_code
+hmac_key(const struct krb5_hash_provider *hash, krb5_key key,
+         const krb5_keyblock *keyblock, struct cksum_msg *msgs, size_t count)
 {
-    unsigned int i = 0, md_len = 0, ok;
+    unsigned int md_len = 0, ok;
     unsigned char md[EVP_MAX_MD_SIZE];
+    const EVP_MD *evp_md;
     HMAC_CTX *ctx;
-    size_t hashsize, blocksize;
+    size_t hashsize, blocksize, i, j;
 
     hashsize = hash->hashsize;
     blocksize = hash->blocksize;
 
     if (keyblock->length > blocksize)
         return(KRB5_CRYPTO_INTERNAL);
-    if (output->length < hashsize)
-        return(KRB5_BAD_MSIZE);
+    for (i = 0; i < count; i++) {
+        if (msgs[i].output.length < hashsize)
+            return(KRB5_BAD_MSIZE);
+    }
 
-    if (!map_digest(hash))
+    evp_md = map_digest(hash);
+    if (evp_md == NULL)
         return(KRB5_CRYPTO_INTERNAL); // unsupported alg
 
-    ctx = HMAC_CTX_new();
+    ctx = k5_ossl_get_hmac(key, keyblock, evp_md);
     if (ctx == NULL)
-        return ENOMEM;
-
-    ok = HMAC_Init_ex(ctx, keyblock->contents, keyblock->length,
-                      map_digest(hash), NULL);
-    for (i = 0; ok && i < num_data; i++) {
-        const krb5_crypto_iov *iov = &data[i];
-
-        if (SIGN_IOV(iov))
-            ok = HMAC_Update(ctx, (uint8_t *)iov->data.data, iov->data.length);
-    }
-    if (ok)
-        ok = HMAC_Final(ctx, md, &md_len);
-    if (ok && md_len <= output->length) {
-        output->length = md_len;
-        memcpy(output->data, md, output->length);
+        return KRB5_CRYPTO_INTERNAL;
+
+    ok = 1;
+    for (i = 0; ok && i < count; i++) {
+        /* With no key or digest, HMAC_Init_ex() reuses the loaded key. */
+        if (i > 0)
+            ok = HMAC_Init_ex(ctx, NULL, 0, NULL, NULL);
+        for (j = 0; ok && j < msgs[i].num_data; j++) {
+            const krb5_crypto_iov *iov = &msgs[i].data[j];
+
+            if (SIGN_IOV(iov)) {
+                ok = HMAC_Update(ctx, (uint8_t *)iov->data.data,
+                                 iov->data.length);
+            }
+        }
+        if (ok)
+            ok = HMAC_Final(ctx, md, &md_len);
+        if (ok && md_len <= msgs[i].output.length) {
+            msgs[i].output.length = md_len;
+            memcpy(msgs[i].output.data, md, md_len);
+        }
     }
-    HMAC_CTX_free(ctx);
+    k5_ossl_put_hmac(key, ctx, evp_md);
     return ok ? 0 : KRB5_CRYPTO_INTERNAL;
 }
 
+/* Compute the HMAC of one message with hmac_key(). */
+static krb5_error_code
+hmac_one(const struct krb5_hash_provider *hash, krb5_key key,
+         const krb5_keyblock *keyblock, const krb5_crypto_iov *data,
+         size_t num_data, krb5_data *output)
+{
+    krb5_error_code ret;
+    struct cksum_msg msg;
+
+    msg.data = data;
+    msg.num_data = num_data;
+    msg.output = *output;
+    ret = hmac_key(hash, key, keyblock, &msg, 1);
+    if (!ret)
+        output->length = msg.output.length;
+    return ret;
+}
+
+krb5_error_code
+krb5int_hmac_keyblock(const struct krb5_hash_provider *hash,
+                      const krb5_keyblock *keyblock,
+                      const krb5_crypto_iov *data, size_t num_data,
+                      krb5_data *output)
+{
+    return hmac_one(hash, NULL, keyblock, data, num_data, output);
+}
+
 krb5_error_code
 krb5int_hmac(const struct krb5_hash_provider *hash, krb5_key key,
              const krb5_crypto_iov *data, size_t num_data,
              krb5_data *output)
 {
-    return krb5int_hmac_keyblock(hash, &key->keyblock, data, num_data, output);
+    return hmac_one(hash, key, &key->keyblock, data, num_data, output);
+}
+
+krb5_error_code
+krb5int_hmac_keyblock_multi(const struct krb5_hash_provider *hash,
+                            const krb5_keyblock *keyblock,
+                            struct cksum_msg *msgs, size_t count)
+{
+    return hmac_key(hash, NULL, keyblock, msgs, count);
+}
+
+krb5_error_code
+krb5int_hmac_multi(const struct krb5_hash_provider *hash, krb5_key key,
+                   struct cksum_msg *msgs, size_t count)
+{
+    return hmac_key(hash, key, &key->keyblock, msgs, count);
 }
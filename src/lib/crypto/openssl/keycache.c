@@ -0,0 +1,303 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/* lib/crypto/openssl/keycache.c - Per-key OpenSSL context cache */
+/*
+ * Copyright (C) 2020 by the Massachusetts Institute of Technology.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in
+ *   the documentation and/or other materials provided with the
+ *   distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Creating an OpenSSL cipher or HMAC context and loading a key into it can
+ * cost more than processing a typical Kerberos message, so the enc providers
+ * in this module keep keyed contexts in the cache field of a krb5_key and
+ * only reset the IV or HMAC state for each operation.  A cached context is
+ * removed from the cache while in use; if another thread uses the same key
+ * at the same time, it gets a newly created context, which is cached
+ * afterwards if the slot is empty or freed otherwise.
+ */
+
+#include "crypto_int.h"
+#include <openssl/modes.h>
+
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+
+/* OpenSSL 1.1 makes HMAC_CTX opaque, while 1.0 does not have pointer
+ * constructors or destructors. */
+
+#define HMAC_CTX_new compat_hmac_ctx_new
+static HMAC_CTX *
+compat_hmac_ctx_new()
+{
+    HMAC_CTX *ctx;
+
+    ctx = calloc(1, sizeof(*ctx));
+    if (ctx != NULL)
+        HMAC_CTX_init(ctx);
+    return ctx;
+}
+
+#define HMAC_CTX_free compat_hmac_ctx_free
+static void
+compat_hmac_ctx_free(HMAC_CTX *ctx)
+{
+    HMAC_CTX_cleanup(ctx);
+    free(ctx);
+}
+
+#endif /* OPENSSL_VERSION_NUMBER < 0x10100000L */
+
+enum { SLOT_ENC, SLOT_DEC, SLOT_HMAC, NUM_SLOTS };
+
+struct ossl_key_cache {
+    k5_mutex_t lock;
+    void *slots[NUM_SLOTS];     /* idle contexts, or NULL */
+    const EVP_MD *hmac_md;      /* digest of the HMAC context */
+};
+
+#define CACHE(X) ((struct ossl_key_cache *)((X)->cache))
+
+/* Return the context cache of key, creating it if necessary.  Return NULL if
+ * key's cache field doesn't belong to this module or memory is exhausted. */
+static struct ossl_key_cache *
+get_cache(krb5_key key)
+{
+    const struct krb5_keytypes *ktp;
+    struct ossl_key_cache *cache;
+
+    if (key == NULL)
+        return NULL;
+    cache = k5_atomic_load_ptr(&key->cache);
+    if (cache != NULL)
+        return cache;
+
+    /* The cache is freed by the key's enc provider, so only create it for
+     * the enc providers of this module. */
+    ktp = find_enctype(key->keyblock.enctype);
+    if (ktp == NULL || ktp->enc->key_cleanup != k5_ossl_key_cleanup)
+        return NULL;
+    cache = calloc(1, sizeof(*cache));
+    if (cache == NULL)
+        return NULL;
+    if (k5_mutex_init(&cache->lock) != 0) {
+        free(cache);
+        return NULL;
+    }
+    /* Another thread sharing key may have published its cache first. */
+    if (!k5_atomic_cas_ptr(&key->cache, NULL, cache)) {
+        k5_mutex_destroy(&cache->lock);
+        free(cache);
+        return CACHE(key);
+    }
+    return cache;
+}
+
+/* Remove and return the context in slot i, or return NULL if there is
+ * none. */
+static void *
+take_slot(struct ossl_key_cache *cache, int i)
+{
+    void *ctx;
+
+    k5_mutex_lock(&cache->lock);
+    ctx = cache->slots[i];
+    cache->slots[i] = NULL;
+    k5_mutex_unlock(&cache->lock);
+    return ctx;
+}
+
+/* Store ctx in slot i and return NULL, or return ctx if the slot is full. */
+static void *
+fill_slot(struct ossl_key_cache *cache, int i, void *ctx)
+{
+    k5_mutex_lock(&cache->lock);
+    if (cache->slots[i] == NULL) {
+        cache->slots[i] = ctx;
+        ctx = NULL;
+    }
+    k5_mutex_unlock(&cache->lock);
+    return ctx;
+}
+
+EVP_CIPHER_CTX *
+k5_ossl_get_cipher(krb5_key key, const EVP_CIPHER *cipher, int enc,
+                   const unsigned char *iv)
+{
+    static const unsigned char zero_iv[EVP_MAX_IV_LENGTH];
+    struct ossl_key_cache *cache = get_cache(key);
+    EVP_CIPHER_CTX *ctx = NULL;
+
+    if (iv == NULL)
+        iv = zero_iv;
+    if (cache != NULL)
+        ctx = take_slot(cache, enc ? SLOT_ENC : SLOT_DEC);
+    if (ctx != NULL) {
+        if (EVP_CipherInit_ex(ctx, NULL, NULL, NULL, iv, enc) == 1)
+            return ctx;
+        EVP_CIPHER_CTX_free(ctx);
+        return NULL;
+    }
+
+    if (cipher == NULL)
+        return NULL;
+    ctx = EVP_CIPHER_CTX_new();
+    if (ctx == NULL)
+        return NULL;
+    if (EVP_CipherInit_ex(ctx, cipher, NULL, key->keyblock.contents, iv,
+                          enc) != 1) {
+        EVP_CIPHER_CTX_free(ctx);
+        return NULL;
+    }
+    EVP_CIPHER_CTX_set_padding(ctx, 0);
+    return ctx;
+}
+
+void
+k5_ossl_put_cipher(krb5_key key, EVP_CIPHER_CTX *ctx, int enc)
+{
+    struct ossl_key_cache *cache = get_cache(key);
+
+    if (ctx == NULL)
+        return;
+    if (cache != NULL)
+        ctx = fill_slot(cache, enc ? SLOT_ENC : SLOT_DEC, ctx);
+    EVP_CIPHER_CTX_free(ctx);
+}
+
+HMAC_CTX *
+k5_ossl_get_hmac(krb5_key key, const krb5_keyblock *keyblock,
+                 const EVP_MD *md)
+{
+    struct ossl_key_cache *cache = get_cache(key);
+    HMAC_CTX *ctx = NULL;
+
+    if (cache != NULL) {
+        k5_mutex_lock(&cache->lock);
+        if (cache->hmac_md == md) {
+            ctx = cache->slots[SLOT_HMAC];
+            cache->slots[SLOT_HMAC] = NULL;
+        }
+        k5_mutex_unlock(&cache->lock);
+    }
+    if (ctx != NULL) {
+        /* With no key or digest, HMAC_Init_ex() reuses the loaded key. */
+        if (HMAC_Init_ex(ctx, NULL, 0, NULL, NULL) == 1)
+            return ctx;
+        HMAC_CTX_free(ctx);
+        return NULL;
+    }
+
+    ctx = HMAC_CTX_new();
+    if (ctx == NULL)
+        return NULL;
+    if (HMAC_Init_ex(ctx, keyblock->contents, keyblock->length, md,
+                     NULL) != 1) {
+        HMAC_CTX_free(ctx);
+        return NULL;
+    }
+    return ctx;
+}
+
+void
+k5_ossl_put_hmac(krb5_key key, HMAC_CTX *ctx, const EVP_MD *md)
+{
+    struct ossl_key_cache *cache = get_cache(key);
+
+    if (ctx == NULL)
+        return;
+    if (cache != NULL) {
+        k5_mutex_lock(&cache->lock);
+        if (cache->slots[SLOT_HMAC] == NULL) {
+            cache->slots[SLOT_HMAC] = ctx;
+            cache->hmac_md = md;
+            ctx = NULL;
+        }
+        k5_mutex_unlock(&cache->lock);
+    }
+    HMAC_CTX_free(ctx);
+}
+
+void
+k5_ossl_key_cleanup(krb5_key key)
+{
+    struct ossl_key_cache *cache = CACHE(key);
+
+    if (cache == NULL)
+        return;
+    EVP_CIPHER_CTX_free(cache->slots[SLOT_ENC]);
+    EVP_CIPHER_CTX_free(cache->slots[SLOT_DEC]);
+    HMAC_CTX_free(cache->slots[SLOT_HMAC]);
+    k5_mutex_destroy(&cache->lock);
+    free(cache);
+    key->cache = NULL;
+}
+
+/* A cbc128_f function for CRYPTO_cts128_encrypt() and
+ * CRYPTO_cts128_decrypt(), with a struct cts_state as the key. */
+struct cts_state {
+    EVP_CIPHER_CTX *ctx;
+    int ok;
+};
+
+static void
+evp_cbc(const unsigned char *in, unsigned char *out, size_t len,
+        const void *key, unsigned char ivec[16], int enc)
+{
+    struct cts_state *st = (struct cts_state *)key;
+    unsigned char last[16];
+    int olen;
+
+    if (!st->ok || len < 16 || len > INT_MAX) {
+        st->ok = 0;
+        return;
+    }
+    /* Save the last ciphertext block in case of in-place decryption. */
+    if (!enc)
+        memcpy(last, in + len - 16, 16);
+    if (EVP_CipherInit_ex(st->ctx, NULL, NULL, NULL, ivec, enc) != 1 ||
+        EVP_CipherUpdate(st->ctx, out, &olen, in, len) != 1 ||
+        (size_t)olen != len) {
+        st->ok = 0;
+        return;
+    }
+    memcpy(ivec, enc ? out + len - 16 : last, 16);
+}
+
+krb5_error_code
+k5_ossl_cts(EVP_CIPHER_CTX *ctx, int enc, const unsigned char *in,
+            unsigned char *out, size_t len, unsigned char ivec[16])
+{
+    struct cts_state st;
+    size_t size;
+
+    st.ctx = ctx;
+    st.ok = 1;
+    if (enc)
+        size = CRYPTO_cts128_encrypt(in, out, len, &st, ivec, evp_cbc);
+    else
+        size = CRYPTO_cts128_decrypt(in, out, len, &st, ivec, evp_cbc);
+    return (size == 0 || !st.ok) ? KRB5_CRYPTO_INTERNAL : 0;
+}
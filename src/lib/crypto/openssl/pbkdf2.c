@@ -52,3 +52,20 @@ krb5int_pbkdf2_hmac(const struct krb5_hash_provider *hash,
                            md, out->length, (unsigned char *)out->data);
     return ok ? 0 : KRB5_CRYPTO_INTERNAL;
 }
+
+krb5_error_code
+krb5int_pbkdf2_hmac_multi(struct pbkdf2_job *jobs, size_t njobs)
+{
+    krb5_error_code ret = 0;
+    size_t i;
+
+    /* OpenSSL has no multi-buffer PBKDF2, so compute the jobs in turn. */
+    for (i = 0; i < njobs; i++) {
+        jobs[i].code = krb5int_pbkdf2_hmac(jobs[i].hash, &jobs[i].out,
+                                           jobs[i].count, &jobs[i].password,
+                                           &jobs[i].salt);
+        if (ret == 0)
+            ret = jobs[i].code;
+    }
+    return ret;
+}
@@ -241,9 +241,40 @@ make_random_salt(krb5_context context, krb5_keysalt *salt_out)
     return 0;
 }
 
+/* Compute the salt for a password-derived key of salt type salttype. */
+static krb5_error_code
+make_salt(krb5_context context, krb5_db_entry *db_entry, krb5_int32 salttype,
+          krb5_keysalt *key_salt)
+{
+    krb5_error_code retval;
+    krb5_data *saltdata;
+
+    switch (key_salt->type = salttype) {
+    case KRB5_KDB_SALTTYPE_ONLYREALM:
+        retval = krb5_copy_data(context, &db_entry->princ->realm, &saltdata);
+        if (retval)
+            return retval;
+        key_salt->data = *saltdata;
+        free(saltdata);
+        return 0;
+    case KRB5_KDB_SALTTYPE_NOREALM:
+        return krb5_principal2salt_norealm(context, db_entry->princ,
+                                           &key_salt->data);
+    case KRB5_KDB_SALTTYPE_NORMAL:
+        return krb5_principal2salt(context, db_entry->princ, &key_salt->data);
+    case KRB5_KDB_SALTTYPE_SPECIAL:
+        return make_random_salt(context, key_salt);
+    default:
+        return KRB5_KDB_BAD_SALTTYPE;
+    }
+}
+
 /*
  * Add key_data for a krb5_db_entry
  * If passwd is NULL the assumes that the caller wants a random password.
+ *
+ * The keys are generated with a single call to krb5_c_string_to_key_multi(),
+ * which performs the PBKDF2 iterations of all of the enctypes together.
  */
 static krb5_error_code
 add_key_pwd(context, master_key, ks_tuple, ks_tuple_count, passwd,
@@ -257,12 +288,24 @@ add_key_pwd(context, master_key, ks_tuple, ks_tuple_count, passwd,
     int                   kvno;
 {
     krb5_error_code       retval;
-    krb5_keysalt          key_salt;
-    krb5_keyblock         key;
-    krb5_data             pwd;
-    int                   i, j;
+    krb5_keysalt         *salts = NULL;
+    krb5_keyblock        *keys = NULL;
+    krb5_enctype         *enctypes = NULL;
+    krb5_data            *pwds = NULL, *saltdata = NULL;
+    int                   i, j, n = 0;
     krb5_key_data        *kd_slot;
 
+    if (ks_tuple_count <= 0)
+        return 0;
+    salts = k5calloc(ks_tuple_count, sizeof(*salts), &retval);
+    keys = k5calloc(ks_tuple_count, sizeof(*keys), &retval);
+    enctypes = k5calloc(ks_tuple_count, sizeof(*enctypes), &retval);
+    pwds = k5calloc(ks_tuple_count, sizeof(*pwds), &retval);
+    saltdata = k5calloc(ks_tuple_count, sizeof(*saltdata), &retval);
+    if (salts == NULL || keys == NULL || enctypes == NULL || pwds == NULL ||
+        saltdata == NULL)
+        goto cleanup;
+
     for (i = 0; i < ks_tuple_count; i++) {
         krb5_boolean similar;
 
@@ -278,7 +321,7 @@ add_key_pwd(context, master_key, ks_tuple, ks_tuple_count, passwd,
                                                  ks_tuple[i].ks_enctype,
                                                  ks_tuple[j].ks_enctype,
                                                  &similar)))
-                return(retval);
+                goto cleanup;
 
             if (similar &&
                 (ks_tuple[j].ks_salttype == ks_tuple[i].ks_salttype))
@@ -288,64 +331,47 @@ add_key_pwd(context, master_key, ks_tuple, ks_tuple_count, passwd,
         if (j < i)
             continue;
 
-        if ((retval = krb5_dbe_create_key_data(context, db_entry)))
-            return(retval);
-        kd_slot = &db_entry->key_data[db_entry->n_key_data - 1];
-
-        /* Convert password string to key using appropriate salt */
-        switch (key_salt.type = ks_tuple[i].ks_salttype) {
-        case KRB5_KDB_SALTTYPE_ONLYREALM: {
-            krb5_data * saltdata;
-            if ((retval = krb5_copy_data(context, krb5_princ_realm(context,
-                                                                   db_entry->princ), &saltdata)))
-                return(retval);
-
-            key_salt.data = *saltdata;
-            free(saltdata);
-        }
-            break;
-        case KRB5_KDB_SALTTYPE_NOREALM:
-            if ((retval=krb5_principal2salt_norealm(context, db_entry->princ,
-                                                    &key_salt.data)))
-                return(retval);
-            break;
-        case KRB5_KDB_SALTTYPE_NORMAL:
-            if ((retval = krb5_principal2salt(context, db_entry->princ,
-                                              &key_salt.data)))
-                return(retval);
-            break;
-        case KRB5_KDB_SALTTYPE_SPECIAL:
-            retval = make_random_salt(context, &key_salt);
-            if (retval)
-                return retval;
-            break;
-        default:
-            return(KRB5_KDB_BAD_SALTTYPE);
-        }
+        /* Compute the salt now; the keys are generated together below. */
+        retval = make_salt(context, db_entry, ks_tuple[i].ks_salttype,
+                           &salts[n]);
+        if (retval)
+            goto cleanup;
+        enctypes[n] = ks_tuple[i].ks_enctype;
+        pwds[n] = string2data((char *)passwd);
+        saltdata[n] = salts[n].data;
+        n++;
+    }
 
-        pwd = string2data((char *)passwd);
+    /* Derive the keys together so that PBKDF2 enctypes can share hashing
+     * work.  Don't create threads, as this runs inside kadmind and the KDC. */
+    retval = krb5_c_string_to_key_multi(context, n, enctypes, pwds, saltdata,
+                                        NULL, 1, keys, NULL);
+    if (retval)
+        goto cleanup;
 
-        retval = krb5_c_string_to_key_with_params(context,
-                                                  ks_tuple[i].ks_enctype,
-                                                  &pwd, &key_salt.data,
-                                                  NULL, &key);
-        if (retval) {
-            free(key_salt.data.data);
-            return retval;
-        }
+    for (i = 0; i < n; i++) {
+        if ((retval = krb5_dbe_create_key_data(context, db_entry)))
+            goto cleanup;
+        kd_slot = &db_entry->key_data[db_entry->n_key_data - 1];
 
-        retval = krb5_dbe_encrypt_key_data(context, master_key, &key,
-                                           (const krb5_keysalt *)&key_salt,
+        retval = krb5_dbe_encrypt_key_data(context, master_key, &keys[i],
+                                           (const krb5_keysalt *)&salts[i],
                                            kvno, kd_slot);
-        if (key_salt.data.data)
-            free(key_salt.data.data);
-        free(key.contents);
-
-        if( retval )
-            return retval;
+        if (retval)
+            goto cleanup;
     }
 
-    return 0;
+cleanup:
+    for (i = 0; salts != NULL && i < n; i++)
+        free(salts[i].data.data);
+    for (i = 0; keys != NULL && i < n; i++)
+        krb5_free_keyblock_contents(context, &keys[i]);
+    free(salts);
+    free(keys);
+    free(enctypes);
+    free(pwds);
+    free(saltdata);
+    return retval;
 }
 
 static krb5_error_code
@@ -42,9 +42,66 @@ krb5_error_code
 k5_cc_retrieve_cred_default(krb5_context, krb5_ccache, krb5_flags,
                             krb5_creds *, krb5_creds *);
 
+/* Search an in-memory array of credentials in order, returning a copy of the
+ * credential k5_cc_retrieve_cred_default() would select from a cache with the
+ * same contents. */
+krb5_error_code
+k5_cc_retrieve_cred_array(krb5_context context, krb5_flags flags,
+                          krb5_creds *mcreds, krb5_creds *list, size_t count,
+                          krb5_creds *creds);
+
 krb5_boolean
 krb5int_cc_creds_match_request(krb5_context, krb5_flags whichfields, krb5_creds *mcreds, krb5_creds *creds);
 
+/* A marshalled principal, with its fields located but not copied; see
+ * ccmarshal.c. */
+struct k5_princ_view {
+    int version;
+    uint32_t ncomps;
+    krb5_data realm;
+    const unsigned char *comps; /* marshalled components */
+    size_t comps_len;
+};
+
+/* A marshalled credential, with the fields used for matching located but not
+ * copied.  data and len give the whole marshalled credential, which can be
+ * unmarshalled with k5_unmarshal_cred() if it matches. */
+struct k5_cred_view {
+    const unsigned char *data;
+    size_t len;
+    int version;
+    struct k5_princ_view client;
+    struct k5_princ_view server;
+    krb5_enctype enctype;
+    krb5_ticket_times times;
+    krb5_boolean is_skey;
+    krb5_flags ticket_flags;
+    const unsigned char *authdata; /* marshalled authdata entries */
+    size_t authdata_len;
+    uint32_t authdata_count;
+    krb5_data second_ticket;
+};
+
+/* Set *view_out to the next credential of a scan, or return KRB5_CC_END if
+ * there are no more.  The view's memory must remain valid until the next
+ * call. */
+typedef krb5_error_code
+(*k5_cc_next_view_fn)(krb5_context context, void *arg,
+                      struct k5_cred_view *view_out);
+
+/* Like krb5int_cc_creds_match_request(), but for a credential view. */
+krb5_boolean
+k5_cc_view_match_request(krb5_context context, krb5_flags whichfields,
+                         krb5_creds *mcreds, const struct k5_cred_view *view);
+
+/* Search the credentials yielded by next_fn, returning the credential
+ * k5_cc_retrieve_cred_default() would select from a cache with the same
+ * contents.  Only matching credentials are unmarshalled. */
+krb5_error_code
+k5_cc_retrieve_cred_views(krb5_context context, krb5_flags flags,
+                          krb5_creds *mcreds, k5_cc_next_view_fn next_fn,
+                          void *arg, krb5_creds *creds);
+
 int
 krb5int_cc_initialize(void);
 
@@ -135,6 +192,9 @@ k5_cccol_force_unlock(void);
 krb5_error_code
 krb5int_fcc_new_unique(krb5_context context, char *template, krb5_ccache *id);
 
+void
+k5_fcc_free_shadows(void);
+
 krb5_error_code
 ccselect_hostname_initvt(krb5_context context, int maj_ver, int min_ver,
                          krb5_plugin_vtable vtable);
@@ -155,6 +215,18 @@ krb5_error_code
 k5_unmarshal_princ(const unsigned char *data, size_t len, int version,
                    krb5_principal *princ_out);
 
+krb5_error_code
+k5_unmarshal_cred_view(const unsigned char *data, size_t len, int version,
+                       struct k5_cred_view *view);
+
+krb5_boolean
+k5_princ_view_eq(const struct k5_princ_view *view, krb5_const_principal princ,
+                 krb5_boolean ignore_realm);
+
+krb5_boolean
+k5_authdata_view_eq(const struct k5_cred_view *view,
+                    krb5_authdata *const *authdata);
+
 void
 k5_marshal_cred(struct k5buf *buf, int version, krb5_creds *creds);
 
@@ -164,6 +236,69 @@ k5_marshal_mcred(struct k5buf *buf, krb5_creds *mcred);
 void
 k5_marshal_princ(struct k5buf *buf, int version, krb5_principal princ);
 
+/* Principal index for a cache collection; see ccindex.c. */
+struct k5_ccindex_entry {
+    char *subsidiary;
+    char *princname;
+    krb5_timestamp expiry;
+};
+
+struct k5_ccindex {
+    struct k5_ccindex_entry *entries;
+    size_t count;
+    krb5_boolean changed;
+};
+
+/* Open the subsidiary cache named subsidiary within the collection given by
+ * arg. */
+typedef krb5_error_code
+(*k5_ccindex_open_fn)(krb5_context context, void *arg, const char *subsidiary,
+                      krb5_ccache *cache_out);
+
+/* Set *names_out to a null-terminated list of the subsidiary cache names in
+ * the collection given by arg. */
+typedef krb5_error_code
+(*k5_ccindex_list_fn)(krb5_context context, void *arg, char ***names_out);
+
+krb5_error_code
+k5_ccindex_parse(const char *data, size_t len, struct k5_ccindex *index_out);
+
+void
+k5_ccindex_marshal(const struct k5_ccindex *index, struct k5buf *buf);
+
+/* Add or replace the entry for subsidiary in index. */
+krb5_error_code
+k5_ccindex_set(krb5_context context, struct k5_ccindex *index,
+               const char *subsidiary, krb5_const_principal princ,
+               krb5_timestamp expiry);
+
+void
+k5_ccindex_remove(struct k5_ccindex *index, const char *subsidiary);
+
+void
+k5_ccindex_free(struct k5_ccindex *index);
+
+void
+k5_ccindex_free_names(char **names);
+
+/* Return true if creds is a TGT for the client principal's realm. */
+krb5_boolean
+k5_ccindex_local_tgt(const krb5_creds *creds);
+
+/*
+ * Find a cache in a collection whose default principal is client, consulting
+ * index first, and updating index to reflect any caches found to be missing,
+ * changed, or unindexed.  primary is the name of the collection's primary
+ * cache, if known, which is preferred over other matching caches.  Return
+ * KRB5_CC_NOTFOUND if no cache matches.
+ */
+krb5_error_code
+k5_ccindex_match(krb5_context context, struct k5_ccindex *index,
+                 const char *primary, krb5_const_principal client,
+                 k5_ccindex_open_fn open_cache,
+                 k5_ccindex_list_fn list_caches, void *arg,
+                 krb5_ccache *cache_out);
+
 /*
  * Per-type ccache cursor.
  */
@@ -217,6 +352,12 @@ struct _krb5_cc_ops {
     krb5_error_code (KRB5_CALLCONV *lock)(krb5_context, krb5_ccache);
     krb5_error_code (KRB5_CALLCONV *unlock)(krb5_context, krb5_ccache);
     krb5_error_code (KRB5_CALLCONV *switch_to)(krb5_context, krb5_ccache);
+    /* Optional: find a cache in the type's collection for a client principal
+     * without scanning it.  Return KRB5_CC_NOTFOUND if there is no match, or
+     * KRB5_CC_NOSUPP if the collection must be scanned. */
+    krb5_error_code (KRB5_CALLCONV *match)(krb5_context,
+                                           krb5_const_principal,
+                                           krb5_ccache *);
 };
 
 extern const krb5_cc_ops *krb5_cc_dfl_ops;
@@ -43,6 +43,11 @@
  * contains a single line naming the primary cache.  The directory must already
  * exist when the DIR ccache is resolved, but the primary file will be created
  * automatically if it does not exist.
+ *
+ * The file "index" contains a principal index of the caches in the directory
+ * (see ccindex.c), which is updated when caches are initialized or destroyed
+ * and when local TGTs are stored.  It is read and written with an exclusive
+ * lock held.
  */
 
 #include "k5-int.h"
@@ -83,6 +88,13 @@ primary_pathname(const char *dirname, char **path_out)
     return k5_path_join(dirname, "primary", path_out);
 }
 
+/* Compose the pathname of the index file within a cache directory. */
+static inline krb5_error_code
+index_pathname(const char *dirname, char **path_out)
+{
+    return k5_path_join(dirname, "index", path_out);
+}
+
 /* Compose a residual string for a subsidiary path with the specified directory
  * name and filename. */
 static krb5_error_code
@@ -239,6 +251,111 @@ verify_dir(krb5_context context, const char *dirname)
     return 0;
 }
 
+/* Open and lock the index file for dirname and read its contents into
+ * *index_out. */
+static krb5_error_code
+open_index(krb5_context context, const char *dirname, int *fd_out,
+           struct k5_ccindex *index_out)
+{
+    krb5_error_code ret;
+    char *path = NULL, *contents = NULL;
+    struct stat st;
+    ssize_t nread;
+    int fd = -1;
+
+    *fd_out = -1;
+    ret = index_pathname(dirname, &path);
+    if (ret)
+        return ret;
+    fd = open(path, O_RDWR | O_CREAT | O_BINARY, 0600);
+    if (fd < 0) {
+        ret = errno;
+        goto cleanup;
+    }
+    set_cloexec_fd(fd);
+    ret = krb5_lock_file(context, fd, KRB5_LOCKMODE_EXCLUSIVE);
+    if (ret)
+        goto cleanup;
+
+    if (fstat(fd, &st) != 0) {
+        ret = errno;
+        goto cleanup;
+    }
+    contents = k5alloc(st.st_size + 1, &ret);
+    if (contents == NULL)
+        goto cleanup;
+    nread = read(fd, contents, st.st_size);
+    if (nread < 0) {
+        ret = errno;
+        goto cleanup;
+    }
+    ret = k5_ccindex_parse(contents, nread, index_out);
+    if (ret)
+        goto cleanup;
+
+    *fd_out = fd;
+    fd = -1;
+
+cleanup:
+    if (fd >= 0)
+        close(fd);
+    free(path);
+    free(contents);
+    return ret;
+}
+
+/* Write the index back to fd if it has changed, then unlock and close fd and
+ * free the index. */
+static krb5_error_code
+close_index(krb5_context context, int fd, struct k5_ccindex *index)
+{
+    krb5_error_code ret = 0;
+    struct k5buf buf;
+
+    if (index->changed) {
+        k5_buf_init_dynamic(&buf);
+        k5_ccindex_marshal(index, &buf);
+        ret = k5_buf_status(&buf);
+        if (ret == 0 && (ftruncate(fd, 0) != 0 ||
+                         lseek(fd, 0, SEEK_SET) != 0 ||
+                         write(fd, buf.data, buf.len) != (ssize_t)buf.len))
+            ret = KRB5_CC_IO;
+        k5_buf_free(&buf);
+    }
+    (void)krb5_unlock_file(context, fd);
+    close(fd);
+    k5_ccindex_free(index);
+    return ret;
+}
+
+/*
+ * Update the index entry for the subsidiary cache with the given residual.
+ * If princ is NULL, remove the entry; otherwise set it to princ and expiry.
+ * Errors are not reported, since the index is only a hint.
+ */
+static void
+update_index(krb5_context context, const char *residual,
+             krb5_const_principal princ, krb5_timestamp expiry)
+{
+    struct k5_ccindex index;
+    char *dirname, *filename;
+    int fd;
+
+    if (split_path(context, residual + 1, &dirname, &filename) != 0) {
+        krb5_clear_error_message(context);
+        return;
+    }
+    if (open_index(context, dirname, &fd, &index) == 0) {
+        if (princ == NULL)
+            k5_ccindex_remove(&index, filename);
+        else
+            (void)k5_ccindex_set(context, &index, filename, princ, expiry);
+        (void)close_index(context, fd, &index);
+    }
+    free(dirname);
+    free(filename);
+}
+
 /*
  * If the default ccache name for context is a directory collection, set
  * *dirname_out to the directory name for that collection.  Otherwise set
@@ -432,8 +549,13 @@ static krb5_error_code KRB5_CALLCONV
 dcc_init(krb5_context context, krb5_ccache cache, krb5_principal princ)
 {
     dcc_data *data = cache->data;
+    krb5_error_code ret;
 
-    return krb5_fcc_ops.init(context, data->fcc, princ);
+    ret = krb5_fcc_ops.init(context, data->fcc, princ);
+    if (ret)
+        return ret;
+    update_index(context, data->residual, princ, 0);
+    return 0;
 }
 
 static krb5_error_code KRB5_CALLCONV
@@ -443,6 +565,7 @@ dcc_destroy(krb5_context context, krb5_ccache cache)
     krb5_error_code ret;
 
     ret = krb5_fcc_ops.destroy(context, data->fcc);
+    update_index(context, data->residual, NULL, 0);
     free(data->residual);
     free(data);
     free(cache);
@@ -466,8 +589,15 @@ static krb5_error_code KRB5_CALLCONV
 dcc_store(krb5_context context, krb5_ccache cache, krb5_creds *creds)
 {
     dcc_data *data = cache->data;
+    krb5_error_code ret;
 
-    return krb5_fcc_ops.store(context, data->fcc, creds);
+    ret = krb5_fcc_ops.store(context, data->fcc, creds);
+    if (ret)
+        return ret;
+    if (k5_ccindex_local_tgt(creds))
+        update_index(context, data->residual, creds->client,
+                     creds->times.endtime);
+    return 0;
 }
 
 static krb5_error_code KRB5_CALLCONV
@@ -731,6 +861,103 @@ cleanup:
     return ret;
 }
 
+static krb5_error_code
+open_subsidiary(krb5_context context, void *arg, const char *filename,
+                krb5_ccache *cache_out)
+{
+    krb5_error_code ret;
+    char *residual;
+
+    ret = subsidiary_residual(arg, filename, &residual);
+    if (ret)
+        return ret;
+    ret = dcc_resolve(context, cache_out, residual);
+    free(residual);
+    return ret;
+}
+
+static krb5_error_code
+list_subsidiaries(krb5_context context, void *arg, char ***names_out)
+{
+    DIR *dir;
+    struct dirent *ent;
+    char **names = NULL, **newnames;
+    size_t count = 0;
+
+    *names_out = NULL;
+    dir = opendir(arg);
+    if (dir == NULL)
+        return KRB5_CC_IO;
+    names = calloc(1, sizeof(*names));
+    if (names == NULL)
+        goto oom;
+    while ((ent = readdir(dir)) != NULL) {
+        if (!filename_is_cache(ent->d_name))
+            continue;
+        newnames = realloc(names, (count + 2) * sizeof(*names));
+        if (newnames == NULL)
+            goto oom;
+        names = newnames;
+        names[count] = strdup(ent->d_name);
+        if (names[count] == NULL)
+            goto oom;
+        names[++count] = NULL;
+    }
+    closedir(dir);
+    *names_out = names;
+    return 0;
+
+oom:
+    closedir(dir);
+    k5_ccindex_free_names(names);
+    return ENOMEM;
+}
+
+/* Look up client in the index of the context's default directory
+ * collection. */
+static krb5_error_code KRB5_CALLCONV
+dcc_match(krb5_context context, krb5_const_principal client,
+          krb5_ccache *cache_out)
+{
+    krb5_error_code ret;
+    struct k5_ccindex index;
+    char *dirname = NULL, *primary_path = NULL, *presidual = NULL;
+    char *pdirname = NULL, *primary = NULL;
+    int fd;
+
+    *cache_out = NULL;
+
+    /* Let the caller scan if the default cache isn't a directory
+     * collection. */
+    ret = get_context_default_dir(context, &dirname);
+    if (ret || dirname == NULL)
+        return KRB5_CC_NOSUPP;
+
+    ret = open_index(context, dirname, &fd, &index);
+    if (ret) {
+        ret = KRB5_CC_NOSUPP;
+        goto cleanup;
+    }
+
+    /* Fetch the primary cache filename if possible. */
+    if (primary_pathname(dirname, &primary_path) == 0 &&
+        read_primary_file(context, primary_path, dirname, &presidual) == 0)
+        (void)k5_path_split(presidual + 1, &pdirname, &primary);
+    krb5_clear_error_message(context);
+
+    ret = k5_ccindex_match(context, &index, primary, client, open_subsidiary,
+                           list_subsidiaries, dirname, cache_out);
+    (void)close_index(context, fd, &index);
+
+cleanup:
+    free(dirname);
+    free(primary_path);
+    free(presidual);
+    free(pdirname);
+    free(primary);
+    return ret;
+}
+
 const krb5_cc_ops krb5_dcc_ops = {
     0,
     "DIR",
@@ -757,6 +984,7 @@ const krb5_cc_ops krb5_dcc_ops = {
     dcc_lock,
     dcc_unlock,
     dcc_switch_to,
+    dcc_match,
 };
 
 #endif /* not _WIN32 */
@@ -62,6 +62,7 @@
 
 #include "k5-int.h"
 #include "cc-int.h"
+#include "../os/os-proto.h"
 
 #include <stdio.h>
 #include <errno.h>
@@ -79,6 +80,7 @@ extern const krb5_cc_ops krb5_cc_file_ops;
 krb5_error_code krb5_change_cache(void);
 
 static krb5_error_code interpret_errno(krb5_context, int);
+static void drop_shadow(krb5_context context, const char *filename);
 
 /* The cache format version is a positive integer, represented in the cache
  * file as a two-byte big endian number with 0x0500 added to it. */
@@ -323,6 +325,17 @@ cleanup:
     return ret;
 }
 
+/* Return true if filename still refers to the file open as fd. */
+static krb5_boolean
+file_is_current(int fd, const char *filename)
+{
+    struct stat fsb, sb;
+
+    if (fstat(fd, &fsb) != 0 || stat(filename, &sb) != 0)
+        return TRUE;
+    return fsb.st_dev == sb.st_dev && fsb.st_ino == sb.st_ino;
+}
+
 /*
  * Open and lock an existing cache file.  If writable is true, open it for
  * writing (with O_APPEND) and get an exclusive lock; otherwise open it for
@@ -333,22 +346,35 @@ open_cache_file(krb5_context context, const char *filename,
                 krb5_boolean writable, FILE **fp_out)
 {
     krb5_error_code ret;
-    int fd, flags, lockmode;
+    int fd, flags, lockmode, tries = 0;
     FILE *fp;
 
     *fp_out = NULL;
 
     flags = writable ? (O_RDWR | O_APPEND) : O_RDONLY;
-    fd = open(filename, flags | O_BINARY | O_CLOEXEC, 0600);
-    if (fd == -1)
-        return interpret_errno(context, errno);
-    set_cloexec_fd(fd);
-
     lockmode = writable ? KRB5_LOCKMODE_EXCLUSIVE : KRB5_LOCKMODE_SHARED;
-    ret = krb5_lock_file(context, fd, lockmode);
-    if (ret) {
+    for (;;) {
+        fd = open(filename, flags | O_BINARY | O_CLOEXEC, 0600);
+        if (fd == -1)
+            return interpret_errno(context, errno);
+        set_cloexec_fd(fd);
+
+        ret = krb5_lock_file(context, fd, lockmode);
+        if (ret) {
+            (void)close(fd);
+            return ret;
+        }
+
+        /* If the cache file was replaced (by compaction or reinitialization)
+         * while we waited for the lock, a write to the old file would be
+         * lost; open the new file instead.  Give up if it keeps being
+         * replaced. */
+        if (!writable || file_is_current(fd, filename))
+            break;
+        (void)krb5_unlock_file(context, fd);
         (void)close(fd);
-        return ret;
+        if (++tries >= 3)
+            return KRB5_CC_IO;
     }
 
     fp = fdopen(fd, writable ? "r+b" : "rb");
@@ -378,19 +404,46 @@ close_cache_file(krb5_context context, FILE *fp)
     return st ? interpret_errno(context, errno) : 0;
 }
 
+/* The KDC time offset from a cache file header, if present. */
+struct deltatime {
+    krb5_boolean present;
+    uint32_t time_offset;
+    uint32_t usec_offset;
+};
+
+/* Set the time offsets in context from dt if appropriate. */
+static void
+set_deltatime(krb5_context context, const struct deltatime *dt)
+{
+    krb5_os_context os_ctx = &context->os_context;
+
+    if (!dt->present ||
+        !(context->library_options & KRB5_LIBOPT_SYNC_KDCTIME) ||
+        (os_ctx->os_flags & KRB5_OS_TOFFSET_VALID))
+        return;
+
+    os_ctx->time_offset = dt->time_offset;
+    os_ctx->usec_offset = dt->usec_offset;
+    os_ctx->os_flags = ((os_ctx->os_flags & ~KRB5_OS_TOFFSET_TIME) |
+                        KRB5_OS_TOFFSET_VALID);
+}
+
 /* Read the cache file header.  Set time offsets in context from the header if
- * appropriate.  Set *version_out to the cache file format version. */
+ * appropriate.  Set *version_out to the cache file format version.  If dt_out
+ * is not null, set it to the time offset recorded in the header. */
 static krb5_error_code
-read_header(krb5_context context, FILE *fp, int *version_out)
+read_header(krb5_context context, FILE *fp, int *version_out,
+            struct deltatime *dt_out)
 {
     krb5_error_code ret;
-    krb5_os_context os_ctx = &context->os_context;
     uint16_t fields_len, tag, flen;
-    uint32_t time_offset, usec_offset;
+    struct deltatime dt = { FALSE, 0, 0 };
     char i16buf[2];
     int version;
 
     *version_out = 0;
+    if (dt_out != NULL)
+        *dt_out = dt;
 
     /* Get the file format version. */
     ret = read_bytes(context, fp, i16buf, 2);
@@ -415,18 +468,13 @@ read_header(krb5_context context, FILE *fp, int *version_out)
         switch (tag) {
         case FCC_TAG_DELTATIME:
             if (flen != 8 ||
-                read32(context, fp, version, NULL, &time_offset) ||
-                read32(context, fp, version, NULL, &usec_offset))
+                read32(context, fp, version, NULL, &dt.time_offset) ||
+                read32(context, fp, version, NULL, &dt.usec_offset))
                 return KRB5_CC_FORMAT;
-
-            if (!(context->library_options & KRB5_LIBOPT_SYNC_KDCTIME) ||
-                (os_ctx->os_flags & KRB5_OS_TOFFSET_VALID))
-                break;
-
-            os_ctx->time_offset = time_offset;
-            os_ctx->usec_offset = usec_offset;
-            os_ctx->os_flags = ((os_ctx->os_flags & ~KRB5_OS_TOFFSET_TIME) |
-                                KRB5_OS_TOFFSET_VALID);
+            dt.present = TRUE;
+            set_deltatime(context, &dt);
+            if (dt_out != NULL)
+                *dt_out = dt;
             break;
 
         default:
@@ -517,6 +565,7 @@ cleanup:
     if (fd != -1)
         close(fd);
     k5_cc_mutex_unlock(context, &data->lock);
+    drop_shadow(context, data->filename);
     krb5_change_cache();
     return set_errmsg_filename(context, ret, data->filename);
 }
@@ -641,6 +690,7 @@ fcc_destroy(krb5_context context, krb5_ccache id)
 cleanup:
     (void)set_errmsg_filename(context, ret, data->filename);
     k5_cc_mutex_unlock(context, &data->lock);
+    drop_shadow(context, data->filename);
     free_fccdata(context, data);
     free(id);
 
@@ -712,7 +762,7 @@ fcc_start_seq_get(krb5_context context, krb5_ccache id, krb5_cc_cursor *cursor)
     ret = open_cache_file(context, data->filename, FALSE, &fp);
     if (ret)
         goto cleanup;
-    ret = read_header(context, fp, &version);
+    ret = read_header(context, fp, &version, NULL);
     if (ret)
         goto cleanup;
 
@@ -737,29 +787,26 @@ cleanup:
     return set_errmsg_filename(context, ret, data->filename);
 }
 
-/* Return true if cred is a removed entry (assuming that no legitimate cred
- * entries will have authtime=-1 and endtime=0). */
+/* Return true if times belong to a removed entry (assuming that no legitimate
+ * cred entries will have authtime=-1 and endtime=0). */
 static inline krb5_boolean
-cred_removed(krb5_creds *c)
+cred_removed(const krb5_ticket_times *times)
 {
-    return c->times.endtime == 0 && c->times.authtime == -1;
+    return times->endtime == 0 && times->authtime == -1;
 }
 
-/* Get the next credential from the cache file. */
-static krb5_error_code KRB5_CALLCONV
-fcc_next_cred(krb5_context context, krb5_ccache id, krb5_cc_cursor *cursor,
-              krb5_creds *creds)
+/* Load the next credential which has not been removed from the cache file
+ * into buf, and set *view to a view of it within buf. */
+static krb5_error_code
+next_cred_view(krb5_context context, krb5_ccache id, krb5_fcc_cursor *fcursor,
+               struct k5buf *buf, struct k5_cred_view *view)
 {
     krb5_error_code ret;
-    krb5_fcc_cursor *fcursor = *cursor;
     fcc_data *data = id->data;
-    struct k5buf buf;
     size_t maxsize;
     krb5_boolean file_locked = FALSE;
 
-    memset(creds, 0, sizeof(*creds));
     k5_cc_mutex_lock(context, &data->lock);
-    k5_buf_init_dynamic_zap(&buf);
 
     ret = krb5_lock_file(context, fileno(fcursor->fp), KRB5_LOCKMODE_SHARED);
     if (ret)
@@ -768,37 +815,55 @@ fcc_next_cred(krb5_context context, krb5_ccache id, krb5_cc_cursor *cursor,
 
     for (;;) {
         /* Load a marshalled cred into memory. */
+        k5_buf_truncate(buf, 0);
         ret = get_size(context, fcursor->fp, &maxsize);
         if (ret)
             goto cleanup;
-        ret = load_cred(context, fcursor->fp, fcursor->version, maxsize, &buf);
+        ret = load_cred(context, fcursor->fp, fcursor->version, maxsize, buf);
         if (ret)
             goto cleanup;
-        ret = k5_buf_status(&buf);
+        ret = k5_buf_status(buf);
         if (ret)
             goto cleanup;
 
-        /* Unmarshal it from buf into creds. */
-        ret = k5_unmarshal_cred(buf.data, buf.len, fcursor->version, creds);
+        ret = k5_unmarshal_cred_view(buf->data, buf->len, fcursor->version,
+                                     view);
         if (ret)
             goto cleanup;
 
         /* Keep going if this entry has been removed; otherwise stop. */
-        if (!cred_removed(creds))
+        if (!cred_removed(&view->times))
             break;
-
-        k5_buf_truncate(&buf, 0);
-        krb5_free_cred_contents(context, creds);
     }
 
 cleanup:
     if (file_locked)
         (void)krb5_unlock_file(context, fileno(fcursor->fp));
     k5_cc_mutex_unlock(context, &data->lock);
-    k5_buf_free(&buf);
     return set_errmsg_filename(context, ret, data->filename);
 }
 
+/* Get the next credential from the cache file. */
+static krb5_error_code KRB5_CALLCONV
+fcc_next_cred(krb5_context context, krb5_ccache id, krb5_cc_cursor *cursor,
+              krb5_creds *creds)
+{
+    krb5_error_code ret;
+    fcc_data *data = id->data;
+    struct k5buf buf;
+    struct k5_cred_view view;
+
+    memset(creds, 0, sizeof(*creds));
+    k5_buf_init_dynamic_zap(&buf);
+    ret = next_cred_view(context, id, *cursor, &buf, &view);
+    if (!ret) {
+        ret = k5_unmarshal_cred(view.data, view.len, view.version, creds);
+        ret = set_errmsg_filename(context, ret, data->filename);
+    }
+    k5_buf_free(&buf);
+    return ret;
+}
+
 /* Release an iteration cursor. */
 static krb5_error_code KRB5_CALLCONV
 fcc_end_seq_get(krb5_context context, krb5_ccache id, krb5_cc_cursor *cursor)
@@ -950,7 +1015,7 @@ fcc_get_principal(krb5_context context, krb5_ccache id, krb5_principal *princ)
     ret = open_cache_file(context, data->filename, FALSE, &fp);
     if (ret)
         goto cleanup;
-    ret = read_header(context, fp, &version);
+    ret = read_header(context, fp, &version, NULL);
     if (ret)
         goto cleanup;
     ret = read_principal(context, fp, version, princ);
@@ -961,15 +1026,347 @@ cleanup:
     return set_errmsg_filename(context, ret, data->filename);
 }
 
+/*
+ * To avoid re-reading and re-parsing a large cache file for each retrieval,
+ * we keep a per-process shadow of the credentials in recently searched cache
+ * files, protected by krb5int_cc_file_mutex.  A shadow is a file index (see
+ * os/file_index.c), so it is only used while the file's stamp matches the
+ * one observed when it was loaded; credential removal overwrites the file in
+ * place without changing its size, so this relies on the modification time.
+ * Within a shadow, credentials are grouped by a hash of the server name
+ * (without the realm, to support KRB5_TC_MATCH_SRV_NAMEONLY).
+ */
+
+#define SHADOW_MAX_FILES 8
+#define SHADOW_MAX_FILE_SIZE (16 * 1024 * 1024)
+
+struct fcc_shadow {
+    struct k5_file_index ix;    /* must be first */
+    struct deltatime dt;
+    krb5_creds *creds;
+    size_t ncreds;
+#ifndef _WIN32
+    uid_t euid;                 /* effective uid which read the file */
+#endif
+};
+
+/* Most recently used first. */
+static struct k5_file_index *shadow_list;
+
+/* Hash the name components of princ, ignoring the realm. */
+static uint32_t
+hash_server(krb5_const_principal princ)
+{
+    uint32_t h = K5_FNV_HASH_INIT;
+    int i;
+
+    for (i = 0; i < princ->length; i++)
+        h = k5_fnv_hash_data(h, &princ->data[i]);
+    return h;
+}
+
+static uint32_t
+hash_cred(const void *item)
+{
+    const krb5_creds *creds = item;
+
+    return hash_server(creds->server);
+}
+
+static void
+free_shadow(krb5_context context, struct fcc_shadow *sh)
+{
+    size_t i;
+
+    if (sh == NULL)
+        return;
+    for (i = 0; i < sh->ncreds; i++)
+        krb5_free_cred_contents(context, &sh->creds[i]);
+    free(sh->creds);
+    k5_file_index_free_contents(&sh->ix);
+    free(sh);
+}
+
+/* Read the non-removed credentials in filename into a new shadow. */
+static krb5_error_code
+load_shadow(krb5_context context, const char *filename,
+            struct fcc_shadow **shadow_out)
+{
+    krb5_error_code ret;
+    struct fcc_shadow *sh;
+    struct stat sb;
+    struct k5buf buf;
+    struct k5_cred_view view;
+    krb5_principal princ = NULL;
+    krb5_creds *newcreds;
+    size_t maxsize, space = 0;
+    FILE *fp = NULL;
+    int version;
+
+    *shadow_out = NULL;
+    k5_buf_init_dynamic_zap(&buf);
+
+    sh = k5alloc(sizeof(*sh), &ret);
+    if (sh == NULL)
+        goto cleanup;
+    sh->ix.filename = k5memdup0(filename, strlen(filename), &ret);
+    if (sh->ix.filename == NULL)
+        goto cleanup;
+#ifndef _WIN32
+    sh->euid = geteuid();
+#endif
+
+    ret = open_cache_file(context, filename, FALSE, &fp);
+    if (ret)
+        goto cleanup;
+    if (fstat(fileno(fp), &sb) == -1) {
+        ret = interpret_errno(context, errno);
+        goto cleanup;
+    }
+    if (sb.st_size > SHADOW_MAX_FILE_SIZE) {
+        ret = EFBIG;
+        goto cleanup;
+    }
+    k5_file_stamp_get(&sb, &sh->ix.stamp);
+    maxsize = sb.st_size;
+
+    ret = read_header(context, fp, &version, &sh->dt);
+    if (ret)
+        goto cleanup;
+    ret = read_principal(context, fp, version, &princ);
+    if (ret)
+        goto cleanup;
+
+    for (;;) {
+        if (sh->ncreds == space) {
+            space = (space == 0) ? 16 : space * 2;
+            newcreds = realloc(sh->creds, space * sizeof(*sh->creds));
+            if (newcreds == NULL) {
+                ret = ENOMEM;
+                goto cleanup;
+            }
+            sh->creds = newcreds;
+        }
+
+        k5_buf_truncate(&buf, 0);
+        ret = load_cred(context, fp, version, maxsize, &buf);
+        if (ret == KRB5_CC_END)
+            break;
+        if (!ret)
+            ret = k5_buf_status(&buf);
+        if (ret)
+            goto cleanup;
+        ret = k5_unmarshal_cred_view(buf.data, buf.len, version, &view);
+        if (ret)
+            goto cleanup;
+        if (cred_removed(&view.times))
+            continue;
+        ret = k5_unmarshal_cred(buf.data, buf.len, version,
+                                &sh->creds[sh->ncreds]);
+        if (ret)
+            goto cleanup;
+        sh->ncreds++;
+    }
+
+    ret = k5_file_index_build(&sh->ix, sh->creds, sh->ncreds,
+                              sizeof(*sh->creds), hash_cred);
+    if (ret)
+        goto cleanup;
+    *shadow_out = sh;
+    sh = NULL;
+
+cleanup:
+    (void)close_cache_file(context, fp);
+    krb5_free_principal(context, princ);
+    k5_buf_free(&buf);
+    free_shadow(context, sh);
+    return ret;
+}
+
+/* Unlink and return the shadow for filename, if there is one.  The caller
+ * must hold krb5int_cc_file_mutex. */
+static struct fcc_shadow *
+unlink_shadow(const char *filename)
+{
+    return (struct fcc_shadow *)k5_file_index_unlink(&shadow_list, filename);
+}
+
+/* Discard any shadow of filename, after it has been reinitialized or
+ * destroyed. */
+static void
+drop_shadow(krb5_context context, const char *filename)
+{
+    struct fcc_shadow *sh;
+
+    k5_cc_mutex_lock(context, &krb5int_cc_file_mutex);
+    sh = unlink_shadow(filename);
+    k5_cc_mutex_unlock(context, &krb5int_cc_file_mutex);
+    free_shadow(context, sh);
+}
+
+/* Add sh to the front of the shadow list, evicting the least recently used
+ * shadow if the list is full.  Return the evicted shadow, which the caller
+ * should free after releasing krb5int_cc_file_mutex. */
+static struct fcc_shadow *
+add_shadow(struct fcc_shadow *sh)
+{
+    return (struct fcc_shadow *)k5_file_index_add(&shadow_list, &sh->ix,
+                                                  SHADOW_MAX_FILES);
+}
+
+/* Search sh for a credential matching mcreds.  The caller must hold
+ * krb5int_cc_file_mutex. */
+static krb5_error_code
+search_shadow(krb5_context context, struct fcc_shadow *sh,
+              krb5_flags whichfields, krb5_creds *mcreds, krb5_creds *creds)
+{
+    size_t start, end;
+
+    set_deltatime(context, &sh->dt);
+    k5_file_index_bucket(&sh->ix, hash_server(mcreds->server), &start, &end);
+    return k5_cc_retrieve_cred_array(context, whichfields, mcreds,
+                                     sh->creds + start, end - start, creds);
+}
+
+/* Return true if sh was loaded with the caller's effective uid.  A process
+ * may switch its euid to read a ccache with a user's rights, so a shadow
+ * loaded under another identity must not be used. */
+static krb5_boolean
+shadow_owned(struct fcc_shadow *sh)
+{
+#ifndef _WIN32
+    return sh->euid == geteuid();
+#else
+    return TRUE;
+#endif
+}
+
+/*
+ * Search for a credential using a shadow of filename, loading the shadow if
+ * necessary.  Set *used_out to false, and return 0, if the search must
+ * instead be performed by reading the file.
+ */
+static krb5_error_code
+shadow_retrieve(krb5_context context, const char *filename,
+                krb5_flags whichfields, krb5_creds *mcreds, krb5_creds *creds,
+                krb5_boolean *used_out)
+{
+    krb5_error_code ret;
+    struct fcc_shadow *sh, *old;
+    struct k5_file_stamp stamp;
+    struct stat sb;
+
+    *used_out = FALSE;
+    if (stat(filename, &sb) != 0)
+        return 0;
+    k5_file_stamp_get(&sb, &stamp);
+    if (k5_file_stamp_settling(&stamp))
+        return 0;
+
+    /* Use an existing shadow if it is current. */
+    k5_cc_mutex_lock(context, &krb5int_cc_file_mutex);
+    sh = unlink_shadow(filename);
+    if (sh != NULL && k5_file_stamps_equal(&sh->ix.stamp, &stamp)) {
+        (void)add_shadow(sh);
+        if (!shadow_owned(sh)) {
+            /* Keep the shadow, but read the file with our own rights. */
+            k5_cc_mutex_unlock(context, &krb5int_cc_file_mutex);
+            return 0;
+        }
+        ret = search_shadow(context, sh, whichfields, mcreds, creds);
+        k5_cc_mutex_unlock(context, &krb5int_cc_file_mutex);
+        *used_out = TRUE;
+        return ret;
+    }
+    k5_cc_mutex_unlock(context, &krb5int_cc_file_mutex);
+    free_shadow(context, sh);
+
+    /* Load a new shadow without holding the mutex.  The file might have
+     * changed since we checked it, so check the stamp of the loaded shadow
+     * again. */
+    if (load_shadow(context, filename, &sh) != 0)
+        return 0;
+    if (k5_file_stamp_settling(&sh->ix.stamp)) {
+        free_shadow(context, sh);
+        return 0;
+    }
+
+    k5_cc_mutex_lock(context, &krb5int_cc_file_mutex);
+    old = unlink_shadow(filename);
+    if (old == NULL)
+        old = add_shadow(sh);
+    else
+        (void)add_shadow(sh);
+    ret = search_shadow(context, sh, whichfields, mcreds, creds);
+    k5_cc_mutex_unlock(context, &krb5int_cc_file_mutex);
+    free_shadow(context, old);
+    *used_out = TRUE;
+    return ret;
+}
+
+void
+k5_fcc_free_shadows(void)
+{
+    struct fcc_shadow *sh, *next;
+
+    for (sh = (struct fcc_shadow *)shadow_list; sh != NULL; sh = next) {
+        next = (struct fcc_shadow *)sh->ix.next;
+        free_shadow(NULL, sh);
+    }
+    shadow_list = NULL;
+}
+
+struct scan_state {
+    krb5_ccache id;
+    krb5_fcc_cursor *fcursor;
+    struct k5buf buf;
+};
+
+static krb5_error_code
+scan_next_view(krb5_context context, void *arg, struct k5_cred_view *view)
+{
+    struct scan_state *scan = arg;
+
+    return next_cred_view(context, scan->id, scan->fcursor, &scan->buf, view);
+}
+
+/* Search for a credential by reading the cache file, unmarshalling only
+ * matching entries. */
+static krb5_error_code
+scan_retrieve(krb5_context context, krb5_ccache id, krb5_flags whichfields,
+              krb5_creds *mcreds, krb5_creds *creds)
+{
+    krb5_error_code ret;
+    krb5_cc_cursor cursor;
+    struct scan_state scan;
+
+    ret = fcc_start_seq_get(context, id, &cursor);
+    if (ret)
+        return ret;
+    scan.id = id;
+    scan.fcursor = cursor;
+    k5_buf_init_dynamic_zap(&scan.buf);
+    ret = k5_cc_retrieve_cred_views(context, whichfields, mcreds,
+                                    scan_next_view, &scan, creds);
+    k5_buf_free(&scan.buf);
+    (void)fcc_end_seq_get(context, id, &cursor);
+    return ret;
+}
+
 /* Search for a credential within the cache file. */
 static krb5_error_code KRB5_CALLCONV
 fcc_retrieve(krb5_context context, krb5_ccache id, krb5_flags whichfields,
              krb5_creds *mcreds, krb5_creds *creds)
 {
     krb5_error_code ret;
+    fcc_data *data = id->data;
+    krb5_boolean used_shadow;
 
-    ret = k5_cc_retrieve_cred_default(context, id, whichfields, mcreds, creds);
-    return set_errmsg_filename(context, ret, ((fcc_data *)id->data)->filename);
+    ret = shadow_retrieve(context, data->filename, whichfields, mcreds, creds,
+                          &used_shadow);
+    if (!used_shadow)
+        ret = scan_retrieve(context, id, whichfields, mcreds, creds);
+    return set_errmsg_filename(context, ret, data->filename);
 }
 
 /* Store a credential in the cache file. */
@@ -989,7 +1386,7 @@ fcc_store(krb5_context context, krb5_ccache id, krb5_creds *creds)
     ret = open_cache_file(context, data->filename, TRUE, &fp);
     if (ret)
         goto cleanup;
-    ret = read_header(context, fp, &version);
+    ret = read_header(context, fp, &version, NULL);
     if (ret)
         goto cleanup;
 
@@ -1123,6 +1520,119 @@ cleanup:
     return ret;
 }
 
+#ifndef _WIN32
+
+/*
+ * Removed entries remain in the cache file, and must be read past by every
+ * scan.  When they occupy more than half of the space used by credentials
+ * (and at least COMPACT_MIN_DEAD bytes), rewrite the cache without them.  The
+ * compacted contents are written to a new file which is renamed over the
+ * cache file, so that iterators in progress continue to read the old contents
+ * and the file format remains unchanged.  Compaction is only an
+ * optimization, so failures are not reported.
+ */
+
+#define COMPACT_MIN_DEAD 4096
+
+static void
+compact_cache(krb5_context context, krb5_ccache cache)
+{
+    fcc_data *data = cache->data;
+    struct k5buf live = EMPTY_K5BUF, entry = EMPTY_K5BUF;
+    struct k5_cred_view view;
+    struct stat sb;
+    krb5_principal princ;
+    size_t maxsize, dead = 0;
+    long hdrlen;
+    ssize_t nwritten;
+    int version, nremoved = 0, fd = -1;
+    char *tmpname = NULL;
+    FILE *fp = NULL;
+
+    k5_cc_mutex_lock(context, &data->lock);
+    k5_buf_init_dynamic_zap(&live);
+    k5_buf_init_dynamic_zap(&entry);
+
+    /* Replacing a symlink or another user's file would change its meaning or
+     * ownership, so only compact regular files we own. */
+    if (lstat(data->filename, &sb) != 0 || !S_ISREG(sb.st_mode) ||
+        sb.st_uid != geteuid())
+        goto cleanup;
+
+    /* Lock the cache file against writers while we read it, and copy the
+     * header and default principal. */
+    if (open_cache_file(context, data->filename, TRUE, &fp) != 0)
+        goto cleanup;
+    if (read_header(context, fp, &version, NULL) != 0 ||
+        read_principal(context, fp, version, &princ) != 0)
+        goto cleanup;
+    krb5_free_principal(context, princ);
+    hdrlen = ftell(fp);
+    if (hdrlen == -1 || fseek(fp, 0, SEEK_SET) != 0 ||
+        get_size(context, fp, &maxsize) != 0 ||
+        load_bytes(context, fp, hdrlen, &live) != 0)
+        goto cleanup;
+
+    /* Copy the entries which have not been removed. */
+    for (;;) {
+        k5_buf_truncate(&entry, 0);
+        if (load_cred(context, fp, version, maxsize, &entry) != 0)
+            break;
+        if (k5_buf_status(&entry) != 0 ||
+            k5_unmarshal_cred_view(entry.data, entry.len, version,
+                                   &view) != 0)
+            goto cleanup;
+        if (cred_removed(&view.times)) {
+            dead += entry.len;
+            nremoved++;
+        } else {
+            k5_buf_add_len(&live, entry.data, entry.len);
+        }
+    }
+    if (k5_buf_status(&live) != 0 || dead < COMPACT_MIN_DEAD ||
+        dead <= live.len - hdrlen)
+        goto cleanup;
+
+    /* Write the compacted contents to a new file and rename it into place
+     * while still holding the lock on the old file. */
+    if (asprintf(&tmpname, "%s.XXXXXX", data->filename) < 0) {
+        tmpname = NULL;
+        goto cleanup;
+    }
+    fd = mkstemp(tmpname);
+    if (fd == -1)
+        goto cleanup;
+    set_cloexec_fd(fd);
+    if (fchmod(fd, S_IRUSR | S_IWUSR) != 0)
+        goto cleanup;
+    nwritten = write(fd, live.data, live.len);
+    if (nwritten < 0 || (size_t)nwritten != live.len)
+        goto cleanup;
+    if (close(fd) != 0) {
+        fd = -1;
+        goto cleanup;
+    }
+    fd = -1;
+    if (rename(tmpname, data->filename) != 0)
+        goto cleanup;
+    free(tmpname);
+    tmpname = NULL;
+    TRACE_CC_COMPACT(context, cache, nremoved);
+
+cleanup:
+    if (fd != -1)
+        close(fd);
+    if (tmpname != NULL)
+        (void)unlink(tmpname);
+    free(tmpname);
+    (void)close_cache_file(context, fp);
+    k5_buf_free(&live);
+    k5_buf_free(&entry);
+    k5_cc_mutex_unlock(context, &data->lock);
+}
+
+#endif /* not _WIN32 */
+
 /* Remove the given creds from the ccache file. */
 static krb5_error_code KRB5_CALLCONV
 fcc_remove_cred(krb5_context context, krb5_ccache cache, krb5_flags flags,
@@ -1131,25 +1641,41 @@ fcc_remove_cred(krb5_context context, krb5_ccache cache, krb5_flags flags,
     krb5_error_code ret;
     krb5_cc_cursor cursor;
     krb5_creds cur;
+    struct k5buf buf;
+    struct k5_cred_view view;
+    krb5_boolean any_removed = FALSE;
 
-    ret = krb5_cc_start_seq_get(context, cache, &cursor);
+    ret = fcc_start_seq_get(context, cache, &cursor);
     if (ret)
         return ret;
+    k5_buf_init_dynamic_zap(&buf);
 
     for (;;) {
-        ret = krb5_cc_next_cred(context, cache, &cursor, &cur);
+        ret = next_cred_view(context, cache, cursor, &buf, &view);
         if (ret)
             break;
+        if (!k5_cc_view_match_request(context, flags, creds, &view))
+            continue;
 
-        if (krb5int_cc_creds_match_request(context, flags, creds, &cur))
-            ret = delete_cred(context, cache, &cursor, &cur);
+        ret = k5_unmarshal_cred(view.data, view.len, view.version, &cur);
+        if (ret)
+            break;
+        ret = delete_cred(context, cache, &cursor, &cur);
+        any_removed = TRUE;
         krb5_free_cred_contents(context, &cur);
         if (ret)
             break;
     }
 
-    krb5_cc_end_seq_get(context, cache, &cursor);
-    return (ret == KRB5_CC_END) ? 0 : ret;
+    k5_buf_free(&buf);
+    (void)fcc_end_seq_get(context, cache, &cursor);
+    if (ret != KRB5_CC_END)
+        return ret;
+#ifndef _WIN32
+    if (any_removed)
+        compact_cache(context, cache);
+#endif
+    return 0;
 }
 
 static krb5_error_code KRB5_CALLCONV
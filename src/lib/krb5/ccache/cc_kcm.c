@@ -42,6 +42,7 @@
 #include "k5-input.h"
 #include "cc-int.h"
 #include "kcm.h"
+#include "../krb/int-proto.h"
 #include "../os/os-proto.h"
 #include <sys/socket.h>
 #include <sys/un.h>
@@ -53,6 +54,10 @@
 
 #define MAX_REPLY_SIZE (10 * 1024 * 1024)
 
+/* The maximum number of requests we send before reading their replies, when
+ * fetching credentials one at a time. */
+#define MAX_PIPELINE 16
+
 const krb5_cc_ops krb5_kcm_ops;
 
 struct uuid_list {
@@ -66,6 +71,19 @@ struct kcmio {
 #ifdef __APPLE__
     mach_port_t mport;
 #endif
+    krb5_boolean no_cred_list;  /* daemon lacks KCM_OP_GET_CRED_LIST */
+    krb5_boolean reused;        /* idle connection not yet used again */
+};
+
+/* A credential cursor holds credentials which have been fetched from the
+ * daemon but not yet returned.  If the daemon supports KCM_OP_GET_CRED_LIST,
+ * all of the credentials are fetched at once; otherwise they are fetched by
+ * UUID in batches of up to MAX_PIPELINE. */
+struct kcm_cursor {
+    struct uuid_list *uuids;    /* NULL if the creds were fetched in bulk */
+    krb5_creds *creds;
+    size_t count;
+    size_t pos;
 };
 
 /* This structure bundles together a KCM request and reply, to minimize how
@@ -280,23 +298,27 @@ cleanup:
     return ret;
 }
 
-/* Write a KCM request: 4-byte big-endian length, then the marshalled
- * request. */
+/* Write nreqs KCM requests, each as a 4-byte big-endian length followed by
+ * the marshalled request. */
 static krb5_error_code
-kcmio_unix_socket_write(krb5_context context, struct kcmio *io, void *request,
-                        size_t len)
+kcmio_unix_socket_write(krb5_context context, struct kcmio *io,
+                        struct kcmreq *reqs, size_t nreqs)
 {
-    char lenbytes[4];
-    sg_buf sg[2];
+    char lenbytes[MAX_PIPELINE][4];
+    sg_buf sg[MAX_PIPELINE * 2];
+    size_t i;
     int ret;
     krb5_boolean reconnected = FALSE;
 
-    SG_SET(&sg[0], lenbytes, sizeof(lenbytes));
-    SG_SET(&sg[1], request, len);
-    store_32_be(len, lenbytes);
+    assert(nreqs <= MAX_PIPELINE);
+    for (i = 0; i < nreqs; i++) {
+        store_32_be(reqs[i].reqbuf.len, lenbytes[i]);
+        SG_SET(&sg[i * 2], lenbytes[i], 4);
+        SG_SET(&sg[i * 2 + 1], reqs[i].reqbuf.data, reqs[i].reqbuf.len);
+    }
 
     for (;;) {
-        ret = krb5int_net_writev(context, io->fd, sg, 2);
+        ret = krb5int_net_writev(context, io->fd, sg, nreqs * 2);
         if (ret >= 0)
             return 0;
         ret = errno;
@@ -311,7 +333,8 @@ kcmio_unix_socket_write(krb5_context context, struct kcmio *io, void *request,
          * always listen for connections on the socket during upgrades, or a
          * single reconnect attempt won't be robust.
          */
-        close(io->fd);
+        closesocket(io->fd);
+        io->fd = INVALID_SOCKET;
         ret = kcmio_unix_socket_connect(context, io);
         if (ret)
             return ret;
@@ -361,6 +384,50 @@ kcmio_unix_socket_read(krb5_context context, struct kcmio *io,
     return 0;
 }
 
+/* Replace io's socket with a new connection, after an error which may have
+ * left unread replies on the old one.  Leave io->fd invalid if we can't
+ * reconnect. */
+static void
+kcmio_unix_socket_reset(krb5_context context, struct kcmio *io)
+{
+    if (io->fd != INVALID_SOCKET)
+        closesocket(io->fd);
+    io->fd = INVALID_SOCKET;
+    (void)kcmio_unix_socket_connect(context, io);
+}
+
+/*
+ * Write nreqs KCM requests and read the reply to the first one.  If io is an
+ * idle connection being reused, the daemon may have closed it in the meantime
+ * (sssd-kcm drops idle clients), which we might only notice when reading the
+ * reply; in that case reconnect and try once more.
+ */
+static krb5_error_code
+kcmio_unix_socket_begin(krb5_context context, struct kcmio *io,
+                        struct kcmreq *reqs, size_t nreqs, size_t *len_out)
+{
+    krb5_error_code ret;
+    krb5_boolean retry = io->reused;
+
+    io->reused = FALSE;
+    for (;;) {
+        ret = kcmio_unix_socket_write(context, io, reqs, nreqs);
+        if (ret == 0) {
+            ret = kcmio_unix_socket_read(context, io, &reqs[0].reply_mem,
+                                         len_out);
+        }
+        if (ret == 0 || !retry ||
+            (ret != EPIPE && ret != ECONNRESET && ret != KRB5_CC_IO))
+            return ret;
+        retry = FALSE;
+        kcmio_unix_socket_reset(context, io);
+        if (io->fd == INVALID_SOCKET)
+            return ret;
+    }
+}
+
+/* Get a connection to the KCM daemon, reusing the idle connection saved in
+ * context if there is one. */
 static krb5_error_code
 kcmio_connect(krb5_context context, struct kcmio **io_out)
 {
@@ -368,6 +435,13 @@ kcmio_connect(krb5_context context, struct kcmio **io_out)
     struct kcmio *io;
 
     *io_out = NULL;
+    if (context->kcm_idle_io != NULL) {
+        *io_out = context->kcm_idle_io;
+        (*io_out)->reused = TRUE;
+        context->kcm_idle_io = NULL;
+        return 0;
+    }
+
     io = calloc(1, sizeof(*io));
     if (io == NULL)
         return ENOMEM;
@@ -386,6 +460,18 @@ kcmio_connect(krb5_context context, struct kcmio **io_out)
     return 0;
 }
 
+/* Set up req->reply to read the marshalled reply of length reply_len in
+ * req->reply_mem, and return the status code at its start. */
+static krb5_error_code
+kcmreq_begin_reply(struct kcmreq *req, size_t reply_len)
+{
+    krb5_error_code ret;
+
+    k5_input_init(&req->reply, req->reply_mem, reply_len);
+    ret = k5_input_get_uint32_be(&req->reply);
+    return req->reply.status ? KRB5_KCM_MALFORMED_REPLY : ret;
+}
+
 /* Check req->reqbuf for an error condition and return it.  Otherwise, send the
  * request to the KCM daemon and get a response. */
 static krb5_error_code
@@ -398,11 +484,7 @@ kcmio_call(krb5_context context, struct kcmio *io, struct kcmreq *req)
         return ENOMEM;
 
     if (io->fd != INVALID_SOCKET) {
-        ret = kcmio_unix_socket_write(context, io, req->reqbuf.data,
-                                      req->reqbuf.len);
-        if (ret)
-            return ret;
-        ret = kcmio_unix_socket_read(context, io, &req->reply_mem, &reply_len);
+        ret = kcmio_unix_socket_begin(context, io, req, 1, &reply_len);
         if (ret)
             return ret;
     } else {
@@ -413,10 +495,53 @@ kcmio_call(krb5_context context, struct kcmio *io, struct kcmreq *req)
             return ret;
     }
 
-    /* Read the status code from the marshalled reply. */
-    k5_input_init(&req->reply, req->reply_mem, reply_len);
-    ret = k5_input_get_uint32_be(&req->reply);
-    return req->reply.status ? KRB5_KCM_MALFORMED_REPLY : ret;
+    return kcmreq_begin_reply(req, reply_len);
+}
+
+/*
+ * Send nreqs requests to the KCM daemon and get their responses, placing the
+ * status code of each reply in the corresponding element of codes.  When
+ * using a Unix domain socket, write all of the requests before reading any
+ * replies, so that the requests cost one round trip instead of nreqs.  Return
+ * an error only if the requests could not be sent or the replies could not be
+ * read.
+ */
+static krb5_error_code
+kcmio_call_pipelined(krb5_context context, struct kcmio *io,
+                     struct kcmreq *reqs, size_t nreqs,
+                     krb5_error_code *codes)
+{
+    krb5_error_code ret;
+    size_t i, reply_len;
+
+    if (io->fd == INVALID_SOCKET) {
+        /* Mach RPC requests can't be pipelined. */
+        for (i = 0; i < nreqs; i++)
+            codes[i] = kcmio_call(context, io, &reqs[i]);
+        return 0;
+    }
+
+    for (i = 0; i < nreqs; i++) {
+        if (k5_buf_status(&reqs[i].reqbuf) != 0)
+            return ENOMEM;
+    }
+
+    for (i = 0; i < nreqs; i++) {
+        if (i == 0) {
+            ret = kcmio_unix_socket_begin(context, io, reqs, nreqs,
+                                          &reply_len);
+        } else {
+            ret = kcmio_unix_socket_read(context, io, &reqs[i].reply_mem,
+                                         &reply_len);
+        }
+        if (ret) {
+            /* Don't leave the remaining replies for the next caller. */
+            kcmio_unix_socket_reset(context, io);
+            return ret;
+        }
+        codes[i] = kcmreq_begin_reply(&reqs[i], reply_len);
+    }
+    return 0;
 }
 
 static void
@@ -430,6 +555,29 @@ kcmio_close(struct kcmio *io)
     }
 }
 
+/* Release io, keeping it in context for reuse if there is no idle connection
+ * there already.  This avoids reconnecting to the daemon for each cache handle
+ * when a program opens caches one after another.  Only socket connections are
+ * kept; looking up a Mach RPC port is cheap, and an invalid socket may be the
+ * result of a failed reconnect. */
+static void
+kcmio_release(krb5_context context, struct kcmio *io)
+{
+    if (io == NULL)
+        return;
+    if (context->kcm_idle_io == NULL && io->fd != INVALID_SOCKET)
+        context->kcm_idle_io = io;
+    else
+        kcmio_close(io);
+}
+
+void
+k5_kcm_free_context(krb5_context context)
+{
+    kcmio_close(context->kcm_idle_io);
+    context->kcm_idle_io = NULL;
+}
+
 /* Fetch a zero-terminated name string from req->reply.  The returned pointer
  * is an alias and must not be freed by the caller. */
 static krb5_error_code
@@ -681,7 +829,7 @@ kcm_close(krb5_context context, krb5_ccache cache)
     struct kcm_cache_data *data = cache->data;
 
     k5_cc_mutex_destroy(&data->lock);
-    kcmio_close(data->io);
+    kcmio_release(context, data->io);
     free(data->residual);
     free(data);
     free(cache);
@@ -714,14 +862,6 @@ kcm_store(krb5_context context, krb5_ccache cache, krb5_creds *cred)
     return ret;
 }
 
-static krb5_error_code KRB5_CALLCONV
-kcm_retrieve(krb5_context context, krb5_ccache cache, krb5_flags flags,
-             krb5_creds *mcred, krb5_creds *cred_out)
-{
-    /* There is a KCM opcode for retrieving creds, but Heimdal's client doesn't
-     * use it.  It causes the KCM daemon to actually make a TGS request. */
-    return k5_cc_retrieve_cred_default(context, cache, flags, mcred, cred_out);
-}
 
 static krb5_error_code KRB5_CALLCONV
 kcm_get_princ(krb5_context context, krb5_ccache cache,
@@ -747,61 +887,274 @@ kcm_get_princ(krb5_context context, krb5_ccache cache,
     return map_invalid(ret);
 }
 
+/* Return true if code is an error which a KCM daemon might return for an
+ * opcode it doesn't implement.  Heimdal's daemon returns KRB5_FCC_INTERNAL,
+ * and sssd's returns KRB5_CC_IO. */
+static krb5_boolean
+unsupported_op_error(krb5_error_code code)
+{
+    return code == KRB5_FCC_INTERNAL || code == KRB5_CC_IO ||
+        code == KRB5_CC_NOSUPP;
+}
+
+/* Free the credentials in cursor which have not yet been returned. */
+static void
+free_cursor_creds(krb5_context context, struct kcm_cursor *cursor)
+{
+    for (; cursor->pos < cursor->count; cursor->pos++)
+        krb5_free_cred_contents(context, &cursor->creds[cursor->pos]);
+    cursor->pos = cursor->count = 0;
+}
+
+/* Fetch a credential list from req->reply into cursor. */
+static krb5_error_code
+kcmreq_get_cred_list(struct kcmreq *req, struct kcm_cursor *cursor)
+{
+    krb5_error_code ret;
+    struct k5input *in = &req->reply;
+    const unsigned char *bytes;
+    uint32_t count, len;
+
+    count = k5_input_get_uint32_be(in);
+    /* Each credential takes at least four bytes for its length. */
+    if (in->status || count > in->len / 4)
+        return KRB5_KCM_MALFORMED_REPLY;
+    cursor->creds = k5calloc(count, sizeof(*cursor->creds), &ret);
+    if (cursor->creds == NULL)
+        return ret;
+
+    while (cursor->count < count) {
+        len = k5_input_get_uint32_be(in);
+        bytes = k5_input_get_bytes(in, len);
+        if (in->status)
+            return KRB5_KCM_MALFORMED_REPLY;
+        ret = k5_unmarshal_cred(bytes, len, 4, &cursor->creds[cursor->count]);
+        if (ret)
+            return map_invalid(ret);
+        cursor->count++;
+    }
+    return 0;
+}
+
+/* Fetch the next batch of credentials listed in cursor->uuids, sending the
+ * requests together.  Skip credentials which have been removed since the list
+ * was made. */
+static krb5_error_code
+fetch_cred_batch(krb5_context context, krb5_ccache cache,
+                 struct kcm_cursor *cursor)
+{
+    krb5_error_code ret, codes[MAX_PIPELINE];
+    struct kcm_cache_data *data = cache->data;
+    struct uuid_list *uuids = cursor->uuids;
+    struct kcmreq reqs[MAX_PIPELINE];
+    krb5_creds *cred;
+    size_t i, n;
+
+    free_cursor_creds(context, cursor);
+    n = uuids->count - uuids->pos;
+    if (n > MAX_PIPELINE)
+        n = MAX_PIPELINE;
+    for (i = 0; i < n; i++) {
+        kcmreq_init(&reqs[i], KCM_OP_GET_CRED_BY_UUID, cache);
+        k5_buf_add_len(&reqs[i].reqbuf,
+                       uuids->uuidbytes + (uuids->pos + i) * KCM_UUID_LEN,
+                       KCM_UUID_LEN);
+    }
+    uuids->pos += n;
+
+    k5_cc_mutex_lock(context, &data->lock);
+    ret = kcmio_call_pipelined(context, data->io, reqs, n, codes);
+    k5_cc_mutex_unlock(context, &data->lock);
+    if (ret)
+        goto cleanup;
+
+    for (i = 0; i < n; i++) {
+        if (codes[i] == KRB5_CC_END)
+            continue;
+        ret = map_invalid(codes[i]);
+        if (ret)
+            goto cleanup;
+        cred = &cursor->creds[cursor->count];
+        ret = k5_unmarshal_cred(reqs[i].reply.ptr, reqs[i].reply.len, 4,
+                                cred);
+        if (ret) {
+            ret = map_invalid(ret);
+            goto cleanup;
+        }
+        cursor->count++;
+    }
+
+cleanup:
+    if (ret)
+        free_cursor_creds(context, cursor);
+    for (i = 0; i < n; i++)
+        kcmreq_free(&reqs[i]);
+    return ret;
+}
+
+static void
+free_cursor(krb5_context context, struct kcm_cursor *cursor)
+{
+    if (cursor == NULL)
+        return;
+    free_cursor_creds(context, cursor);
+    free(cursor->creds);
+    free_uuid_list(cursor->uuids);
+    free(cursor);
+}
+
+/* Position within a KCM_OP_GET_CRED_LIST reply being scanned for a
+ * matching credential. */
+struct list_scan {
+    struct k5input in;
+    uint32_t count;
+};
+
+static krb5_error_code
+list_next_view(krb5_context context, void *arg, struct k5_cred_view *view)
+{
+    struct list_scan *scan = arg;
+    const unsigned char *bytes;
+    uint32_t len;
+
+    if (scan->count == 0)
+        return KRB5_CC_END;
+    scan->count--;
+    len = k5_input_get_uint32_be(&scan->in);
+    bytes = k5_input_get_bytes(&scan->in, len);
+    if (scan->in.status)
+        return KRB5_KCM_MALFORMED_REPLY;
+    return map_invalid(k5_unmarshal_cred_view(bytes, len, 4, view));
+}
+
+static krb5_error_code KRB5_CALLCONV
+kcm_retrieve(krb5_context context, krb5_ccache cache, krb5_flags flags,
+             krb5_creds *mcred, krb5_creds *cred_out)
+{
+    krb5_error_code ret;
+    struct kcmreq req = EMPTY_KCMREQ;
+    struct kcm_cache_data *data = cache->data;
+    struct list_scan scan;
+
+    /* There is a KCM opcode for retrieving creds, but Heimdal's client doesn't
+     * use it.  It causes the KCM daemon to actually make a TGS request.
+     * Instead, fetch all of the creds in one request and match them within
+     * the reply, unmarshalling only the one we return. */
+    get_kdc_offset(context, cache);
+    k5_cc_mutex_lock(context, &data->lock);
+    ret = KRB5_CC_NOSUPP;
+    if (!data->io->no_cred_list) {
+        kcmreq_init(&req, KCM_OP_GET_CRED_LIST, cache);
+        ret = kcmio_call(context, data->io, &req);
+        if (unsupported_op_error(ret))
+            data->io->no_cred_list = TRUE;
+    }
+    k5_cc_mutex_unlock(context, &data->lock);
+    if (unsupported_op_error(ret)) {
+        /* Iterate using the cursor, which fetches creds in batches. */
+        ret = k5_cc_retrieve_cred_default(context, cache, flags, mcred,
+                                          cred_out);
+        goto cleanup;
+    }
+    if (ret)
+        goto cleanup;
+
+    scan.in = req.reply;
+    scan.count = k5_input_get_uint32_be(&scan.in);
+    if (scan.in.status) {
+        ret = KRB5_KCM_MALFORMED_REPLY;
+        goto cleanup;
+    }
+    ret = k5_cc_retrieve_cred_views(context, flags, mcred, list_next_view,
+                                    &scan, cred_out);
+
+cleanup:
+    kcmreq_free(&req);
+    return ret;
+}
+
 static krb5_error_code KRB5_CALLCONV
 kcm_start_seq_get(krb5_context context, krb5_ccache cache,
                   krb5_cc_cursor *cursor_out)
 {
     krb5_error_code ret;
     struct kcmreq req = EMPTY_KCMREQ;
-    struct uuid_list *uuids;
+    struct kcm_cache_data *data = cache->data;
+    struct kcm_cursor *cursor;
 
     *cursor_out = NULL;
 
     get_kdc_offset(context, cache);
 
+    cursor = k5alloc(sizeof(*cursor), &ret);
+    if (cursor == NULL)
+        return ret;
+
+    /* Fetch all of the creds in one request if the daemon supports it. */
+    k5_cc_mutex_lock(context, &data->lock);
+    ret = KRB5_CC_NOSUPP;
+    if (!data->io->no_cred_list) {
+        kcmreq_init(&req, KCM_OP_GET_CRED_LIST, cache);
+        ret = kcmio_call(context, data->io, &req);
+        if (unsupported_op_error(ret))
+            data->io->no_cred_list = TRUE;
+    }
+    k5_cc_mutex_unlock(context, &data->lock);
+    if (!ret) {
+        ret = kcmreq_get_cred_list(&req, cursor);
+        goto cleanup;
+    }
+    if (!unsupported_op_error(ret))
+        goto cleanup;
+
+    /* Otherwise get the list of cred UUIDs, to be fetched in batches. */
+    kcmreq_free(&req);
     kcmreq_init(&req, KCM_OP_GET_CRED_UUID_LIST, cache);
     ret = cache_call(context, cache, &req);
     if (ret)
         goto cleanup;
-    ret = kcmreq_get_uuid_list(&req, &uuids);
+    ret = kcmreq_get_uuid_list(&req, &cursor->uuids);
     if (ret)
         goto cleanup;
-    *cursor_out = (krb5_cc_cursor)uuids;
+    cursor->creds = k5calloc(MAX_PIPELINE, sizeof(*cursor->creds), &ret);
 
 cleanup:
+    if (ret)
+        free_cursor(context, cursor);
+    else
+        *cursor_out = (krb5_cc_cursor)cursor;
     kcmreq_free(&req);
     return ret;
 }
 
 static krb5_error_code KRB5_CALLCONV
-kcm_next_cred(krb5_context context, krb5_ccache cache, krb5_cc_cursor *cursor,
-              krb5_creds *cred_out)
+kcm_next_cred(krb5_context context, krb5_ccache cache,
+              krb5_cc_cursor *cursor_ptr, krb5_creds *cred_out)
 {
     krb5_error_code ret;
-    struct kcmreq req;
-    struct uuid_list *uuids = (struct uuid_list *)*cursor;
+    struct kcm_cursor *cursor = (struct kcm_cursor *)*cursor_ptr;
 
     memset(cred_out, 0, sizeof(*cred_out));
 
-    if (uuids->pos >= uuids->count)
+    while (cursor->pos >= cursor->count && cursor->uuids != NULL &&
+           cursor->uuids->pos < cursor->uuids->count) {
+        ret = fetch_cred_batch(context, cache, cursor);
+        if (ret)
+            return ret;
+    }
+    if (cursor->pos >= cursor->count)
         return KRB5_CC_END;
 
-    kcmreq_init(&req, KCM_OP_GET_CRED_BY_UUID, cache);
-    k5_buf_add_len(&req.reqbuf, uuids->uuidbytes + (uuids->pos * KCM_UUID_LEN),
-                   KCM_UUID_LEN);
-    uuids->pos++;
-    ret = cache_call(context, cache, &req);
-    if (!ret)
-        ret = k5_unmarshal_cred(req.reply.ptr, req.reply.len, 4, cred_out);
-    kcmreq_free(&req);
-    return map_invalid(ret);
+    /* Transfer ownership of the cred contents to the caller. */
+    *cred_out = cursor->creds[cursor->pos++];
+    return 0;
 }
 
 static krb5_error_code KRB5_CALLCONV
 kcm_end_seq_get(krb5_context context, krb5_ccache cache,
                 krb5_cc_cursor *cursor)
 {
-    free_uuid_list((struct uuid_list *)*cursor);
+    free_cursor(context, (struct kcm_cursor *)*cursor);
     *cursor = NULL;
     return 0;
 }
@@ -1009,7 +1362,7 @@ kcm_ptcursor_free(krb5_context context, krb5_cc_ptcursor *cursor)
 
     free(data->residual);
     free_uuid_list(data->uuids);
-    kcmio_close(data->io);
+    kcmio_release(context, data->io);
     free(data);
     free(*cursor);
     *cursor = NULL;
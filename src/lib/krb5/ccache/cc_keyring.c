@@ -80,7 +80,9 @@
  * anchor keyring.  The keys within a keyring collection are links to cache
  * keyrings, plus a link to one user key named "krb_ccache:primary" which
  * contains a serialized representation of the collection version (currently 1)
- * and the primary name of the collection.
+ * and the primary name of the collection.  A collection may also contain a
+ * user key named "krb_ccache:index" holding a principal index of its caches
+ * (see ccindex.c).
  *
  * Cache keyrings contain one user key per credential which contains a
  * serialized representation of the credential.  There is also one user key
@@ -169,6 +171,12 @@ debug_print(char *fmt, ...)
  */
 #define KRCC_COLLECTION_PRIMARY "krb_ccache:primary"
 
+/*
+ * This name identifies the key containing the principal index of the caches
+ * within a collection.
+ */
+#define KRCC_COLLECTION_INDEX "krb_ccache:index"
+
 /*
  * If the library context does not specify a keyring collection, unique ccaches
  * will be created within this collection.
@@ -569,6 +577,81 @@ parse_index(krb5_context context, int32_t *version, char **primary,
     return (*primary == NULL) ? ret : 0;
 }
 
+/* Read the principal index of collection_id into *index_out. */
+static krb5_error_code
+read_index(key_serial_t collection_id, struct k5_ccindex *index_out)
+{
+    krb5_error_code ret;
+    key_serial_t key;
+    void *payload;
+    int psize;
+
+    key = keyctl_search(collection_id, KRCC_KEY_TYPE_USER,
+                        KRCC_COLLECTION_INDEX, 0);
+    if (key == -1)
+        return k5_ccindex_parse("", 0, index_out);
+    psize = keyctl_read_alloc(key, &payload);
+    if (psize == -1)
+        return errno;
+    ret = k5_ccindex_parse(payload, psize, index_out);
+    free(payload);
+    return ret;
+}
+
+/* Write the principal index of collection_id if it has changed, and free
+ * it. */
+static krb5_error_code
+write_index(key_serial_t collection_id, struct k5_ccindex *index)
+{
+    krb5_error_code ret = 0;
+    struct k5buf buf;
+    key_serial_t key;
+
+    if (index->changed) {
+        k5_buf_init_dynamic(&buf);
+        k5_ccindex_marshal(index, &buf);
+        ret = k5_buf_status(&buf);
+        if (ret == 0 && buf.len == 0) {
+            /* User keys can't be empty, so unlink the key instead. */
+            key = keyctl_search(collection_id, KRCC_KEY_TYPE_USER,
+                                KRCC_COLLECTION_INDEX, 0);
+            if (key != -1 && keyctl_unlink(key, collection_id) == -1)
+                ret = errno;
+        } else if (ret == 0) {
+            key = add_key(KRCC_KEY_TYPE_USER, KRCC_COLLECTION_INDEX, buf.data,
+                          buf.len, collection_id);
+            if (key == -1)
+                ret = errno;
+        }
+        k5_buf_free(&buf);
+    }
+    k5_ccindex_free(index);
+    return ret;
+}
+
+/*
+ * Update the index entry for the cache described by data.  If princ is NULL,
+ * remove the entry; otherwise set it to princ and expiry.  Errors are not
+ * reported, since the index is only a hint.
+ */
+static void
+update_index(krb5_context context, krcc_data *data,
+             krb5_const_principal princ, krb5_timestamp expiry)
+{
+    struct k5_ccindex index;
+    const char *p, *cache_name;
+
+    p = strrchr(data->name, ':');
+    cache_name = (p != NULL) ? p + 1 : data->name;
+    if (read_index(data->collection_id, &index) != 0)
+        return;
+    if (princ == NULL)
+        k5_ccindex_remove(&index, cache_name);
+    else
+        (void)k5_ccindex_set(context, &index, cache_name, princ, expiry);
+    (void)write_index(data->collection_id, &index);
+}
+
 /*
  * Get or initialize the primary name within collection_id and set
  * *subsidiary_out to its value.  If initializing a legacy collection, look
@@ -807,8 +890,10 @@ krcc_initialize(krb5_context context, krb5_ccache id, krb5_principal princ)
                                 os_ctx->usec_offset);
     }
 
-    if (ret == 0)
+    if (ret == 0) {
+        update_index(context, data, princ, 0);
         krb5_change_cache();
+    }
 
 out:
     k5_cc_mutex_unlock(context, &data->lock);
@@ -872,6 +957,7 @@ krcc_destroy(krb5_context context, krb5_ccache id)
         /* If this is a legacy cache, unlink it from the session anchor. */
         if (is_legacy_cache_name(data->name))
             (void)keyctl_unlink(data->cache_id, session_write_anchor());
+        update_index(context, data, NULL, 0);
     }
 
     k5_cc_mutex_unlock(context, &data->lock);
@@ -1016,20 +1102,18 @@ krcc_start_seq_get(krb5_context context, krb5_ccache id,
     return 0;
 }
 
-/* Get the next credential from the cache keyring. */
-static krb5_error_code KRB5_CALLCONV
-krcc_next_cred(krb5_context context, krb5_ccache id, krb5_cc_cursor *cursor,
-               krb5_creds *creds)
+/* Read the payload of the next credential key in the cursor's list of keys
+ * into *payload_out (allocated) and *psize_out. */
+static krb5_error_code
+next_cred_payload(krcc_cursor krcursor, void **payload_out, int *psize_out)
 {
-    krcc_cursor krcursor;
-    krb5_error_code ret;
     int psize;
     void *payload = NULL;
 
-    memset(creds, 0, sizeof(krb5_creds));
+    *payload_out = NULL;
+    *psize_out = 0;
 
     /* The cursor has the entire list of keys. */
-    krcursor = *cursor;
     if (krcursor == NULL)
         return KRB5_CC_END;
 
@@ -1048,11 +1132,9 @@ krcc_next_cred(krb5_context context, krb5_ccache id, krb5_cc_cursor *cursor,
                                   &payload);
         if (psize != -1) {
             krcursor->currkey++;
-
-            /* Unmarshal the cred using the file ccache version 4 format. */
-            ret = k5_unmarshal_cred(payload, psize, 4, creds);
-            free(payload);
-            return ret;
+            *payload_out = payload;
+            *psize_out = psize;
+            return 0;
         } else if (errno != ENOKEY && errno != EACCES) {
             DEBUG_PRINT(("Error reading key %d: %s\n",
                          krcursor->keys[krcursor->currkey], strerror(errno)));
@@ -1068,6 +1150,27 @@ krcc_next_cred(krb5_context context, krb5_ccache id, krb5_cc_cursor *cursor,
     return KRB5_CC_END;
 }
 
+/* Get the next credential from the cache keyring. */
+static krb5_error_code KRB5_CALLCONV
+krcc_next_cred(krb5_context context, krb5_ccache id, krb5_cc_cursor *cursor,
+               krb5_creds *creds)
+{
+    krb5_error_code ret;
+    int psize;
+    void *payload;
+
+    memset(creds, 0, sizeof(krb5_creds));
+
+    ret = next_cred_payload(*cursor, &payload, &psize);
+    if (ret)
+        return ret;
+
+    /* Unmarshal the cred using the file ccache version 4 format. */
+    ret = k5_unmarshal_cred(payload, psize, 4, creds);
+    free(payload);
+    return ret;
+}
+
 /* Release an iteration cursor. */
 static krb5_error_code KRB5_CALLCONV
 krcc_end_seq_get(krb5_context context, krb5_ccache id, krb5_cc_cursor *cursor)
@@ -1236,14 +1339,47 @@ errout:
     return ret;
 }
 
-/* Search for a credential within the cache keyring. */
+/* State for scanning the cache keyring with views of each credential. */
+struct krcc_scan {
+    krcc_cursor krcursor;
+    void *payload;
+};
+
+static krb5_error_code
+scan_next_view(krb5_context context, void *arg, struct k5_cred_view *view)
+{
+    krb5_error_code ret;
+    struct krcc_scan *scan = arg;
+    int psize;
+
+    free(scan->payload);
+    ret = next_cred_payload(scan->krcursor, &scan->payload, &psize);
+    if (ret)
+        return ret;
+    return k5_unmarshal_cred_view(scan->payload, psize, 4, view);
+}
+
+/* Search for a credential within the cache keyring, unmarshalling only
+ * matching entries. */
 static krb5_error_code KRB5_CALLCONV
 krcc_retrieve(krb5_context context, krb5_ccache id,
               krb5_flags whichfields, krb5_creds *mcreds,
               krb5_creds *creds)
 {
-    return k5_cc_retrieve_cred_default(context, id, whichfields, mcreds,
-                                       creds);
+    krb5_error_code ret;
+    krb5_cc_cursor cursor;
+    struct krcc_scan scan;
+
+    ret = krcc_start_seq_get(context, id, &cursor);
+    if (ret)
+        return ret;
+    scan.krcursor = cursor;
+    scan.payload = NULL;
+    ret = k5_cc_retrieve_cred_views(context, whichfields, mcreds,
+                                    scan_next_view, &scan, creds);
+    free(scan.payload);
+    krcc_end_seq_get(context, id, &cursor);
+    return ret;
 }
 
 /* Remove a credential from the cache keyring. */
@@ -1254,21 +1390,27 @@ krcc_remove_cred(krb5_context context, krb5_ccache cache,
     krb5_error_code ret;
     krcc_data *data = cache->data;
     krb5_cc_cursor cursor;
-    krb5_creds c;
+    struct k5_cred_view view;
     krcc_cursor krcursor;
     key_serial_t key;
     krb5_boolean match;
+    int psize;
+    void *payload;
 
     ret = krcc_start_seq_get(context, cache, &cursor);
     if (ret)
         return ret;
 
     for (;;) {
-        ret = krcc_next_cred(context, cache, &cursor, &c);
+        ret = next_cred_payload(cursor, &payload, &psize);
+        if (ret)
+            break;
+        ret = k5_unmarshal_cred_view(payload, psize, 4, &view);
+        match = !ret && k5_cc_view_match_request(context, flags, creds,
+                                                 &view);
+        free(payload);
         if (ret)
             break;
-        match = krb5int_cc_creds_match_request(context, flags, creds, &c);
-        krb5_free_cred_contents(context, &c);
         if (match) {
             krcursor = cursor;
             key = krcursor->keys[krcursor->currkey - 1];
@@ -1348,6 +1490,9 @@ krcc_store(krb5_context context, krb5_ccache id, krb5_creds *creds)
 
     update_keyring_expiration(context, id);
 
+    if (k5_ccindex_local_tgt(creds))
+        update_index(context, data, creds->client, creds->times.endtime);
+
 errout:
     k5_buf_free(&buf);
     krb5_free_unparsed_name(context, keyname);
@@ -1680,6 +1825,118 @@ cleanup:
     return ret;
 }
 
+struct krcc_match_data {
+    key_serial_t collection_id;
+    const char *anchor_name;
+    const char *collection_name;
+};
+
+static krb5_error_code
+open_subsidiary(krb5_context context, void *arg, const char *subsidiary_name,
+                krb5_ccache *cache_out)
+{
+    struct krcc_match_data *md = arg;
+    key_serial_t cache_id;
+
+    cache_id = keyctl_search(md->collection_id, KRCC_KEY_TYPE_KEYRING,
+                             subsidiary_name, 0);
+    if (cache_id == -1)
+        return KRB5_FCC_NOFILE;
+    return make_cache(context, md->collection_id, cache_id, md->anchor_name,
+                      md->collection_name, subsidiary_name, cache_out);
+}
+
+static krb5_error_code
+list_subsidiaries(krb5_context context, void *arg, char ***names_out)
+{
+    struct krcc_match_data *md = arg;
+    krb5_error_code ret = ENOMEM;
+    const char *keytype = KRCC_KEY_TYPE_KEYRING ";", *sep;
+    char *description = NULL, **names = NULL;
+    key_serial_t *keys = NULL;
+    long size, i, count = 0;
+
+    *names_out = NULL;
+    size = keyctl_read_alloc(md->collection_id, (void **)&keys);
+    if (size == -1)
+        return errno;
+    names = calloc(size / sizeof(key_serial_t) + 1, sizeof(*names));
+    if (names == NULL)
+        goto cleanup;
+    for (i = 0; i < size / (long)sizeof(key_serial_t); i++) {
+        free(description);
+        description = NULL;
+
+        /* Look for keyrings, with descriptions of the form
+         * typename;UID;GID;permissions;description */
+        if (keyctl_describe_alloc(keys[i], &description) < 0)
+            continue;
+        sep = strrchr(description, ';');
+        if (sep == NULL || strncmp(description, keytype, strlen(keytype)) != 0)
+            continue;
+        names[count] = strdup(sep + 1);
+        if (names[count] == NULL)
+            goto cleanup;
+        count++;
+    }
+    *names_out = names;
+    names = NULL;
+    ret = 0;
+
+cleanup:
+    free(description);
+    free(keys);
+    k5_ccindex_free_names(names);
+    return ret;
+}
+
+/* Look up client in the index of the context's default keyring collection. */
+static krb5_error_code KRB5_CALLCONV
+krcc_match(krb5_context context, krb5_const_principal client,
+           krb5_ccache *cache_out)
+{
+    krb5_error_code ret;
+    struct krcc_match_data md;
+    struct k5_ccindex index;
+    char *anchor_name = NULL, *collection_name = NULL, *subsidiary_name = NULL;
+    char *primary_name = NULL;
+
+    *cache_out = NULL;
+
+    /* Let the caller scan if the default cache isn't a keyring collection. */
+    ret = get_default(context, &anchor_name, &collection_name,
+                      &subsidiary_name);
+    if (ret || anchor_name == NULL || subsidiary_name != NULL) {
+        ret = KRB5_CC_NOSUPP;
+        goto cleanup;
+    }
+
+    ret = get_collection(anchor_name, collection_name, &md.collection_id);
+    if (ret)
+        goto cleanup;
+    ret = get_primary_name(context, anchor_name, collection_name,
+                           md.collection_id, &primary_name);
+    if (ret)
+        goto cleanup;
+    ret = read_index(md.collection_id, &index);
+    if (ret)
+        goto cleanup;
+
+    md.anchor_name = anchor_name;
+    md.collection_name = collection_name;
+    ret = k5_ccindex_match(context, &index, primary_name, client,
+                           open_subsidiary, list_subsidiaries, &md,
+                           cache_out);
+    (void)write_index(md.collection_id, &index);
+
+cleanup:
+    free(anchor_name);
+    free(collection_name);
+    free(subsidiary_name);
+    free(primary_name);
+    return ret;
+}
+
 /*
  * ccache implementation storing credentials in the Linux keyring facility
  * The default is to put them at the session keyring level.
@@ -1712,6 +1969,7 @@ const krb5_cc_ops krb5_krcc_ops = {
     krcc_lock,
     krcc_unlock,
     krcc_switch_to,
+    krcc_match,
 };
 
 #else /* !USE_KEYRING_CCACHE */
@@ -1745,5 +2003,6 @@ const krb5_cc_ops krb5_krcc_ops = {
     NULL,
     NULL,
     NULL,
+    NULL,
 };
 #endif  /* USE_KEYRING_CCACHE */
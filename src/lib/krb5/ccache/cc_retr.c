@@ -193,62 +193,188 @@ krb5int_cc_creds_match_request(krb5_context context, krb5_flags whichfields,
     return TRUE;
 }
 
+krb5_boolean
+k5_cc_view_match_request(krb5_context context, krb5_flags whichfields,
+                         krb5_creds *mcreds, const struct k5_cred_view *view)
+{
+    krb5_boolean is_skey, nameonly;
+
+    nameonly = (whichfields & KRB5_TC_MATCH_SRV_NAMEONLY) != 0;
+    if (!k5_princ_view_eq(&view->client, mcreds->client, FALSE) ||
+        !k5_princ_view_eq(&view->server, mcreds->server, nameonly))
+        return FALSE;
+
+    is_skey = (whichfields & KRB5_TC_MATCH_IS_SKEY) ? mcreds->is_skey : FALSE;
+    if (view->is_skey != is_skey)
+        return FALSE;
+
+    if ((whichfields & KRB5_TC_MATCH_FLAGS_EXACT) &&
+        mcreds->ticket_flags != view->ticket_flags)
+        return FALSE;
+    if ((whichfields & KRB5_TC_MATCH_FLAGS) &&
+        (view->ticket_flags & mcreds->ticket_flags) != mcreds->ticket_flags)
+        return FALSE;
+
+    if ((whichfields & KRB5_TC_MATCH_TIMES_EXACT) &&
+        !times_match_exact(&mcreds->times, &view->times))
+        return FALSE;
+    if ((whichfields & KRB5_TC_MATCH_TIMES) &&
+        !times_match(&mcreds->times, &view->times))
+        return FALSE;
+
+    if ((whichfields & KRB5_TC_MATCH_AUTHDATA) &&
+        !k5_authdata_view_eq(view, mcreds->authdata))
+        return FALSE;
+
+    if ((whichfields & KRB5_TC_MATCH_2ND_TKT) &&
+        !data_eq(mcreds->second_ticket, view->second_ticket))
+        return FALSE;
+
+    if ((whichfields & KRB5_TC_MATCH_KTYPE) &&
+        mcreds->keyblock.enctype != view->enctype)
+        return FALSE;
+
+    return TRUE;
+}
+
+/*
+ * Return true if a matching credential with session key enctype enctype
+ * should replace the best match found so far.  If ktypes is not null, prefer
+ * matches whose enctype appears earliest in ktypes, updating *best_pref, and
+ * set *nomatch_err to KRB5_CC_NOT_KTYPE if a match is rejected because of its
+ * enctype.
+ */
+static krb5_boolean
+preferred(krb5_enctype enctype, int nktypes, krb5_enctype *ktypes,
+          krb5_boolean have_best, int *best_pref, krb5_error_code *nomatch_err)
+{
+    int p;
+
+    if (ktypes == NULL)
+        return !have_best;
+
+    p = pref(enctype, nktypes, ktypes);
+    if (p < 0) {
+        *nomatch_err = KRB5_CC_NOT_KTYPE;
+        return FALSE;
+    }
+    if (have_best && p >= *best_pref)
+        return FALSE;
+    *best_pref = p;
+    return TRUE;
+}
+
+/* Return true if creds matches mcreds according to whichfields and should
+ * replace the best match found so far, as determined by preferred(). */
+static krb5_boolean
+better_match(krb5_context context, krb5_flags whichfields, krb5_creds *mcreds,
+             krb5_creds *creds, int nktypes, krb5_enctype *ktypes,
+             krb5_boolean have_best, int *best_pref,
+             krb5_error_code *nomatch_err)
+{
+    if (!krb5int_cc_creds_match_request(context, whichfields, mcreds, creds))
+        return FALSE;
+    return preferred(creds->keyblock.enctype, nktypes, ktypes, have_best,
+                     best_pref, nomatch_err);
+}
+
 static krb5_error_code
 krb5_cc_retrieve_cred_seq (krb5_context context, krb5_ccache id,
                            krb5_flags whichfields, krb5_creds *mcreds,
                            krb5_creds *creds, int nktypes, krb5_enctype *ktypes)
 {
-    /* This function could be considerably faster if it kept indexing */
-    /* information.. sounds like a "next version" idea to me. :-) */
-
     krb5_cc_cursor cursor;
     krb5_error_code kret;
     krb5_error_code nomatch_err = KRB5_CC_NOTFOUND;
-    struct {
-        krb5_creds creds;
-        int pref;
-    } fetched, best;
-    int have_creds = 0;
-#define fetchcreds (fetched.creds)
+    krb5_creds fetched, best;
+    krb5_boolean have_creds = FALSE;
+    int best_pref = 0;
 
     kret = krb5_cc_start_seq_get(context, id, &cursor);
     if (kret != KRB5_OK)
         return kret;
 
-    while (krb5_cc_next_cred(context, id, &cursor, &fetchcreds) == KRB5_OK) {
-        if (krb5int_cc_creds_match_request(context, whichfields, mcreds, &fetchcreds))
-        {
-            if (ktypes) {
-                fetched.pref = pref (fetchcreds.keyblock.enctype,
-                                     nktypes, ktypes);
-                if (fetched.pref < 0)
-                    nomatch_err = KRB5_CC_NOT_KTYPE;
-                else if (!have_creds || fetched.pref < best.pref) {
-                    if (have_creds)
-                        krb5_free_cred_contents (context, &best.creds);
-                    else
-                        have_creds = 1;
-                    best = fetched;
-                    continue;
-                }
-            } else {
-                krb5_cc_end_seq_get(context, id, &cursor);
-                *creds = fetchcreds;
-                return KRB5_OK;
-            }
+    while (krb5_cc_next_cred(context, id, &cursor, &fetched) == KRB5_OK) {
+        if (better_match(context, whichfields, mcreds, &fetched, nktypes,
+                         ktypes, have_creds, &best_pref, &nomatch_err)) {
+            if (have_creds)
+                krb5_free_cred_contents(context, &best);
+            best = fetched;
+            have_creds = TRUE;
+            /* Without an enctype preference, the first match wins. */
+            if (ktypes == NULL)
+                break;
+        } else {
+            krb5_free_cred_contents(context, &fetched);
         }
-
-        /* This one doesn't match */
-        krb5_free_cred_contents(context, &fetchcreds);
     }
 
-    /* If we get here, a match wasn't found */
     krb5_cc_end_seq_get(context, id, &cursor);
-    if (have_creds) {
-        *creds = best.creds;
-        return KRB5_OK;
-    } else
+    if (!have_creds)
+        return nomatch_err;
+    *creds = best;
+    return KRB5_OK;
+}
+
+/* Search the array list of count credentials in order, and return a copy of
+ * the best match in *creds. */
+static krb5_error_code
+retrieve_cred_array(krb5_context context, krb5_flags whichfields,
+                    krb5_creds *mcreds, krb5_creds *list, size_t count,
+                    krb5_creds *creds, int nktypes, krb5_enctype *ktypes)
+{
+    krb5_error_code nomatch_err = KRB5_CC_NOTFOUND;
+    krb5_creds *best = NULL;
+    int best_pref = 0;
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        if (better_match(context, whichfields, mcreds, &list[i], nktypes,
+                         ktypes, best != NULL, &best_pref, &nomatch_err)) {
+            best = &list[i];
+            if (ktypes == NULL)
+                break;
+        }
+    }
+    if (best == NULL)
+        return nomatch_err;
+    return k5_copy_creds_contents(context, best, creds);
+}
+
+/* Search the credentials yielded by next_fn, unmarshalling only those which
+ * become the best match. */
+static krb5_error_code
+retrieve_cred_views(krb5_context context, krb5_flags whichfields,
+                    krb5_creds *mcreds, k5_cc_next_view_fn next_fn, void *arg,
+                    krb5_creds *creds, int nktypes, krb5_enctype *ktypes)
+{
+    krb5_error_code ret, nomatch_err = KRB5_CC_NOTFOUND;
+    struct k5_cred_view view;
+    krb5_creds best;
+    krb5_boolean have_best = FALSE;
+    int best_pref = 0;
+
+    while (next_fn(context, arg, &view) == 0) {
+        if (!k5_cc_view_match_request(context, whichfields, mcreds, &view) ||
+            !preferred(view.enctype, nktypes, ktypes, have_best, &best_pref,
+                       &nomatch_err))
+            continue;
+        if (have_best)
+            krb5_free_cred_contents(context, &best);
+        have_best = FALSE;
+        ret = k5_unmarshal_cred(view.data, view.len, view.version, &best);
+        if (ret)
+            return ret;
+        have_best = TRUE;
+        /* Without an enctype preference, the first match wins. */
+        if (ktypes == NULL)
+            break;
+    }
+
+    if (!have_best)
         return nomatch_err;
+    *creds = best;
+    return KRB5_OK;
 }
 
 krb5_error_code
@@ -275,3 +401,51 @@ k5_cc_retrieve_cred_default(krb5_context context, krb5_ccache id,
                                           0, 0);
     }
 }
+
+krb5_error_code
+k5_cc_retrieve_cred_array(krb5_context context, krb5_flags flags,
+                          krb5_creds *mcreds, krb5_creds *list, size_t count,
+                          krb5_creds *creds)
+{
+    krb5_enctype *ktypes;
+    int nktypes;
+    krb5_error_code ret;
+
+    if (flags & KRB5_TC_SUPPORTED_KTYPES) {
+        ret = krb5_get_tgs_ktypes(context, mcreds->server, &ktypes);
+        if (ret)
+            return ret;
+        nktypes = k5_count_etypes(ktypes);
+        ret = retrieve_cred_array(context, flags, mcreds, list, count, creds,
+                                  nktypes, ktypes);
+        free(ktypes);
+        return ret;
+    } else {
+        return retrieve_cred_array(context, flags, mcreds, list, count, creds,
+                                   0, NULL);
+    }
+}
+
+krb5_error_code
+k5_cc_retrieve_cred_views(krb5_context context, krb5_flags flags,
+                          krb5_creds *mcreds, k5_cc_next_view_fn next_fn,
+                          void *arg, krb5_creds *creds)
+{
+    krb5_enctype *ktypes;
+    int nktypes;
+    krb5_error_code ret;
+
+    if (flags & KRB5_TC_SUPPORTED_KTYPES) {
+        ret = krb5_get_tgs_ktypes(context, mcreds->server, &ktypes);
+        if (ret)
+            return ret;
+        nktypes = k5_count_etypes(ktypes);
+        ret = retrieve_cred_views(context, flags, mcreds, next_fn, arg, creds,
+                                  nktypes, ktypes);
+        free(ktypes);
+        return ret;
+    } else {
+        return retrieve_cred_views(context, flags, mcreds, next_fn, arg, creds,
+                                   0, NULL);
+    }
+}
@@ -133,6 +133,7 @@ krb5int_cc_finalize(void)
     k5_cc_mutex_destroy(&cccol_lock);
     k5_mutex_destroy(&cc_typelist_lock);
 #ifndef NO_FILE_CCACHE
+    k5_fcc_free_shadows();
     k5_cc_mutex_destroy(&krb5int_cc_file_mutex);
 #endif
     k5_cc_mutex_destroy(&krb5int_mcc_mutex);
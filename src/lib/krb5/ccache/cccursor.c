@@ -141,23 +141,23 @@ krb5_cccol_cursor_free(krb5_context context,
     return 0;
 }
 
-krb5_error_code KRB5_CALLCONV
-krb5_cc_cache_match(krb5_context context, krb5_principal client,
-                    krb5_ccache *cache_out)
+/* Scan the collection of the cache type ops for a cache whose default
+ * principal is client. */
+static krb5_error_code
+scan_type(krb5_context context, const krb5_cc_ops *ops,
+          krb5_const_principal client, krb5_ccache *cache_out)
 {
     krb5_error_code ret;
-    krb5_cccol_cursor cursor;
+    krb5_cc_ptcursor cursor;
     krb5_ccache cache = NULL;
     krb5_principal princ;
-    char *name;
     krb5_boolean eq;
 
     *cache_out = NULL;
-    ret = krb5_cccol_cursor_new(context, &cursor);
+    ret = ops->ptcursor_new(context, &cursor);
     if (ret)
         return ret;
-
-    while ((ret = krb5_cccol_cursor_next(context, cursor, &cache)) == 0 &&
+    while ((ret = ops->ptcursor_next(context, cursor, &cache)) == 0 &&
            cache != NULL) {
         ret = krb5_cc_get_principal(context, cache, &princ);
         if (ret == 0) {
@@ -168,9 +168,54 @@ krb5_cc_cache_match(krb5_context context, krb5_principal client,
         }
         krb5_cc_close(context, cache);
     }
-    krb5_cccol_cursor_free(context, &cursor);
+    ops->ptcursor_free(context, &cursor);
+    if (ret)
+        return ret;
+    *cache_out = cache;
+    return 0;
+}
+
+krb5_error_code KRB5_CALLCONV
+krb5_cc_cache_match(krb5_context context, krb5_principal client,
+                    krb5_ccache *cache_out)
+{
+    krb5_error_code ret;
+    krb5_cc_typecursor typecursor;
+    const krb5_cc_ops *ops;
+    krb5_ccache cache = NULL;
+    char *name;
+
+    *cache_out = NULL;
+    ret = krb5int_cc_typecursor_new(context, &typecursor);
     if (ret)
         return ret;
+
+    /* Search each type's collection in the order of the collection cursor,
+     * using the type's index if it has one. */
+    while (cache == NULL &&
+           (ret = krb5int_cc_typecursor_next(context, typecursor,
+                                             &ops)) == 0 &&
+           ops != NULL) {
+        if (ops->ptcursor_new == NULL)
+            continue;
+        if (ops->match != NULL) {
+            ret = ops->match(context, client, &cache);
+            if (ret == 0 || ret == KRB5_CC_NOTFOUND) {
+                ret = 0;
+                continue;
+            }
+            krb5_clear_error_message(context);
+        }
+        ret = scan_type(context, ops, client, &cache);
+        if (ret)
+            break;
+    }
+    krb5int_cc_typecursor_free(context, &typecursor);
+    if (ret) {
+        if (cache != NULL)
+            krb5_cc_close(context, cache);
+        return ret;
+    }
     if (cache == NULL) {
         ret = krb5_unparse_name(context, client, &name);
         if (ret == 0) {
@@ -0,0 +1,474 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/* lib/krb5/ccache/ccindex.c - Principal index for cache collections */
+/*
+ * Copyright (C) 2020 by the Massachusetts Institute of Technology.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in
+ *   the documentation and/or other materials provided with the
+ *   distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * The DIR and KEYRING cache types maintain an index for each collection,
+ * mapping subsidiary cache names to the cache's default principal and the
+ * expiry time of its local TGT.  The index lets krb5_cc_cache_match() find a
+ * cache for a client principal without opening every cache in the
+ * collection.
+ *
+ * The index is only a hint.  Indexed caches are verified before they are
+ * returned, and if no indexed cache matches, every other cache in the
+ * collection is checked and the index is corrected, so that caches created or
+ * reinitialized by code which does not maintain the index are still found.
+ *
+ * The serialized form is a sequence of lines of the form
+ * "subsidiary<TAB>expiry<TAB>principal", where expiry is a decimal timestamp
+ * (zero if unknown) and principal is an unparsed principal name.  Malformed
+ * lines are ignored.
+ */
+
+#include "k5-int.h"
+#include "cc-int.h"
+
+/* Return true if name can be represented in a serialized index. */
+static krb5_boolean
+indexable(const char *name)
+{
+    return *name != '\0' && strpbrk(name, "\t\n") == NULL;
+}
+
+static struct k5_ccindex_entry *
+find_entry(struct k5_ccindex *index, const char *subsidiary)
+{
+    size_t i;
+
+    for (i = 0; i < index->count; i++) {
+        if (strcmp(index->entries[i].subsidiary, subsidiary) == 0)
+            return &index->entries[i];
+    }
+    return NULL;
+}
+
+static void
+remove_entry(struct k5_ccindex *index, struct k5_ccindex_entry *ent)
+{
+    free(ent->subsidiary);
+    free(ent->princname);
+    *ent = index->entries[--index->count];
+    index->changed = TRUE;
+}
+
+/* Add or replace the entry for subsidiary, taking ownership of princname on
+ * success. */
+static krb5_error_code
+set_entry(struct k5_ccindex *index, const char *subsidiary, char *princname,
+          krb5_timestamp expiry)
+{
+    struct k5_ccindex_entry *ent, *newents;
+    char *subcopy;
+
+    ent = find_entry(index, subsidiary);
+    if (ent != NULL) {
+        if (strcmp(ent->princname, princname) == 0 && ent->expiry == expiry) {
+            free(princname);
+            return 0;
+        }
+        free(ent->princname);
+        ent->princname = princname;
+        ent->expiry = expiry;
+        index->changed = TRUE;
+        return 0;
+    }
+
+    subcopy = strdup(subsidiary);
+    if (subcopy == NULL)
+        return ENOMEM;
+    newents = realloc(index->entries,
+                      (index->count + 1) * sizeof(*index->entries));
+    if (newents == NULL) {
+        free(subcopy);
+        return ENOMEM;
+    }
+    index->entries = newents;
+    ent = &index->entries[index->count++];
+    ent->subsidiary = subcopy;
+    ent->princname = princname;
+    ent->expiry = expiry;
+    index->changed = TRUE;
+    return 0;
+}
+
+/* Parse one line of a serialized index and add it to index if it is
+ * well-formed. */
+static krb5_error_code
+parse_line(struct k5_ccindex *index, const char *line, size_t len)
+{
+    const char *tab1, *tab2, *end = line + len;
+    char *subsidiary = NULL, *expstr = NULL, *princname = NULL, *p;
+    unsigned long expiry;
+    krb5_error_code ret;
+
+    tab1 = memchr(line, '\t', len);
+    if (tab1 == NULL)
+        return 0;
+    tab2 = memchr(tab1 + 1, '\t', end - (tab1 + 1));
+    if (tab2 == NULL || tab1 == line || tab2 + 1 == end)
+        return 0;
+
+    subsidiary = k5memdup0(line, tab1 - line, &ret);
+    if (subsidiary == NULL)
+        goto cleanup;
+    expstr = k5memdup0(tab1 + 1, tab2 - (tab1 + 1), &ret);
+    if (expstr == NULL)
+        goto cleanup;
+    princname = k5memdup0(tab2 + 1, end - (tab2 + 1), &ret);
+    if (princname == NULL)
+        goto cleanup;
+
+    errno = 0;
+    expiry = strtoul(expstr, &p, 10);
+    if (errno != 0 || *expstr == '\0' || *p != '\0' || expiry > UINT32_MAX ||
+        find_entry(index, subsidiary) != NULL)
+        goto cleanup;
+
+    ret = set_entry(index, subsidiary, princname, (krb5_timestamp)expiry);
+    if (ret == 0)
+        princname = NULL;
+
+cleanup:
+    free(subsidiary);
+    free(expstr);
+    free(princname);
+    return ret;
+}
+
+krb5_error_code
+k5_ccindex_parse(const char *data, size_t len, struct k5_ccindex *index_out)
+{
+    krb5_error_code ret;
+    struct k5_ccindex index = { NULL, 0, FALSE };
+    const char *nl;
+
+    while (len > 0) {
+        nl = memchr(data, '\n', len);
+        if (nl == NULL)
+            break;
+        ret = parse_line(&index, data, nl - data);
+        if (ret) {
+            k5_ccindex_free(&index);
+            return ret;
+        }
+        len -= nl + 1 - data;
+        data = nl + 1;
+    }
+
+    index.changed = FALSE;
+    *index_out = index;
+    return 0;
+}
+
+void
+k5_ccindex_marshal(const struct k5_ccindex *index, struct k5buf *buf)
+{
+    const struct k5_ccindex_entry *ent;
+    size_t i;
+
+    for (i = 0; i < index->count; i++) {
+        ent = &index->entries[i];
+        k5_buf_add_fmt(buf, "%s\t%lu\t%s\n", ent->subsidiary,
+                       (unsigned long)(uint32_t)ent->expiry, ent->princname);
+    }
+}
+
+krb5_error_code
+k5_ccindex_set(krb5_context context, struct k5_ccindex *index,
+               const char *subsidiary, krb5_const_principal princ,
+               krb5_timestamp expiry)
+{
+    krb5_error_code ret;
+    char *princname;
+
+    if (!indexable(subsidiary))
+        return 0;
+    ret = krb5_unparse_name(context, princ, &princname);
+    if (ret)
+        return ret;
+    ret = set_entry(index, subsidiary, princname, expiry);
+    if (ret)
+        free(princname);
+    return ret;
+}
+
+void
+k5_ccindex_remove(struct k5_ccindex *index, const char *subsidiary)
+{
+    struct k5_ccindex_entry *ent = find_entry(index, subsidiary);
+
+    if (ent != NULL)
+        remove_entry(index, ent);
+}
+
+void
+k5_ccindex_free(struct k5_ccindex *index)
+{
+    size_t i;
+
+    for (i = 0; i < index->count; i++) {
+        free(index->entries[i].subsidiary);
+        free(index->entries[i].princname);
+    }
+    free(index->entries);
+    index->entries = NULL;
+    index->count = 0;
+}
+
+krb5_boolean
+k5_ccindex_local_tgt(const krb5_creds *creds)
+{
+    krb5_const_principal server = creds->server, client = creds->client;
+
+    return server != NULL && client != NULL && server->length == 2 &&
+        data_eq_string(server->data[0], KRB5_TGS_NAME) &&
+        data_eq(server->data[1], client->realm) &&
+        data_eq(server->realm, client->realm);
+}
+
+/* Sort entries in descending order of expiry time. */
+static int
+compare_expiry(const void *a, const void *b)
+{
+    const struct k5_ccindex_entry *e1 = *(const struct k5_ccindex_entry **)a;
+    const struct k5_ccindex_entry *e2 = *(const struct k5_ccindex_entry **)b;
+
+    if (e1->expiry == e2->expiry)
+        return 0;
+    return ts_after(e1->expiry, e2->expiry) ? -1 : 1;
+}
+
+/*
+ * Set *names_out to a null-terminated list of the subsidiary names of index
+ * entries for princname, with primary (if it matches) first and the
+ * remainder in descending order of expiry time.
+ */
+static krb5_error_code
+get_candidates(struct k5_ccindex *index, const char *princname,
+               const char *primary, char ***names_out)
+{
+    struct k5_ccindex_entry **ents, *ent;
+    char **names;
+    size_t i, n = 0;
+
+    *names_out = NULL;
+    ents = calloc(index->count + 1, sizeof(*ents));
+    if (ents == NULL)
+        return ENOMEM;
+    for (i = 0; i < index->count; i++) {
+        if (strcmp(index->entries[i].princname, princname) == 0)
+            ents[n++] = &index->entries[i];
+    }
+    qsort(ents, n, sizeof(*ents), compare_expiry);
+    for (i = 0; primary != NULL && i < n; i++) {
+        if (strcmp(ents[i]->subsidiary, primary) == 0) {
+            ent = ents[i];
+            memmove(ents + 1, ents, i * sizeof(*ents));
+            ents[0] = ent;
+            break;
+        }
+    }
+
+    /* Copy the names, since verifying the candidates may alter the index. */
+    names = calloc(n + 1, sizeof(*names));
+    if (names == NULL)
+        goto oom;
+    for (i = 0; i < n; i++) {
+        names[i] = strdup(ents[i]->subsidiary);
+        if (names[i] == NULL)
+            goto oom;
+    }
+    free(ents);
+    *names_out = names;
+    return 0;
+
+oom:
+    free(ents);
+    k5_ccindex_free_names(names);
+    return ENOMEM;
+}
+
+void
+k5_ccindex_free_names(char **names)
+{
+    size_t i;
+
+    for (i = 0; names != NULL && names[i] != NULL; i++)
+        free(names[i]);
+    free(names);
+}
+
+/*
+ * Open the subsidiary cache name and update its index entry according to its
+ * current principal.  If cache_out is not NULL and the cache's principal
+ * matches client, set *cache_out to the open cache.
+ */
+static krb5_error_code
+check_cache(krb5_context context, struct k5_ccindex *index, const char *name,
+            krb5_const_principal client, k5_ccindex_open_fn open_cache,
+            void *arg, krb5_ccache *cache_out)
+{
+    krb5_error_code ret;
+    struct k5_ccindex_entry *ent;
+    krb5_ccache cache;
+    krb5_principal princ;
+    char *princname;
+
+    /* Drop the entry for a cache which doesn't exist or isn't initialized. */
+    ret = open_cache(context, arg, name, &cache);
+    if (ret) {
+        krb5_clear_error_message(context);
+        k5_ccindex_remove(index, name);
+        return 0;
+    }
+    ret = krb5_cc_get_principal(context, cache, &princ);
+    if (ret) {
+        krb5_clear_error_message(context);
+        krb5_cc_close(context, cache);
+        k5_ccindex_remove(index, name);
+        return 0;
+    }
+
+    /* Index the cache under its actual principal, keeping the expiry time if
+     * the principal hasn't changed. */
+    ret = krb5_unparse_name(context, princ, &princname);
+    if (ret)
+        goto cleanup;
+    ent = find_entry(index, name);
+    if (ent != NULL && strcmp(ent->princname, princname) == 0) {
+        free(princname);
+    } else if (indexable(name)) {
+        ret = set_entry(index, name, princname, 0);
+        if (ret) {
+            free(princname);
+            goto cleanup;
+        }
+    } else {
+        free(princname);
+    }
+
+    if (cache_out != NULL && krb5_principal_compare(context, princ, client)) {
+        *cache_out = cache;
+        cache = NULL;
+    }
+
+cleanup:
+    krb5_free_principal(context, princ);
+    if (cache != NULL)
+        krb5_cc_close(context, cache);
+    return ret;
+}
+
+static krb5_boolean
+in_list(char **names, const char *name)
+{
+    for (; *names != NULL; names++) {
+        if (strcmp(*names, name) == 0)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+krb5_error_code
+k5_ccindex_match(krb5_context context, struct k5_ccindex *index,
+                 const char *primary, krb5_const_principal client,
+                 k5_ccindex_open_fn open_cache,
+                 k5_ccindex_list_fn list_caches, void *arg,
+                 krb5_ccache *cache_out)
+{
+    krb5_error_code ret;
+    krb5_ccache cache = NULL;
+    char *princname = NULL, **cands = NULL, **names = NULL;
+    size_t i;
+
+    *cache_out = NULL;
+
+    ret = krb5_unparse_name(context, client, &princname);
+    if (ret)
+        goto cleanup;
+
+    /* Try the indexed caches for client. */
+    ret = get_candidates(index, princname, primary, &cands);
+    if (ret)
+        goto cleanup;
+    for (i = 0; cands[i] != NULL && cache == NULL; i++) {
+        ret = check_cache(context, index, cands[i], client, open_cache, arg,
+                          &cache);
+        if (ret)
+            goto cleanup;
+    }
+    if (cache != NULL)
+        goto cleanup;
+
+    /* Reconcile the index with the caches in the collection.  Check every
+     * cache we haven't already checked, since an indexed cache may have been
+     * reinitialized with a different principal by code which doesn't maintain
+     * the index. */
+    ret = list_caches(context, arg, &names);
+    if (ret)
+        goto cleanup;
+    i = 0;
+    while (i < index->count) {
+        if (in_list(names, index->entries[i].subsidiary))
+            i++;
+        else
+            remove_entry(index, &index->entries[i]);
+    }
+    if (primary != NULL && in_list(names, primary) &&
+        !in_list(cands, primary)) {
+        ret = check_cache(context, index, primary, client, open_cache, arg,
+                          &cache);
+        if (ret)
+            goto cleanup;
+    }
+    for (i = 0; names[i] != NULL; i++) {
+        if (in_list(cands, names[i]) ||
+            (primary != NULL && strcmp(names[i], primary) == 0))
+            continue;
+        ret = check_cache(context, index, names[i], client, open_cache, arg,
+                          (cache == NULL) ? &cache : NULL);
+        if (ret)
+            goto cleanup;
+    }
+
+    if (cache == NULL)
+        ret = KRB5_CC_NOTFOUND;
+
+cleanup:
+    free(princname);
+    k5_ccindex_free_names(cands);
+    k5_ccindex_free_names(names);
+    if (ret && cache != NULL)
+        krb5_cc_close(context, cache);
+    else
+        *cache_out = cache;
+    return ret;
+}
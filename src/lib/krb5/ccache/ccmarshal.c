@@ -329,6 +329,153 @@ k5_unmarshal_princ(const unsigned char *data, size_t len, int version,
     return (in.status == EINVAL) ? KRB5_CC_FORMAT : in.status;
 }
 
+/* Read a 32-bit length and return an alias to that many bytes of in. */
+static krb5_data
+get_data_alias(struct k5input *in, int version)
+{
+    uint32_t len = get32(in, version);
+    const unsigned char *bytes = k5_input_get_bytes(in, len);
+
+    return (bytes == NULL) ? empty_data() : make_data((void *)bytes, len);
+}
+
+/* Skip over a list of {16-bit type, data} pairs (addresses or authdata),
+ * returning the count.  If start_out is not null, set *start_out and *len_out
+ * to the region containing the pairs. */
+static uint32_t
+skip_typed_data_list(struct k5input *in, int version,
+                     const unsigned char **start_out, size_t *len_out)
+{
+    const unsigned char *start;
+    uint32_t i, count;
+
+    count = get32(in, version);
+    start = in->ptr;
+    for (i = 0; i < count && !in->status; i++) {
+        (void)get16(in, version);
+        (void)get_data_alias(in, version);
+    }
+    if (start_out != NULL) {
+        *start_out = start;
+        *len_out = in->ptr - start;
+    }
+    return count;
+}
+
+/* Locate the fields of a marshalled principal in in, recording them in
+ * view. */
+static void
+view_princ(struct k5input *in, int version, struct k5_princ_view *view)
+{
+    uint32_t i, ncomps;
+
+    view->version = version;
+    /* See unmarshal_princ() for the version 1 differences. */
+    if (version != 1)
+        (void)get32(in, version);
+    ncomps = get32(in, version);
+    if (version == 1)
+        ncomps--;
+    if (ncomps > in->len) {
+        k5_input_set_status(in, EINVAL);
+        return;
+    }
+    view->ncomps = ncomps;
+    view->realm = get_data_alias(in, version);
+    view->comps = in->ptr;
+    for (i = 0; i < ncomps && !in->status; i++)
+        (void)get_data_alias(in, version);
+    view->comps_len = in->ptr - view->comps;
+}
+
+/*
+ * Locate the fields of a credential marshalled using the specified file ccache
+ * version, without copying any of them.  The principals, authdata, and second
+ * ticket in view alias data, which must remain valid while view is used.
+ * Does not check for trailing garbage.
+ */
+krb5_error_code
+k5_unmarshal_cred_view(const unsigned char *data, size_t len, int version,
+                       struct k5_cred_view *view)
+{
+    struct k5input in;
+
+    memset(view, 0, sizeof(*view));
+    view->data = data;
+    view->len = len;
+    view->version = version;
+
+    k5_input_init(&in, data, len);
+    view_princ(&in, version, &view->client);
+    view_princ(&in, version, &view->server);
+    view->enctype = (int16_t)get16(&in, version);
+    if (version == 3)
+        (void)get16(&in, version);
+    (void)get_data_alias(&in, version);
+    view->times.authtime = get32(&in, version);
+    view->times.starttime = get32(&in, version);
+    view->times.endtime = get32(&in, version);
+    view->times.renew_till = get32(&in, version);
+    view->is_skey = k5_input_get_byte(&in);
+    view->ticket_flags = get32(&in, version);
+    (void)skip_typed_data_list(&in, version, NULL, NULL);
+    view->authdata_count = skip_typed_data_list(&in, version, &view->authdata,
+                                                &view->authdata_len);
+    (void)get_data_alias(&in, version);
+    view->second_ticket = get_data_alias(&in, version);
+    return (in.status == EINVAL) ? KRB5_CC_FORMAT : in.status;
+}
+
+/* Return true if the principal in view is equal to princ, ignoring the realm
+ * if ignore_realm is set.  Name types are not compared, as with
+ * krb5_principal_compare(). */
+krb5_boolean
+k5_princ_view_eq(const struct k5_princ_view *view, krb5_const_principal princ,
+                 krb5_boolean ignore_realm)
+{
+    struct k5input in;
+    krb5_data comp;
+    uint32_t i;
+
+    if (princ->length < 0 || view->ncomps != (uint32_t)princ->length)
+        return FALSE;
+    if (!ignore_realm && !data_eq(view->realm, princ->realm))
+        return FALSE;
+    k5_input_init(&in, view->comps, view->comps_len);
+    for (i = 0; i < view->ncomps; i++) {
+        comp = get_data_alias(&in, view->version);
+        if (!data_eq(comp, princ->data[i]))
+            return FALSE;
+    }
+    return TRUE;
+}
+
+/* Return true if the authdata list in view is equal to authdata, which may be
+ * null to indicate an empty list. */
+krb5_boolean
+k5_authdata_view_eq(const struct k5_cred_view *view,
+                    krb5_authdata *const *authdata)
+{
+    struct k5input in;
+    krb5_authdata *ad;
+    krb5_data contents;
+    krb5_authdatatype ad_type;
+    uint32_t i;
+
+    k5_input_init(&in, view->authdata, view->authdata_len);
+    for (i = 0; i < view->authdata_count; i++) {
+        ad = (authdata == NULL) ? NULL : authdata[i];
+        if (ad == NULL)
+            return FALSE;
+        ad_type = (int16_t)get16(&in, view->version);
+        contents = get_data_alias(&in, view->version);
+        if (ad->ad_type != ad_type ||
+            !data_eq(contents, make_data(ad->contents, ad->length)))
+            return FALSE;
+    }
+    return authdata == NULL || authdata[i] == NULL;
+}
+
 /* Store a 16-bit integer in host byte order for versions 1 and 2, or in
  * big-endian byte order for later versions.*/
 static void
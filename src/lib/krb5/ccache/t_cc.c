@@ -32,6 +32,7 @@
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
+#include <utime.h>
 #include "com_err.h"
 
 #define KRB5_OK 0
@@ -560,6 +561,199 @@ test_memory_concurrent(krb5_context context)
     free_test_cred(context);
 }
 
+/* Set the modification time of filename to ago seconds in the past. */
+static void
+backdate(const char *filename, time_t ago)
+{
+    struct utimbuf ut;
+
+    ut.actime = ut.modtime = time(NULL) - ago;
+    if (utime(filename, &ut) != 0) {
+        perror("utime");
+        exit(1);
+    }
+}
+
+/* Retrieve a credential for the client and server of cred and check the
+ * result against expected. */
+static void
+check_retrieve(krb5_context context, krb5_ccache id, krb5_creds *cred,
+               krb5_error_code expected, unsigned linenum)
+{
+    krb5_error_code ret;
+    krb5_creds mcreds, creds;
+
+    memset(&mcreds, 0, sizeof(mcreds));
+    mcreds.client = cred->client;
+    mcreds.server = cred->server;
+    mcreds.is_skey = cred->is_skey;
+    ret = krb5_cc_retrieve_cred(context, id, KRB5_TC_MATCH_IS_SKEY, &mcreds,
+                                &creds);
+    if (ret != expected) {
+        com_err("", ret, "(on line %d) - retrieve (expected %d)", linenum,
+                (int)expected);
+        fflush(stderr);
+        exit(1);
+    }
+    if (ret)
+        return;
+    CHECK_BOOL(!krb5_principal_compare(context, creds.server, cred->server),
+               "wrong server", "retrieve");
+    krb5_free_cred_contents(context, &creds);
+}
+
+/*
+ * Exercise retrievals from a FILE cache, which are answered from an in-memory
+ * shadow of the file once its modification time is old enough.  The file
+ * modification time is set into the past to avoid sleeping.
+ */
+static void
+test_file_shadow(krb5_context context)
+{
+    krb5_error_code kret;
+    krb5_ccache id;
+    krb5_creds creds[40];
+    char name[300];
+    const char *filename;
+    int i;
+
+    kret = init_test_cred(context);
+    CHECK(kret, "init_creds");
+    snprintf(name, sizeof(name), "FILE:/tmp/cctest-shadow.%ld",
+             (long)getpid());
+    filename = name + 5;
+    kret = krb5_cc_resolve(context, name, &id);
+    CHECK(kret, "resolve for shadow");
+    kret = krb5_cc_initialize(context, id, test_creds.client);
+    CHECK(kret, "initialize for shadow");
+
+    /* Store enough credentials to make several share a hash bucket. */
+    for (i = 0; i < 40; i++) {
+        creds[i] = test_creds;
+        snprintf(name, sizeof(name), "%d", i);
+        kret = krb5_build_principal(context, &creds[i].server, sizeof(REALM),
+                                    REALM, "shadow", name, NULL);
+        CHECK(kret, "build_principal for shadow");
+        kret = krb5_cc_store_cred(context, id, &creds[i]);
+        CHECK(kret, "store for shadow");
+    }
+    kret = krb5_cc_store_cred(context, id, &test_creds);
+    CHECK(kret, "store for shadow");
+    kret = krb5_cc_store_cred(context, id, &test_creds2);
+    CHECK(kret, "store for shadow");
+
+    backdate(filename, 100);
+    check_retrieve(context, id, &test_creds, 0, __LINE__);
+    check_retrieve(context, id, &test_creds2, 0, __LINE__);
+    for (i = 0; i < 40; i++)
+        check_retrieve(context, id, &creds[i], 0, __LINE__);
+    check_retrieve(context, id, &test_creds, 0, __LINE__);
+
+#ifndef _WIN32
+    /* A shadow loaded under one euid is not used under another, which must
+     * read the file with its own rights. */
+    if (geteuid() == 0) {
+        CHECK_BOOL(seteuid(65534) != 0, "seteuid failed", "shadow");
+        check_retrieve(context, id, &test_creds, KRB5_FCC_PERM, __LINE__);
+        CHECK_BOOL(seteuid(0) != 0, "seteuid failed", "shadow");
+        check_retrieve(context, id, &test_creds, 0, __LINE__);
+    }
+#endif
+
+    /* Removal does not change the file size, but is detected through the
+     * modification time. */
+    kret = krb5_cc_remove_cred(context, id, KRB5_TC_MATCH_IS_SKEY,
+                               &test_creds);
+    CHECK(kret, "remove for shadow");
+    backdate(filename, 50);
+    check_retrieve(context, id, &test_creds, KRB5_CC_NOTFOUND, __LINE__);
+    check_retrieve(context, id, &test_creds2, 0, __LINE__);
+
+    /* A credential stored within the settling time is found immediately. */
+    kret = krb5_cc_store_cred(context, id, &test_creds);
+    CHECK(kret, "store for shadow");
+    check_retrieve(context, id, &test_creds, 0, __LINE__);
+
+    /* Reinitializing the cache discards the previous contents. */
+    kret = krb5_cc_initialize(context, id, test_creds.client);
+    CHECK(kret, "initialize for shadow");
+    backdate(filename, 100);
+    check_retrieve(context, id, &test_creds2, KRB5_CC_NOTFOUND, __LINE__);
+    check_retrieve(context, id, &creds[0], KRB5_CC_NOTFOUND, __LINE__);
+
+    kret = krb5_cc_destroy(context, id);
+    CHECK(kret, "destroy for shadow");
+    for (i = 0; i < 40; i++)
+        krb5_free_principal(context, creds[i].server);
+    free_test_cred(context);
+}
+
+/* Check that removing most of the credentials in a FILE cache causes it to be
+ * compacted, without affecting the remaining credentials. */
+static void
+test_file_compact(krb5_context context)
+{
+    krb5_error_code kret;
+    krb5_ccache id;
+    krb5_creds creds[40];
+    struct stat before, after;
+    char name[300], ticket[200];
+    const char *filename;
+    int i;
+
+    kret = init_test_cred(context);
+    CHECK(kret, "init_creds");
+    snprintf(name, sizeof(name), "FILE:/tmp/cctest-compact.%ld",
+             (long)getpid());
+    filename = name + 5;
+    kret = krb5_cc_resolve(context, name, &id);
+    CHECK(kret, "resolve for compact");
+    kret = krb5_cc_initialize(context, id, test_creds.client);
+    CHECK(kret, "initialize for compact");
+
+    memset(ticket, 'x', sizeof(ticket));
+    for (i = 0; i < 40; i++) {
+        creds[i] = test_creds;
+        creds[i].ticket = make_data(ticket, sizeof(ticket));
+        snprintf(name, sizeof(name), "%d", i);
+        kret = krb5_build_principal(context, &creds[i].server, sizeof(REALM),
+                                    REALM, "compact", name, NULL);
+        CHECK(kret, "build_principal for compact");
+        kret = krb5_cc_store_cred(context, id, &creds[i]);
+        CHECK(kret, "store for compact");
+    }
+
+    /* Removing a few credentials leaves them in place. */
+    for (i = 0; i < 5; i++) {
+        kret = krb5_cc_remove_cred(context, id, KRB5_TC_MATCH_IS_SKEY,
+                                   &creds[i]);
+        CHECK(kret, "remove for compact");
+    }
+    CHECK_BOOL(stat(filename, &before) != 0, "stat failed", "stat");
+    check_num_entries(context, id, 35, __LINE__);
+
+    /* Removing most of them causes the file to be rewritten. */
+    for (i = 5; i < 30; i++) {
+        kret = krb5_cc_remove_cred(context, id, KRB5_TC_MATCH_IS_SKEY,
+                                   &creds[i]);
+        CHECK(kret, "remove for compact");
+    }
+    CHECK_BOOL(stat(filename, &after) != 0, "stat failed", "stat");
+    CHECK_BOOL(after.st_size >= before.st_size / 2, "file not compacted",
+               "compact");
+    check_num_entries(context, id, 10, __LINE__);
+    for (i = 0; i < 40; i++) {
+        check_retrieve(context, id, &creds[i],
+                       (i < 30) ? KRB5_CC_NOTFOUND : 0, __LINE__);
+    }
+
+    kret = krb5_cc_destroy(context, id);
+    CHECK(kret, "destroy for compact");
+    for (i = 0; i < 40; i++)
+        krb5_free_principal(context, creds[i].server);
+    free_test_cred(context);
+}
+
 extern const krb5_cc_ops krb5_mcc_ops;
 extern const krb5_cc_ops krb5_fcc_ops;
 
@@ -609,6 +803,8 @@ main(void)
     do_test(context, "FILE:");
 
     test_memory_concurrent(context);
+    test_file_shadow(context);
+    test_file_compact(context);
 
     krb5_free_context(context);
     return 0;
@@ -122,4 +122,50 @@ realm.run([kdestroy])
 cursor_test('noexist', [], [])
 realm.run(['./t_cccursor', fccname, 'CONTENT'], expected_code=1)
 
+# Test the principal index used by krb5_cc_cache_match() for DIR
+# collections.
+mark('DIR principal index')
+denv = realm.env.copy()
+denv['KRB5CCNAME'] = dccname
+indexfile = os.path.join(ccdir, 'index')
+def dir_match(princ, expected_cache):
+    realm.run([kswitch, '-p', princ], env=denv)
+    realm.run([klist], env=denv,
+              expected_msg='Ticket cache: ' + expected_cache)
+
+def read_index():
+    with open(indexfile) as f:
+        return sorted(line.split('\t')[0] for line in f)
+
+# The caches were indexed when they were initialized.
+if read_index() != ['tkt1', 'tkt2', 'tkt3']:
+    fail('DIR index does not contain initialized caches')
+dir_match('alice', dalice)
+dir_match('bob', dbob)
+
+# A missing index is rebuilt by the next lookup.
+os.remove(indexfile)
+dir_match('user', duser)
+if read_index() != ['tkt1', 'tkt2', 'tkt3']:
+    fail('DIR index not rebuilt')
+
+# Caches created or reinitialized without updating the index are found.
+realm.kinit('alice', password('alice'),
+            flags=['-c', 'FILE:%s/tkt4' % ccdir])
+realm.kinit('bob', password('bob'), flags=['-c', 'FILE:%s/tkt2' % ccdir])
+dir_match('bob', dbob)
+realm.run([kswitch, '-p', 'alice'], env=denv)
+realm.run([klist], env=denv, expected_msg='Ticket cache: DIR::%s/tkt4' % ccdir)
+os.remove(os.path.join(ccdir, 'tkt4'))
+realm.run([kswitch, '-p', 'alice'], env=denv, expected_code=1,
+          expected_msg='Matching credential not found')
+if read_index() != ['tkt1', 'tkt2', 'tkt3']:
+    fail('DIR index not reconciled with directory contents')
+
+# Destroying a cache removes its index entry.
+realm.run([kdestroy, '-c', dbob])
+if read_index() != ['tkt1', 'tkt2']:
+    fail('DIR index entry not removed for destroyed cache')
+dir_match('bob', dalice)
+
 success('Renewing credentials')
@@ -262,6 +262,29 @@ verify_cred2(const krb5_creds *c)
     assert(data_eq_string(c->second_ticket, "2ticket"));
 }
 
+/* Verify that a view of the marshalled cred in data matches cred on every
+ * field, and that it fails to match when the enctype differs. */
+static void
+verify_view(krb5_context context, const unsigned char *data, size_t len,
+            int version, krb5_creds *cred)
+{
+    struct k5_cred_view view;
+    krb5_flags all = KRB5_TC_MATCH_IS_SKEY | KRB5_TC_MATCH_FLAGS_EXACT |
+        KRB5_TC_MATCH_TIMES_EXACT | KRB5_TC_MATCH_AUTHDATA |
+        KRB5_TC_MATCH_2ND_TKT | KRB5_TC_MATCH_KTYPE;
+    krb5_enctype enctype = cred->keyblock.enctype;
+
+    if (k5_unmarshal_cred_view(data, len, version, &view) != 0)
+        abort();
+    assert(view.len == len);
+    assert(k5_cc_view_match_request(context, all, cred, &view));
+    cred->keyblock.enctype = ENCTYPE_DES3_CBC_SHA1;
+    assert(!k5_cc_view_match_request(context, all, cred, &view));
+    assert(k5_cc_view_match_request(context, all & ~KRB5_TC_MATCH_KTYPE, cred,
+                                    &view));
+    cred->keyblock.enctype = enctype;
+}
+
 int
 main(int argc, char **argv)
 {
@@ -302,6 +325,7 @@ main(int argc, char **argv)
         if (k5_unmarshal_cred(t->cred1, t->cred1len, version, &cred1) != 0)
             abort();
         verify_cred1(&cred1);
+        verify_view(context, t->cred1, t->cred1len, version, &cred1);
         k5_buf_init_dynamic(&buf);
         k5_marshal_cred(&buf, version, &cred1);
         assert(buf.len == t->cred1len);
@@ -312,6 +336,7 @@ main(int argc, char **argv)
         if (k5_unmarshal_cred(t->cred2, t->cred2len, version, &cred2) != 0)
             abort();
         verify_cred2(&cred2);
+        verify_view(context, t->cred2, t->cred2len, version, &cred2);
         k5_buf_init_dynamic(&buf);
         k5_marshal_cred(&buf, version, &cred2);
         assert(buf.len == t->cred2len);
@@ -42,6 +42,10 @@ int krb5int_mkt_initialize(void);
 
 void krb5int_mkt_finalize(void);
 
+int krb5int_ktfile_initialize(void);
+
+void krb5int_ktfile_finalize(void);
+
 extern const krb5_kt_ops krb5_kt_dfl_ops;
 
 #endif /* __KRB5_KEYTAB_INT_H__ */
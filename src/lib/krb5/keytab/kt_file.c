@@ -54,6 +54,7 @@
 #ifndef LEAN_CLIENT
 
 #include "k5-int.h"
+#include "kt-int.h"
 #include "../os/os-proto.h"
 #include <stdio.h>
 
@@ -275,6 +276,324 @@ more_recent(const krb5_keytab_entry *k1, const krb5_keytab_entry *k2)
     return k1->vno > k2->vno;
 }
 
+enum match_result { NO_MATCH, BETTER_MATCH, EXACT_MATCH };
+
+/*
+ * Compare ent against a request for principal, kvno, and enctype, given the
+ * best matching entry found so far (or NULL).  Increment *wrong_kvno if ent
+ * matches except for its key version.
+ */
+static enum match_result
+match_entry(krb5_context context, krb5_const_principal principal,
+            krb5_kvno kvno, krb5_enctype enctype,
+            const krb5_keytab_entry *ent, const krb5_keytab_entry *best,
+            int *wrong_kvno)
+{
+    if (!krb5_principal_compare(context, principal, ent->principal))
+        return NO_MATCH;
+    if (enctype != IGNORE_ENCTYPE && enctype != ent->key.enctype)
+        return NO_MATCH;
+
+    /* If the kvno is ignored, prefer the most recent entry. */
+    if (kvno == IGNORE_VNO || ent->vno == IGNORE_VNO)
+        return (best == NULL || more_recent(ent, best)) ? BETTER_MATCH :
+            NO_MATCH;
+
+    /*
+     * An exact kvno match ends the search.  If ent matches the low 8 bits of
+     * the desired kvno, remember the first such match (because the recorded
+     * kvno may have been truncated due to pre-1.14 keytab format or kadmin
+     * protocol limitations) but keep looking for an exact match.
+     */
+    if (ent->vno == kvno)
+        return EXACT_MATCH;
+    if (ent->vno == (kvno & 0xff) && best == NULL)
+        return BETTER_MATCH;
+    (*wrong_kvno)++;
+    return NO_MATCH;
+}
+
+/* Return the error for a keytab search which found no matching entry. */
+static krb5_error_code
+not_found_error(krb5_context context, krb5_const_principal principal,
+                int found_wrong_kvno)
+{
+    char *princname;
+
+    if (found_wrong_kvno)
+        return KRB5_KT_KVNONOTFOUND;
+    if (krb5_unparse_name(context, principal, &princname) == 0) {
+        k5_setmsg(context, KRB5_KT_NOTFOUND,
+                  _("No key table entry found for %s"), princname);
+        free(princname);
+    }
+    return KRB5_KT_NOTFOUND;
+}
+
+/*
+ * Servers verifying many requests against a large keytab would otherwise
+ * read and decode the whole file for each lookup, so we keep a per-process
+ * file index (see os/file_index.c) of the entries of recently used keytab
+ * files, protected by ktfile_index_mutex.  Entries are written and removed in
+ * place, so an index is only used while the file's stamp is unchanged and
+ * settled.  Entries are grouped by a hash of the principal name.
+ */
+
+#define INDEX_MAX_FILES 8
+
+struct kt_index {
+    struct k5_file_index ix;    /* must be first */
+    krb5_keytab_entry *entries;
+    size_t nentries;
+};
+
+static k5_mutex_t ktfile_index_mutex = K5_MUTEX_PARTIAL_INITIALIZER;
+
+/* Most recently used first. */
+static struct k5_file_index *index_list;
+
+/* Hash the realm and components of princ. */
+static uint32_t
+hash_principal(krb5_const_principal princ)
+{
+    uint32_t h = K5_FNV_HASH_INIT;
+    int i;
+
+    h = k5_fnv_hash_data(h, &princ->realm);
+    for (i = 0; i < princ->length; i++)
+        h = k5_fnv_hash_data(h, &princ->data[i]);
+    return h;
+}
+
+static uint32_t
+hash_entry(const void *item)
+{
+    const krb5_keytab_entry *entry = item;
+
+    return hash_principal(entry->principal);
+}
+
+static void
+free_index(krb5_context context, struct kt_index *ix)
+{
+    size_t i;
+
+    if (ix == NULL)
+        return;
+    for (i = 0; i < ix->nentries; i++)
+        krb5_kt_free_entry(context, &ix->entries[i]);
+    free(ix->entries);
+    k5_file_index_free_contents(&ix->ix);
+    free(ix);
+}
+
+/* Read all of the entries in the keytab file into a new index.  id must be
+ * locked and not open. */
+static krb5_error_code
+load_index(krb5_context context, krb5_keytab id, struct kt_index **index_out)
+{
+    krb5_error_code ret;
+    struct kt_index *ix;
+    struct stat sb;
+    krb5_keytab_entry *newentries;
+    size_t space = 0;
+
+    *index_out = NULL;
+
+    ix = k5alloc(sizeof(*ix), &ret);
+    if (ix == NULL)
+        return ret;
+    ix->ix.filename = k5memdup0(KTFILENAME(id), strlen(KTFILENAME(id)),
+                                &ret);
+    if (ix->ix.filename == NULL)
+        goto cleanup;
+
+    ret = krb5_ktfileint_openr(context, id);
+    if (ret)
+        goto cleanup;
+    if (fstat(fileno(KTFILEP(id)), &sb) == -1) {
+        ret = errno;
+        goto cleanup;
+    }
+    k5_file_stamp_get(&sb, &ix->ix.stamp);
+
+    for (;;) {
+        if (ix->nentries == space) {
+            space = (space == 0) ? 16 : space * 2;
+            newentries = realloc(ix->entries, space * sizeof(*ix->entries));
+            if (newentries == NULL) {
+                ret = ENOMEM;
+                goto cleanup;
+            }
+            ix->entries = newentries;
+        }
+        ret = krb5_ktfileint_read_entry(context, id,
+                                        &ix->entries[ix->nentries]);
+        if (ret)
+            break;
+        ix->nentries++;
+    }
+    if (ret != KRB5_KT_END)
+        goto cleanup;
+
+    ret = k5_file_index_build(&ix->ix, ix->entries, ix->nentries,
+                              sizeof(*ix->entries), hash_entry);
+    if (ret)
+        goto cleanup;
+    *index_out = ix;
+    ix = NULL;
+
+cleanup:
+    (void)krb5_ktfileint_close(context, id);
+    free_index(context, ix);
+    return ret;
+}
+
+/* Unlink and return the index for filename, if there is one.  The caller must
+ * hold ktfile_index_mutex. */
+static struct kt_index *
+unlink_index(const char *filename)
+{
+    return (struct kt_index *)k5_file_index_unlink(&index_list, filename);
+}
+
+/* Add ix to the front of the index list, evicting the least recently used
+ * index if the list is full.  Return the evicted index, which the caller
+ * should free after releasing ktfile_index_mutex. */
+static struct kt_index *
+add_index(struct kt_index *ix)
+{
+    return (struct kt_index *)k5_file_index_add(&index_list, &ix->ix,
+                                                INDEX_MAX_FILES);
+}
+
+/* Copy the chosen entry match into *out, as krb5_ktfile_get_entry() would
+ * return it. */
+static krb5_error_code
+copy_entry(krb5_context context, const krb5_keytab_entry *match,
+           krb5_keytab_entry *out)
+{
+    krb5_error_code ret;
+
+    *out = *match;
+    out->principal = NULL;
+    out->key.contents = NULL;
+    ret = krb5_copy_keyblock_contents(context, &match->key, &out->key);
+    if (ret)
+        return ret;
+    ret = krb5_copy_principal(context, match->principal, &out->principal);
+    if (ret) {
+        krb5_free_keyblock_contents(context, &out->key);
+        return ret;
+    }
+    return 0;
+}
+
+/* Search ix for the entry krb5_ktfile_get_entry() would return.  The caller
+ * must hold ktfile_index_mutex. */
+static krb5_error_code
+search_index(krb5_context context, struct kt_index *ix,
+             krb5_const_principal principal, krb5_kvno kvno,
+             krb5_enctype enctype, krb5_keytab_entry *entry)
+{
+    const krb5_keytab_entry *best = NULL;
+    enum match_result m;
+    size_t i, start, end;
+    int found_wrong_kvno = 0;
+
+    k5_file_index_bucket(&ix->ix, hash_principal(principal), &start, &end);
+    for (i = start; i < end; i++) {
+        m = match_entry(context, principal, kvno, enctype, &ix->entries[i],
+                        best, &found_wrong_kvno);
+        if (m == NO_MATCH)
+            continue;
+        best = &ix->entries[i];
+        if (m == EXACT_MATCH)
+            break;
+    }
+    if (best == NULL)
+        return not_found_error(context, principal, found_wrong_kvno);
+    return copy_entry(context, best, entry);
+}
+
+/*
+ * Look up an entry using an index of the keytab file, loading the index if
+ * necessary.  id must be locked and not open.  Set *used_out to false, and
+ * return 0, if the lookup must instead be performed by reading the file.
+ */
+static krb5_error_code
+index_get_entry(krb5_context context, krb5_keytab id,
+                krb5_const_principal principal, krb5_kvno kvno,
+                krb5_enctype enctype, krb5_keytab_entry *entry,
+                krb5_boolean *used_out)
+{
+    krb5_error_code ret;
+    struct kt_index *ix, *old;
+    struct k5_file_stamp stamp;
+    struct stat sb;
+
+    *used_out = FALSE;
+    if (stat(KTFILENAME(id), &sb) != 0)
+        return 0;
+    k5_file_stamp_get(&sb, &stamp);
+    if (k5_file_stamp_settling(&stamp))
+        return 0;
+
+    /* Use an existing index if it is current. */
+    k5_mutex_lock(&ktfile_index_mutex);
+    ix = unlink_index(KTFILENAME(id));
+    if (ix != NULL && k5_file_stamps_equal(&ix->ix.stamp, &stamp)) {
+        (void)add_index(ix);
+        ret = search_index(context, ix, principal, kvno, enctype, entry);
+        k5_mutex_unlock(&ktfile_index_mutex);
+        *used_out = TRUE;
+        return ret;
+    }
+    k5_mutex_unlock(&ktfile_index_mutex);
+    free_index(context, ix);
+
+    /* Load a new index without holding the mutex.  The file might have
+     * changed since we checked it, so check the stamp of the loaded index
+     * again. */
+    if (load_index(context, id, &ix) != 0)
+        return 0;
+    if (k5_file_stamp_settling(&ix->ix.stamp)) {
+        free_index(context, ix);
+        return 0;
+    }
+
+    k5_mutex_lock(&ktfile_index_mutex);
+    old = unlink_index(KTFILENAME(id));
+    if (old == NULL)
+        old = add_index(ix);
+    else
+        (void)add_index(ix);
+    ret = search_index(context, ix, principal, kvno, enctype, entry);
+    k5_mutex_unlock(&ktfile_index_mutex);
+    free_index(context, old);
+    *used_out = TRUE;
+    return ret;
+}
+
+int
+krb5int_ktfile_initialize(void)
+{
+    return k5_mutex_finish_init(&ktfile_index_mutex);
+}
+
+void
+krb5int_ktfile_finalize(void)
+{
+    struct kt_index *ix, *next;
+
+    k5_mutex_destroy(&ktfile_index_mutex);
+    for (ix = (struct kt_index *)index_list; ix != NULL; ix = next) {
+        next = (struct kt_index *)ix->ix.next;
+        free_index(NULL, ix);
+    }
+    index_list = NULL;
+}
+
 /*
  * This is the get_entry routine for the file based keytab implementation.
  * It opens the keytab file, and either retrieves the entry or returns
@@ -288,9 +607,10 @@ krb5_ktfile_get_entry(krb5_context context, krb5_keytab id,
 {
     krb5_keytab_entry cur_entry, new_entry;
     krb5_error_code kerror = 0;
+    enum match_result m;
     int found_wrong_kvno = 0;
     int was_open;
-    char *princname;
+    krb5_boolean used_index;
 
     KTLOCK(id);
 
@@ -304,6 +624,13 @@ krb5_ktfile_get_entry(krb5_context context, krb5_keytab id,
     } else {
         was_open = 0;
 
+        kerror = index_get_entry(context, id, principal, kvno, enctype,
+                                 entry, &used_index);
+        if (used_index) {
+            KTUNLOCK(id);
+            return kerror;
+        }
+
         /* Open the keyfile for reading */
         if ((kerror = krb5_ktfileint_openr(context, id))) {
             KTUNLOCK(id);
@@ -326,70 +653,24 @@ krb5_ktfile_get_entry(krb5_context context, krb5_keytab id,
         /* by the time this loop exits, it must either free cur_entry,
            and copy new_entry there, or free new_entry.  Otherwise, it
            leaks. */
-
-        /* if the principal isn't the one requested, free new_entry
-           and continue to the next. */
-
-        if (!krb5_principal_compare(context, principal, new_entry.principal)) {
+        m = match_entry(context, principal, kvno, enctype, &new_entry,
+                        (cur_entry.principal != NULL) ? &cur_entry : NULL,
+                        &found_wrong_kvno);
+        if (m == NO_MATCH) {
             krb5_kt_free_entry(context, &new_entry);
             continue;
         }
-
-        /* If the enctype is not ignored and doesn't match, free new_entry and
-           continue to the next. */
-        if (enctype != IGNORE_ENCTYPE && enctype != new_entry.key.enctype) {
-            krb5_kt_free_entry(context, &new_entry);
-            continue;
-        }
-
-        if (kvno == IGNORE_VNO || new_entry.vno == IGNORE_VNO) {
-            /* If this entry is more recent (or the first match), free the
-             * current and keep the new.  Otherwise, free the new. */
-            if (cur_entry.principal == NULL ||
-                more_recent(&new_entry, &cur_entry)) {
-                krb5_kt_free_entry(context, &cur_entry);
-                cur_entry = new_entry;
-            } else {
-                krb5_kt_free_entry(context, &new_entry);
-            }
-        } else {
-            /*
-             * If this kvno matches exactly, free the current, keep the new,
-             * and break out.  If it matches the low 8 bits of the desired
-             * kvno, remember the first match (because the recorded kvno may
-             * have been truncated due to pre-1.14 keytab format or kadmin
-             * protocol limitations) but keep looking for an exact match.
-             * Otherwise, remember that we were here so we can return the right
-             * error, and free the new.
-             */
-            if (new_entry.vno == kvno) {
-                krb5_kt_free_entry(context, &cur_entry);
-                cur_entry = new_entry;
-                if (new_entry.vno == kvno)
-                    break;
-            } else if (new_entry.vno == (kvno & 0xff) &&
-                       cur_entry.principal == NULL) {
-                cur_entry = new_entry;
-            } else {
-                found_wrong_kvno++;
-                krb5_kt_free_entry(context, &new_entry);
-            }
-        }
+        krb5_kt_free_entry(context, &cur_entry);
+        cur_entry = new_entry;
+        if (m == EXACT_MATCH)
+            break;
     }
 
     if (kerror == KRB5_KT_END) {
         if (cur_entry.principal)
             kerror = 0;
-        else if (found_wrong_kvno)
-            kerror = KRB5_KT_KVNONOTFOUND;
-        else {
-            kerror = KRB5_KT_NOTFOUND;
-            if (krb5_unparse_name(context, principal, &princname) == 0) {
-                k5_setmsg(context, kerror,
-                          _("No key table entry found for %s"), princname);
-                free(princname);
-            }
-        }
+        else
+            kerror = not_found_error(context, principal, found_wrong_kvno);
     }
     if (kerror) {
         if (was_open == 0)
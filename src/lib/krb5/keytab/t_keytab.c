@@ -32,6 +32,7 @@
 #include <unistd.h>
 #endif
 #include <string.h>
+#include <utime.h>
 
 
 int debug=0;
@@ -394,6 +395,120 @@ kt_test(krb5_context context, const char *name)
 
 }
 
+/* Set the modification time of filename to ago seconds in the past. */
+static void
+backdate(const char *filename, time_t ago)
+{
+    struct utimbuf ut;
+
+    ut.actime = ut.modtime = time(NULL) - ago;
+    if (utime(filename, &ut) != 0) {
+        perror("utime");
+        exit(1);
+    }
+}
+
+/* Look up principal index i in kt with the given kvno, and check the result
+ * against expected and (if successful) the expected kvno. */
+static void
+check_lookup(krb5_context context, krb5_keytab kt, int i, krb5_kvno kvno,
+             krb5_error_code expected, krb5_kvno expected_kvno)
+{
+    krb5_error_code kret;
+    krb5_principal princ;
+    krb5_keytab_entry ent;
+    char name[64];
+
+    snprintf(name, sizeof(name), "svc%d/host@TEST.MIT.EDU", i);
+    kret = krb5_parse_name(context, name, &princ);
+    CHECK(kret, "parsing principal");
+    kret = krb5_kt_get_entry(context, kt, princ, kvno, 0, &ent);
+    CHECK_ERR(kret, expected, "indexed lookup");
+    if (kret == 0) {
+        if (ent.vno != expected_kvno || ent.key.contents[0] != 'a' + i % 26 ||
+            !krb5_principal_compare(context, ent.principal, princ)) {
+            fprintf(stderr, "Wrong entry from indexed lookup\n");
+            exit(1);
+        }
+        krb5_free_keytab_entry_contents(context, &ent);
+    }
+    krb5_free_principal(context, princ);
+}
+
+/*
+ * Exercise lookups in a keytab file with many principals, which are answered
+ * from an in-memory index once the file's modification time is old enough.
+ * The file modification time is set into the past to avoid sleeping.
+ */
+static void
+test_file_index(krb5_context context)
+{
+    krb5_error_code kret;
+    krb5_keytab kt;
+    krb5_keytab_entry kent;
+    char *name, princname[64], key;
+    const char *filename;
+    int i;
+
+    printf("Starting keytab index test\n");
+    if (asprintf(&name, "WRFILE:/tmp/kttest-index.%ld", (long)getpid()) < 0) {
+        perror("asprintf");
+        exit(1);
+    }
+    filename = name + 7;
+    kret = krb5_kt_resolve(context, name, &kt);
+    CHECK(kret, "resolve");
+
+    /* Add kvnos 1 and 2 for each of 100 principals. */
+    memset(&kent, 0, sizeof(kent));
+    kent.magic = KV5M_KEYTAB_ENTRY;
+    kent.key.magic = KV5M_KEYBLOCK;
+    kent.key.enctype = ENCTYPE_AES128_CTS_HMAC_SHA1_96;
+    kent.key.length = 1;
+    kent.key.contents = (krb5_octet *)&key;
+    for (i = 0; i < 100; i++) {
+        snprintf(princname, sizeof(princname), "svc%d/host@TEST.MIT.EDU", i);
+        kret = krb5_parse_name(context, princname, &kent.principal);
+        CHECK(kret, "parsing principal");
+        key = 'a' + i % 26;
+        kent.vno = 1;
+        kret = krb5_kt_add_entry(context, kt, &kent);
+        CHECK(kret, "adding entry");
+        kent.vno = 2;
+        kret = krb5_kt_add_entry(context, kt, &kent);
+        CHECK(kret, "adding entry");
+        krb5_free_principal(context, kent.principal);
+    }
+
+    backdate(filename, 100);
+    for (i = 0; i < 100; i++) {
+        check_lookup(context, kt, i, 0, 0, 2);
+        check_lookup(context, kt, i, 1, 0, 1);
+        check_lookup(context, kt, i, 3, KRB5_KT_KVNONOTFOUND, 0);
+    }
+    check_lookup(context, kt, 100, 0, KRB5_KT_NOTFOUND, 0);
+
+    /* Remove kvno 2 of one principal, which overwrites the entry in place
+     * without changing the file size. */
+    snprintf(princname, sizeof(princname), "svc%d/host@TEST.MIT.EDU", 7);
+    kret = krb5_parse_name(context, princname, &kent.principal);
+    CHECK(kret, "parsing principal");
+    key = 'a' + 7;
+    kret = krb5_kt_remove_entry(context, kt, &kent);
+    CHECK(kret, "removing entry");
+    krb5_free_principal(context, kent.principal);
+    backdate(filename, 50);
+    check_lookup(context, kt, 7, 0, 0, 1);
+    check_lookup(context, kt, 7, 2, KRB5_KT_KVNONOTFOUND, 0);
+    check_lookup(context, kt, 8, 2, 0, 2);
+
+    kret = krb5_kt_close(context, kt);
+    CHECK(kret, "close");
+    unlink(filename);
+    free(name);
+    printf("Keytab index test passed\n");
+}
+
 static void
 do_test(krb5_context context, const char *prefix, krb5_boolean delete)
 {
@@ -438,6 +553,7 @@ main(void)
     test_misc(context);
     do_test(context, "WRFILE:", FALSE);
     do_test(context, "MEMORY:", TRUE);
+    test_file_index(context);
 
     krb5_free_context(context);
     return 0;
@@ -79,6 +79,9 @@ krb5_copy_context(krb5_context ctx, krb5_context *nctx_out)
     nctx->localauth_handles = NULL;
     nctx->hostrealm_handles = NULL;
     nctx->tls = NULL;
+    nctx->kdc_conncache = NULL;
+    nctx->rd_req_keycache = NULL;
+    nctx->kcm_idle_io = NULL;
     nctx->kdblog_context = NULL;
     nctx->trace_callback = NULL;
     nctx->trace_callback_data = NULL;
@@ -186,6 +186,16 @@ struct _krb5_tkt_creds_context {
     krb5_data *caller_out;      /* Caller's out parameter */
     krb5_data *caller_realm;    /* Caller's realm parameter */
     unsigned int *caller_flags; /* Caller's flags parameter */
+
+    /* The following field is used by krb5_get_credentials_multi(). */
+    struct pending_creds *pending; /* Creds for the caller's ccache */
+};
+
+/* Credentials stored into a staging ccache by the contexts of a
+ * krb5_get_credentials_multi() call, in the order they were stored. */
+struct pending_creds {
+    krb5_creds **list;
+    size_t count;
 };
 
 /* Convert ticket flags to necessary KDC options */
@@ -225,6 +235,31 @@ cleanup:
     return code;
 }
 
+/* Store creds in ctx->ccache, ignoring failure.  If ctx is part of a batch,
+ * also remember them for storage in the batch caller's ccache; failure to do
+ * so is returned, as the creds would otherwise be silently lost. */
+static krb5_error_code
+store_creds(krb5_context context, krb5_tkt_creds_context ctx,
+            krb5_creds *creds)
+{
+    krb5_error_code code;
+    struct pending_creds *pending = ctx->pending;
+    krb5_creds **list;
+
+    (void)krb5_cc_store_cred(context, ctx->ccache, creds);
+    if (pending == NULL)
+        return 0;
+    list = realloc(pending->list, (pending->count + 1) * sizeof(*list));
+    if (list == NULL)
+        return ENOMEM;
+    pending->list = list;
+    code = krb5_copy_creds(context, creds, &list[pending->count]);
+    if (code)
+        return code;
+    pending->count++;
+    return 0;
+}
+
 /* Simple wrapper around krb5_cc_retrieve_cred which allocates the result
  * container. */
 static krb5_error_code
@@ -427,6 +462,8 @@ seen_realm_before(krb5_context context, krb5_tkt_creds_context ctx,
 static krb5_error_code
 complete(krb5_context context, krb5_tkt_creds_context ctx)
 {
+    krb5_error_code code;
+
     TRACE_TKT_CREDS_COMPLETE(context, ctx->reply_creds->server);
 
     /* Put the requested server principal in the output creds. */
@@ -440,7 +477,9 @@ complete(krb5_context context, krb5_tkt_creds_context ctx)
 
     if (!(ctx->req_options & KRB5_GC_NO_STORE)) {
         /* Try to cache the credential. */
-        (void) krb5_cc_store_cred(context, ctx->ccache, ctx->reply_creds);
+        code = store_creds(context, ctx, ctx->reply_creds);
+        if (code != 0)
+            return code;
     }
 
     ctx->state = STATE_COMPLETE;
@@ -921,8 +960,11 @@ step_get_tgt(krb5_context context, krb5_tkt_creds_context ctx)
         path_realm = find_realm_in_path(context, ctx, tgt_realm);
         if (path_realm != NULL) {
             /* Only cache the TGT if we asked for it, to avoid duplicates. */
-            if (path_realm == ctx->next_realm)
-                (void)krb5_cc_store_cred(context, ctx->ccache, ctx->cur_tgt);
+            if (path_realm == ctx->next_realm) {
+                code = store_creds(context, ctx, ctx->cur_tgt);
+                if (code != 0)
+                    return code;
+            }
             if (path_realm == ctx->last_realm) {
                 /* We received a TGT for the target realm. */
                 TRACE_TKT_CREDS_TARGET_TGT(context, ctx->cur_tgt->server);
@@ -1251,47 +1293,28 @@ cleanup:
     return code;
 }
 
-krb5_error_code KRB5_CALLCONV
-krb5_get_credentials(krb5_context context, krb5_flags options,
-                     krb5_ccache ccache, krb5_creds *in_creds,
-                     krb5_creds **out_creds)
+/*
+ * Possibly try again with the canonicalized hostname after a
+ * KRB5KDC_ERR_S_PRINCIPAL_UNKNOWN error, if the server is host-based and we
+ * are configured for fallback canonicalization.  Return
+ * KRB5KDC_ERR_S_PRINCIPAL_UNKNOWN if no fallback is possible.
+ */
+static krb5_error_code
+try_canon_fallback(krb5_context context, krb5_flags options,
+                   krb5_ccache ccache, krb5_creds *in_creds,
+                   krb5_creds *creds_out)
 {
     krb5_error_code code;
-    krb5_creds *ncreds = NULL;
     krb5_creds canon_creds, store_creds;
     krb5_principal_data canon_server;
     krb5_data canon_components[2];
     char *hostname = NULL, *canon_hostname = NULL;
 
-    *out_creds = NULL;
-
-    /* If S4U2Proxy is requested, use the synchronous implementation in
-     * s4u_creds.c. */
-    if (options & KRB5_GC_CONSTRAINED_DELEGATION) {
-        return k5_get_proxy_cred_from_kdc(context, options, ccache, in_creds,
-                                          out_creds);
-    }
-
-    /* Allocate a container. */
-    ncreds = k5alloc(sizeof(*ncreds), &code);
-    if (ncreds == NULL)
-        goto cleanup;
-
-    code = try_get_creds(context, options, ccache, in_creds, ncreds);
-    if (!code) {
-        *out_creds = ncreds;
-        return 0;
-    }
-
-    /* Possibly try again with the canonicalized hostname, if the server is
-     * host-based and we are configured for fallback canonicalization. */
-    if (code != KRB5KDC_ERR_S_PRINCIPAL_UNKNOWN)
-        goto cleanup;
     if (context->dns_canonicalize_hostname != CANONHOST_FALLBACK)
-        goto cleanup;
+        return KRB5KDC_ERR_S_PRINCIPAL_UNKNOWN;
     if (in_creds->server->type != KRB5_NT_SRV_HST ||
         in_creds->server->length != 2)
-        goto cleanup;
+        return KRB5KDC_ERR_S_PRINCIPAL_UNKNOWN;
 
     hostname = k5memdup0(in_creds->server->data[1].data,
                          in_creds->server->data[1].length, &code);
@@ -1312,24 +1335,323 @@ krb5_get_credentials(krb5_context context, krb5_flags options,
     canon_creds.server = &canon_server;
 
     code = try_get_creds(context, options | KRB5_GC_NO_STORE, ccache,
-                         &canon_creds, ncreds);
+                         &canon_creds, creds_out);
     if (code)
         goto cleanup;
 
     if (!(options & KRB5_GC_NO_STORE)) {
         /* Store the creds under the originally requested server name.  The
          * ccache layer will also store them under the ticket server name. */
-        store_creds = *ncreds;
+        store_creds = *creds_out;
         store_creds.server = in_creds->server;
         (void)krb5_cc_store_cred(context, ccache, &store_creds);
     }
 
+cleanup:
+    free(hostname);
+    free(canon_hostname);
+    return code;
+}
+
+krb5_error_code KRB5_CALLCONV
+krb5_get_credentials(krb5_context context, krb5_flags options,
+                     krb5_ccache ccache, krb5_creds *in_creds,
+                     krb5_creds **out_creds)
+{
+    krb5_error_code code;
+    krb5_creds *ncreds = NULL;
+
+    *out_creds = NULL;
+
+    /* If S4U2Proxy is requested, use the synchronous implementation in
+     * s4u_creds.c. */
+    if (options & KRB5_GC_CONSTRAINED_DELEGATION) {
+        return k5_get_proxy_cred_from_kdc(context, options, ccache, in_creds,
+                                          out_creds);
+    }
+
+    /* Allocate a container. */
+    ncreds = k5alloc(sizeof(*ncreds), &code);
+    if (ncreds == NULL)
+        goto cleanup;
+
+    code = try_get_creds(context, options, ccache, in_creds, ncreds);
+    if (code == KRB5KDC_ERR_S_PRINCIPAL_UNKNOWN) {
+        code = try_canon_fallback(context, options, ccache, in_creds,
+                                  ncreds);
+    }
+    if (code)
+        goto cleanup;
+
     *out_creds = ncreds;
     ncreds = NULL;
 
 cleanup:
-    free(hostname);
-    free(canon_hostname);
     krb5_free_creds(context, ncreds);
     return code;
 }
+
+/* The state of one credential request in krb5_get_credentials_multi(). */
+struct multi_entry {
+    krb5_tkt_creds_context ctx;
+    struct multi_entry *leader; /* Entry getting the TGT we need, if any */
+    krb5_data request;
+    krb5_data realm;
+    krb5_data reply;
+    int tcp_only;
+    krb5_boolean done;
+    krb5_error_code code;
+};
+
+/* Return true if entry should wait for its leader to obtain a TGT for the
+ * server realm before making any requests. */
+static krb5_boolean
+follower_waiting(struct multi_entry *entry)
+{
+    struct multi_entry *leader = entry->leader;
+
+    if (entry->ctx->state != STATE_BEGIN || leader == NULL || leader->done)
+        return FALSE;
+    return leader->ctx->state == STATE_BEGIN ||
+        leader->ctx->state == STATE_GET_TGT ||
+        leader->ctx->state == STATE_GET_TGT_OFFPATH;
+}
+
+/*
+ * Elect a leader among entries requesting tickets for the same foreign server
+ * realm.  The other entries wait for the leader to get a TGT for that realm
+ * into the staging ccache, so that the realm path is only walked once.
+ */
+static void
+choose_leaders(struct multi_entry *entries, size_t count,
+               krb5_creds *const *in_creds, krb5_principal client)
+{
+    size_t i, j;
+    const krb5_data *realm;
+
+    for (i = 0; i < count; i++) {
+        realm = &in_creds[i]->server->realm;
+        if (entries[i].done || krb5_is_referral_realm(realm) ||
+            data_eq(*realm, client->realm))
+            continue;
+        for (j = 0; j < i; j++) {
+            if (!entries[j].done && entries[j].leader == NULL &&
+                data_eq(in_creds[j]->server->realm, *realm)) {
+                entries[i].leader = &entries[j];
+                break;
+            }
+        }
+    }
+}
+
+/*
+ * Step each unfinished entry and make a request for each entry which needs
+ * one.  Return the number of requests made in *nreqs_out, with the index of
+ * each request's entry in map.
+ */
+static void
+step_entries(krb5_context context, struct multi_entry *entries, size_t count,
+             k5_kdc_request *reqs, size_t *map, size_t *nreqs_out)
+{
+    struct multi_entry *e;
+    krb5_error_code code;
+    unsigned int flags;
+    size_t i, nreqs = 0;
+
+    for (i = 0; i < count; i++) {
+        e = &entries[i];
+        if (e->done || follower_waiting(e))
+            continue;
+
+        krb5_free_data_contents(context, &e->request);
+        krb5_free_data_contents(context, &e->realm);
+        code = krb5_tkt_creds_step(context, e->ctx, &e->reply, &e->request,
+                                   &e->realm, &flags);
+        krb5_free_data_contents(context, &e->reply);
+        if (code == KRB5KRB_ERR_RESPONSE_TOO_BIG && !e->tcp_only) {
+            TRACE_TKT_CREDS_RETRY_TCP(context);
+            e->tcp_only = 1;
+        } else if (code != 0 || !(flags & KRB5_TKT_CREDS_STEP_FLAG_CONTINUE)) {
+            e->code = code;
+            e->done = TRUE;
+            continue;
+        }
+
+        reqs[nreqs].message = &e->request;
+        reqs[nreqs].realm = &e->realm;
+        reqs[nreqs].no_udp = e->tcp_only;
+        reqs[nreqs].use_master = 0;
+        map[nreqs++] = i;
+    }
+    *nreqs_out = nreqs;
+}
+
+/* Copy ccache into a new memory ccache for use by the contexts of a batch. */
+static krb5_error_code
+make_staging_ccache(krb5_context context, krb5_ccache ccache,
+                    krb5_principal *client_out, krb5_ccache *mcc_out)
+{
+    krb5_error_code code;
+    krb5_principal client = NULL;
+    krb5_ccache mcc = NULL;
+
+    *client_out = NULL;
+    *mcc_out = NULL;
+
+    code = krb5_cc_get_principal(context, ccache, &client);
+    if (code)
+        goto cleanup;
+    code = krb5_cc_new_unique(context, "MEMORY", NULL, &mcc);
+    if (code)
+        goto cleanup;
+    code = krb5_cc_initialize(context, mcc, client);
+    if (code)
+        goto cleanup;
+    code = krb5_cc_copy_creds(context, ccache, mcc);
+    if (code)
+        goto cleanup;
+
+    *client_out = client;
+    client = NULL;
+    *mcc_out = mcc;
+    mcc = NULL;
+
+cleanup:
+    krb5_free_principal(context, client);
+    if (mcc != NULL)
+        krb5_cc_destroy(context, mcc);
+    return code;
+}
+
+krb5_error_code KRB5_CALLCONV
+krb5_get_credentials_multi(krb5_context context, krb5_flags options,
+                           krb5_ccache ccache, size_t count,
+                           krb5_creds *const *in_creds,
+                           krb5_creds **out_creds, krb5_error_code *codes)
+{
+    krb5_error_code code, first_code = 0;
+    krb5_principal client = NULL;
+    krb5_ccache mcc = NULL;
+    struct multi_entry *entries = NULL, *e;
+    struct pending_creds pending = { NULL, 0 };
+    k5_kdc_request *reqs = NULL;
+    krb5_creds *ncreds;
+    size_t i, j, nreqs, *map = NULL;
+
+    for (i = 0; i < count; i++)
+        out_creds[i] = NULL;
+    if (count == 0)
+        return 0;
+
+    /* S4U2Proxy requests use a synchronous implementation. */
+    if (options & KRB5_GC_CONSTRAINED_DELEGATION) {
+        for (i = 0; i < count; i++) {
+            code = krb5_get_credentials(context, options, ccache, in_creds[i],
+                                        &out_creds[i]);
+            if (codes != NULL)
+                codes[i] = code;
+            if (code && !first_code)
+                first_code = code;
+        }
+        return first_code;
+    }
+
+    entries = k5calloc(count, sizeof(*entries), &code);
+    if (entries == NULL)
+        goto cleanup;
+    reqs = k5calloc(count, sizeof(*reqs), &code);
+    if (reqs == NULL)
+        goto cleanup;
+    map = k5calloc(count, sizeof(*map), &code);
+    if (map == NULL)
+        goto cleanup;
+
+    /* Share the ccache contents, and any TGTs obtained along the way, among
+     * all of the requests. */
+    code = make_staging_ccache(context, ccache, &client, &mcc);
+    if (code)
+        goto cleanup;
+
+    for (i = 0; i < count; i++) {
+        e = &entries[i];
+        e->code = krb5_tkt_creds_init(context, mcc, in_creds[i], options,
+                                      &e->ctx);
+        if (e->code) {
+            e->done = TRUE;
+            continue;
+        }
+        e->ctx->pending = &pending;
+    }
+    choose_leaders(entries, count, in_creds, client);
+
+    /* Make all of the requests needed at each step concurrently. */
+    for (;;) {
+        step_entries(context, entries, count, reqs, map, &nreqs);
+        if (nreqs == 0)
+            break;
+        code = k5_sendto_kdc_multi(context, reqs, nreqs);
+        if (code)
+            goto cleanup;
+        for (j = 0; j < nreqs; j++) {
+            e = &entries[map[j]];
+            if (reqs[j].code) {
+                e->code = reqs[j].code;
+                e->done = TRUE;
+            } else {
+                e->reply = reqs[j].reply;
+            }
+        }
+    }
+
+    /* Write the credentials obtained by all of the requests to ccache. */
+    for (i = 0; i < pending.count; i++)
+        (void)krb5_cc_store_cred(context, ccache, pending.list[i]);
+
+    for (i = 0; i < count; i++) {
+        e = &entries[i];
+        ncreds = k5alloc(sizeof(*ncreds), &code);
+        if (ncreds == NULL)
+            goto cleanup;
+        if (!e->code)
+            e->code = krb5_tkt_creds_get_creds(context, e->ctx, ncreds);
+        if (e->code == KRB5KDC_ERR_S_PRINCIPAL_UNKNOWN) {
+            e->code = try_canon_fallback(context, options, ccache,
+                                         in_creds[i], ncreds);
+        }
+        if (e->code)
+            krb5_free_creds(context, ncreds);
+        else
+            out_creds[i] = ncreds;
+    }
+
+    for (i = 0; i < count; i++) {
+        if (codes != NULL)
+            codes[i] = entries[i].code;
+        if (entries[i].code && !first_code)
+            first_code = entries[i].code;
+    }
+
+cleanup:
+    if (code) {
+        for (i = 0; i < count; i++) {
+            krb5_free_creds(context, out_creds[i]);
+            out_creds[i] = NULL;
+        }
+    }
+    for (i = 0; entries != NULL && i < count; i++) {
+        krb5_tkt_creds_free(context, entries[i].ctx);
+        krb5_free_data_contents(context, &entries[i].request);
+        krb5_free_data_contents(context, &entries[i].realm);
+        krb5_free_data_contents(context, &entries[i].reply);
+    }
+    for (i = 0; i < pending.count; i++)
+        krb5_free_creds(context, pending.list[i]);
+    free(pending.list);
+    if (mcc != NULL)
+        krb5_cc_destroy(context, mcc);
+    krb5_free_principal(context, client);
+    free(entries);
+    free(reqs);
+    free(map);
+    return code ? code : first_code;
+}
@@ -324,8 +324,13 @@ krb5_free_context(krb5_context ctx)
 #endif
 
     k5_ccselect_free_context(ctx);
+#ifndef _WIN32
+    k5_kcm_free_context(ctx);
+#endif
     k5_hostrealm_free_context(ctx);
     k5_localauth_free_context(ctx);
+    k5_sendto_free_context(ctx);
+    k5_rd_req_free_context(ctx);
     k5_plugin_free_context(ctx);
     free(ctx->plugin_base_dir);
     free(ctx->tls);
@@ -284,6 +284,140 @@ is_matching(krb5_context context, krb5_const_principal princ)
                 context->ignore_acceptor_hostname));
 }
 
+/*
+ * Keep krb5_key objects for the keytab keys which most recently decrypted
+ * tickets, so that their derived keys and cipher state can be reused by later
+ * AP-REQs.  Entries are looked up by key contents, so a keytab entry must
+ * still be present for its cached key to be used.  keys[0] is the most
+ * recently used.
+ */
+#define KEYCACHE_SIZE 8
+
+struct rd_req_keycache {
+    krb5_key keys[KEYCACHE_SIZE];
+    size_t count;
+};
+
+void
+k5_rd_req_free_context(krb5_context context)
+{
+    struct rd_req_keycache *cache = context->rd_req_keycache;
+    size_t i;
+
+    if (cache == NULL)
+        return;
+    for (i = 0; i < cache->count; i++)
+        krb5_k_free_key(context, cache->keys[i]);
+    free(cache);
+    context->rd_req_keycache = NULL;
+}
+
+/* Return the index of the cached key matching kb, or -1 if there is none. */
+static int
+keycache_find(krb5_context context, const krb5_keyblock *kb)
+{
+    struct rd_req_keycache *cache = context->rd_req_keycache;
+    krb5_keyblock *ckb;
+    size_t i;
+
+    if (cache == NULL)
+        return -1;
+    for (i = 0; i < cache->count; i++) {
+        ckb = &cache->keys[i]->keyblock;
+        if (ckb->enctype == kb->enctype && ckb->length == kb->length &&
+            k5_bcmp(ckb->contents, kb->contents, kb->length) == 0)
+            return i;
+    }
+    return -1;
+}
+
+/* Move the cached key at index i to the front of the cache. */
+static void
+keycache_promote(krb5_context context, int i)
+{
+    struct rd_req_keycache *cache = context->rd_req_keycache;
+    krb5_key key = cache->keys[i];
+
+    memmove(&cache->keys[1], &cache->keys[0], i * sizeof(*cache->keys));
+    cache->keys[0] = key;
+}
+
+/* Add key to the front of the cache, evicting the least recently used entry
+ * if the cache is full.  Failures are ignored; the cache is an
+ * optimization. */
+static void
+keycache_add(krb5_context context, krb5_key key)
+{
+    struct rd_req_keycache *cache = context->rd_req_keycache;
+
+    if (cache == NULL) {
+        cache = calloc(1, sizeof(*cache));
+        if (cache == NULL)
+            return;
+        context->rd_req_keycache = cache;
+    }
+    if (cache->count == KEYCACHE_SIZE)
+        krb5_k_free_key(context, cache->keys[--cache->count]);
+    memmove(&cache->keys[1], &cache->keys[0],
+            cache->count * sizeof(*cache->keys));
+    krb5_k_reference_key(context, key);
+    cache->keys[0] = key;
+    cache->count++;
+}
+
+/* Decrypt the encrypted part of ticket using key, as krb5_decrypt_tkt_part()
+ * does with a keyblock. */
+static krb5_error_code
+decrypt_tkt_part_k(krb5_context context, krb5_key key, krb5_ticket *ticket)
+{
+    krb5_error_code ret;
+    krb5_data plain;
+
+    if (!krb5_c_valid_enctype(ticket->enc_part.enctype))
+        return KRB5_PROG_ETYPE_NOSUPP;
+    if (!krb5_is_permitted_enctype(context, ticket->enc_part.enctype))
+        return KRB5_NOPERM_ETYPE;
+
+    ret = alloc_data(&plain, ticket->enc_part.ciphertext.length);
+    if (ret)
+        return ret;
+    ret = krb5_k_decrypt(context, key, KRB5_KEYUSAGE_KDC_REP_TICKET, NULL,
+                         &ticket->enc_part, &plain);
+    if (!ret)
+        ret = decode_krb5_enc_tkt_part(&plain, &ticket->enc_part2);
+    zapfree(plain.data, plain.length);
+    return ret;
+}
+
+/* Decrypt the ticket in req using the key in ent, using a cached key object
+ * if we have one for it.  Cache the key object if decryption succeeds. */
+static krb5_error_code
+decrypt_with_entry(krb5_context context, const krb5_ap_req *req,
+                   krb5_keytab_entry *ent)
+{
+    krb5_error_code ret;
+    krb5_key key;
+    int i;
+
+    i = keycache_find(context, &ent->key);
+    if (i >= 0) {
+        ret = decrypt_tkt_part_k(context, context->rd_req_keycache->keys[i],
+                                 req->ticket);
+        if (ret == 0)
+            keycache_promote(context, i);
+        return ret;
+    }
+
+    ret = krb5_k_create_key(context, &ent->key, &key);
+    if (ret)
+        return ret;
+    ret = decrypt_tkt_part_k(context, key, req->ticket);
+    if (ret == 0)
+        keycache_add(context, key);
+    krb5_k_free_key(context, key);
+    return ret;
+}
+
 /* Decrypt the ticket in req using the key in ent. */
 static krb5_error_code
 try_one_entry(krb5_context context, const krb5_ap_req *req,
@@ -293,7 +427,7 @@ try_one_entry(krb5_context context, const krb5_ap_req *req,
     krb5_principal tmp = NULL;
 
     /* Try decrypting the ticket with this entry's key. */
-    ret = krb5_decrypt_tkt_part(context, &ent->key, req->ticket);
+    ret = decrypt_with_entry(context, req, ent);
     if (ret)
         return ret;
 
@@ -345,15 +479,28 @@ try_one_princ(krb5_context context, const krb5_ap_req *req,
     return ret;
 }
 
+/* Which candidate keytab entries scan_keytab() should try. */
+enum scan_pass { TRY_ALL, TRY_CACHED, TRY_UNCACHED };
+
+/* Facts gathered by scan_keytab() for use in error reporting. */
+struct scan_info {
+    krb5_boolean tkt_server_mismatch, found_server_match;
+    krb5_boolean found_tkt_server, found_enctype;
+    krb5_boolean found_kvno, found_higher_kvno;
+    krb5_boolean skipped;
+};
+
 /*
- * Decrypt the ticket in req using an entry in keytab matching server (if
- * given).  Set req->ticket->server to the principal of the keytab entry used.
- * Store the decrypting key in *keyblock_out if it is not NULL.
+ * Iterate over keytab and try to decrypt the ticket in req with each entry
+ * matching server and the ticket enctype, subject to pass.  Return 0 if
+ * decryption succeeded and KRB5_KT_END if it did not.  Set info->skipped if
+ * any candidate entries were not tried because of pass.
  */
 static krb5_error_code
-decrypt_ticket(krb5_context context, const krb5_ap_req *req,
-               krb5_const_principal server, krb5_keytab keytab,
-               krb5_keyblock *keyblock_out)
+scan_keytab(krb5_context context, const krb5_ap_req *req,
+            krb5_const_principal server, krb5_keytab keytab,
+            krb5_keyblock *keyblock_out, enum scan_pass pass,
+            struct scan_info *info)
 {
     krb5_error_code ret;
     krb5_keytab_entry ent;
@@ -361,31 +508,8 @@ decrypt_ticket(krb5_context context, const krb5_ap_req *req,
     krb5_principal tkt_server = req->ticket->server;
     krb5_kvno tkt_kvno = req->ticket->enc_part.kvno;
     krb5_enctype tkt_etype = req->ticket->enc_part.enctype;
-    krb5_boolean similar_enctype;
-    krb5_boolean tkt_server_mismatch = FALSE, found_server_match = FALSE;
-    krb5_boolean found_tkt_server = FALSE, found_enctype = FALSE;
-    krb5_boolean found_kvno = FALSE, found_higher_kvno = FALSE;
+    krb5_boolean similar_enctype, cached;
 
-#ifdef LEAN_CLIENT
-    return KRB5KRB_AP_WRONG_PRINC;
-#else
-    /* If we have an explicit server principal, try just that one. */
-    if (!is_matching(context, server)) {
-        return try_one_princ(context, req, server, keytab, TRUE,
-                             keyblock_out);
-    }
-
-    if (keytab->ops->start_seq_get == NULL) {
-        /* We can't iterate over the keytab.  Try the principal asserted by the
-         * client if it's allowed by the server parameter. */
-        if (!krb5_sname_match(context, server, tkt_server))
-            return nomatch_error(context, server, tkt_server);
-        return try_one_princ(context, req, tkt_server, keytab, FALSE,
-                             keyblock_out);
-    }
-
-    /* Scan all keys in the keytab, in case the ticket server is an alias for
-     * one of the principals in the keytab. */
     ret = krb5_kt_start_seq_get(context, keytab, &cursor);
     if (ret) {
         k5_change_error_message_code(context, ret, KRB5KRB_AP_ERR_NOKEY);
@@ -395,24 +519,24 @@ decrypt_ticket(krb5_context context, const krb5_ap_req *req,
         /* Only try keys which match the server principal. */
         if (!krb5_sname_match(context, server, ent.principal)) {
             if (krb5_principal_compare(context, ent.principal, tkt_server))
-                tkt_server_mismatch = TRUE;
+                info->tkt_server_mismatch = TRUE;
             (void)krb5_free_keytab_entry_contents(context, &ent);
             continue;
         }
-        found_server_match = TRUE;
+        info->found_server_match = TRUE;
 
         if (krb5_c_enctype_compare(context, ent.key.enctype, tkt_etype,
                                    &similar_enctype) != 0)
             similar_enctype = FALSE;
 
         if (krb5_principal_compare(context, ent.principal, tkt_server)) {
-            found_tkt_server = TRUE;
+            info->found_tkt_server = TRUE;
             if (ent.vno == tkt_kvno) {
-                found_kvno = TRUE;
+                info->found_kvno = TRUE;
                 if (similar_enctype)
-                    found_enctype = TRUE;
+                    info->found_enctype = TRUE;
             } else if (ent.vno > tkt_kvno) {
-                found_higher_kvno = TRUE;
+                info->found_higher_kvno = TRUE;
             }
         }
 
@@ -420,7 +544,11 @@ decrypt_ticket(krb5_context context, const krb5_ap_req *req,
         if (similar_enctype) {
             /* Coerce inexact matches to the request enctype. */
             ent.key.enctype = tkt_etype;
-            if (try_one_entry(context, req, &ent, keyblock_out) == 0) {
+            cached = keycache_find(context, &ent.key) >= 0;
+            if ((pass == TRY_CACHED && !cached) ||
+                (pass == TRY_UNCACHED && cached)) {
+                info->skipped = TRUE;
+            } else if (try_one_entry(context, req, &ent, keyblock_out) == 0) {
                 TRACE_RD_REQ_DECRYPT_ANY(context, ent.principal, &ent.key);
                 (void)krb5_free_keytab_entry_contents(context, &ent);
                 break;
@@ -431,13 +559,67 @@ decrypt_ticket(krb5_context context, const krb5_ap_req *req,
     }
 
     (void)krb5_kt_end_seq_get(context, keytab, &cursor);
+    return ret;
+}
+
+/*
+ * Decrypt the ticket in req using an entry in keytab matching server (if
+ * given).  Set req->ticket->server to the principal of the keytab entry used.
+ * Store the decrypting key in *keyblock_out if it is not NULL.
+ */
+static krb5_error_code
+decrypt_ticket(krb5_context context, const krb5_ap_req *req,
+               krb5_const_principal server, krb5_keytab keytab,
+               krb5_keyblock *keyblock_out)
+{
+    krb5_error_code ret;
+    krb5_principal tkt_server = req->ticket->server;
+    krb5_kvno tkt_kvno = req->ticket->enc_part.kvno;
+    krb5_enctype tkt_etype = req->ticket->enc_part.enctype;
+    struct scan_info info = { FALSE };
+    krb5_boolean have_cached;
+
+#ifdef LEAN_CLIENT
+    return KRB5KRB_AP_WRONG_PRINC;
+#else
+    /* If we have an explicit server principal, try just that one. */
+    if (!is_matching(context, server)) {
+        return try_one_princ(context, req, server, keytab, TRUE,
+                             keyblock_out);
+    }
+
+    if (keytab->ops->start_seq_get == NULL) {
+        /* We can't iterate over the keytab.  Try the principal asserted by the
+         * client if it's allowed by the server parameter. */
+        if (!krb5_sname_match(context, server, tkt_server))
+            return nomatch_error(context, server, tkt_server);
+        return try_one_princ(context, req, tkt_server, keytab, FALSE,
+                             keyblock_out);
+    }
+
+    /*
+     * Scan all keys in the keytab, in case the ticket server is an alias for
+     * one of the principals in the keytab.  If we have cached keys, try the
+     * entries matching them first, to avoid setting up keys which are
+     * unlikely to work.  This cannot change which entry is used, since only
+     * an entry with the same key contents as a cached key could decrypt the
+     * ticket before it.
+     */
+    have_cached = context->rd_req_keycache != NULL &&
+        context->rd_req_keycache->count > 0;
+    ret = scan_keytab(context, req, server, keytab, keyblock_out,
+                      have_cached ? TRY_CACHED : TRY_ALL, &info);
+    if (ret == KRB5_KT_END && info.skipped) {
+        ret = scan_keytab(context, req, server, keytab, keyblock_out,
+                          TRY_UNCACHED, &info);
+    }
 
     if (ret != KRB5_KT_END)
         return ret;
     return iteration_error(context, server, tkt_server, tkt_kvno, tkt_etype,
-                           tkt_server_mismatch, found_server_match,
-                           found_tkt_server, found_kvno, found_higher_kvno,
-                           found_enctype);
+                           info.tkt_server_mismatch, info.found_server_match,
+                           info.found_tkt_server, info.found_kvno,
+                           info.found_higher_kvno, info.found_enctype);
 #endif /* LEAN_CLIENT */
 }
 
@@ -10,6 +10,7 @@
 #include "k5-platform.h"
 #include "cc-int.h"
 #include "kt-int.h"
+#include "rc-int.h"
 #include "os-proto.h"
 
 /*
@@ -45,6 +46,9 @@ int krb5int_lib_init(void)
         return err;
 #endif /* LEAN_CLIENT */
     err = krb5int_cc_initialize();
+    if (err)
+        return err;
+    err = krb5int_rc_initialize();
     if (err)
         return err;
     err = k5_mutex_finish_init(&krb5int_us_time_mutex);
@@ -79,6 +83,7 @@ void krb5int_lib_fini(void)
 
     k5_mutex_destroy(&krb5int_us_time_mutex);
 
+    krb5int_rc_finalize();
     krb5int_cc_finalize();
 #ifndef LEAN_CLIENT
     krb5int_kt_finalize();
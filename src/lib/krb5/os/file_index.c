@@ -0,0 +1,191 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/* lib/krb5/os/file_index.c - In-memory indexes of file contents */
+/*
+ * Copyright (C) 2020 by the Massachusetts Institute of Technology.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in
+ *   the documentation and/or other materials provided with the
+ *   distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * The FILE ccache and keytab types keep per-process copies of the contents of
+ * recently read files, so that lookups need not read and decode the whole
+ * file each time.  A copy is only used while the file's device, inode, size,
+ * and modification time match the values observed when it was loaded.  Both
+ * file formats are modified in place, possibly without changing the file
+ * size, so we rely on the modification time to detect such changes, and do
+ * not trust the stamp of a file modified within the last FILE_SETTLE_TIME
+ * seconds (when a later write might not change the timestamp).
+ *
+ * The items of an index are grouped into hash buckets, in file order within
+ * each bucket, so that a lookup finds the same item a scan of the file would.
+ * The indexes of a file type are kept on a list, most recently used first.
+ */
+
+#include "k5-int.h"
+#include "os-proto.h"
+
+#define FILE_SETTLE_TIME 2
+
+void
+k5_file_stamp_get(const struct stat *sb, struct k5_file_stamp *stamp)
+{
+    memset(stamp, 0, sizeof(*stamp));
+    stamp->dev = sb->st_dev;
+    stamp->ino = sb->st_ino;
+    stamp->size = sb->st_size;
+    stamp->mtime = sb->st_mtime;
+#if defined HAVE_STRUCT_STAT_ST_MTIMENSEC
+    stamp->mtime_frac = sb->st_mtimensec;
+#elif defined HAVE_STRUCT_STAT_ST_MTIMESPEC_TV_NSEC
+    stamp->mtime_frac = sb->st_mtimespec.tv_nsec;
+#elif defined HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC
+    stamp->mtime_frac = sb->st_mtim.tv_nsec;
+#endif
+}
+
+krb5_boolean
+k5_file_stamps_equal(const struct k5_file_stamp *a,
+                     const struct k5_file_stamp *b)
+{
+    return a->dev == b->dev && a->ino == b->ino && a->size == b->size &&
+        a->mtime == b->mtime && a->mtime_frac == b->mtime_frac;
+}
+
+krb5_boolean
+k5_file_stamp_settling(const struct k5_file_stamp *stamp)
+{
+    return stamp->mtime >= time(NULL) - FILE_SETTLE_TIME;
+}
+
+uint32_t
+k5_fnv_hash_data(uint32_t h, const krb5_data *d)
+{
+    unsigned int i;
+
+    h = (h ^ d->length) * 16777619U;
+    for (i = 0; i < d->length; i++)
+        h = (h ^ (unsigned char)d->data[i]) * 16777619U;
+    return h;
+}
+
+krb5_error_code
+k5_file_index_build(struct k5_file_index *ix, void *items, size_t nitems,
+                    size_t itemsize, uint32_t (*hash)(const void *item))
+{
+    unsigned char *sorted, *base = items;
+    size_t i, b, *pos;
+    uint32_t *hashes;
+
+    ix->nbuckets = 8;
+    while (ix->nbuckets < nitems)
+        ix->nbuckets *= 2;
+    ix->bucket_start = calloc(ix->nbuckets + 1, sizeof(*ix->bucket_start));
+    hashes = calloc(nitems + 1, sizeof(*hashes));
+    pos = calloc(ix->nbuckets, sizeof(*pos));
+    sorted = calloc(nitems + 1, itemsize);
+    if (ix->bucket_start == NULL || hashes == NULL || pos == NULL ||
+        sorted == NULL) {
+        free(hashes);
+        free(pos);
+        free(sorted);
+        return ENOMEM;
+    }
+
+    /* Count the items in each bucket, then compute the bucket start
+     * positions. */
+    for (i = 0; i < nitems; i++) {
+        hashes[i] = hash(base + i * itemsize) & (ix->nbuckets - 1);
+        ix->bucket_start[hashes[i] + 1]++;
+    }
+    for (b = 0; b < ix->nbuckets; b++) {
+        ix->bucket_start[b + 1] += ix->bucket_start[b];
+        pos[b] = ix->bucket_start[b];
+    }
+
+    for (i = 0; i < nitems; i++) {
+        memcpy(sorted + pos[hashes[i]]++ * itemsize, base + i * itemsize,
+               itemsize);
+    }
+    if (nitems > 0)
+        memcpy(base, sorted, nitems * itemsize);
+    free(sorted);
+    free(hashes);
+    free(pos);
+    return 0;
+}
+
+void
+k5_file_index_bucket(const struct k5_file_index *ix, uint32_t hash,
+                     size_t *start_out, size_t *end_out)
+{
+    size_t b = hash & (ix->nbuckets - 1);
+
+    *start_out = ix->bucket_start[b];
+    *end_out = ix->bucket_start[b + 1];
+}
+
+struct k5_file_index *
+k5_file_index_unlink(struct k5_file_index **list, const char *filename)
+{
+    struct k5_file_index **ixp, *ix;
+
+    for (ixp = list; *ixp != NULL; ixp = &(*ixp)->next) {
+        ix = *ixp;
+        if (strcmp(ix->filename, filename) == 0) {
+            *ixp = ix->next;
+            ix->next = NULL;
+            return ix;
+        }
+    }
+    return NULL;
+}
+
+struct k5_file_index *
+k5_file_index_add(struct k5_file_index **list, struct k5_file_index *ix,
+                  int max)
+{
+    struct k5_file_index **ixp;
+    int count = 1;
+
+    ix->next = *list;
+    *list = ix;
+    for (ixp = &ix->next; *ixp != NULL; ixp = &(*ixp)->next) {
+        if (++count > max) {
+            ix = *ixp;
+            *ixp = NULL;
+            return ix;
+        }
+    }
+    return NULL;
+}
+
+void
+k5_file_index_free_contents(struct k5_file_index *ix)
+{
+    free(ix->bucket_start);
+    free(ix->filename);
+}
@@ -37,20 +37,147 @@
  */
 
 #include "k5-int.h"
+#include "k5-queue.h"
+#include "k5-hashtab.h"
 #include "os-proto.h"
 #include <krb5/hostrealm_plugin.h>
 
 #ifdef KRB5_DNS_LOOKUP
 
+/*
+ * The answers to TXT record queries are cached in the module data, so that a
+ * process looking up the realms of many hosts in the same domains doesn't
+ * repeat the queries for the parent domains.  The TTLs of the records aren't
+ * available, so found realms are kept for TXT_POSITIVE_TTL seconds and failed
+ * lookups for TXT_NEGATIVE_TTL seconds.  At most TXT_CACHE_MAX answers are
+ * kept, discarding failed lookups first.
+ */
+#define TXT_POSITIVE_TTL 300
+#define TXT_NEGATIVE_TTL 60
+#define TXT_CACHE_MAX 1024
+
+struct txt_entry {
+    K5_TAILQ_ENTRY(txt_entry) links;
+    char *name;
+    char *realm;                /* NULL if the lookup failed */
+    time_t expires;
+};
+
+K5_TAILQ_HEAD(txt_queue, txt_entry);
+
+struct krb5_hostrealm_moddata_st {
+    struct k5_hashtab *hash_table;
+    /* Each queue is in order of expiration, as its entries share a TTL. */
+    struct txt_queue positive;
+    struct txt_queue negative;
+    size_t count;
+};
+
+/* Remove entry from the hash table and its queue, and free it. */
+static void
+discard_entry(krb5_hostrealm_moddata data, struct txt_entry *entry)
+{
+    struct txt_queue *queue;
+
+    queue = (entry->realm != NULL) ? &data->positive : &data->negative;
+    k5_hashtab_remove(data->hash_table, entry->name, strlen(entry->name));
+    K5_TAILQ_REMOVE(queue, entry, links);
+    data->count--;
+    free(entry->name);
+    free(entry->realm);
+    free(entry);
+}
+
+/* Discard the entries of queue which have expired as of now. */
+static void
+expire_queue(krb5_hostrealm_moddata data, struct txt_queue *queue, time_t now)
+{
+    struct txt_entry *e, *next;
+
+    K5_TAILQ_FOREACH_SAFE(e, queue, links, next) {
+        if (e->expires > now)
+            break;
+        discard_entry(data, e);
+    }
+}
+
+/* Cache the answer realm (NULL for a failed lookup) for name.  Errors are
+ * ignored, as the answer can always be looked up again. */
+static void
+add_entry(krb5_hostrealm_moddata data, const char *name, const char *realm,
+          time_t now)
+{
+    struct txt_entry *entry, *oldest;
+    struct txt_queue *queue;
+
+    if (data->count >= TXT_CACHE_MAX) {
+        oldest = K5_TAILQ_FIRST(&data->negative);
+        if (oldest == NULL)
+            oldest = K5_TAILQ_FIRST(&data->positive);
+        discard_entry(data, oldest);
+    }
+
+    entry = calloc(1, sizeof(*entry));
+    if (entry == NULL)
+        return;
+    entry->name = strdup(name);
+    entry->realm = (realm != NULL) ? strdup(realm) : NULL;
+    if (entry->name == NULL || (realm != NULL && entry->realm == NULL) ||
+        k5_hashtab_add(data->hash_table, entry->name, strlen(entry->name),
+                       entry) != 0) {
+        free(entry->name);
+        free(entry->realm);
+        free(entry);
+        return;
+    }
+    entry->expires = now + ((realm != NULL) ? TXT_POSITIVE_TTL :
+                            TXT_NEGATIVE_TTL);
+    queue = (realm != NULL) ? &data->positive : &data->negative;
+    K5_TAILQ_INSERT_TAIL(queue, entry, links);
+    data->count++;
+}
+
+/* Look up a _kerberos TXT record for name (NULL for the global record) using
+ * the cache in data, and return the realm in *realm_out. */
+static krb5_error_code
+cached_txt_rr(krb5_context context, krb5_hostrealm_moddata data,
+              const char *name, char **realm_out)
+{
+    krb5_error_code ret;
+    struct txt_entry *entry;
+    const char *key = (name != NULL) ? name : "";
+    time_t now = time(NULL);
+
+    *realm_out = NULL;
+    expire_queue(data, &data->positive, now);
+    expire_queue(data, &data->negative, now);
+
+    entry = k5_hashtab_get(data->hash_table, key, strlen(key));
+    if (entry != NULL) {
+        if (entry->realm == NULL)
+            return KRB5_ERR_HOST_REALM_UNKNOWN;
+        *realm_out = strdup(entry->realm);
+        return (*realm_out == NULL) ? ENOMEM : 0;
+    }
+
+    ret = k5_try_realm_txt_rr(context, "_kerberos", name, realm_out);
+    if (ret == 0)
+        add_entry(data, key, *realm_out, now);
+    else if (ret == KRB5_ERR_HOST_REALM_UNKNOWN)
+        add_entry(data, key, NULL, now);
+    return ret;
+}
+
 /* Try a _kerberos TXT lookup for fqdn and each parent domain; return the
  * resulting realm (caller must free) or NULL. */
 static char *
-txt_lookup(krb5_context context, const char *fqdn)
+txt_lookup(krb5_context context, krb5_hostrealm_moddata data,
+           const char *fqdn)
 {
     char *realm;
 
     while (fqdn != NULL && *fqdn != '\0') {
-        if (k5_try_realm_txt_rr(context, "_kerberos", fqdn, &realm) == 0)
+        if (cached_txt_rr(context, data, fqdn, &realm) == 0)
             return realm;
         fqdn = strchr(fqdn, '.');
         if (fqdn != NULL)
@@ -71,7 +198,7 @@ dns_fallback_realm(krb5_context context, krb5_hostrealm_moddata data,
         return KRB5_PLUGIN_NO_HANDLE;
 
     /* Try a TXT record lookup for each component of host. */
-    realm = txt_lookup(context, host);
+    realm = txt_lookup(context, data, host);
     if (realm == NULL)
         return KRB5_PLUGIN_NO_HANDLE;
     ret = k5_make_realmlist(realm, realms_out);
@@ -96,10 +223,10 @@ dns_default_realm(krb5_context context, krb5_hostrealm_moddata data,
 
     /* If we don't find a TXT record for localhost or any parent, look for a
      * global record. */
-    realm = txt_lookup(context, localhost);
+    realm = txt_lookup(context, data, localhost);
     free(localhost);
     if (realm == NULL)
-        (void)k5_try_realm_txt_rr(context, "_kerberos", NULL, &realm);
+        (void)cached_txt_rr(context, data, NULL, &realm);
 
     if (realm == NULL)
         return KRB5_PLUGIN_NO_HANDLE;
@@ -115,6 +242,48 @@ dns_free_realmlist(krb5_context context, krb5_hostrealm_moddata data,
     krb5_free_host_realm(context, list);
 }
 
+static krb5_error_code
+dns_init(krb5_context context, krb5_hostrealm_moddata *data_out)
+{
+    krb5_error_code ret;
+    krb5_hostrealm_moddata data;
+    uint8_t seed[K5_HASH_SEED_LEN];
+    krb5_data seed_data = make_data(seed, sizeof(seed));
+
+    *data_out = NULL;
+
+    ret = krb5_c_random_make_octets(context, &seed_data);
+    if (ret)
+        return ret;
+
+    data = calloc(1, sizeof(*data));
+    if (data == NULL)
+        return ENOMEM;
+    ret = k5_hashtab_create(seed, 64, &data->hash_table);
+    if (ret) {
+        free(data);
+        return ret;
+    }
+    K5_TAILQ_INIT(&data->positive);
+    K5_TAILQ_INIT(&data->negative);
+
+    *data_out = data;
+    return 0;
+}
+
+static void
+dns_fini(krb5_context context, krb5_hostrealm_moddata data)
+{
+    struct txt_entry *e, *next;
+
+    K5_TAILQ_FOREACH_SAFE(e, &data->positive, links, next)
+        discard_entry(data, e);
+    K5_TAILQ_FOREACH_SAFE(e, &data->negative, links, next)
+        discard_entry(data, e);
+    k5_hashtab_free(data->hash_table);
+    free(data);
+}
+
 krb5_error_code
 hostrealm_dns_initvt(krb5_context context, int maj_ver, int min_ver,
                      krb5_plugin_vtable vtable)
@@ -122,6 +291,8 @@ hostrealm_dns_initvt(krb5_context context, int maj_ver, int min_ver,
     krb5_hostrealm_vtable vt = (krb5_hostrealm_vtable)vtable;
 
     vt->name = "dns";
+    vt->init = dns_init;
+    vt->fini = dns_fini;
     vt->fallback_realm = dns_fallback_realm;
     vt->default_realm = dns_default_realm;
     vt->free_list = dns_free_realmlist;
@@ -40,6 +40,176 @@
 #include "os-proto.h"
 #include <krb5/hostrealm_plugin.h>
 
+/*
+ * To avoid a profile lookup for every suffix of every host, the module keeps
+ * a trie of the [domain_realm] relation names, keyed on their characters in
+ * reverse order, so that a host's suffixes can all be matched in one walk
+ * from the end of the host name.  The trie is rebuilt when the profile
+ * library reloads any of the profile's files.  Profiles with in-memory
+ * modifications or a vtable are searched directly instead.
+ */
+
+struct suffix_node {
+    char c;
+    char *realm;                /* realm mapped by this suffix, or NULL */
+    struct suffix_node *child;
+    struct suffix_node *sibling;
+};
+
+struct krb5_hostrealm_moddata_st {
+    struct suffix_node *trie;
+    unsigned long serial;       /* profile serial when the trie was built */
+};
+
+static void
+free_trie(struct suffix_node *node)
+{
+    struct suffix_node *next;
+
+    for (; node != NULL; node = next) {
+        next = node->sibling;
+        free_trie(node->child);
+        free(node->realm);
+        free(node);
+    }
+}
+
+/* Return the child of node for the character c, creating it if create is
+ * true.  Return NULL if there is no such child or memory is exhausted. */
+static struct suffix_node *
+trie_child(struct suffix_node *node, char c, krb5_boolean create)
+{
+    struct suffix_node *child;
+
+    for (child = node->child; child != NULL; child = child->sibling) {
+        if (child->c == c)
+            return child;
+    }
+    if (!create)
+        return NULL;
+    child = calloc(1, sizeof(*child));
+    if (child == NULL)
+        return NULL;
+    child->c = c;
+    child->sibling = node->child;
+    node->child = child;
+    return child;
+}
+
+/* Add a mapping from name to realm to the trie at root, unless name already
+ * has a mapping. */
+static krb5_error_code
+trie_add(struct suffix_node *root, const char *name, const char *realm)
+{
+    struct suffix_node *node = root;
+    size_t i;
+
+    for (i = strlen(name); i > 0; i--) {
+        node = trie_child(node, name[i - 1], TRUE);
+        if (node == NULL)
+            return ENOMEM;
+    }
+    if (node->realm == NULL) {
+        node->realm = strdup(realm);
+        if (node->realm == NULL)
+            return ENOMEM;
+    }
+    return 0;
+}
+
+/* Build a trie from the [domain_realm] section of the profile. */
+static krb5_error_code
+build_trie(krb5_context context, struct suffix_node **trie_out)
+{
+    krb5_error_code ret;
+    struct suffix_node *root;
+    const char *names[] = { KRB5_CONF_DOMAIN_REALM, NULL };
+    void *iter = NULL;
+    char *name = NULL, *value = NULL;
+
+    *trie_out = NULL;
+    root = calloc(1, sizeof(*root));
+    if (root == NULL)
+        return ENOMEM;
+    ret = profile_iterator_create(context->profile, names,
+                                  PROFILE_ITER_LIST_SECTION |
+                                  PROFILE_ITER_RELATIONS_ONLY, &iter);
+    if (ret)
+        goto cleanup;
+    for (;;) {
+        ret = profile_iterator(&iter, &name, &value);
+        if (ret || name == NULL)
+            break;
+        ret = trie_add(root, name, value);
+        profile_release_string(name);
+        profile_release_string(value);
+        if (ret)
+            break;
+    }
+    if (!ret) {
+        *trie_out = root;
+        root = NULL;
+    }
+
+cleanup:
+    profile_iterator_free(&iter);
+    free_trie(root);
+    return ret;
+}
+
+/* Return true if the suffix of host at offset i is one of the names searched
+ * for in [domain_realm]: host itself, or a suffix beginning at or just after
+ * a period. */
+static inline krb5_boolean
+is_candidate(const char *host, size_t i)
+{
+    return i == 0 || host[i] == '.' || host[i - 1] == '.';
+}
+
+/* Return the realm of the longest candidate suffix of host in trie, or NULL
+ * if there is none. */
+static const char *
+trie_lookup(struct suffix_node *trie, const char *host)
+{
+    struct suffix_node *node = trie;
+    const char *realm = NULL;
+    size_t i = strlen(host);
+
+    for (;;) {
+        if (node->realm != NULL && is_candidate(host, i))
+            realm = node->realm;
+        if (i == 0)
+            break;
+        node = trie_child(node, host[--i], FALSE);
+        if (node == NULL)
+            break;
+    }
+    return realm;
+}
+
+/* Return a current trie for the profile, or NULL if one could not be
+ * built. */
+static struct suffix_node *
+get_trie(krb5_context context, krb5_hostrealm_moddata data)
+{
+    unsigned long serial;
+    int modified;
+
+    if (profile_get_serial(context->profile, &serial) != 0 ||
+        profile_is_modified(context->profile, &modified) != 0 || modified) {
+        free_trie(data->trie);
+        data->trie = NULL;
+        return NULL;
+    }
+    if (data->trie != NULL && data->serial == serial)
+        return data->trie;
+    free_trie(data->trie);
+    data->trie = NULL;
+    if (build_trie(context, &data->trie) == 0)
+        data->serial = serial;
+    return data->trie;
+}
+
 /*
  * Search progressively shorter suffixes of host in the [domain_realms] section
  * of the profile to find the realm.  For example, given a host a.b.c, try to
@@ -51,7 +221,8 @@ profile_host_realm(krb5_context context, krb5_hostrealm_moddata data,
                    const char *host, char ***realms_out)
 {
     krb5_error_code ret;
-    const char *p;
+    struct suffix_node *trie;
+    const char *p, *realm;
     char *prof_realm;
 
     *realms_out = NULL;
@@ -60,6 +231,14 @@ profile_host_realm(krb5_context context, krb5_hostrealm_moddata data,
     if (k5_is_numeric_address(host))
         return KRB5_PLUGIN_NO_HANDLE;
 
+    trie = get_trie(context, data);
+    if (trie != NULL) {
+        realm = trie_lookup(trie, host);
+        if (realm == NULL)
+            return KRB5_PLUGIN_NO_HANDLE;
+        return k5_make_realmlist(realm, realms_out);
+    }
+
     /* Look for the host and each suffix in the [domain_realms] section. */
     for (p = host; p != NULL; p = (*p == '.') ? p + 1 : strchr(p, '.')) {
         ret = profile_get_string(context->profile, KRB5_CONF_DOMAIN_REALM, p,
@@ -96,6 +275,20 @@ profile_default_realm(krb5_context context, krb5_hostrealm_moddata data,
     return ret;
 }
 
+static krb5_error_code
+profile_module_init(krb5_context context, krb5_hostrealm_moddata *data_out)
+{
+    *data_out = calloc(1, sizeof(**data_out));
+    return (*data_out == NULL) ? ENOMEM : 0;
+}
+
+static void
+profile_module_fini(krb5_context context, krb5_hostrealm_moddata data)
+{
+    free_trie(data->trie);
+    free(data);
+}
+
 static void
 profile_free_realmlist(krb5_context context, krb5_hostrealm_moddata data,
                        char **list)
@@ -110,6 +303,8 @@ hostrealm_profile_initvt(krb5_context context, int maj_ver, int min_ver,
     krb5_hostrealm_vtable vt = (krb5_hostrealm_vtable)vtable;
 
     vt->name = "profile";
+    vt->init = profile_module_init;
+    vt->fini = profile_module_fini;
     vt->host_realm = profile_host_realm;
     vt->default_realm = profile_default_realm;
     vt->free_list = profile_free_realmlist;
@@ -153,6 +153,8 @@ krb5_error_code k5_sendto(krb5_context context, const krb5_data *message,
                                              void *),
                           void *msg_handler_data);
 
+void k5_sendto_free_context(krb5_context context);
+
 krb5_error_code krb5int_get_fq_local_hostname(char **);
 
 /* The io vector is *not* const here, unlike writev()!  */
@@ -185,6 +187,63 @@ krb5_error_code k5_write_messages(krb5_context, krb5_pointer, krb5_data *,
                                   int);
 void k5_init_trace(krb5_context context);
 
+/* The identity and modification time of a file, used to tell whether an
+ * in-memory copy of its contents is current.  See file_index.c. */
+struct k5_file_stamp {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+    unsigned long mtime_frac;
+};
+
+/* An in-memory index of the items in a file.  Users embed this structure as
+ * the first member of a structure holding the items. */
+struct k5_file_index {
+    struct k5_file_index *next;
+    char *filename;
+    struct k5_file_stamp stamp;
+    size_t *bucket_start;       /* nbuckets + 1 indices into the items */
+    size_t nbuckets;            /* a power of two */
+};
+
+#define K5_FNV_HASH_INIT 2166136261U
+
+void k5_file_stamp_get(const struct stat *sb, struct k5_file_stamp *stamp);
+krb5_boolean k5_file_stamps_equal(const struct k5_file_stamp *a,
+                                  const struct k5_file_stamp *b);
+
+/* Return true if a file with stamp might still be modified without changing
+ * its stamp. */
+krb5_boolean k5_file_stamp_settling(const struct k5_file_stamp *stamp);
+
+/* Continue an FNV-1a hash h (starting at K5_FNV_HASH_INIT) with the length
+ * and contents of d. */
+uint32_t k5_fnv_hash_data(uint32_t h, const krb5_data *d);
+
+/* Reorder the nitems items (each itemsize bytes) in items into hash buckets
+ * according to hash, preserving their order within each bucket, and set
+ * ix->bucket_start and ix->nbuckets. */
+krb5_error_code k5_file_index_build(struct k5_file_index *ix, void *items,
+                                    size_t nitems, size_t itemsize,
+                                    uint32_t (*hash)(const void *item));
+
+/* Get the range of item indices in the bucket of ix for hash. */
+void k5_file_index_bucket(const struct k5_file_index *ix, uint32_t hash,
+                          size_t *start_out, size_t *end_out);
+
+/* Unlink and return the index for filename from list, if there is one. */
+struct k5_file_index *k5_file_index_unlink(struct k5_file_index **list,
+                                           const char *filename);
+
+/* Add ix to the front of list, evicting the least recently used index if the
+ * list holds more than max indexes.  Return the evicted index, if any. */
+struct k5_file_index *k5_file_index_add(struct k5_file_index **list,
+                                        struct k5_file_index *ix, int max);
+
+/* Free the filename and buckets of ix, but not ix itself. */
+void k5_file_index_free_contents(struct k5_file_index *ix);
+
 #include "k5-thread.h"
 extern k5_mutex_t krb5int_us_time_mutex;
 
@@ -79,6 +79,18 @@
 #define DEFAULT_UDP_PREF_LIMIT   1465
 #define HARD_UDP_LIMIT          32700 /* could probably do 64K-epsilon ? */
 #define PORT_LENGTH                 6 /* decimal repr of UINT16_MAX */
+#define MAX_CACHED_CONNS            8
+
+/* Once a stream connection is established (or a cached one is taken for
+ * reuse), wait this long for the exchange to finish before moving on; see
+ * the exception described above k5_sendto(). */
+#define STREAM_EXCHANGE_TIMEOUT 10000
+
+/* The number of sendto states run_sendto_states() drives at once.  Each
+ * state may hold a socket for every address it has contacted, so the rest are
+ * queued to keep the sockets polled together within MAX_POLLFDS or
+ * FD_SETSIZE. */
+#define MAX_ACTIVE_SENDTOS 32
 
 /* Select state flags.  */
 #define SSF_READ 0x01
@@ -136,15 +148,109 @@ struct conn_state {
     struct conn_state *next;
     time_ms endtime;
     krb5_boolean defer;
+    krb5_boolean reused;
     struct {
         const char *uri_path;
         const char *servername;
         char port[PORT_LENGTH];
         char *https_request;
         k5_tls_handle tls;
+        krb5_boolean keepalive;
+        size_t scan_pos;        /* input searched for the end of headers */
+        size_t body_pos;        /* offset of the response body, or 0 */
+        krb5_boolean have_length;
+        unsigned long content_length;
     } http;
 };
 
+/* An idle stream connection to a KDC, kept open after a successful exchange
+ * for use by later requests to the same address. */
+struct cached_conn {
+    struct remote_address addr;
+    SOCKET fd;
+    k5_tls_handle tls;
+    char *servername;
+    char port[PORT_LENGTH];
+    time_ms idle_since;
+    struct cached_conn *next;
+};
+
+/* A serialized TLS session for an HTTPS proxy server, used to avoid a full
+ * handshake when a new connection must be made to the same server. */
+struct cached_tls_session {
+    char *servername;
+    char port[PORT_LENGTH];
+    krb5_data session;
+    struct cached_tls_session *next;
+};
+
+struct sendto_conncache {
+    time_ms idle_timeout;       /* zero if connection reuse is disabled */
+    struct cached_conn *conns;
+    struct cached_tls_session *sessions;
+};
+
+/* Phases of a sendto operation, following the timing described above
+ * k5_sendto(). */
+enum sendto_phase {
+    FIRST_PASS,                 /* Contacting preferred-transport addresses */
+    DEFERRED_PASS,              /* Contacting non-preferred addresses */
+    FIRST_PASS_END,             /* Waiting 2s at the end of the first pass */
+    RETRY_PASS,                 /* Making another pass over all addresses */
+    RETRY_PASS_END              /* Waiting for the backoff delay */
+};
+
+/*
+ * The progress of a single k5_sendto() operation.  A sendto_state never
+ * blocks; run_sendto_states() polls the sockets of one or more states at once
+ * and advances each state as its sockets become ready or its waits expire.
+ * This can be pretty large, so should not be stack-allocated.
+ */
+struct sendto_state {
+    const krb5_data *message;
+    const krb5_data *realm;
+    const struct serverlist *servers;
+    k5_transport_strategy strategy;
+    struct sendto_callback_info *callback_info;
+    int (*msg_handler)(krb5_context, const krb5_data *, void *);
+    void *msg_handler_data;
+
+    struct conn_state *conns;
+    struct select_state selstate;
+    char *udpbuf;
+
+    enum sendto_phase phase;
+    size_t server;              /* Next server to resolve in FIRST_PASS */
+    struct conn_state *next;    /* Next connection to contact in this pass */
+    int pass;
+    time_ms delay;
+    krb5_boolean waiting;
+    time_ms wait_end;
+    krb5_boolean polled;
+
+    krb5_boolean done;
+    krb5_error_code error;
+    struct conn_state *winner;
+};
+
+static krb5_error_code
+begin_sendto(krb5_context context, const krb5_data *message,
+             const krb5_data *realm, const struct serverlist *servers,
+             k5_transport_strategy strategy,
+             struct sendto_callback_info *callback_info,
+             int (*msg_handler)(krb5_context, const krb5_data *, void *),
+             void *msg_handler_data, struct sendto_state **st_out);
+static void free_sendto_state(krb5_context context, struct sendto_state *st);
+static krb5_error_code run_sendto_states(krb5_context context,
+                                         struct sendto_state **states,
+                                         size_t count);
+static krb5_error_code sendto_result(krb5_context context,
+                                     struct sendto_state *st,
+                                     krb5_data *reply,
+                                     struct sockaddr *remoteaddr,
+                                     socklen_t *remoteaddrlen,
+                                     int *server_used);
+
 /* Set up context->tls.  On allocation failure, return ENOMEM.  On plugin load
  * failure, set context->tls to point to a nulled vtable and return 0. */
 static krb5_error_code
@@ -195,6 +301,296 @@ free_http_tls_data(krb5_context context, struct conn_state *state)
     state->http.https_request = NULL;
 }
 
+static void
+free_cached_conn(krb5_context context, struct cached_conn *entry)
+{
+    if (entry->tls != NULL)
+        context->tls->free_handle(context, entry->tls);
+    closesocket(entry->fd);
+    free(entry->servername);
+    free(entry);
+}
+
+static void
+free_cached_tls_session(struct cached_tls_session *entry)
+{
+    free(entry->servername);
+    zapfree(entry->session.data, entry->session.length);
+    free(entry);
+}
+
+/* Set up context->kdc_conncache if we haven't already, reading the idle
+ * timeout from the profile. */
+static krb5_error_code
+init_conncache(krb5_context context)
+{
+    struct sendto_conncache *cache;
+    krb5_deltat timeout = 0;
+    char *str = NULL;
+
+    if (context->kdc_conncache != NULL)
+        return 0;
+
+    cache = calloc(1, sizeof(*cache));
+    if (cache == NULL)
+        return ENOMEM;
+
+    /* Ignore profile errors and invalid values; reuse is optional. */
+    if (profile_get_string(context->profile, KRB5_CONF_LIBDEFAULTS,
+                           KRB5_CONF_KDC_CONNECTION_IDLE_TIMEOUT, NULL, NULL,
+                           &str) == 0 && str != NULL) {
+        if (krb5_string_to_deltat(str, &timeout) != 0 || timeout < 0)
+            timeout = 0;
+        profile_release_string(str);
+    }
+    cache->idle_timeout = (time_ms)timeout * 1000;
+    context->kdc_conncache = cache;
+    return 0;
+}
+
+static inline krb5_boolean
+conncache_enabled(krb5_context context)
+{
+    return context->kdc_conncache != NULL &&
+        context->kdc_conncache->idle_timeout > 0;
+}
+
+/* Close cached connections which have been idle for too long. */
+static void
+expire_cached_conns(krb5_context context, struct sendto_conncache *cache,
+                    time_ms now)
+{
+    struct cached_conn **ptr = &cache->conns, *entry;
+
+    while (*ptr != NULL) {
+        entry = *ptr;
+        if (now - entry->idle_since >= cache->idle_timeout) {
+            TRACE_SENDTO_KDC_TCP_DISCONNECT(context, &entry->addr);
+            *ptr = entry->next;
+            free_cached_conn(context, entry);
+        } else {
+            ptr = &entry->next;
+        }
+    }
+}
+
+/* Return true if an idle connection has been closed by the peer or has
+ * unexpected data waiting on it. */
+static krb5_boolean
+idle_conn_is_stale(SOCKET fd)
+{
+    char c;
+    ssize_t ret;
+
+    ret = recv(fd, &c, 1, MSG_PEEK);
+    return ret >= 0 || (SOCKET_ERRNO != EWOULDBLOCK && SOCKET_ERRNO != EAGAIN);
+}
+
+static krb5_boolean
+conn_matches(struct cached_conn *entry, struct conn_state *state)
+{
+    if (entry->addr.transport != state->addr.transport ||
+        entry->addr.family != state->addr.family ||
+        entry->addr.len != state->addr.len ||
+        memcmp(&entry->addr.saddr, &state->addr.saddr, state->addr.len) != 0)
+        return FALSE;
+    if (state->addr.transport != HTTPS)
+        return TRUE;
+    return strcmp(entry->servername, state->http.servername) == 0 &&
+        strcmp(entry->port, state->http.port) == 0;
+}
+
+/* If there is a usable cached connection for state's address, transfer it to
+ * state and return true. */
+static krb5_boolean
+take_cached_conn(krb5_context context, struct conn_state *state)
+{
+    struct sendto_conncache *cache = context->kdc_conncache;
+    struct cached_conn **ptr, *entry;
+    time_ms now;
+
+    if (!conncache_enabled(context) || state->addr.transport == UDP)
+        return FALSE;
+    if (get_curtime_ms(&now) != 0)
+        return FALSE;
+    expire_cached_conns(context, cache, now);
+
+    for (ptr = &cache->conns; *ptr != NULL; ptr = &(*ptr)->next) {
+        if (conn_matches(*ptr, state))
+            break;
+    }
+    entry = *ptr;
+    if (entry == NULL)
+        return FALSE;
+    *ptr = entry->next;
+
+    if (idle_conn_is_stale(entry->fd)) {
+        TRACE_SENDTO_KDC_TCP_DISCONNECT(context, &entry->addr);
+        free_cached_conn(context, entry);
+        return FALSE;
+    }
+
+    TRACE_SENDTO_KDC_TCP_REUSE(context, &state->addr);
+    state->fd = entry->fd;
+    state->http.tls = entry->tls;
+    state->state = WRITING;
+    state->reused = TRUE;
+    state->endtime = now + STREAM_EXCHANGE_TIMEOUT;
+    entry->tls = NULL;
+    entry->fd = INVALID_SOCKET;
+    free(entry->servername);
+    free(entry);
+    return TRUE;
+}
+
+/* Remember the TLS session used by an HTTPS connection for later
+ * resumption. */
+static void
+save_tls_session(krb5_context context, struct sendto_conncache *cache,
+                 struct conn_state *conn)
+{
+    struct cached_tls_session **ptr, *entry;
+    krb5_data session;
+    int count;
+
+    if (context->tls->get_session == NULL)
+        return;
+    if (context->tls->get_session(context, conn->http.tls, &session) != 0 ||
+        session.length == 0)
+        return;
+
+    /* Remove any existing session for this server. */
+    for (ptr = &cache->sessions; *ptr != NULL; ptr = &(*ptr)->next) {
+        entry = *ptr;
+        if (strcmp(entry->servername, conn->http.servername) == 0 &&
+            strcmp(entry->port, conn->http.port) == 0) {
+            *ptr = entry->next;
+            free_cached_tls_session(entry);
+            break;
+        }
+    }
+
+    entry = calloc(1, sizeof(*entry));
+    if (entry == NULL)
+        goto fail;
+    entry->servername = strdup(conn->http.servername);
+    if (entry->servername == NULL)
+        goto fail;
+    strlcpy(entry->port, conn->http.port, PORT_LENGTH);
+    entry->session = session;
+    entry->next = cache->sessions;
+    cache->sessions = entry;
+
+    /* Discard the least recently saved sessions beyond the limit. */
+    ptr = &cache->sessions;
+    for (count = 0; *ptr != NULL && count < MAX_CACHED_CONNS; count++)
+        ptr = &(*ptr)->next;
+    while (*ptr != NULL) {
+        entry = *ptr;
+        *ptr = entry->next;
+        free_cached_tls_session(entry);
+    }
+    return;
+
+fail:
+    free(entry);
+    zapfree(session.data, session.length);
+}
+
+/* Attempt to resume a saved TLS session on conn's new TLS handle. */
+static void
+resume_tls_session(krb5_context context, struct conn_state *conn)
+{
+    struct cached_tls_session *entry;
+
+    if (!conncache_enabled(context) || context->tls->set_session == NULL)
+        return;
+    for (entry = context->kdc_conncache->sessions; entry != NULL;
+         entry = entry->next) {
+        if (strcmp(entry->servername, conn->http.servername) == 0 &&
+            strcmp(entry->port, conn->http.port) == 0) {
+            (void)context->tls->set_session(context, conn->http.tls,
+                                            &entry->session);
+            return;
+        }
+    }
+}
+
+/* After a successful exchange on conn, keep its connection open for reuse if
+ * possible.  On success, conn no longer owns its socket or TLS handle. */
+static void
+cache_conn(krb5_context context, struct conn_state *conn)
+{
+    struct sendto_conncache *cache = context->kdc_conncache;
+    struct cached_conn *entry, **ptr;
+    time_ms now;
+    int count;
+
+    if (!conncache_enabled(context) || conn->addr.transport == UDP)
+        return;
+    if (conn->addr.transport == HTTPS) {
+        save_tls_session(context, cache, conn);
+        if (!conn->http.keepalive)
+            return;
+    }
+    if (get_curtime_ms(&now) != 0)
+        return;
+
+    entry = calloc(1, sizeof(*entry));
+    if (entry == NULL)
+        return;
+    if (conn->addr.transport == HTTPS) {
+        entry->servername = strdup(conn->http.servername);
+        if (entry->servername == NULL) {
+            free(entry);
+            return;
+        }
+        strlcpy(entry->port, conn->http.port, PORT_LENGTH);
+    }
+    TRACE_SENDTO_KDC_TCP_KEEP(context, &conn->addr);
+    entry->addr = conn->addr;
+    entry->fd = conn->fd;
+    entry->tls = conn->http.tls;
+    entry->idle_since = now;
+    entry->next = cache->conns;
+    cache->conns = entry;
+    conn->fd = INVALID_SOCKET;
+    conn->http.tls = NULL;
+    free_http_tls_data(context, conn);
+
+    /* Close the least recently used connections beyond the limit. */
+    ptr = &cache->conns;
+    for (count = 0; *ptr != NULL && count < MAX_CACHED_CONNS; count++)
+        ptr = &(*ptr)->next;
+    while (*ptr != NULL) {
+        entry = *ptr;
+        *ptr = entry->next;
+        TRACE_SENDTO_KDC_TCP_DISCONNECT(context, &entry->addr);
+        free_cached_conn(context, entry);
+    }
+}
+
+void
+k5_sendto_free_context(krb5_context context)
+{
+    struct sendto_conncache *cache = context->kdc_conncache;
+    struct cached_conn *conn, *cnext;
+    struct cached_tls_session *sess, *snext;
+
+    if (cache == NULL)
+        return;
+    for (conn = cache->conns; conn != NULL; conn = cnext) {
+        cnext = conn->next;
+        free_cached_conn(context, conn);
+    }
+    for (sess = cache->sessions; sess != NULL; sess = snext) {
+        snext = sess->next;
+        free_cached_tls_session(sess);
+    }
+    free(cache);
+    context->kdc_conncache = NULL;
+}
+
 #ifdef USE_POLL
 
 /* Find a pollfd in selstate by fd, or abort if we can't find it. */
@@ -270,6 +666,28 @@ cm_get_ssflags(struct select_state *selstate, int fd)
         ((pfd->revents & POLLERR) ? SSF_EXCEPTION : 0);
 }
 
+/* Get the events we are polling for on fd in the form of ssflags. */
+static unsigned int
+cm_get_events(struct select_state *selstate, int fd)
+{
+    struct pollfd *pfd = find_pollfd(selstate, fd);
+
+    return ((pfd->events & POLLIN) ? SSF_READ : 0) |
+        ((pfd->events & POLLOUT) ? SSF_WRITE : 0);
+}
+
+/* Add the fds and events of in to out.  Return false and add nothing if they
+ * don't all fit. */
+static krb5_boolean
+cm_merge(struct select_state *out, const struct select_state *in)
+{
+    if (out->nfds + in->nfds > MAX_POLLFDS)
+        return FALSE;
+    memcpy(&out->fds[out->nfds], in->fds, in->nfds * sizeof(*in->fds));
+    out->nfds += in->nfds;
+    return TRUE;
+}
+
 #else /* not USE_POLL */
 
 static void
@@ -337,6 +755,48 @@ cm_get_ssflags(struct select_state *selstate, int fd)
         (FD_ISSET(fd, &selstate->xfds) ? SSF_EXCEPTION : 0);
 }
 
+/* Get the events we are selecting for on fd in the form of ssflags. */
+static unsigned int
+cm_get_events(struct select_state *selstate, int fd)
+{
+    return (FD_ISSET(fd, &selstate->rfds) ? SSF_READ : 0) |
+        (FD_ISSET(fd, &selstate->wfds) ? SSF_WRITE : 0);
+}
+
+/* Add the fds and events of in to out.  Return false and add nothing if they
+ * don't all fit. */
+static krb5_boolean
+cm_merge(struct select_state *out, const struct select_state *in)
+{
+#ifdef _WIN32
+    u_int i;
+
+    if (out->xfds.fd_count + in->xfds.fd_count > FD_SETSIZE)
+        return FALSE;
+    for (i = 0; i < in->rfds.fd_count; i++)
+        FD_SET(in->rfds.fd_array[i], &out->rfds);
+    for (i = 0; i < in->wfds.fd_count; i++)
+        FD_SET(in->wfds.fd_array[i], &out->wfds);
+    for (i = 0; i < in->xfds.fd_count; i++)
+        FD_SET(in->xfds.fd_array[i], &out->xfds);
+#else
+    int fd;
+
+    for (fd = 0; fd < in->max; fd++) {
+        if (FD_ISSET(fd, &in->rfds))
+            FD_SET(fd, &out->rfds);
+        if (FD_ISSET(fd, &in->wfds))
+            FD_SET(fd, &out->wfds);
+        if (FD_ISSET(fd, &in->xfds))
+            FD_SET(fd, &out->xfds);
+    }
+#endif
+    if (out->max < in->max)
+        out->max = in->max;
+    out->nfds += in->nfds;
+    return TRUE;
+}
+
 #endif /* not USE_POLL */
 
 static krb5_error_code
@@ -423,33 +883,26 @@ krb5_set_kdc_recv_hook(krb5_context context, krb5_post_recv_fn recv_hook,
     context->kdc_recv_hook_data = data;
 }
 
-/*
- * send the formatted request 'message' to a KDC for realm 'realm' and
- * return the response (if any) in 'reply'.
- *
- * If the message is sent and a response is received, 0 is returned,
- * otherwise an error code is returned.
- *
- * The storage for 'reply' is allocated and should be freed by the caller
- * when finished.
- */
+/* The state of one request of k5_sendto_kdc_multi(). */
+struct kdc_request_state {
+    k5_kdc_request *req;
+    const krb5_data *message;
+    struct serverlist servers;
+    krb5_data *hook_message;
+    krb5_error_code svc_err;
+    struct sendto_state *sendto;
+};
 
-krb5_error_code
-krb5_sendto_kdc(krb5_context context, const krb5_data *message,
-                const krb5_data *realm, krb5_data *reply_out, int *use_master,
-                int no_udp)
+/* Locate the KDCs for req's realm and prepare a sendto state for it.  If the
+ * send hook supplies a reply, set req->reply and leave ks->sendto NULL. */
+static krb5_error_code
+start_kdc_request(krb5_context context, struct kdc_request_state *ks)
 {
-    krb5_error_code retval, oldret, err;
-    struct serverlist servers;
-    int server_used;
+    krb5_error_code retval;
+    k5_kdc_request *req = ks->req;
     k5_transport_strategy strategy;
-    krb5_data reply = empty_data(), *hook_message = NULL, *hook_reply = NULL;
-
-    *reply_out = empty_data();
-
-    /*
-     * find KDC location(s) for realm
-     */
+    krb5_data *hook_reply = NULL;
+    int tmp;
 
     /*
      * BUG: This code won't return "interesting" errors (e.g., out of mem,
@@ -460,10 +913,10 @@ krb5_sendto_kdc(krb5_context context, const krb5_data *message,
      * should probably be returned as well.
      */
 
-    TRACE_SENDTO_KDC(context, message->length, realm, *use_master, no_udp);
+    TRACE_SENDTO_KDC(context, req->message->length, req->realm,
+                     req->use_master, req->no_udp);
 
-    if (!no_udp && context->udp_pref_limit < 0) {
-        int tmp;
+    if (!req->no_udp && context->udp_pref_limit < 0) {
         retval = profile_get_integer(context->profile,
                                      KRB5_CONF_LIBDEFAULTS, KRB5_CONF_UDP_PREFERENCE_LIMIT, 0,
                                      DEFAULT_UDP_PREF_LIMIT, &tmp);
@@ -479,86 +932,182 @@ krb5_sendto_kdc(krb5_context context, const krb5_data *message,
         context->udp_pref_limit = tmp;
     }
 
-    if (no_udp)
+    if (req->no_udp)
         strategy = NO_UDP;
-    else if (message->length <= (unsigned int) context->udp_pref_limit)
+    else if (req->message->length <= (unsigned int) context->udp_pref_limit)
         strategy = UDP_FIRST;
     else
         strategy = UDP_LAST;
 
-    retval = k5_locate_kdc(context, realm, &servers, *use_master, no_udp);
+    retval = k5_locate_kdc(context, req->realm, &ks->servers, req->use_master,
+                           req->no_udp);
     if (retval)
         return retval;
 
+    ks->message = req->message;
     if (context->kdc_send_hook != NULL) {
         retval = context->kdc_send_hook(context, context->kdc_send_hook_data,
-                                        realm, message, &hook_message,
-                                        &hook_reply);
+                                        req->realm, req->message,
+                                        &ks->hook_message, &hook_reply);
         if (retval)
-            goto cleanup;
+            return retval;
 
         if (hook_reply != NULL) {
-            *reply_out = *hook_reply;
+            req->reply = *hook_reply;
             free(hook_reply);
-            goto cleanup;
+            return 0;
         }
 
-        if (hook_message != NULL)
-            message = hook_message;
+        if (ks->hook_message != NULL)
+            ks->message = ks->hook_message;
     }
 
-    err = 0;
-    retval = k5_sendto(context, message, realm, &servers, strategy, NULL,
-                       &reply, NULL, NULL, &server_used,
-                       check_for_svc_unavailable, &err);
+    ks->svc_err = 0;
+    return begin_sendto(context, ks->message, req->realm, &ks->servers,
+                        strategy, NULL, check_for_svc_unavailable,
+                        &ks->svc_err, &ks->sendto);
+}
+
+static void
+free_kdc_request_state(krb5_context context, struct kdc_request_state *ks)
+{
+    free_sendto_state(context, ks->sendto);
+    ks->sendto = NULL;
+    krb5_free_data(context, ks->hook_message);
+    ks->hook_message = NULL;
+    k5_free_serverlist(&ks->servers);
+}
+
+/* Set req->reply and req->use_master from the completed sendto state of ks,
+ * running the receive hook if one is set. */
+static krb5_error_code
+finish_kdc_request(krb5_context context, struct kdc_request_state *ks)
+{
+    krb5_error_code retval, oldret;
+    k5_kdc_request *req = ks->req;
+    krb5_data reply = empty_data(), *hook_reply = NULL;
+    int server_used = 0;
+
+    retval = sendto_result(context, ks->sendto, &reply, NULL, NULL,
+                           &server_used);
     if (retval == KRB5_KDC_UNREACH) {
-        if (err == KDC_ERR_SVC_UNAVAILABLE) {
+        if (ks->svc_err == KDC_ERR_SVC_UNAVAILABLE) {
             retval = KRB5KDC_ERR_SVC_UNAVAILABLE;
         } else {
             k5_setmsg(context, retval,
                       _("Cannot contact any KDC for realm '%.*s'"),
-                      realm->length, realm->data);
+                      req->realm->length, req->realm->data);
         }
     }
 
     if (context->kdc_recv_hook != NULL) {
         oldret = retval;
         retval = context->kdc_recv_hook(context, context->kdc_recv_hook_data,
-                                        retval, realm, message, &reply,
-                                        &hook_reply);
+                                        retval, req->realm, ks->message,
+                                        &reply, &hook_reply);
         if (oldret && !retval) {
             /* The hook must set a reply if it overrides an error from
              * k5_sendto().  Treat this reply as coming from the master KDC. */
             assert(hook_reply != NULL);
-            *use_master = 1;
+            req->use_master = 1;
         }
     }
     if (retval)
         goto cleanup;
 
     if (hook_reply != NULL) {
-        *reply_out = *hook_reply;
+        req->reply = *hook_reply;
         free(hook_reply);
     } else {
-        *reply_out = reply;
+        req->reply = reply;
         reply = empty_data();
     }
 
     /* Set use_master to 1 if we ended up talking to a master when we didn't
      * explicitly request to. */
-    if (*use_master == 0) {
-        *use_master = k5_kdc_is_master(context, realm,
-                                       &servers.servers[server_used]);
-        TRACE_SENDTO_KDC_MASTER(context, *use_master);
+    if (req->use_master == 0) {
+        req->use_master = k5_kdc_is_master(context, req->realm,
+                                           &ks->servers.servers[server_used]);
+        TRACE_SENDTO_KDC_MASTER(context, req->use_master);
     }
 
 cleanup:
-    krb5_free_data(context, hook_message);
     krb5_free_data_contents(context, &reply);
-    k5_free_serverlist(&servers);
     return retval;
 }
 
+krb5_error_code
+k5_sendto_kdc_multi(krb5_context context, k5_kdc_request *reqs, size_t count)
+{
+    struct kdc_request_state *states;
+    struct sendto_state **sendtos;
+    krb5_error_code ret;
+    size_t i, nsendtos = 0;
+
+    states = k5calloc(count, sizeof(*states), &ret);
+    if (states == NULL)
+        return ret;
+    sendtos = k5calloc(count, sizeof(*sendtos), &ret);
+    if (sendtos == NULL) {
+        free(states);
+        return ret;
+    }
+
+    for (i = 0; i < count; i++) {
+        states[i].req = &reqs[i];
+        reqs[i].reply = empty_data();
+        reqs[i].code = start_kdc_request(context, &states[i]);
+        if (states[i].sendto != NULL)
+            sendtos[nsendtos++] = states[i].sendto;
+    }
+
+    ret = run_sendto_states(context, sendtos, nsendtos);
+
+    for (i = 0; i < count; i++) {
+        if (ret)
+            krb5_free_data_contents(context, &reqs[i].reply);
+        else if (states[i].sendto != NULL)
+            reqs[i].code = finish_kdc_request(context, &states[i]);
+        free_kdc_request_state(context, &states[i]);
+    }
+    free(sendtos);
+    free(states);
+    return ret;
+}
+
+/*
+ * send the formatted request 'message' to a KDC for realm 'realm' and
+ * return the response (if any) in 'reply'.
+ *
+ * If the message is sent and a response is received, 0 is returned,
+ * otherwise an error code is returned.
+ *
+ * The storage for 'reply' is allocated and should be freed by the caller
+ * when finished.
+ */
+
+krb5_error_code
+krb5_sendto_kdc(krb5_context context, const krb5_data *message,
+                const krb5_data *realm, krb5_data *reply_out, int *use_master,
+                int no_udp)
+{
+    krb5_error_code retval;
+    k5_kdc_request req;
+
+    *reply_out = empty_data();
+
+    req.message = message;
+    req.realm = realm;
+    req.no_udp = no_udp;
+    req.use_master = *use_master;
+    retval = k5_sendto_kdc_multi(context, &req, 1);
+    if (retval)
+        return retval;
+    *reply_out = req.reply;
+    *use_master = req.use_master;
+    return req.code;
+}
+
 /*
  * Notes:
  *
@@ -625,6 +1174,8 @@ make_proxy_request(struct conn_state *state, const krb5_data *realm,
     k5_buf_add(&buf, "Pragma: no-cache\r\n");
     k5_buf_add(&buf, "User-Agent: kerberos/1.0\r\n");
     k5_buf_add(&buf, "Content-type: application/kerberos\r\n");
+    if (state->http.keepalive)
+        k5_buf_add(&buf, "Connection: keep-alive\r\n");
     k5_buf_add_fmt(&buf, "Content-Length: %d\r\n\r\n", encoded_pm->length);
     k5_buf_add_len(&buf, encoded_pm->data, encoded_pm->length);
     if (k5_buf_status(&buf) != 0) {
@@ -861,11 +1412,10 @@ resolve_server(krb5_context context, const krb5_data *realm,
     return retval;
 }
 
+/* Create a socket for state and start connecting it.  Return 0 on success or
+ * a negative value as for start_connection() on failure. */
 static int
-start_connection(krb5_context context, struct conn_state *state,
-                 const krb5_data *message, struct select_state *selstate,
-                 const krb5_data *realm,
-                 struct sendto_callback_info *callback_info)
+open_socket(krb5_context context, struct conn_state *state)
 {
     int fd, e, type;
     static const int one = 1;
@@ -909,6 +1459,27 @@ start_connection(krb5_context context, struct conn_state *state,
         state->fd = fd;
     }
 
+    return 0;
+}
+
+static int
+start_connection(krb5_context context, struct conn_state *state,
+                 const krb5_data *message, struct select_state *selstate,
+                 const krb5_data *realm,
+                 struct sendto_callback_info *callback_info)
+{
+    int fd, e;
+
+    /* Connections used for kpasswd requests are never cached. */
+    if (callback_info != NULL || !take_cached_conn(context, state)) {
+        e = open_socket(context, state);
+        if (e != 0)
+            return e;
+    }
+    fd = state->fd;
+    state->http.keepalive = (callback_info == NULL &&
+                             conncache_enabled(context));
+
     /*
      * Here's where KPASSWD callback gets the socket information it needs for
      * a kpasswd request
@@ -1028,6 +1599,19 @@ kill_conn(krb5_context context, struct conn_state *conn,
     closesocket(conn->fd);
     conn->fd = INVALID_SOCKET;
     conn->state = FAILED;
+
+    /* A reused connection may have been closed by the server while it was
+     * idle.  Let the next pass start over with a new connection. */
+    if (conn->reused) {
+        free(conn->in.buf);
+        memset(&conn->in, 0, sizeof(conn->in));
+        conn->http.scan_pos = conn->http.body_pos = 0;
+        conn->http.have_length = FALSE;
+        conn->http.content_length = 0;
+        conn->out.sgp = conn->out.sgbuf;
+        conn->reused = FALSE;
+        conn->state = INITIALIZING;
+    }
 }
 
 /* Check socket for error.  */
@@ -1093,7 +1677,7 @@ service_tcp_connect(krb5_context context, const krb5_data *realm,
 
     /* Record this connection's timeout for service_fds. */
     if (get_curtime_ms(&conn->endtime) == 0)
-        conn->endtime += 10000;
+        conn->endtime += STREAM_EXCHANGE_TIMEOUT;
 
     return conn->service_write(context, realm, conn, selstate);
 }
@@ -1232,6 +1816,7 @@ setup_tls(krb5_context context, const krb5_data *realm,
         TRACE_SENDTO_KDC_HTTPS_ERROR_CONNECT(context, &conn->addr);
         goto cleanup;
     }
+    resume_tls_session(context, conn);
 
     ok = TRUE;
 
@@ -1273,6 +1858,84 @@ service_https_write(krb5_context context, const krb5_data *realm,
     return FALSE;
 }
 
+/* Return true if the header value from line to eol, a comma-separated list
+ * of tokens, contains token, ignoring case. */
+static krb5_boolean
+header_has_token(const char *line, const char *eol, const char *token)
+{
+    size_t len = strlen(token);
+    const char *p = line, *start, *end;
+
+    while (p < eol) {
+        /* Find the next element and trim the whitespace around it. */
+        while (p < eol && (*p == ' ' || *p == '\t'))
+            p++;
+        start = p;
+        while (p < eol && *p != ',')
+            p++;
+        end = p;
+        while (end > start && (end[-1] == ' ' || end[-1] == '\t'))
+            end--;
+        if ((size_t)(end - start) == len &&
+            strncasecmp(start, token, len) == 0)
+            return TRUE;
+        if (p < eol)
+            p++;
+    }
+    return FALSE;
+}
+
+/* Parse the header lines of the response in conn, which end just before body.
+ * Clear conn->http.keepalive if the server did not agree to keep the
+ * connection open. */
+static void
+parse_http_headers(struct conn_state *conn, const char *body)
+{
+    const char *line, *eol;
+    krb5_boolean keepalive = FALSE;
+
+    /* Scan the header lines following the status line. */
+    for (line = strstr(conn->in.buf, "\r\n") + 2; line < body - 2;
+         line = eol + 2) {
+        eol = strstr(line, "\r\n");
+        if (strncasecmp(line, "Content-Length:", 15) == 0) {
+            conn->http.content_length = strtoul(line + 15, NULL, 10);
+            conn->http.have_length = TRUE;
+        } else if (strncasecmp(line, "Connection:", 11) == 0) {
+            keepalive = header_has_token(line + 11, eol, "keep-alive");
+        }
+    }
+    if (!keepalive)
+        conn->http.keepalive = FALSE;
+}
+
+/* Return true if conn has read a complete HTTP response according to its
+ * Content-Length header.  Each call only searches the input not searched by
+ * previous calls, and the headers are parsed once. */
+static krb5_boolean
+http_response_complete(struct conn_state *conn)
+{
+    struct incoming_message *in = &conn->in;
+    const char *body;
+    size_t start;
+
+    if (conn->http.body_pos == 0) {
+        /* Back up in case the blank line was split across reads. */
+        start = (conn->http.scan_pos > 3) ? conn->http.scan_pos - 3 : 0;
+        conn->http.scan_pos = in->pos;
+        body = strstr(in->buf + start, "\r\n\r\n");
+        if (body == NULL)
+            return FALSE;
+        body += 4;
+        conn->http.body_pos = body - in->buf;
+        parse_http_headers(conn, body);
+    }
+
+    if (!conn->http.have_length)
+        return FALSE;
+    return in->pos - conn->http.body_pos >= conn->http.content_length;
+}
+
 /* Return true on finished data.  Call a cm_read/write function and return
  * false if the TLS layer needs it.  Kill the connection on error. */
 static krb5_boolean
@@ -1307,10 +1970,17 @@ https_read_bytes(krb5_context context, struct conn_state *conn,
 
         in->pos += nread;
         in->buf[in->pos] = '\0';
+
+        /* If the server is keeping the connection open, we won't see an
+         * end-of-file after the response. */
+        if (http_response_complete(conn))
+            return TRUE;
     }
 
-    if (st == DONE)
+    if (st == DONE) {
+        conn->http.keepalive = FALSE;
         return TRUE;
+    }
 
     if (st == WANT_READ) {
         cm_read(selstate, conn->fd);
@@ -1384,66 +2054,322 @@ get_endtime(time_ms endtime, struct conn_state *conns)
     return endtime;
 }
 
-static krb5_boolean
-service_fds(krb5_context context, struct select_state *selstate,
-            time_ms interval, struct conn_state *conns,
-            struct select_state *seltemp, const krb5_data *realm,
-            int (*msg_handler)(krb5_context, const krb5_data *, void *),
-            void *msg_handler_data, struct conn_state **winner_out)
+static krb5_error_code
+begin_sendto(krb5_context context, const krb5_data *message,
+             const krb5_data *realm, const struct serverlist *servers,
+             k5_transport_strategy strategy,
+             struct sendto_callback_info *callback_info,
+             int (*msg_handler)(krb5_context, const krb5_data *, void *),
+             void *msg_handler_data, struct sendto_state **st_out)
 {
-    int e, selret = 0;
-    time_ms endtime;
-    struct conn_state *state;
+    krb5_error_code ret;
+    struct sendto_state *st;
 
-    *winner_out = NULL;
+    *st_out = NULL;
 
-    e = get_curtime_ms(&endtime);
-    if (e)
-        return TRUE;
-    endtime += interval;
+    ret = init_conncache(context);
+    if (ret)
+        return ret;
 
-    e = 0;
-    while (selstate->nfds > 0) {
-        e = cm_select_or_poll(selstate, get_endtime(endtime, conns),
-                              seltemp, &selret);
-        if (e == EINTR)
-            continue;
-        if (e != 0)
+    st = calloc(1, sizeof(*st));
+    if (st == NULL)
+        return ENOMEM;
+    st->message = message;
+    st->realm = realm;
+    st->servers = servers;
+    st->strategy = strategy;
+    st->callback_info = callback_info;
+    st->msg_handler = msg_handler;
+    st->msg_handler_data = msg_handler_data;
+    cm_init_selstate(&st->selstate);
+    st->phase = FIRST_PASS;
+    *st_out = st;
+    return 0;
+}
+
+static void
+free_sendto_state(krb5_context context, struct sendto_state *st)
+{
+    struct conn_state *conn, *next;
+
+    if (st == NULL)
+        return;
+    for (conn = st->conns; conn != NULL; conn = next) {
+        next = conn->next;
+        if (conn->fd != INVALID_SOCKET) {
+            if (socktype_for_transport(conn->addr.transport) == SOCK_STREAM)
+                TRACE_SENDTO_KDC_TCP_DISCONNECT(context, &conn->addr);
+            closesocket(conn->fd);
+            free_http_tls_data(context, conn);
+        }
+        if (conn->in.buf != st->udpbuf)
+            free(conn->in.buf);
+        if (st->callback_info) {
+            st->callback_info->pfn_cleanup(st->callback_info->data,
+                                           &conn->callback_buffer);
+        }
+        free(conn);
+    }
+    free(st->udpbuf);
+    free(st);
+}
+
+/* Wait up to interval milliseconds from now for a response. */
+static void
+start_wait(struct sendto_state *st, time_ms now, time_ms interval)
+{
+    st->waiting = TRUE;
+    st->wait_end = now + interval;
+}
+
+/* Perform the next steps of st until it is done or needs to wait. */
+static void
+sendto_advance(krb5_context context, struct sendto_state *st)
+{
+    krb5_error_code ret;
+    struct conn_state *conn, **tailptr;
+    time_ms now;
+
+    if (get_curtime_ms(&now) != 0) {
+        st->done = TRUE;
+        return;
+    }
+
+    while (!st->done) {
+        if (st->waiting) {
+            /* Keep waiting until the interval (extended for any active TCP
+             * connections) expires, unless we have no sockets left. */
+            if (st->selstate.nfds > 0 &&
+                now < get_endtime(st->wait_end, st->conns))
+                return;
+            st->waiting = FALSE;
+            if ((st->phase == RETRY_PASS || st->phase == RETRY_PASS_END) &&
+                st->selstate.nfds == 0) {
+                st->done = TRUE;
+                return;
+            }
+        }
+
+        switch (st->phase) {
+        case FIRST_PASS:
+            if (st->next == NULL) {
+                if (st->server >= st->servers->nservers) {
+                    st->phase = DEFERRED_PASS;
+                    st->next = st->conns;
+                    break;
+                }
+                /* Resolve the next server host and contact the resulting
+                 * addresses of the preferred transport. */
+                for (tailptr = &st->conns; *tailptr != NULL;
+                     tailptr = &(*tailptr)->next);
+                ret = resolve_server(context, st->realm, st->servers,
+                                     st->server++, st->strategy, st->message,
+                                     &st->udpbuf, &st->conns);
+                if (!ret)
+                    ret = get_curtime_ms(&now);
+                if (ret) {
+                    st->error = ret;
+                    st->done = TRUE;
+                    return;
+                }
+                st->next = *tailptr;
+                break;
+            }
+            conn = st->next;
+            st->next = conn->next;
+            if (!conn->defer &&
+                maybe_send(context, conn, st->message, &st->selstate,
+                           st->realm, st->callback_info) == 0)
+                start_wait(st, now, 1000);
             break;
 
-        if (selret == 0)
-            /* Timeout, return to caller.  */
-            return FALSE;
+        case DEFERRED_PASS:
+            /* Complete the first pass by contacting addresses of the
+             * non-preferred RFC 4120 transport. */
+            if (st->next == NULL) {
+                st->phase = FIRST_PASS_END;
+                start_wait(st, now, 2000);
+                break;
+            }
+            conn = st->next;
+            st->next = conn->next;
+            if (conn->defer &&
+                maybe_send(context, conn, st->message, &st->selstate,
+                           st->realm, st->callback_info) == 0)
+                start_wait(st, now, 1000);
+            break;
+
+        case FIRST_PASS_END:
+            st->phase = RETRY_PASS;
+            st->pass = 1;
+            st->delay = 4000;
+            st->next = st->conns;
+            break;
+
+        case RETRY_PASS:
+            if (st->next == NULL) {
+                st->phase = RETRY_PASS_END;
+                start_wait(st, now, st->delay);
+                break;
+            }
+            conn = st->next;
+            st->next = conn->next;
+            if (maybe_send(context, conn, st->message, &st->selstate,
+                           st->realm, st->callback_info) == 0)
+                start_wait(st, now, 1000);
+            break;
+
+        case RETRY_PASS_END:
+            st->delay *= 2;
+            if (++st->pass >= MAX_PASS) {
+                st->done = TRUE;
+                break;
+            }
+            st->phase = RETRY_PASS;
+            st->next = st->conns;
+            break;
+        }
+    }
+}
 
-        /* Got something on a socket, process it.  */
-        for (state = conns; state != NULL; state = state->next) {
-            int ssflags;
+/* Process ssflags events on conn, a connection of st. */
+static void
+service_conn(krb5_context context, struct sendto_state *st,
+             struct conn_state *conn, int ssflags)
+{
+    int stop = 1;
+    krb5_data reply;
+
+    if (!service_dispatch(context, st->realm, conn, &st->selstate, ssflags))
+        return;
+    if (st->msg_handler != NULL) {
+        reply = make_data(conn->in.buf, conn->in.pos);
+        stop = (st->msg_handler(context, &reply, st->msg_handler_data) != 0);
+    }
+    if (stop) {
+        st->winner = conn;
+        st->done = TRUE;
+    }
+}
 
-            if (state->fd == INVALID_SOCKET)
+/* Process the sockets of st which are ready according to seltemp. */
+static void
+sendto_service(krb5_context context, struct sendto_state *st,
+               struct select_state *seltemp)
+{
+    struct conn_state *conn;
+    int ssflags;
+
+    for (conn = st->conns; conn != NULL && !st->done; conn = conn->next) {
+        if (conn->fd == INVALID_SOCKET)
+            continue;
+        ssflags = cm_get_ssflags(seltemp, conn->fd);
+        if (ssflags)
+            service_conn(context, st, conn, ssflags);
+    }
+}
+
+/* Drive all of the given sendto states until each one is done. */
+static krb5_error_code
+run_sendto_states(krb5_context context, struct sendto_state **states,
+                  size_t count)
+{
+    struct select_state *sel, *seltemp;
+    struct sendto_state *st;
+    krb5_boolean active, full;
+    time_ms endtime, st_endtime;
+    size_t i, nstarted = 0, nactive;
+    int e, selret;
+
+    /* One for the fds of all active states, and one for the poll results. */
+    sel = malloc(2 * sizeof(*sel));
+    if (sel == NULL)
+        return ENOMEM;
+    seltemp = &sel[1];
+
+    for (;;) {
+        active = full = FALSE;
+        endtime = 0;
+        nactive = 0;
+        cm_init_selstate(sel);
+        for (i = 0; i < count; i++) {
+            st = states[i];
+            if (st->done)
                 continue;
-            ssflags = cm_get_ssflags(seltemp, state->fd);
-            if (!ssflags)
+            if (i >= nstarted) {
+                /* Start queued states only as earlier ones finish, and not
+                 * while the sockets of the active ones don't all fit. */
+                if (full || nactive >= MAX_ACTIVE_SENDTOS)
+                    break;
+                nstarted = i + 1;
+            }
+            sendto_advance(context, st);
+            if (st->done)
                 continue;
+            st_endtime = get_endtime(st->wait_end, st->conns);
+            if (!active || st_endtime < endtime)
+                endtime = st_endtime;
+            active = TRUE;
+            nactive++;
+            st->polled = cm_merge(sel, &st->selstate);
+            if (!st->polled)
+                full = TRUE;
+        }
+        if (!active)
+            break;
 
-            if (service_dispatch(context, realm, state, selstate, ssflags)) {
-                int stop = 1;
+        e = cm_select_or_poll(sel, endtime, seltemp, &selret);
+        if (e == EINTR)
+            continue;
+        if (e != 0) {
+            for (i = 0; i < count; i++)
+                states[i]->done = TRUE;
+            break;
+        }
 
-                if (msg_handler != NULL) {
-                    krb5_data reply = make_data(state->in.buf, state->in.pos);
+        for (i = 0; i < count && selret > 0; i++) {
+            st = states[i];
+            if (!st->done && st->polled)
+                sendto_service(context, st, seltemp);
+        }
+    }
 
-                    stop = (msg_handler(context, &reply, msg_handler_data) != 0);
-                }
+    free(sel);
+    return 0;
+}
 
-                if (stop) {
-                    *winner_out = state;
-                    return TRUE;
-                }
-            }
+/* Get the result of a completed sendto state. */
+static krb5_error_code
+sendto_result(krb5_context context, struct sendto_state *st,
+              krb5_data *reply, struct sockaddr *remoteaddr,
+              socklen_t *remoteaddrlen, int *server_used)
+{
+    struct conn_state *winner = st->winner, *conn;
+
+    *reply = empty_data();
+    if (st->error)
+        return st->error;
+    if (winner == NULL)
+        return KRB5_KDC_UNREACH;
+
+    /* Success!  Take ownership of the reply buffer. */
+    *reply = make_data(winner->in.buf, winner->in.pos);
+    if (winner->in.buf == st->udpbuf) {
+        for (conn = st->conns; conn != NULL; conn = conn->next) {
+            if (conn->in.buf == st->udpbuf)
+                conn->in.buf = NULL;
         }
+        st->udpbuf = NULL;
     }
-    if (e != 0)
-        return TRUE;
-    return FALSE;
+    winner->in.buf = NULL;
+    if (server_used != NULL)
+        *server_used = winner->server_index;
+    if (remoteaddr != NULL && remoteaddrlen != 0 && *remoteaddrlen > 0)
+        (void)getpeername(winner->fd, remoteaddr, remoteaddrlen);
+    TRACE_SENDTO_KDC_RESPONSE(context, reply->length, &winner->addr);
+    if (st->callback_info == NULL)
+        cache_conn(context, winner);
+    return 0;
 }
 
 /*
@@ -1482,123 +2408,211 @@ k5_sendto(krb5_context context, const krb5_data *message,
           int (*msg_handler)(krb5_context, const krb5_data *, void *),
           void *msg_handler_data)
 {
-    int pass;
-    time_ms delay;
     krb5_error_code retval;
-    struct conn_state *conns = NULL, *state, **tailptr, *next, *winner;
-    size_t s;
-    struct select_state *sel_state = NULL, *seltemp;
-    char *udpbuf = NULL;
-    krb5_boolean done = FALSE;
+    struct sendto_state *st;
 
     *reply = empty_data();
 
-    /* One for use here, listing all our fds in use, and one for
-     * temporary use in service_fds, for the fds of interest.  */
-    sel_state = malloc(2 * sizeof(*sel_state));
-    if (sel_state == NULL) {
-        retval = ENOMEM;
-        goto cleanup;
+    retval = begin_sendto(context, message, realm, servers, strategy,
+                          callback_info, msg_handler, msg_handler_data, &st);
+    if (retval)
+        return retval;
+    retval = run_sendto_states(context, &st, 1);
+    if (!retval) {
+        retval = sendto_result(context, st, reply, remoteaddr, remoteaddrlen,
+                               server_used);
     }
-    seltemp = &sel_state[1];
-    cm_init_selstate(sel_state);
+    free_sendto_state(context, st);
+    return retval;
+}
 
-    /* First pass: resolve server hosts, communicate with resulting addresses
-     * of the preferred transport, and wait 1s for an answer from each. */
-    for (s = 0; s < servers->nservers && !done; s++) {
-        /* Find the current tail pointer. */
-        for (tailptr = &conns; *tailptr != NULL; tailptr = &(*tailptr)->next);
-        retval = resolve_server(context, realm, servers, s, strategy, message,
-                                &udpbuf, &conns);
-        if (retval)
-            goto cleanup;
-        for (state = *tailptr; state != NULL && !done; state = state->next) {
-            /* Contact each new connection, deferring those which use the
-             * non-preferred RFC 4120 transport. */
-            if (state->defer)
-                continue;
-            if (maybe_send(context, state, message, sel_state, realm,
-                           callback_info))
-                continue;
-            done = service_fds(context, sel_state, 1000, conns, seltemp,
-                               realm, msg_handler, msg_handler_data, &winner);
-        }
+struct _krb5_kdc_exchange_context {
+    krb5_data message;
+    krb5_data realm;
+    k5_kdc_request req;
+    struct kdc_request_state ks;
+    krb5_boolean complete;
+};
+
+static unsigned int
+events_to_ssflags(unsigned int events)
+{
+    return ((events & KRB5_KDC_EXCHANGE_EVENT_READ) ? SSF_READ : 0) |
+        ((events & KRB5_KDC_EXCHANGE_EVENT_WRITE) ? SSF_WRITE : 0) |
+        ((events & KRB5_KDC_EXCHANGE_EVENT_ERROR) ? SSF_EXCEPTION : 0);
+}
+
+static unsigned int
+ssflags_to_events(unsigned int ssflags)
+{
+    return ((ssflags & SSF_READ) ? KRB5_KDC_EXCHANGE_EVENT_READ : 0) |
+        ((ssflags & SSF_WRITE) ? KRB5_KDC_EXCHANGE_EVENT_WRITE : 0) |
+        ((ssflags & SSF_EXCEPTION) ? KRB5_KDC_EXCHANGE_EVENT_ERROR : 0);
+}
+
+/* If the sendto state of ctx is done, get its result and close its
+ * sockets. */
+static void
+check_exchange_complete(krb5_context context, krb5_kdc_exchange_context ctx)
+{
+    if (ctx->complete || !ctx->ks.sendto->done)
+        return;
+    ctx->req.code = finish_kdc_request(context, &ctx->ks);
+    free_sendto_state(context, ctx->ks.sendto);
+    ctx->ks.sendto = NULL;
+    ctx->complete = TRUE;
+}
+
+krb5_error_code KRB5_CALLCONV
+krb5_kdc_exchange_init(krb5_context context, const krb5_data *request,
+                       const krb5_data *realm, krb5_flags options,
+                       krb5_kdc_exchange_context *ctx_out)
+{
+    krb5_error_code ret;
+    krb5_kdc_exchange_context ctx;
+
+    *ctx_out = NULL;
+
+    ctx = k5alloc(sizeof(*ctx), &ret);
+    if (ctx == NULL)
+        return ret;
+    ret = krb5int_copy_data_contents(context, request, &ctx->message);
+    if (ret)
+        goto error;
+    ret = krb5int_copy_data_contents(context, realm, &ctx->realm);
+    if (ret)
+        goto error;
+
+    ctx->req.message = &ctx->message;
+    ctx->req.realm = &ctx->realm;
+    ctx->req.no_udp = (options & KRB5_KDC_EXCHANGE_TCP_ONLY) != 0;
+    ctx->req.use_master = 0;
+    ctx->req.reply = empty_data();
+    ctx->ks.req = &ctx->req;
+
+    /* Errors in locating KDCs are reported by krb5_kdc_exchange_get_reply(),
+     * as are replies supplied by a send hook. */
+    ctx->req.code = start_kdc_request(context, &ctx->ks);
+    if (ctx->ks.sendto == NULL) {
+        ctx->complete = TRUE;
+    } else {
+        sendto_advance(context, ctx->ks.sendto);
+        check_exchange_complete(context, ctx);
     }
 
-    /* Complete the first pass by contacting servers of the non-preferred RFC
-     * 4120 transport (if given), waiting 1s for an answer from each. */
-    for (state = conns; state != NULL && !done; state = state->next) {
-        if (!state->defer)
-            continue;
-        if (maybe_send(context, state, message, sel_state, realm,
-                       callback_info))
+    *ctx_out = ctx;
+    return 0;
+
+error:
+    krb5_kdc_exchange_free(context, ctx);
+    return ret;
+}
+
+krb5_error_code KRB5_CALLCONV
+krb5_kdc_exchange_get_fds(krb5_context context, krb5_kdc_exchange_context ctx,
+                          krb5_kdc_exchange_fd *fds, size_t space,
+                          size_t *nfds_out)
+{
+    struct sendto_state *st = ctx->ks.sendto;
+    struct conn_state *conn;
+    size_t n = 0;
+
+    *nfds_out = 0;
+    if (ctx->complete)
+        return 0;
+
+    for (conn = st->conns; conn != NULL; conn = conn->next) {
+        if (conn->fd == INVALID_SOCKET)
             continue;
-        done = service_fds(context, sel_state, 1000, conns, seltemp,
-                           realm, msg_handler, msg_handler_data, &winner);
+        if (n < space) {
+            fds[n].fd = conn->fd;
+            fds[n].events =
+                ssflags_to_events(cm_get_events(&st->selstate, conn->fd));
+        }
+        n++;
     }
+    *nfds_out = n;
+    return (n > space) ? ERANGE : 0;
+}
 
-    /* Wait for two seconds at the end of the first pass. */
-    if (!done) {
-        done = service_fds(context, sel_state, 2000, conns, seltemp,
-                           realm, msg_handler, msg_handler_data, &winner);
-    }
+krb5_error_code KRB5_CALLCONV
+krb5_kdc_exchange_get_timeout(krb5_context context,
+                              krb5_kdc_exchange_context ctx,
+                              int *timeout_ms_out)
+{
+    krb5_error_code ret;
+    struct sendto_state *st = ctx->ks.sendto;
+    time_ms now, endtime;
 
-    /* Make remaining passes over all of the connections. */
-    delay = 4000;
-    for (pass = 1; pass < MAX_PASS && !done; pass++) {
-        for (state = conns; state != NULL && !done; state = state->next) {
-            if (maybe_send(context, state, message, sel_state, realm,
-                           callback_info))
-                continue;
-            done = service_fds(context, sel_state, 1000, conns, seltemp,
-                               realm, msg_handler, msg_handler_data, &winner);
-            if (sel_state->nfds == 0)
+    *timeout_ms_out = 0;
+    if (ctx->complete)
+        return 0;
+
+    ret = get_curtime_ms(&now);
+    if (ret)
+        return ret;
+    endtime = get_endtime(st->wait_end, st->conns);
+    if (endtime > now)
+        *timeout_ms_out = (endtime - now > INT_MAX) ? INT_MAX : endtime - now;
+    return 0;
+}
+
+krb5_error_code KRB5_CALLCONV
+krb5_kdc_exchange_process(krb5_context context, krb5_kdc_exchange_context ctx,
+                          const krb5_kdc_exchange_fd *ready, size_t nready,
+                          krb5_boolean *complete_out)
+{
+    struct sendto_state *st = ctx->ks.sendto;
+    struct conn_state *conn;
+    size_t i;
+
+    *complete_out = ctx->complete;
+    if (ctx->complete)
+        return 0;
+
+    for (i = 0; i < nready && !st->done; i++) {
+        if (ready[i].events == 0)
+            continue;
+        for (conn = st->conns; conn != NULL; conn = conn->next) {
+            if (conn->fd != INVALID_SOCKET && conn->fd == ready[i].fd)
                 break;
         }
-        /* Wait for the delay backoff at the end of this pass. */
-        if (!done) {
-            done = service_fds(context, sel_state, delay, conns, seltemp,
-                               realm, msg_handler, msg_handler_data, &winner);
+        if (conn != NULL) {
+            service_conn(context, st, conn,
+                         events_to_ssflags(ready[i].events));
         }
-        if (sel_state->nfds == 0)
-            break;
-        delay *= 2;
     }
+    if (!st->done)
+        sendto_advance(context, st);
+    check_exchange_complete(context, ctx);
 
-    if (sel_state->nfds == 0 || !done || winner == NULL) {
-        retval = KRB5_KDC_UNREACH;
-        goto cleanup;
-    }
-    /* Success!  */
-    *reply = make_data(winner->in.buf, winner->in.pos);
-    retval = 0;
-    winner->in.buf = NULL;
-    if (server_used != NULL)
-        *server_used = winner->server_index;
-    if (remoteaddr != NULL && remoteaddrlen != 0 && *remoteaddrlen > 0)
-        (void)getpeername(winner->fd, remoteaddr, remoteaddrlen);
-    TRACE_SENDTO_KDC_RESPONSE(context, reply->length, &winner->addr);
+    *complete_out = ctx->complete;
+    return 0;
+}
 
-cleanup:
-    for (state = conns; state != NULL; state = next) {
-        next = state->next;
-        if (state->fd != INVALID_SOCKET) {
-            if (socktype_for_transport(state->addr.transport) == SOCK_STREAM)
-                TRACE_SENDTO_KDC_TCP_DISCONNECT(context, &state->addr);
-            closesocket(state->fd);
-            free_http_tls_data(context, state);
-        }
-        if (state->in.buf != udpbuf)
-            free(state->in.buf);
-        if (callback_info) {
-            callback_info->pfn_cleanup(callback_info->data,
-                                       &state->callback_buffer);
-        }
-        free(state);
-    }
+krb5_error_code KRB5_CALLCONV
+krb5_kdc_exchange_get_reply(krb5_context context,
+                            krb5_kdc_exchange_context ctx,
+                            krb5_data *reply_out)
+{
+    *reply_out = empty_data();
+    if (!ctx->complete)
+        return EINVAL;
+    if (ctx->req.code)
+        return ctx->req.code;
+    *reply_out = ctx->req.reply;
+    ctx->req.reply = empty_data();
+    return 0;
+}
 
-    if (reply->data != udpbuf)
-        free(udpbuf);
-    free(sel_state);
-    return retval;
+void KRB5_CALLCONV
+krb5_kdc_exchange_free(krb5_context context, krb5_kdc_exchange_context ctx)
+{
+    if (ctx == NULL)
+        return;
+    free_kdc_request_state(context, &ctx->ks);
+    krb5_free_data_contents(context, &ctx->message);
+    krb5_free_data_contents(context, &ctx->realm);
+    krb5_free_data_contents(context, &ctx->req.reply);
+    free(ctx);
 }
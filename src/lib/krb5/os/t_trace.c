@@ -144,7 +144,7 @@ main (int argc, char *argv[])
     key.keyblock.length = strlen(str);
     key.keyblock.contents = (krb5_octet *)str;
     key.refcount = 0;
-    key.derived = NULL;
+    memset(key.derived, 0, sizeof(key.derived));
     key.cache = NULL;
     TRACE(ctx, "const krb5_keyblock *, display enctype and hash of key: "
           "{keyblock}", &key.keyblock);
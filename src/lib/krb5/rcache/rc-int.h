@@ -47,11 +47,24 @@ struct krb5_rc_st {
 
 extern const krb5_rc_ops k5_rc_dfl_ops;
 extern const krb5_rc_ops k5_rc_file2_ops;
+extern const krb5_rc_ops k5_rc_mem_ops;
 extern const krb5_rc_ops k5_rc_none_ops;
 
+/* The shm type requires lock-free 64-bit atomic operations which work across
+ * processes. */
+#if !defined(_WIN32) && defined(__GCC_ATOMIC_LLONG_LOCK_FREE) && \
+    __GCC_ATOMIC_LLONG_LOCK_FREE == 2
+#define RC_SHM_SUPPORTED
+extern const krb5_rc_ops k5_rc_shm_ops;
+#endif
+
 /* Check and store a replay record in an open (but not locked) file descriptor,
  * using the file2 format.  fd is assumed to be at offset 0. */
 krb5_error_code k5_rcfile2_store(krb5_context context, int fd,
                                  const krb5_data *tag_data);
 
+/* Initialize and finalize the global state of the mem type. */
+int krb5int_rc_initialize(void);
+void krb5int_rc_finalize(void);
+
 #endif /* RC_INT_H */
@@ -0,0 +1,619 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/* lib/krb5/rcache/rc_mem.c - in-process replay cache */
+/*
+ * Copyright (C) 2020 by the Massachusetts Institute of Technology.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in
+ *   the documentation and/or other materials provided with the
+ *   distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * The mem replay cache type keeps replay records in process memory, for
+ * threaded servers which do not share a replay cache with other processes.
+ * All handles with the same residual value share a table, which lasts until
+ * the library is finalized.  A table is divided into shards selected by a hash
+ * of the tag, each with its own lock, so that threads storing different tags
+ * rarely contend.  Within a shard, records are grouped into expiry buckets
+ * spanning BUCKET_SECS seconds of timestamps, and a bucket is discarded as a
+ * whole once its latest record has expired.
+ *
+ * A table holds at most a configured number of records, divided evenly among
+ * the shards.  Each record uses about 128 bytes of memory, counting the
+ * record, its hash table entry, and allocation overhead.
+ *
+ * If the residual value is not empty, it names a file to which records are
+ * appended at most once every PERSIST_INTERVAL seconds.  Each shard keeps a
+ * journal of the records stored since the last write; the thread which finds
+ * a write due takes the journals from the shards and appends them to the
+ * file, so only new records are serialized, and no shard lock is held during
+ * the write.  Once the file was started longer ago than the clock skew, all
+ * of the records in any previous file have expired, so the file is renamed to
+ * the residual value with ".old" appended (replacing the previous file) and a
+ * new file is started.  When a table is created, unexpired records are loaded
+ * from both files.  Records stored after the last write are lost if the
+ * process exits.
+ *
+ * The file contains the magic string "K5RCMEM1" followed by records, each
+ * containing a four-byte big-endian timestamp, a two-byte big-endian tag
+ * length, and the tag.
+ */
+
+#include "k5-int.h"
+#include "k5-buf.h"
+#include "k5-hashtab.h"
+#include "k5-queue.h"
+#include "rc-int.h"
+#ifndef _WIN32
+#include <sys/types.h>
+#include <sys/stat.h>
+#endif
+
+#define NSHARDS 32
+#define DEFAULT_MAX_RECORDS (1024 * 1024)
+#define BUCKET_SECS 8
+#define PERSIST_INTERVAL 30
+#define MAX_TAG_LEN 256
+#define MAGIC "K5RCMEM1"
+#define MAGIC_LEN 8
+
+struct entry {
+    struct entry *next;
+    krb5_timestamp timestamp;
+    size_t taglen;
+    uint8_t *tag;
+};
+
+struct bucket {
+    K5_TAILQ_ENTRY(bucket) links;
+    krb5_timestamp start;
+    krb5_timestamp latest;
+    struct entry *entries;
+};
+
+K5_TAILQ_HEAD(bucket_queue, bucket);
+
+struct shard {
+    k5_mutex_t lock;
+    struct k5_hashtab *hash_table;
+    struct bucket_queue buckets;
+    size_t count;
+    struct k5buf journal;       /* records not yet written to the file */
+};
+
+struct mem_table {
+    struct mem_table *next;
+    char *name;
+    uint8_t shard_seed[K5_HASH_SEED_LEN];
+    uint8_t hash_seed[K5_HASH_SEED_LEN];
+    struct shard shards[NSHARDS];
+    size_t shard_max;
+
+    /* Protects persisting and last_persist. */
+    k5_mutex_t persist_lock;
+    krb5_boolean persisting;
+    krb5_timestamp last_persist;
+    /* Only used by the persisting thread. */
+    krb5_timestamp file_start;
+};
+
+static k5_mutex_t tables_lock = K5_MUTEX_PARTIAL_INITIALIZER;
+static struct mem_table *tables;
+
+/* Allocate an entry with space for a copy of tag. */
+static struct entry *
+new_entry(const uint8_t *tag, size_t taglen, krb5_timestamp timestamp)
+{
+    struct entry *entry;
+
+    entry = malloc(sizeof(*entry) + taglen);
+    if (entry == NULL)
+        return NULL;
+    entry->next = NULL;
+    entry->timestamp = timestamp;
+    entry->taglen = taglen;
+    entry->tag = (uint8_t *)(entry + 1);
+    memcpy(entry->tag, tag, taglen);
+    return entry;
+}
+
+/* Free bucket and its entries, removing them from shard. */
+static void
+discard_bucket(struct shard *shard, struct bucket *bucket)
+{
+    struct entry *entry, *next;
+
+    for (entry = bucket->entries; entry != NULL; entry = next) {
+        next = entry->next;
+        k5_hashtab_remove(shard->hash_table, entry->tag, entry->taglen);
+        shard->count--;
+        free(entry);
+    }
+    K5_TAILQ_REMOVE(&shard->buckets, bucket, links);
+    free(bucket);
+}
+
+/* Discard buckets whose records have all expired at now.  shard must be
+ * locked. */
+static void
+expire_shard(struct shard *shard, krb5_timestamp now, krb5_deltat skew)
+{
+    struct bucket *bucket;
+
+    while ((bucket = K5_TAILQ_FIRST(&shard->buckets)) != NULL) {
+        if (!ts_after(now, ts_incr(bucket->latest, skew)))
+            break;
+        discard_bucket(shard, bucket);
+    }
+}
+
+/* Check tag against shard and add it if it is not present, if shard has fewer
+ * than max records.  shard must be locked. */
+static krb5_error_code
+store_entry(struct shard *shard, size_t max, const uint8_t *tag,
+            size_t taglen, krb5_timestamp timestamp)
+{
+    struct bucket *bucket;
+    struct entry *entry;
+
+    if (k5_hashtab_get(shard->hash_table, tag, taglen) != NULL)
+        return KRB5KRB_AP_ERR_REPEAT;
+    if (shard->count >= max)
+        return KRB5_RC_IO_SPACE;
+
+    /* Use the newest bucket if timestamp is within its span; otherwise start
+     * a new one. */
+    bucket = K5_TAILQ_LAST(&shard->buckets, bucket_queue);
+    if (bucket == NULL || ts_after(timestamp,
+                                   ts_incr(bucket->start, BUCKET_SECS - 1))) {
+        bucket = calloc(1, sizeof(*bucket));
+        if (bucket == NULL)
+            return ENOMEM;
+        bucket->start = bucket->latest = timestamp;
+        K5_TAILQ_INSERT_TAIL(&shard->buckets, bucket, links);
+    }
+
+    entry = new_entry(tag, taglen, timestamp);
+    if (entry == NULL)
+        return ENOMEM;
+    if (k5_hashtab_add(shard->hash_table, entry->tag, taglen, entry) != 0) {
+        free(entry);
+        return ENOMEM;
+    }
+    entry->next = bucket->entries;
+    bucket->entries = entry;
+    if (ts_after(timestamp, bucket->latest))
+        bucket->latest = timestamp;
+    shard->count++;
+    return 0;
+}
+
+static struct shard *
+select_shard(struct mem_table *table, const uint8_t *tag, size_t taglen)
+{
+    return &table->shards[k5_siphash24(tag, taglen, table->shard_seed) %
+                           NSHARDS];
+}
+
+/* Add a record to buf in the file format. */
+static void
+marshal_record(struct k5buf *buf, const uint8_t *tag, size_t taglen,
+               krb5_timestamp timestamp)
+{
+    k5_buf_add_uint32_be(buf, timestamp);
+    k5_buf_add_uint16_be(buf, taglen);
+    k5_buf_add_len(buf, tag, taglen);
+}
+
+/* Check and store tag in table at time now, journaling it if table has a
+ * file. */
+static krb5_error_code
+store_tag(krb5_context context, struct mem_table *table, const uint8_t *tag,
+          size_t taglen, krb5_timestamp now)
+{
+    krb5_error_code ret;
+    struct shard *shard = select_shard(table, tag, taglen);
+
+    k5_mutex_lock(&shard->lock);
+    expire_shard(shard, now, context->clockskew);
+    ret = store_entry(shard, table->shard_max, tag, taglen, now);
+    if (!ret && *table->name != '\0')
+        marshal_record(&shard->journal, tag, taglen, now);
+    k5_mutex_unlock(&shard->lock);
+    if (ret == KRB5_RC_IO_SPACE) {
+        k5_setmsg(context, ret, _("Replay cache mem:%s is full"),
+                  table->name);
+    }
+    return ret;
+}
+
+/* Load unexpired records from the persistence file filename into table, if it
+ * exists.  Ignore a missing file or trailing garbage. */
+static krb5_error_code
+load_file(krb5_context context, struct mem_table *table, const char *filename,
+          krb5_timestamp now)
+{
+    krb5_error_code ret = 0;
+    FILE *fp;
+    uint8_t magic[MAGIC_LEN], hdr[6], tag[MAX_TAG_LEN];
+    krb5_timestamp timestamp;
+    size_t taglen;
+    struct shard *shard;
+
+    fp = fopen(filename, "rb");
+    if (fp == NULL)
+        return (errno == ENOENT) ? 0 : errno;
+    set_cloexec_file(fp);
+
+    if (fread(magic, 1, MAGIC_LEN, fp) != MAGIC_LEN ||
+        memcmp(magic, MAGIC, MAGIC_LEN) != 0)
+        goto cleanup;
+    while (fread(hdr, 1, 6, fp) == 6) {
+        timestamp = load_32_be(hdr);
+        taglen = load_16_be(hdr + 4);
+        if (taglen > MAX_TAG_LEN || fread(tag, 1, taglen, fp) != taglen)
+            break;
+        if (ts_after(now, ts_incr(timestamp, context->clockskew)))
+            continue;
+        shard = select_shard(table, tag, taglen);
+        ret = store_entry(shard, table->shard_max, tag, taglen, timestamp);
+        if (ret == KRB5KRB_AP_ERR_REPEAT || ret == KRB5_RC_IO_SPACE)
+            ret = 0;
+        if (ret)
+            break;
+    }
+
+cleanup:
+    fclose(fp);
+    return ret;
+}
+
+/* Load unexpired records from the previous and current persistence files of
+ * table. */
+static krb5_error_code
+load_table(krb5_context context, struct mem_table *table, krb5_timestamp now)
+{
+    krb5_error_code ret;
+    char *oldname;
+
+    if (asprintf(&oldname, "%s.old", table->name) < 0)
+        return ENOMEM;
+    ret = load_file(context, table, oldname, now);
+    free(oldname);
+    if (ret)
+        return ret;
+    return load_file(context, table, table->name, now);
+}
+
+/* Append the records journaled by the shards of table to its persistence
+ * file, first starting a new file if the current one is old enough. */
+static krb5_error_code
+persist_table(krb5_context context, struct mem_table *table,
+              krb5_timestamp now)
+{
+    krb5_error_code ret = 0;
+    struct k5buf buf, journal;
+    struct shard *shard;
+    struct stat sb;
+    char *oldname = NULL;
+    ssize_t st;
+    int i, fd = -1;
+
+#ifdef _WIN32
+    return KRB5_RC_NOIO;
+#endif
+
+    /* Take each shard's journal, holding its lock only for the exchange. */
+    k5_buf_init_dynamic(&buf);
+    for (i = 0; i < NSHARDS; i++) {
+        shard = &table->shards[i];
+        k5_mutex_lock(&shard->lock);
+        journal = shard->journal;
+        k5_buf_init_dynamic(&shard->journal);
+        k5_mutex_unlock(&shard->lock);
+        k5_buf_add_len(&buf, journal.data, journal.len);
+        k5_buf_free(&journal);
+    }
+    ret = k5_buf_status(&buf);
+    if (ret)
+        goto cleanup;
+
+    if (ts_after(now, ts_incr(table->file_start, context->clockskew)) ||
+        ts_after(table->file_start, now)) {
+        if (asprintf(&oldname, "%s.old", table->name) < 0) {
+            oldname = NULL;
+            ret = ENOMEM;
+            goto cleanup;
+        }
+        if (rename(table->name, oldname) != 0 && errno != ENOENT) {
+            ret = errno;
+            goto cleanup;
+        }
+        table->file_start = now;
+    } else if (buf.len == 0) {
+        goto cleanup;
+    }
+
+    fd = open(table->name, O_WRONLY | O_CREAT | O_APPEND | O_BINARY, 0600);
+    if (fd < 0) {
+        ret = errno;
+        goto cleanup;
+    }
+    set_cloexec_fd(fd);
+    if (fstat(fd, &sb) != 0) {
+        ret = errno;
+        goto cleanup;
+    }
+    if (sb.st_size == 0) {
+        st = write(fd, MAGIC, MAGIC_LEN);
+        if (st != MAGIC_LEN) {
+            ret = (st < 0) ? errno : EIO;
+            goto cleanup;
+        }
+    }
+    if (buf.len > 0) {
+        st = write(fd, buf.data, buf.len);
+        if (st < 0 || (size_t)st != buf.len) {
+            ret = (st < 0) ? errno : EIO;
+            goto cleanup;
+        }
+    }
+    if (close(fd) != 0)
+        ret = errno;
+    fd = -1;
+
+cleanup:
+    if (fd != -1)
+        close(fd);
+    free(oldname);
+    k5_buf_free(&buf);
+    return ret;
+}
+
+/* Persist table if it has a file and has not been persisted recently.  Only
+ * one thread does so at a time; others return immediately. */
+static void
+maybe_persist(krb5_context context, struct mem_table *table,
+              krb5_timestamp now)
+{
+    krb5_error_code ret;
+    krb5_boolean due;
+
+    if (*table->name == '\0')
+        return;
+    k5_mutex_lock(&table->persist_lock);
+    due = !table->persisting &&
+        (ts_after(now, ts_incr(table->last_persist, PERSIST_INTERVAL - 1)) ||
+         ts_after(table->last_persist, now));
+    if (due) {
+        table->persisting = TRUE;
+        table->last_persist = now;
+    }
+    k5_mutex_unlock(&table->persist_lock);
+    if (!due)
+        return;
+
+    ret = persist_table(context, table, now);
+    if (ret)
+        TRACE_RC_MEM_PERSIST_ERROR(context, table->name, ret);
+
+    k5_mutex_lock(&table->persist_lock);
+    table->persisting = FALSE;
+    k5_mutex_unlock(&table->persist_lock);
+}
+
+static void
+free_table(struct mem_table *table)
+{
+    struct shard *shard;
+    struct bucket *bucket;
+    int i;
+
+    for (i = 0; i < NSHARDS; i++) {
+        shard = &table->shards[i];
+        while ((bucket = K5_TAILQ_FIRST(&shard->buckets)) != NULL)
+            discard_bucket(shard, bucket);
+        if (shard->hash_table != NULL)
+            k5_hashtab_free(shard->hash_table);
+        k5_buf_free(&shard->journal);
+        k5_mutex_destroy(&shard->lock);
+    }
+    k5_mutex_destroy(&table->persist_lock);
+    free(table->name);
+    free(table);
+}
+
+/* Create a table named name, loading records from its persistence file if it
+ * has one. */
+static krb5_error_code
+create_table(krb5_context context, const char *name, krb5_timestamp now,
+             struct mem_table **table_out)
+{
+    krb5_error_code ret;
+    struct mem_table *table;
+    struct shard *shard;
+    krb5_data d;
+    int i, max_records;
+
+    *table_out = NULL;
+
+    ret = profile_get_integer(context->profile, KRB5_CONF_LIBDEFAULTS,
+                              KRB5_CONF_MEM_RCACHE_MAX_RECORDS, NULL,
+                              DEFAULT_MAX_RECORDS, &max_records);
+    if (ret)
+        return ret;
+    if (max_records < NSHARDS)
+        max_records = NSHARDS;
+
+    table = k5alloc(sizeof(*table), &ret);
+    if (table == NULL)
+        return ret;
+    table->shard_max = max_records / NSHARDS;
+    for (i = 0; i < NSHARDS; i++) {
+        shard = &table->shards[i];
+        K5_TAILQ_INIT(&shard->buckets);
+        k5_buf_init_dynamic(&shard->journal);
+        ret = k5_mutex_init(&shard->lock);
+        if (ret) {
+            free(table);
+            return ret;
+        }
+    }
+    ret = k5_mutex_init(&table->persist_lock);
+    if (ret) {
+        for (i = 0; i < NSHARDS; i++)
+            k5_mutex_destroy(&table->shards[i].lock);
+        free(table);
+        return ret;
+    }
+    table->last_persist = table->file_start = now;
+
+    table->name = strdup(name);
+    if (table->name == NULL) {
+        ret = ENOMEM;
+        goto error;
+    }
+    /* Use independent seeds for shard selection and the shard hash tables, so
+     * that the tags within a shard are spread across its hash buckets. */
+    d = make_data(table->shard_seed, sizeof(table->shard_seed));
+    ret = krb5_c_random_make_octets(context, &d);
+    if (ret)
+        goto error;
+    d = make_data(table->hash_seed, sizeof(table->hash_seed));
+    ret = krb5_c_random_make_octets(context, &d);
+    if (ret)
+        goto error;
+    for (i = 0; i < NSHARDS; i++) {
+        ret = k5_hashtab_create(table->hash_seed, 0,
+                                &table->shards[i].hash_table);
+        if (ret)
+            goto error;
+    }
+
+    if (*name != '\0') {
+#ifdef _WIN32
+        ret = KRB5_RC_NOIO;
+        goto error;
+#endif
+        ret = load_table(context, table, now);
+        if (ret) {
+            k5_prependmsg(context, ret, _("Cannot load replay cache file %s"),
+                          name);
+            goto error;
+        }
+    }
+
+    *table_out = table;
+    return 0;
+
+error:
+    free_table(table);
+    return ret;
+}
+
+static krb5_error_code
+mem_resolve(krb5_context context, const char *residual, void **rcdata_out)
+{
+    krb5_error_code ret = 0;
+    struct mem_table *table;
+    krb5_timestamp now;
+
+    *rcdata_out = NULL;
+
+    ret = krb5_timeofday(context, &now);
+    if (ret)
+        return ret;
+
+    k5_mutex_lock(&tables_lock);
+    for (table = tables; table != NULL; table = table->next) {
+        if (strcmp(table->name, residual) == 0)
+            break;
+    }
+    if (table == NULL) {
+        ret = create_table(context, residual, now, &table);
+        if (!ret) {
+            table->next = tables;
+            tables = table;
+        }
+    }
+    k5_mutex_unlock(&tables_lock);
+    if (ret)
+        return ret;
+
+    *rcdata_out = table;
+    return 0;
+}
+
+static void
+mem_close(krb5_context context, void *rcdata)
+{
+    /* Tables are kept until the library is finalized. */
+}
+
+static krb5_error_code
+mem_store(krb5_context context, void *rcdata, const krb5_data *tag)
+{
+    krb5_error_code ret;
+    struct mem_table *table = rcdata;
+    krb5_timestamp now;
+
+    if (tag->length > MAX_TAG_LEN)
+        return EINVAL;
+    ret = krb5_timeofday(context, &now);
+    if (ret)
+        return ret;
+
+    ret = store_tag(context, table, (uint8_t *)tag->data, tag->length, now);
+    if (!ret)
+        maybe_persist(context, table, now);
+    return ret;
+}
+
+int
+krb5int_rc_initialize(void)
+{
+    return k5_mutex_finish_init(&tables_lock);
+}
+
+void
+krb5int_rc_finalize(void)
+{
+    struct mem_table *table, *next;
+
+    for (table = tables; table != NULL; table = next) {
+        next = table->next;
+        free_table(table);
+    }
+    tables = NULL;
+    k5_mutex_destroy(&tables_lock);
+}
+
+const krb5_rc_ops k5_rc_mem_ops =
+{
+    "mem",
+    mem_resolve,
+    mem_close,
+    mem_store
+};
@@ -0,0 +1,357 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/* lib/krb5/rcache/rc_shm.c - shared-memory replay cache */
+/*
+ * Copyright (C) 2020 by the Massachusetts Institute of Technology.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in
+ *   the documentation and/or other materials provided with the
+ *   distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * The shm replay cache type stores replay records in a fixed-size
+ * open-addressed hash table within a memory-mapped file, normally on a
+ * memory-backed filesystem such as /dev/shm.  Records are inserted with atomic
+ * compare-and-swap operations, so processes sharing the file only lock it when
+ * it is first opened.
+ *
+ * The file begins with a header of HEADER_LEN bytes, containing the magic
+ * string "K5RCSHM1", the number of slots as a 64-bit integer, and a hash seed.
+ * The slots follow, each a 64-bit integer.  A slot value of zero indicates an
+ * unused slot.  Otherwise the high 48 bits of a slot contain a fingerprint of
+ * a tag, and the low 16 bits contain the time bucket (the timestamp divided by
+ * BUCKET_SECS) in which the tag was stored.  Integers are in host byte order,
+ * as the file is only meaningful to processes on the host which created it.
+ *
+ * A tag is stored within MAX_PROBE slots of the position given by its hash
+ * value.  Slots are never emptied; a slot whose time bucket has expired may be
+ * reused for a new tag.
+ */
+
+#include "k5-int.h"
+#include "k5-hashtab.h"
+#include "rc-int.h"
+
+#ifdef RC_SHM_SUPPORTED
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#define MAGIC "K5RCSHM1"
+#define MAGIC_LEN 8
+#define HEADER_LEN 64
+#define TAG_LEN 12
+#define DEFAULT_SLOTS (1024 * 1024)
+#define MIN_SLOTS 1024
+#define MAX_PROBE 128
+#define BUCKET_SECS 16
+
+struct shm_rc {
+    char *filename;
+    void *map;
+    size_t maplen;
+    uint64_t *slots;
+    uint64_t nslots;
+    uint8_t seed[K5_HASH_SEED_LEN];
+};
+
+/* Return the filename to use for an empty residual, selecting a directory as
+ * the dfl type does. */
+static char *
+default_filename(void)
+{
+    const char *dir;
+    char *fname;
+
+    dir = secure_getenv("KRB5RCACHEDIR");
+    if (dir == NULL) {
+        dir = secure_getenv("TMPDIR");
+        if (dir == NULL)
+            dir = RCTMPDIR;
+    }
+    if (asprintf(&fname, "%s/krb5_%lu.rcshm", dir,
+                 (unsigned long)geteuid()) < 0)
+        return NULL;
+    return fname;
+}
+
+/* Write a header to the locked file fd, whose size is size.  Use the existing
+ * file size to determine the number of slots if it is large enough;
+ * otherwise extend the file to hold the default number of slots. */
+static krb5_error_code
+init_header(krb5_context context, int fd, off_t size)
+{
+    krb5_error_code ret;
+    uint8_t header[HEADER_LEN] = { 0 };
+    uint64_t nslots;
+    krb5_data d;
+
+    if (size >= HEADER_LEN + MIN_SLOTS * 8) {
+        nslots = (size - HEADER_LEN) / 8;
+    } else {
+        nslots = DEFAULT_SLOTS;
+        if (ftruncate(fd, HEADER_LEN + nslots * 8) != 0)
+            return errno;
+    }
+
+    memcpy(header, MAGIC, MAGIC_LEN);
+    memcpy(header + MAGIC_LEN, &nslots, 8);
+    d = make_data(header + MAGIC_LEN + 8, K5_HASH_SEED_LEN);
+    ret = krb5_c_random_make_octets(context, &d);
+    if (ret)
+        return ret;
+
+    if (pwrite(fd, header, HEADER_LEN, 0) != HEADER_LEN)
+        return EIO;
+    return 0;
+}
+
+/* Open and map the file for rc, initializing it if necessary. */
+static krb5_error_code
+map_table(krb5_context context, struct shm_rc *rc)
+{
+    krb5_error_code ret;
+    uint8_t header[HEADER_LEN], zero[MAGIC_LEN] = { 0 };
+    struct stat statbuf;
+    void *map;
+    int fd, locked = 0;
+
+    fd = open(rc->filename, O_CREAT | O_RDWR | O_NOFOLLOW, 0600);
+    if (fd < 0) {
+        ret = errno;
+        k5_setmsg(context, ret, "%s (filename: %s)", error_message(ret),
+                  rc->filename);
+        return ret;
+    }
+    set_cloexec_fd(fd);
+
+    if (fstat(fd, &statbuf) != 0 || statbuf.st_uid != geteuid()) {
+        ret = EIO;
+        k5_setmsg(context, ret, "Replay cache file %s is not owned by uid %lu",
+                  rc->filename, (unsigned long)geteuid());
+        goto cleanup;
+    }
+
+    /* Initialize the header if no one has done so yet. */
+    ret = krb5_lock_file(context, fd, KRB5_LOCKMODE_EXCLUSIVE);
+    if (ret)
+        goto cleanup;
+    locked = 1;
+    memset(header, 0, sizeof(header));
+    if (pread(fd, header, HEADER_LEN, 0) < 0) {
+        ret = errno;
+        goto cleanup;
+    }
+    if (memcmp(header, zero, MAGIC_LEN) == 0) {
+        ret = init_header(context, fd, statbuf.st_size);
+        if (ret)
+            goto cleanup;
+        if (pread(fd, header, HEADER_LEN, 0) != HEADER_LEN ||
+            fstat(fd, &statbuf) != 0) {
+            ret = EIO;
+            goto cleanup;
+        }
+    }
+
+    memcpy(&rc->nslots, header + MAGIC_LEN, 8);
+    memcpy(rc->seed, header + MAGIC_LEN + 8, K5_HASH_SEED_LEN);
+    if (memcmp(header, MAGIC, MAGIC_LEN) != 0 || rc->nslots == 0 ||
+        statbuf.st_size < HEADER_LEN ||
+        rc->nslots > (uint64_t)(statbuf.st_size - HEADER_LEN) / 8 ||
+        rc->nslots > (SIZE_MAX - HEADER_LEN) / 8) {
+        ret = KRB5_RC_IO;
+        k5_setmsg(context, ret, "Replay cache file %s is not a shm replay "
+                  "cache", rc->filename);
+        goto cleanup;
+    }
+
+    rc->maplen = HEADER_LEN + rc->nslots * 8;
+    map = mmap(NULL, rc->maplen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        ret = errno;
+        goto cleanup;
+    }
+    rc->map = map;
+    rc->slots = (uint64_t *)((uint8_t *)map + HEADER_LEN);
+
+cleanup:
+    if (locked)
+        (void)krb5_unlock_file(context, fd);
+    close(fd);
+    return ret;
+}
+
+/* Return true if the slot value val was stored long enough before the time
+ * bucket now to be expired for the allowable clock skew.  Bucket numbers wrap
+ * around every 65536 buckets (about 12 days), so compute the age modulo that
+ * range.  Treat a value from the next bucket as current, as another process
+ * may have read the clock just after we did. */
+static inline krb5_boolean
+expired(uint64_t val, uint16_t now, krb5_deltat skew)
+{
+    uint16_t age = now - (uint16_t)(val & 0xFFFF);
+
+    if (age == UINT16_MAX)
+        return FALSE;
+    return age > skew / BUCKET_SECS + 1;
+}
+
+/* Return true if a slot within MAX_PROBE slots of home, other than skip, holds
+ * the fingerprint fp. */
+static krb5_boolean
+probe_match(struct shm_rc *rc, uint64_t home, uint64_t fp, uint64_t skip)
+{
+    uint64_t i, pos, val;
+
+    for (i = 0; i < MAX_PROBE; i++) {
+        pos = (home + i) % rc->nslots;
+        val = __atomic_load_n(&rc->slots[pos], __ATOMIC_SEQ_CST);
+        if (val == 0)
+            break;
+        if (pos != skip && (val >> 16) == fp)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+static krb5_error_code
+store(krb5_context context, struct shm_rc *rc, const uint8_t tag[TAG_LEN],
+      krb5_timestamp now)
+{
+    uint8_t seed[K5_HASH_SEED_LEN];
+    uint64_t home, fp, rec, i, pos, val, avail, availval;
+    uint16_t bucket = (uint32_t)now / BUCKET_SECS;
+
+    /* Compute the table position and fingerprint from independent hashes. */
+    home = k5_siphash24(tag, TAG_LEN, rc->seed) % rc->nslots;
+    memcpy(seed, rc->seed, sizeof(seed));
+    seed[0]++;
+    fp = k5_siphash24(tag, TAG_LEN, seed) >> 16;
+    if (fp == 0)
+        fp = 1;
+    rec = (fp << 16) | bucket;
+
+    for (;;) {
+        /* Look for a matching record, and note the first slot available for
+         * writing (empty or expired).  An empty slot ends the search. */
+        avail = availval = UINT64_MAX;
+        for (i = 0; i < MAX_PROBE; i++) {
+            pos = (home + i) % rc->nslots;
+            val = __atomic_load_n(&rc->slots[pos], __ATOMIC_SEQ_CST);
+            if (val != 0 && (val >> 16) == fp)
+                return KRB5KRB_AP_ERR_REPEAT;
+            if (avail == UINT64_MAX &&
+                (val == 0 || expired(val, bucket, context->clockskew))) {
+                avail = pos;
+                availval = val;
+            }
+            if (val == 0)
+                break;
+        }
+        if (avail == UINT64_MAX) {
+            k5_setmsg(context, KRB5_RC_IO_SPACE,
+                      _("Replay cache %s is full"), rc->filename);
+            return KRB5_RC_IO_SPACE;
+        }
+
+        /* Claim the slot.  If another process changed it first, search
+         * again. */
+        if (__atomic_compare_exchange_n(&rc->slots[avail], &availval, rec, 0,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+            break;
+    }
+
+    /* If another process concurrently stored the same tag in a different slot,
+     * at least one of us will see the other's record here.  Treat it as a
+     * replay. */
+    if (probe_match(rc, home, fp, avail))
+        return KRB5KRB_AP_ERR_REPEAT;
+    return 0;
+}
+
+static krb5_error_code
+shm_resolve(krb5_context context, const char *residual, void **rcdata_out)
+{
+    struct shm_rc *rc;
+
+    *rcdata_out = NULL;
+    rc = calloc(1, sizeof(*rc));
+    if (rc == NULL)
+        return ENOMEM;
+    rc->filename = (*residual == '\0') ? default_filename() :
+        strdup(residual);
+    if (rc->filename == NULL) {
+        free(rc);
+        return ENOMEM;
+    }
+    *rcdata_out = rc;
+    return 0;
+}
+
+static void
+shm_close(krb5_context context, void *rcdata)
+{
+    struct shm_rc *rc = rcdata;
+
+    if (rc->map != NULL)
+        munmap(rc->map, rc->maplen);
+    free(rc->filename);
+    free(rc);
+}
+
+static krb5_error_code
+shm_store(krb5_context context, void *rcdata, const krb5_data *tag_data)
+{
+    krb5_error_code ret;
+    struct shm_rc *rc = rcdata;
+    krb5_timestamp now;
+    uint8_t tagbuf[TAG_LEN] = { 0 };
+
+    ret = krb5_timeofday(context, &now);
+    if (ret)
+        return ret;
+
+    /* Map the file on first use. */
+    if (rc->map == NULL) {
+        ret = map_table(context, rc);
+        if (ret)
+            return ret;
+    }
+
+    memcpy(tagbuf, tag_data->data,
+           (tag_data->length < TAG_LEN) ? tag_data->length : TAG_LEN);
+    return store(context, rc, tagbuf, now);
+}
+
+const krb5_rc_ops k5_rc_shm_ops =
+{
+    "shm",
+    shm_resolve,
+    shm_close,
+    shm_store
+};
+
+#endif /* RC_SHM_SUPPORTED */
@@ -0,0 +1,336 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/* lib/krb5/rcache/t_rcmem.c - mem replay cache tests */
+/*
+ * Copyright (C) 2020 by the Massachusetts Institute of Technology.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in
+ *   the documentation and/or other materials provided with the
+ *   distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Usage: t_rcmem <filename>
+ *
+ * Test the mem replay cache type, using <filename> and other names beginning
+ * with <filename> as persistence files.  If thread support is enabled, also test concurrent
+ * stores from multiple threads.
+ */
+
+#include "k5-int.h"
+#include "rc-int.h"
+#include <sys/stat.h>
+#ifdef ENABLE_THREADS
+#include <pthread.h>
+#endif
+
+#define TAG_LEN 12
+#define NTHREADS 8
+#define THREAD_REPS 5000
+#define RACE_REPS 100
+
+static krb5_error_code
+store(krb5_context ctx, krb5_rcache rc, uint32_t id, uint32_t n,
+      krb5_timestamp timestamp)
+{
+    uint8_t tag[TAG_LEN] = { 0 };
+    krb5_data d = make_data(tag, TAG_LEN);
+
+    store_32_be(id, tag);
+    store_32_be(n, tag + 4);
+    (void)krb5_set_debugging_time(ctx, timestamp, 0);
+    return rc->ops->store(ctx, rc->data, &d);
+}
+
+static krb5_rcache
+resolve(krb5_context ctx, const char *name)
+{
+    krb5_rcache rc;
+
+    if (k5_rc_resolve(ctx, name, &rc) != 0)
+        abort();
+    return rc;
+}
+
+/* Verify that handles with the same name share records, and that records
+ * expire. */
+static void
+test_basic(krb5_context ctx)
+{
+    krb5_rcache rc1, rc2, rc3;
+
+    ctx->clockskew = 100;
+    rc1 = resolve(ctx, "mem:");
+    rc2 = resolve(ctx, "mem:");
+    rc3 = resolve(ctx, "mem:");
+
+    assert(store(ctx, rc1, 1, 1, 1000) == 0);
+    assert(store(ctx, rc1, 1, 1, 1000) == KRB5KRB_AP_ERR_REPEAT);
+    assert(store(ctx, rc2, 1, 1, 1050) == KRB5KRB_AP_ERR_REPEAT);
+    assert(store(ctx, rc2, 1, 2, 1050) == 0);
+
+    /* A closed handle does not discard the records. */
+    k5_rc_close(ctx, rc1);
+    k5_rc_close(ctx, rc2);
+    rc1 = resolve(ctx, "mem:");
+    assert(store(ctx, rc1, 1, 2, 1050) == KRB5KRB_AP_ERR_REPEAT);
+
+    /* After the skew has passed, both records have expired. */
+    assert(store(ctx, rc3, 1, 1, 1200) == 0);
+    assert(store(ctx, rc3, 1, 2, 1200) == 0);
+    assert(store(ctx, rc3, 1, 2, 1200) == KRB5KRB_AP_ERR_REPEAT);
+
+    k5_rc_close(ctx, rc1);
+    k5_rc_close(ctx, rc3);
+}
+
+/* Return the size of filename, or -1 if it does not exist. */
+static off_t
+file_size(const char *filename)
+{
+    struct stat statbuf;
+
+    return (stat(filename, &statbuf) == 0) ? statbuf.st_size : -1;
+}
+
+/* Verify that records are appended to the persistence file after the persist
+ * interval, that the file is moved aside once it is older than the clock skew,
+ * and that records from both files are loaded into a new table. */
+static void
+test_persist(krb5_context ctx, const char *filename)
+{
+    krb5_rcache rc;
+    char *name, *oldname, *copyname, *copyoldname;
+    off_t size;
+    int i;
+
+    ctx->clockskew = 100;
+    if (asprintf(&name, "mem:%s", filename) < 0 ||
+        asprintf(&oldname, "%s.old", filename) < 0 ||
+        asprintf(&copyname, "%s.copy", filename) < 0 ||
+        asprintf(&copyoldname, "%s.copy.old", filename) < 0)
+        abort();
+    (void)unlink(filename);
+    (void)unlink(oldname);
+
+    /* Resolve the table at time 2000, so the first persist is due at 2030. */
+    (void)krb5_set_debugging_time(ctx, 2000, 0);
+    rc = resolve(ctx, name);
+    for (i = 0; i < 100; i++)
+        assert(store(ctx, rc, 2, i, 2000) == 0);
+    assert(file_size(filename) == -1);
+    assert(store(ctx, rc, 2, 100, 2030) == 0);
+    size = file_size(filename);
+    assert(size == 8 + 101 * (6 + TAG_LEN));
+
+    /* Only the records stored since the last write are appended at the next
+     * one. */
+    assert(store(ctx, rc, 2, 101, 2040) == 0);
+    assert(file_size(filename) == size);
+    assert(store(ctx, rc, 2, 102, 2060) == 0);
+    assert(file_size(filename) == size + 2 * (6 + TAG_LEN));
+
+    /* Once the file is older than the clock skew, it is renamed and a new
+     * file is started. */
+    assert(store(ctx, rc, 2, 103, 2110) == 0);
+    assert(file_size(oldname) == size + 2 * (6 + TAG_LEN));
+    assert(file_size(filename) == 8 + (6 + TAG_LEN));
+    k5_rc_close(ctx, rc);
+
+    /* Copy the files to a new name and load them into a new table.  Records
+     * which have expired at load time are not loaded. */
+    if ((link(filename, copyname) != 0 && errno != EEXIST) ||
+        (link(oldname, copyoldname) != 0 && errno != EEXIST))
+        abort();
+    free(name);
+    if (asprintf(&name, "mem:%s", copyname) < 0)
+        abort();
+    (void)krb5_set_debugging_time(ctx, 2120, 0);
+    rc = resolve(ctx, name);
+    for (i = 100; i <= 103; i++)
+        assert(store(ctx, rc, 2, i, 2120) == KRB5KRB_AP_ERR_REPEAT);
+    assert(store(ctx, rc, 2, 0, 2120) == 0);
+    k5_rc_close(ctx, rc);
+
+    (void)unlink(filename);
+    (void)unlink(oldname);
+    (void)unlink(copyname);
+    (void)unlink(copyoldname);
+    free(name);
+    free(oldname);
+    free(copyname);
+    free(copyoldname);
+}
+
+/* Verify that a table created with a small mem_rcache_max_records value
+ * rejects records once it is full. */
+static void
+test_limit(const char *filename)
+{
+    krb5_error_code ret;
+    krb5_context ctx;
+    krb5_rcache rc;
+    profile_t profile;
+    FILE *fp;
+    char *confname, *name;
+    int i, nstored = 0;
+
+    if (asprintf(&confname, "%s.conf", filename) < 0 ||
+        asprintf(&name, "mem:%s.limit", filename) < 0)
+        abort();
+    fp = fopen(confname, "w");
+    if (fp == NULL)
+        abort();
+    fprintf(fp, "[libdefaults]\n\tmem_rcache_max_records = 64\n");
+    fclose(fp);
+    if (profile_init_path(confname, &profile) != 0 ||
+        krb5_init_context_profile(profile, 0, &ctx) != 0)
+        abort();
+    profile_release(profile);
+
+    ctx->clockskew = 100;
+    (void)krb5_set_debugging_time(ctx, 4000, 0);
+    rc = resolve(ctx, name);
+    for (i = 0; i < 256; i++) {
+        ret = store(ctx, rc, 4, i, 4000);
+        assert(ret == 0 || ret == KRB5_RC_IO_SPACE);
+        if (ret == 0)
+            nstored++;
+    }
+    assert(nstored <= 64);
+    k5_rc_close(ctx, rc);
+    krb5_free_context(ctx);
+
+    (void)unlink(confname);
+    free(confname);
+    free(name);
+}
+
+#ifdef ENABLE_THREADS
+
+struct thread_args {
+    uint32_t id;
+    uint32_t reps;
+    int nsuccess;
+};
+
+static pthread_barrier_t barrier;
+
+/* Store args->reps unique tags, or (if args->reps is 0) one tag shared with
+ * the other threads, counting the successes. */
+static void *
+run_thread(void *ptr)
+{
+    struct thread_args *args = ptr;
+    krb5_context ctx;
+    krb5_rcache rc;
+    uint32_t i;
+
+    if (krb5_init_context(&ctx) != 0)
+        abort();
+    ctx->clockskew = 100;
+    rc = resolve(ctx, "mem:");
+    pthread_barrier_wait(&barrier);
+    if (args->reps == 0) {
+        if (store(ctx, rc, 0, args->id, 3000) == 0)
+            args->nsuccess++;
+    } else {
+        for (i = 0; i < args->reps; i++) {
+            if (store(ctx, rc, args->id, i, 3000) == 0)
+                args->nsuccess++;
+        }
+    }
+    k5_rc_close(ctx, rc);
+    krb5_free_context(ctx);
+    return NULL;
+}
+
+/* Run NTHREADS threads with the given number of reps each, and return the
+ * total number of successful stores. */
+static int
+run_threads(uint32_t id_base, uint32_t reps)
+{
+    pthread_t threads[NTHREADS];
+    struct thread_args args[NTHREADS];
+    int i, total = 0;
+
+    pthread_barrier_init(&barrier, NULL, NTHREADS);
+    for (i = 0; i < NTHREADS; i++) {
+        args[i].id = (reps == 0) ? id_base : id_base + i;
+        args[i].reps = reps;
+        args[i].nsuccess = 0;
+        if (pthread_create(&threads[i], NULL, run_thread, &args[i]) != 0)
+            abort();
+    }
+    for (i = 0; i < NTHREADS; i++) {
+        pthread_join(threads[i], NULL);
+        total += args[i].nsuccess;
+    }
+    pthread_barrier_destroy(&barrier);
+    return total;
+}
+
+/* Verify that concurrent stores of unique tags all succeed and are then
+ * detected as replays, and that exactly one concurrent store of the same tag
+ * succeeds. */
+static void
+test_threads(krb5_context ctx)
+{
+    krb5_rcache rc;
+    uint32_t i, j;
+
+    assert(run_threads(100, THREAD_REPS) == NTHREADS * THREAD_REPS);
+    ctx->clockskew = 100;
+    rc = resolve(ctx, "mem:");
+    for (i = 0; i < NTHREADS; i++) {
+        for (j = 0; j < THREAD_REPS; j++)
+            assert(store(ctx, rc, 100 + i, j, 3000) == KRB5KRB_AP_ERR_REPEAT);
+    }
+    k5_rc_close(ctx, rc);
+
+    for (i = 0; i < RACE_REPS; i++)
+        assert(run_threads(1000 + i, 0) == 1);
+}
+
+#endif /* ENABLE_THREADS */
+
+int
+main(int argc, char **argv)
+{
+    krb5_context ctx;
+
+    assert(argc == 2);
+    if (krb5_init_context(&ctx) != 0)
+        abort();
+
+    test_basic(ctx);
+    test_persist(ctx, argv[1]);
+    test_limit(argv[1]);
+#ifdef ENABLE_THREADS
+    test_threads(ctx);
+#endif
+
+    krb5_free_context(ctx);
+    return 0;
+}
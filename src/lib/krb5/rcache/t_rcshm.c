@@ -0,0 +1,299 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/* lib/krb5/rcache/t_rcshm.c - shm replay cache tests */
+/*
+ * Copyright (C) 2020 by the Massachusetts Institute of Technology.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in
+ *   the documentation and/or other materials provided with the
+ *   distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Usage:
+ *
+ *   t_rcshm <filename> expiry <nreps>
+ *     check the expiry of records of various ages; then, in a minimum-size
+ *     table, store <nreps> records spaced far enough apart that all records
+ *     appear expired, and verify that all stores succeed and the file size
+ *     doesn't change.
+ *
+ *   t_rcshm <filename> concurrent <nprocesses> <nreps>
+ *     spawn <nprocesses> subprocesses, each of which stores <nreps> unique
+ *     tags.  As each process completes, the master process tests that the
+ *     records stored by the subprocess appears as replays.
+ *
+ *   t_rcshm <filename> race <nprocesses> <nreps>
+ *     spawn <nprocesses> subprocesses, each of which tries to store the same
+ *     tag and reports success or failure.  The master process verifies that
+ *     exactly one subprocess succeeds.  Repeat <reps> times.
+ *
+ *   t_rcshm <filename> full
+ *     fill a minimum-size table with unexpired records; verify that the
+ *     stored records appear as replays and that the table accepts new records
+ *     once the old ones expire.
+ *
+ * If the shm type is not supported on this platform, exit successfully
+ * without running any tests.
+ */
+
+#include "rc_shm.c"
+#include <sys/wait.h>
+
+krb5_context ctx;
+
+#ifdef RC_SHM_SUPPORTED
+
+static krb5_error_code
+test_store(const char *filename, uint8_t *tag, krb5_timestamp timestamp,
+           const uint32_t clockskew)
+{
+    krb5_error_code ret;
+    krb5_data tag_data = make_data(tag, TAG_LEN);
+    void *rcdata;
+
+    ctx->clockskew = clockskew;
+    (void)krb5_set_debugging_time(ctx, timestamp, 0);
+    ret = shm_resolve(ctx, filename, &rcdata);
+    assert(ret == 0);
+    ret = shm_store(ctx, rcdata, &tag_data);
+    shm_close(ctx, rcdata);
+    return ret;
+}
+
+/* Create filename as an uninitialized table of the minimum size. */
+static void
+create_small_table(const char *filename)
+{
+    int fd, st;
+
+    fd = open(filename, O_CREAT | O_RDWR | O_TRUNC, 0600);
+    assert(fd >= 0);
+    st = ftruncate(fd, HEADER_LEN + MIN_SLOTS * 8);
+    assert(st == 0);
+    close(fd);
+}
+
+/* Check expired() for slot values from a range of time buckets, including
+ * buckets more than half of the bucket number range in the past. */
+static void
+check_expired(void)
+{
+    const uint16_t now = 1000;
+    const krb5_deltat skew = 300;
+    const uint64_t fp = (uint64_t)1 << 16;
+
+    assert(!expired(fp | now, now, skew));
+    assert(!expired(fp | (now + 1), now, skew));
+    assert(!expired(fp | (now - skew / BUCKET_SECS - 1), now, skew));
+    assert(expired(fp | (now - skew / BUCKET_SECS - 2), now, skew));
+    assert(expired(fp | (uint16_t)(now - 20000), now, skew));
+    assert(expired(fp | (uint16_t)(now - 40000), now, skew));
+    assert(expired(fp | (uint16_t)(now + 2), now, skew));
+}
+
+/* Store a sequence of unique tags, with timestamps far enough apart that all
+ * previous records appear expired.  Verify that every store succeeds in a
+ * minimum-size table. */
+static void
+expiry_test(const char *filename, int reps)
+{
+    krb5_error_code ret;
+    struct stat statbuf;
+    uint8_t tag[TAG_LEN] = { 0 };
+    const uint32_t clockskew = 5, start = 1000, step = BUCKET_SECS * 3;
+    uint32_t timestamp;
+    int i, st;
+
+    check_expired();
+
+    /* Stay within the range of time buckets before bucket numbers wrap
+     * around. */
+    assert((uint32_t)reps < 65535 / 3);
+    create_small_table(filename);
+    for (i = 0, timestamp = start; i < reps; i++, timestamp += step) {
+        store_32_be(i, tag);
+        ret = test_store(filename, tag, timestamp, clockskew);
+        assert(ret == 0);
+    }
+
+    st = stat(filename, &statbuf);
+    assert(st == 0);
+    assert(statbuf.st_size == HEADER_LEN + MIN_SLOTS * 8);
+}
+
+/* Store a sequence of unique tags with the same timestamp.  Exit with failure
+ * if any store operation doesn't succeed or fail as given by expect_fail. */
+static void
+store_records(const char *filename, int id, int reps, int expect_fail)
+{
+    krb5_error_code ret;
+    uint8_t tag[TAG_LEN] = { 0 };
+    int i;
+
+    store_32_be(id, tag);
+    for (i = 0; i < reps; i++) {
+        store_32_be(i, tag + 4);
+        ret = test_store(filename, tag, 1000, 100);
+        if (ret != (expect_fail ? KRB5KRB_AP_ERR_REPEAT : 0)) {
+            fprintf(stderr, "store %d %d %sfail\n", id, i,
+                    expect_fail ? "didn't " : "");
+            _exit(1);
+        }
+    }
+}
+
+/* Spawn multiple child processes, each storing a sequence of unique tags.
+ * After each process completes, verify that its tags appear as replays. */
+static void
+concurrency_test(const char *filename, int nchildren, int reps)
+{
+    pid_t *pids, pid;
+    int i, nprocs, status;
+
+    pids = calloc(nchildren, sizeof(*pids));
+    assert(pids != NULL);
+    for (i = 0; i < nchildren; i++) {
+        pids[i] = fork();
+        assert(pids[i] != -1);
+        if (pids[i] == 0) {
+            store_records(filename, i, reps, 0);
+            _exit(0);
+        }
+    }
+    for (nprocs = nchildren; nprocs > 0; nprocs--) {
+        pid = wait(&status);
+        assert(pid != -1 && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+        for (i = 0; i < nchildren; i++) {
+            if (pids[i] == pid)
+                store_records(filename, i, reps, 1);
+        }
+    }
+    free(pids);
+}
+
+/* Spawn multiple child processes, all trying to store the same tag.  Verify
+ * that only one of the processes succeeded.  Repeat reps times. */
+static void
+race_test(const char *filename, int nchildren, int reps)
+{
+    int i, j, status, nsuccess;
+    uint8_t tag[TAG_LEN] = { 0 };
+    pid_t pid;
+
+    for (i = 0; i < reps; i++) {
+        store_32_be(i, tag);
+        for (j = 0; j < nchildren; j++) {
+            pid = fork();
+            assert(pid != -1);
+            if (pid == 0)
+                _exit(test_store(filename, tag, 1000, 100) != 0);
+        }
+
+        nsuccess = 0;
+        for (j = 0; j < nchildren; j++) {
+            pid = wait(&status);
+            assert(pid != -1);
+            if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+                nsuccess++;
+        }
+        assert(nsuccess == 1);
+    }
+}
+
+/* Fill a minimum-size table with unexpired records, then verify that they
+ * are detected as replays and that new records fit after they expire. */
+static void
+full_test(const char *filename)
+{
+    krb5_error_code ret;
+    uint8_t tag[TAG_LEN] = { 0 };
+    int i, n;
+
+    create_small_table(filename);
+    for (n = 0; n <= MIN_SLOTS; n++) {
+        store_32_be(n, tag);
+        ret = test_store(filename, tag, 1000, 100);
+        if (ret == KRB5_RC_IO_SPACE)
+            break;
+        assert(ret == 0);
+    }
+    assert(n > 0 && n < MIN_SLOTS);
+
+    for (i = 0; i < n; i++) {
+        store_32_be(i, tag);
+        ret = test_store(filename, tag, 1000, 100);
+        assert(ret == KRB5KRB_AP_ERR_REPEAT);
+    }
+
+    store_32_be(n, tag);
+    ret = test_store(filename, tag, 1000 + 100 + BUCKET_SECS * 2, 100);
+    assert(ret == 0);
+}
+
+int
+main(int argc, char **argv)
+{
+    const char *filename, *cmd;
+
+    argv++;
+    assert(*argv != NULL);
+
+    if (krb5_init_context(&ctx) != 0)
+        abort();
+
+    assert(*argv != NULL);
+    filename = *argv++;
+    unlink(filename);
+
+    assert(*argv != NULL);
+    cmd = *argv++;
+    if (strcmp(cmd, "expiry") == 0) {
+        assert(argv[0] != NULL);
+        expiry_test(filename, atoi(argv[0]));
+    } else if (strcmp(cmd, "concurrent") == 0) {
+        assert(argv[0] != NULL && argv[1] != NULL);
+        concurrency_test(filename, atoi(argv[0]), atoi(argv[1]));
+    } else if (strcmp(cmd, "race") == 0) {
+        assert(argv[0] != NULL && argv[1] != NULL);
+        race_test(filename, atoi(argv[0]), atoi(argv[1]));
+    } else if (strcmp(cmd, "full") == 0) {
+        full_test(filename);
+    } else {
+        abort();
+    }
+
+    krb5_free_context(ctx);
+    return 0;
+}
+
+#else /* RC_SHM_SUPPORTED */
+
+int
+main(int argc, char **argv)
+{
+    return 0;
+}
+
+#endif /* RC_SHM_SUPPORTED */
@@ -41,6 +41,7 @@
 struct k5_tls_handle_st {
     SSL *ssl;
     char *servername;
+    krb5_boolean handshake_done;
 };
 
 static int ex_context_id = -1;
@@ -475,6 +476,7 @@ setup(krb5_context context, SOCKET fd, const char *servername,
         goto error;
 
     handle->ssl = ssl;
+    handle->handshake_done = FALSE;
     handle->servername = strdup(servername);
     if (handle->servername == NULL)
         goto error;
@@ -501,8 +503,15 @@ write_tls(krb5_context context, k5_tls_handle handle, const void *data,
         return ERROR_TLS;
     nwritten = SSL_write(handle->ssl, data, len);
     (void)SSL_set_ex_data(handle->ssl, ex_context_id, NULL);
-    if (nwritten > 0)
+    if (nwritten > 0) {
+        /* The first successful write completes the handshake. */
+        if (!handle->handshake_done) {
+            handle->handshake_done = TRUE;
+            if (SSL_session_reused(handle->ssl))
+                TRACE_TLS_SESSION_RESUMED(context);
+        }
         return DONE;
+    }
 
     e = SSL_get_error(handle->ssl, nwritten);
     if (e == SSL_ERROR_WANT_READ)
@@ -553,6 +562,58 @@ free_handle(krb5_context context, k5_tls_handle handle)
     free(handle);
 }
 
+static krb5_error_code
+get_session(krb5_context context, k5_tls_handle handle, krb5_data *session_out)
+{
+    SSL_SESSION *sess;
+    unsigned char *p;
+    int len;
+    krb5_error_code ret = 0;
+
+    *session_out = empty_data();
+
+    sess = SSL_get1_session(handle->ssl);
+    if (sess == NULL)
+        return 0;
+    len = i2d_SSL_SESSION(sess, NULL);
+    if (len <= 0)
+        goto cleanup;
+    ret = alloc_data(session_out, len);
+    if (ret)
+        goto cleanup;
+    p = (unsigned char *)session_out->data;
+    if (i2d_SSL_SESSION(sess, &p) != len) {
+        krb5_free_data_contents(context, session_out);
+        goto cleanup;
+    }
+
+cleanup:
+    SSL_SESSION_free(sess);
+    return ret;
+}
+
+static krb5_error_code
+set_session(krb5_context context, k5_tls_handle handle,
+            const krb5_data *session)
+{
+    SSL_SESSION *sess;
+    const unsigned char *p = (unsigned char *)session->data;
+    int ok;
+
+    sess = d2i_SSL_SESSION(NULL, &p, session->length);
+    if (sess == NULL) {
+        flush_errors(context);
+        return KRB5_PLUGIN_OP_NOTSUPP;
+    }
+    ok = SSL_set_session(handle->ssl, sess);
+    SSL_SESSION_free(sess);
+    if (!ok) {
+        flush_errors(context);
+        return KRB5_PLUGIN_OP_NOTSUPP;
+    }
+    return 0;
+}
+
 krb5_error_code
 tls_k5tls_initvt(krb5_context context, int maj_ver, int min_ver,
                  krb5_plugin_vtable vtable);
@@ -568,6 +629,8 @@ tls_k5tls_initvt(krb5_context context, int maj_ver, int min_ver,
     vt->write = write_tls;
     vt->read = read_tls;
     vt->free_handle = free_handle;
+    vt->get_session = get_session;
+    vt->set_session = set_session;
     return 0;
 }
 
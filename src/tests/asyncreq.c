@@ -0,0 +1,266 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/* tests/asyncreq.c - asynchronous KDC exchange test harness */
+/*
+ * Copyright (C) 2020 by the Massachusetts Institute of Technology.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in
+ *   the documentation and/or other materials provided with the
+ *   distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * This program is intended to be run from a python script as:
+ *
+ *     asyncreq password service princ1 princ2 ...
+ *
+ * For each client principal, asyncreq obtains initial credentials with the
+ * given password using krb5_init_creds_step(), and then a ticket for the
+ * service principal using krb5_tkt_creds_step().  All of the KDC exchanges
+ * are performed with krb5_kdc_exchange_init() and related functions from a
+ * single poll loop.  asyncreq displays the maximum number of exchanges which
+ * were in progress at once, followed by the client and service principal
+ * names of each service ticket obtained.
+ */
+
+#include "k5-int.h"
+#include <poll.h>
+
+#define MAX_FDS_PER_EXCHANGE 16
+
+struct client {
+    krb5_principal princ;
+    krb5_init_creds_context icc;
+    krb5_tkt_creds_context tcc;
+    krb5_ccache ccache;
+    krb5_kdc_exchange_context exch;
+    krb5_data reply;
+    int tcp_only;
+    krb5_creds creds;
+};
+
+static krb5_context ctx;
+static const char *password;
+static krb5_principal service;
+
+static void
+check(krb5_error_code code)
+{
+    const char *errmsg;
+
+    if (code) {
+        errmsg = krb5_get_error_message(ctx, code);
+        fprintf(stderr, "%s\n", errmsg);
+        krb5_free_error_message(ctx, errmsg);
+        exit(1);
+    }
+}
+
+/* Switch c from getting initial credentials to getting a service ticket. */
+static void
+start_tkt_creds(struct client *c)
+{
+    krb5_creds creds, in_creds;
+
+    check(krb5_init_creds_get_creds(ctx, c->icc, &creds));
+    check(krb5_cc_new_unique(ctx, "MEMORY", NULL, &c->ccache));
+    check(krb5_cc_initialize(ctx, c->ccache, c->princ));
+    check(krb5_cc_store_cred(ctx, c->ccache, &creds));
+    krb5_free_cred_contents(ctx, &creds);
+    krb5_init_creds_free(ctx, c->icc);
+    c->icc = NULL;
+
+    memset(&in_creds, 0, sizeof(in_creds));
+    in_creds.client = c->princ;
+    in_creds.server = service;
+    check(krb5_tkt_creds_init(ctx, c->ccache, &in_creds, 0, &c->tcc));
+}
+
+/* Step c's current context with c->reply, and begin an exchange for the next
+ * request if there is one. */
+static void
+step(struct client *c)
+{
+    krb5_error_code ret;
+    krb5_data req = empty_data(), realm = empty_data();
+    unsigned int flags = 0;
+
+    for (;;) {
+        if (c->icc != NULL) {
+            ret = krb5_init_creds_step(ctx, c->icc, &c->reply, &req, &realm,
+                                       &flags);
+        } else {
+            ret = krb5_tkt_creds_step(ctx, c->tcc, &c->reply, &req, &realm,
+                                      &flags);
+        }
+        krb5_free_data_contents(ctx, &c->reply);
+        if (ret == KRB5KRB_ERR_RESPONSE_TOO_BIG && !c->tcp_only) {
+            c->tcp_only = 1;
+            flags = KRB5_INIT_CREDS_STEP_FLAG_CONTINUE;
+        } else {
+            check(ret);
+        }
+
+        if (flags & KRB5_INIT_CREDS_STEP_FLAG_CONTINUE) {
+            check(krb5_kdc_exchange_init(ctx, &req, &realm,
+                                         c->tcp_only ?
+                                         KRB5_KDC_EXCHANGE_TCP_ONLY : 0,
+                                         &c->exch));
+            break;
+        } else if (c->icc != NULL) {
+            start_tkt_creds(c);
+            c->tcp_only = 0;
+        } else {
+            check(krb5_tkt_creds_get_creds(ctx, c->tcc, &c->creds));
+            break;
+        }
+    }
+    krb5_free_data_contents(ctx, &req);
+    krb5_free_data_contents(ctx, &realm);
+}
+
+int
+main(int argc, char **argv)
+{
+    struct client *clients, *c;
+    struct pollfd *pfds;
+    krb5_kdc_exchange_fd xfds[MAX_FDS_PER_EXCHANGE], *ready;
+    size_t *owner, nfds, nxfds, nready, j;
+    krb5_boolean complete;
+    char *cname, *sname;
+    int i, nclients, timeout, t, nactive, maxactive = 0;
+
+    if (argc < 4) {
+        fprintf(stderr, "Usage: asyncreq password service princ1 ...\n");
+        exit(1);
+    }
+    password = argv[1];
+    nclients = argc - 3;
+
+    check(krb5_init_context(&ctx));
+    check(krb5_parse_name(ctx, argv[2], &service));
+
+    clients = calloc(nclients, sizeof(*clients));
+    pfds = calloc(nclients * MAX_FDS_PER_EXCHANGE, sizeof(*pfds));
+    owner = calloc(nclients * MAX_FDS_PER_EXCHANGE, sizeof(*owner));
+    ready = calloc(nclients * MAX_FDS_PER_EXCHANGE, sizeof(*ready));
+    assert(clients != NULL && pfds != NULL && owner != NULL && ready != NULL);
+
+    /* Begin the first exchange for each client. */
+    for (i = 0; i < nclients; i++) {
+        c = &clients[i];
+        check(krb5_parse_name(ctx, argv[i + 3], &c->princ));
+        check(krb5_init_creds_init(ctx, c->princ, NULL, NULL, 0, NULL,
+                                   &c->icc));
+        check(krb5_init_creds_set_password(ctx, c->icc, password));
+        step(c);
+    }
+
+    for (;;) {
+        /* Gather the sockets and timeouts of all exchanges in progress. */
+        nfds = 0;
+        nactive = 0;
+        timeout = -1;
+        for (i = 0; i < nclients; i++) {
+            c = &clients[i];
+            if (c->exch == NULL)
+                continue;
+            nactive++;
+            check(krb5_kdc_exchange_get_fds(ctx, c->exch, xfds,
+                                            MAX_FDS_PER_EXCHANGE, &nxfds));
+            for (j = 0; j < nxfds; j++) {
+                pfds[nfds].fd = xfds[j].fd;
+                pfds[nfds].events =
+                    ((xfds[j].events & KRB5_KDC_EXCHANGE_EVENT_READ) ?
+                     POLLIN : 0) |
+                    ((xfds[j].events & KRB5_KDC_EXCHANGE_EVENT_WRITE) ?
+                     POLLOUT : 0);
+                owner[nfds++] = i;
+            }
+            check(krb5_kdc_exchange_get_timeout(ctx, c->exch, &t));
+            if (timeout == -1 || t < timeout)
+                timeout = t;
+        }
+        if (nactive == 0)
+            break;
+        if (nactive > maxactive)
+            maxactive = nactive;
+
+        if (poll(pfds, nfds, timeout) < 0) {
+            perror("poll");
+            exit(1);
+        }
+
+        /* Process each exchange with its ready sockets. */
+        for (i = 0; i < nclients; i++) {
+            c = &clients[i];
+            if (c->exch == NULL)
+                continue;
+            nready = 0;
+            for (j = 0; j < nfds; j++) {
+                if (owner[j] != (size_t)i || pfds[j].revents == 0)
+                    continue;
+                ready[nready].fd = pfds[j].fd;
+                ready[nready].events =
+                    ((pfds[j].revents & POLLIN) ?
+                     KRB5_KDC_EXCHANGE_EVENT_READ : 0) |
+                    ((pfds[j].revents & POLLOUT) ?
+                     KRB5_KDC_EXCHANGE_EVENT_WRITE : 0) |
+                    ((pfds[j].revents & (POLLERR | POLLHUP | POLLNVAL)) ?
+                     KRB5_KDC_EXCHANGE_EVENT_ERROR : 0);
+                nready++;
+            }
+            check(krb5_kdc_exchange_process(ctx, c->exch, ready, nready,
+                                            &complete));
+            if (!complete)
+                continue;
+            check(krb5_kdc_exchange_get_reply(ctx, c->exch, &c->reply));
+            krb5_kdc_exchange_free(ctx, c->exch);
+            c->exch = NULL;
+            step(c);
+        }
+    }
+
+    printf("%d exchanges in progress at once\n", maxactive);
+    for (i = 0; i < nclients; i++) {
+        c = &clients[i];
+        check(krb5_unparse_name(ctx, c->creds.client, &cname));
+        check(krb5_unparse_name(ctx, c->creds.server, &sname));
+        printf("%s: %s\n", cname, sname);
+        krb5_free_unparsed_name(ctx, cname);
+        krb5_free_unparsed_name(ctx, sname);
+        krb5_free_cred_contents(ctx, &c->creds);
+        krb5_tkt_creds_free(ctx, c->tcc);
+        krb5_cc_destroy(ctx, c->ccache);
+        krb5_free_principal(ctx, c->princ);
+    }
+
+    free(clients);
+    free(pfds);
+    free(owner);
+    free(ready);
+    krb5_free_principal(ctx, service);
+    krb5_free_context(ctx);
+    return 0;
+}
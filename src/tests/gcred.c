@@ -33,7 +33,7 @@
 /*
  * This program is intended to be run from a python script as:
  *
- *     gcred [-f] [-t] nametype princname
+ *     gcred [-f] [-t] nametype princname [princname ...]
  *
  * where nametype is one of "unknown", "principal", "srv-inst", and "srv-hst",
  * and princname is the name of the service principal.  gcred acquires
@@ -42,6 +42,10 @@
  * with status 0.  On failure, gcred displays the error message for the failed
  * operation to stderr and exits with status 1.
  *
+ * If more than one princname is given, gcred acquires credentials for all of
+ * them with krb5_get_credentials_multi() and displays the server principal
+ * names in the same order.
+ *
  * The -f and -t flags set the KRB5_GC_FORWARDABLE and KRB5_GC_NO_TRANSIT_CHECK
  * options respectively.
  */
@@ -63,16 +67,46 @@ check(krb5_error_code code)
     }
 }
 
+static krb5_principal
+parse_server(const char *nametype, const char *name)
+{
+    krb5_principal server;
+
+    check(krb5_parse_name(ctx, name, &server));
+    if (strcmp(nametype, "unknown") == 0)
+        server->type = KRB5_NT_UNKNOWN;
+    else if (strcmp(nametype, "principal") == 0)
+        server->type = KRB5_NT_PRINCIPAL;
+    else if (strcmp(nametype, "srv-inst") == 0)
+        server->type = KRB5_NT_SRV_INST;
+    else if (strcmp(nametype, "srv-hst") == 0)
+        server->type = KRB5_NT_SRV_HST;
+    else
+        abort();
+    return server;
+}
+
+static void
+display_server(krb5_creds *creds)
+{
+    krb5_ticket *ticket;
+    char *name;
+
+    check(krb5_decode_ticket(&creds->ticket, &ticket));
+    check(krb5_unparse_name(ctx, ticket->server, &name));
+    printf("%s\n", name);
+    krb5_free_ticket(ctx, ticket);
+    krb5_free_unparsed_name(ctx, name);
+}
+
 int
 main(int argc, char **argv)
 {
-    krb5_principal client, server;
+    krb5_principal client;
     krb5_ccache ccache;
-    krb5_creds in_creds, *creds;
-    krb5_ticket *ticket;
+    krb5_creds *in_creds, **in_ptrs, **creds;
     krb5_flags options = 0;
-    char *name;
-    int c;
+    int c, i, n;
 
     check(krb5_init_context(&ctx));
 
@@ -90,34 +124,37 @@ main(int argc, char **argv)
     }
     argc -= optind;
     argv += optind;
-    assert(argc == 2);
-    check(krb5_parse_name(ctx, argv[1], &server));
-    if (strcmp(argv[0], "unknown") == 0)
-        server->type = KRB5_NT_UNKNOWN;
-    else if (strcmp(argv[0], "principal") == 0)
-        server->type = KRB5_NT_PRINCIPAL;
-    else if (strcmp(argv[0], "srv-inst") == 0)
-        server->type = KRB5_NT_SRV_INST;
-    else if (strcmp(argv[0], "srv-hst") == 0)
-        server->type = KRB5_NT_SRV_HST;
-    else
-        abort();
+    assert(argc >= 2);
+    n = argc - 1;
 
     check(krb5_cc_default(ctx, &ccache));
     check(krb5_cc_get_principal(ctx, ccache, &client));
-    memset(&in_creds, 0, sizeof(in_creds));
-    in_creds.client = client;
-    in_creds.server = server;
-    check(krb5_get_credentials(ctx, options, ccache, &in_creds, &creds));
-    check(krb5_decode_ticket(&creds->ticket, &ticket));
-    check(krb5_unparse_name(ctx, ticket->server, &name));
-    printf("%s\n", name);
+    in_creds = calloc(n, sizeof(*in_creds));
+    in_ptrs = calloc(n, sizeof(*in_ptrs));
+    creds = calloc(n, sizeof(*creds));
+    assert(in_creds != NULL && in_ptrs != NULL && creds != NULL);
+    for (i = 0; i < n; i++) {
+        in_creds[i].client = client;
+        in_creds[i].server = parse_server(argv[0], argv[i + 1]);
+        in_ptrs[i] = &in_creds[i];
+    }
+    if (n == 1) {
+        check(krb5_get_credentials(ctx, options, ccache, &in_creds[0],
+                                   &creds[0]));
+    } else {
+        check(krb5_get_credentials_multi(ctx, options, ccache, n, in_ptrs,
+                                         creds, NULL));
+    }
+    for (i = 0; i < n; i++) {
+        display_server(creds[i]);
+        krb5_free_creds(ctx, creds[i]);
+        krb5_free_principal(ctx, in_creds[i].server);
+    }
 
-    krb5_free_ticket(ctx, ticket);
-    krb5_free_unparsed_name(ctx, name);
-    krb5_free_creds(ctx, creds);
+    free(in_creds);
+    free(in_ptrs);
+    free(creds);
     krb5_free_principal(ctx, client);
-    krb5_free_principal(ctx, server);
     krb5_cc_close(ctx, ccache);
     krb5_free_context(ctx);
     return 0;
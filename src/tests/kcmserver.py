@@ -4,6 +4,10 @@
 # (It also imposes no namespace or access constraints, and blocks
 # while reading requests and writing responses.)
 
+# If the -f flag is given before the socket path, the server rejects
+# the MIT extension opcodes like an older daemon would, so that
+# clients must fall back to the base protocol.
+
 # This code knows nothing about how to marshal and unmarshal principal
 # names and credentials as is required in the KCM protocol; instead,
 # it just remembers the marshalled forms and replays them to the
@@ -49,12 +53,14 @@ class KCMOpcodes(object):
     SET_DEFAULT_CACHE = 21
     GET_KDC_OFFSET = 22
     SET_KDC_OFFSET = 23
+    GET_CRED_LIST = 13001
 
 
 class KRB5Errors(object):
     KRB5_CC_END = -1765328242
     KRB5_CC_NOSUPP = -1765328137
     KRB5_FCC_NOFILE = -1765328189
+    KRB5_FCC_INTERNAL = -1765328188
 
 
 def make_uuid():
@@ -137,6 +143,14 @@ def op_get_cred_uuid_list(argbytes):
     return 0, b''.join(cache.cred_uuids)
 
 
+def op_get_cred_list(argbytes):
+    name, rest = unmarshal_name(argbytes)
+    cache = get_cache(name)
+    creds = [cache.creds[u] for u in cache.cred_uuids]
+    return 0, (struct.pack('>L', len(creds)) +
+               b''.join(struct.pack('>L', len(c)) + c for c in creds))
+
+
 def op_get_cred_by_uuid(argbytes):
     name, uuid = unmarshal_name(argbytes)
     cache = get_cache(name)
@@ -197,9 +211,14 @@ ophandlers = {
     KCMOpcodes.GET_DEFAULT_CACHE : op_get_default_cache,
     KCMOpcodes.SET_DEFAULT_CACHE : op_set_default_cache,
     KCMOpcodes.GET_KDC_OFFSET : op_get_kdc_offset,
-    KCMOpcodes.SET_KDC_OFFSET : op_set_kdc_offset
+    KCMOpcodes.SET_KDC_OFFSET : op_set_kdc_offset,
+    KCMOpcodes.GET_CRED_LIST : op_get_cred_list
 }
 
+fallback = (sys.argv[1] == '-f')
+if fallback:
+    del sys.argv[1]
+
 # Read and respond to a request from the socket s.
 def service_request(s):
     lenbytes = b''
@@ -215,7 +234,11 @@ def service_request(s):
 
     majver, minver, op = struct.unpack('>BBH', req[:4])
     argbytes = req[4:]
-    code, payload = ophandlers[op](argbytes)
+    if fallback and op > 13000:
+        # Heimdal's daemon returns this code for unknown opcodes.
+        code, payload = KRB5Errors.KRB5_FCC_INTERNAL, b''
+    else:
+        code, payload = ophandlers[op](argbytes)
 
     # The KCM response is the code (4 bytes) and the response payload.
     # The Heimdal IPC response is the length of the KCM response (4
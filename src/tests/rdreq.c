@@ -36,29 +36,74 @@
 #include <assert.h>
 #include <krb5.h>
 
+/* Get a ticket for tkt_princ from ccache and read an AP-REQ using it with
+ * server as the server principal. */
+static krb5_error_code
+read_apreq(krb5_context context, krb5_ccache ccache,
+           krb5_principal client_princ, krb5_principal tkt_princ,
+           krb5_principal server_princ)
+{
+    krb5_creds *cred, mcred;
+    krb5_auth_context auth_con;
+    krb5_data apreq;
+    krb5_error_code ret;
+
+    /* Produce an AP-REQ message. */
+    memset(&mcred, 0, sizeof(mcred));
+    mcred.client = client_princ;
+    mcred.server = tkt_princ;
+    if (krb5_get_credentials(context, 0, ccache, &mcred, &cred) != 0)
+        abort();
+    auth_con = NULL;
+    if (krb5_mk_req_extended(context, &auth_con, 0, NULL, cred, &apreq) != 0)
+        abort();
+
+    /* Consume the AP-REQ message without using a replay cache. */
+    krb5_auth_con_free(context, auth_con);
+    if (krb5_auth_con_init(context, &auth_con) != 0)
+        abort();
+    if (krb5_auth_con_setflags(context, auth_con, 0) != 0)
+        abort();
+    ret = krb5_rd_req(context, &auth_con, &apreq, server_princ, NULL, NULL,
+                      NULL);
+
+    krb5_free_data_contents(context, &apreq);
+    assert(apreq.length == 0);
+    krb5_auth_con_free(context, auth_con);
+    krb5_free_creds(context, cred);
+    return ret;
+}
+
 int
 main(int argc, char **argv)
 {
     krb5_context context;
-    krb5_principal client_princ, tkt_princ, server_princ;
+    krb5_principal client_princ, tkt_princ, server_princ, prior_princ = NULL;
     krb5_ccache ccache;
-    krb5_creds *cred, mcred;
-    krb5_auth_context auth_con;
-    krb5_data apreq;
     krb5_error_code ret, code;
     const char *tkt_name, *server_name, *emsg;
 
+    if (krb5_init_context(&context) != 0)
+        abort();
+
+    /* With -p, first read an AP-REQ for another ticket using the same
+     * context, so that the keys it uses may be cached. */
+    if (argc >= 3 && strcmp(argv[1], "-p") == 0) {
+        if (krb5_parse_name(context, argv[2], &prior_princ) != 0)
+            abort();
+        argc -= 2;
+        argv += 2;
+    }
+
     /* Parse arguments. */
     if (argc < 2 || argc > 3) {
-        fprintf(stderr, "Usage: rdreq tktname [servername]\n");
+        fprintf(stderr, "Usage: rdreq [-p priortktname] tktname "
+                "[servername]\n");
         exit(1);
     }
     tkt_name = argv[1];
     server_name = argv[2];
 
-    if (krb5_init_context(&context) != 0)
-        abort();
-
     /* Parse the requested principal names. */
     if (krb5_parse_name(context, tkt_name, &tkt_princ) != 0)
         abort();
@@ -70,28 +115,15 @@ main(int argc, char **argv)
         server_princ = NULL;
     }
 
-    /* Produce an AP-REQ message. */
     if (krb5_cc_default(context, &ccache) != 0)
         abort();
     if (krb5_cc_get_principal(context, ccache, &client_princ) != 0)
         abort();
-    memset(&mcred, 0, sizeof(mcred));
-    mcred.client = client_princ;
-    mcred.server = tkt_princ;
-    if (krb5_get_credentials(context, 0, ccache, &mcred, &cred) != 0)
-        abort();
-    auth_con = NULL;
-    if (krb5_mk_req_extended(context, &auth_con, 0, NULL, cred, &apreq) != 0)
-        abort();
 
-    /* Consume the AP-REQ message without using a replay cache. */
-    krb5_auth_con_free(context, auth_con);
-    if (krb5_auth_con_init(context, &auth_con) != 0)
+    if (prior_princ != NULL &&
+        read_apreq(context, ccache, client_princ, prior_princ, NULL) != 0)
         abort();
-    if (krb5_auth_con_setflags(context, auth_con, 0) != 0)
-        abort();
-    ret = krb5_rd_req(context, &auth_con, &apreq, server_princ, NULL, NULL,
-                      NULL);
+    ret = read_apreq(context, ccache, client_princ, tkt_princ, server_princ);
 
     /* Display the result. */
     if (ret) {
@@ -105,14 +137,11 @@ main(int argc, char **argv)
         printf("0 success\n");
     }
 
-    krb5_free_data_contents(context, &apreq);
-    assert(apreq.length == 0);
-    krb5_auth_con_free(context, auth_con);
-    krb5_free_creds(context, cred);
     krb5_cc_close(context, ccache);
     krb5_free_principal(context, client_princ);
     krb5_free_principal(context, tkt_princ);
     krb5_free_principal(context, server_princ);
+    krb5_free_principal(context, prior_princ);
     krb5_free_context(context);
     return 0;
 }
@@ -124,11 +124,62 @@ def collection_test(realm, ccname):
     realm.run([klist, '-A', '-s', ccname], expected_code=1)
 
 
+# Test listing and retrieving enough creds to take several batches
+# when the KCM server doesn't support fetching them all at once.
+def kcm_creds_test(realm):
+    ccname = 'KCM:creds'
+    realm.kinit(realm.user_princ, password('user'), flags=['-c', ccname])
+    realm.run([kvno, '-c', ccname] + services)
+    output = realm.run([klist, '-c', ccname])
+    for svc in services:
+        if svc + '@' not in output:
+            fail('klist did not show credential for ' + svc)
+    realm.run([kvno, '-c', ccname] + services[::7])
+    realm.run([kdestroy, '-c', ccname])
+
+
+# Test that krb5_cc_cache_match() (via kswitch -p) notices a DIR
+# subsidiary cache reinitialized without updating the collection's index.
+def dir_index_test(realm, ccdir):
+    oldccname = realm.env['KRB5CCNAME']
+    realm.env['KRB5CCNAME'] = 'DIR:' + ccdir
+    realm.kinit('alice', password('alice'))
+    realm.kinit('carol', password('carol'))
+    realm.run([kswitch, '-p', 'alice'])
+    output = realm.run([klist, '-l'])
+    path = [l.split()[1] for l in output.splitlines()
+            if l.startswith('alice@')][0]
+    if not path.startswith('DIR::'):
+        fail('unexpected alice cache name in klist -l output')
+    path = path[5:]
+    realm.run([kswitch, '-p', 'carol'])
+    realm.kinit('bob', password('bob'), flags=['-c', 'FILE:' + path])
+    realm.run([kswitch, '-p', 'bob'])
+    realm.run([klist], expected_msg='Default principal: bob@')
+    realm.run([kswitch, '-p', 'alice'], expected_code=1)
+    realm.run([kdestroy, '-A'])
+    realm.env['KRB5CCNAME'] = oldccname
+
+
 collection_test(realm, 'DIR:' + os.path.join(realm.testdir, 'cc'))
+mark('DIR collection, subsidiary reinitialized outside the index')
+dir_index_test(realm, os.path.join(realm.testdir, 'cc'))
 kcmserver_path = os.path.join(srctop, 'tests', 'kcmserver.py')
-realm.start_server([sys.executable, kcmserver_path, kcm_socket_path],
-                   'starting...')
+kcmd = realm.start_server([sys.executable, kcmserver_path, kcm_socket_path],
+                          'starting...')
 collection_test(realm, 'KCM:')
+
+services = ['svc%d' % i for i in range(40)]
+for svc in services:
+    realm.addprinc(svc)
+mark('KCM credential list')
+kcm_creds_test(realm)
+stop_daemon(kcmd)
+os.remove(kcm_socket_path)
+kcmd = realm.start_server([sys.executable, kcmserver_path, '-f',
+                           kcm_socket_path], 'starting...')
+mark('KCM credential fetch by UUID')
+kcm_creds_test(realm)
 if test_keyring:
     def cleanup_keyring(anchor, name):
         out = realm.run(['keyctl', 'list', anchor])
@@ -67,6 +67,35 @@ test_kvno(r2, r1.host_princ, 'basic r2->r1')
 check_klist(r2, (tgt(r2, r2), tgt(r1, r2), r1.host_princ))
 stop(r1, r2)
 
+# Test getting several tickets at once.  The cross-realm TGT should be
+# requested only once, and stored along with all of the service tickets.
+mark('multiple tickets')
+r1, r2 = cross_realms(2)
+r2.addprinc('svc1')
+r2.addprinc('svc2')
+svc1, svc2 = 'svc1@' + r2.realm, 'svc2@' + r2.realm
+out, trace = r1.run(['./gcred', 'principal', svc1, svc2, r1.host_princ],
+                    return_trace=True)
+if out.split() != [svc1, svc2, r1.host_princ]:
+    fail('unexpected gcred output for multiple tickets')
+if trace.count('Requesting TGT %s' % tgt(r2, r1)) != 1:
+    fail('cross-realm TGT not requested exactly once')
+check_klist(r1, (tgt(r1, r1), tgt(r2, r1), r1.host_princ, svc1, svc2))
+stop(r1, r2)
+
+# Test getting more tickets at once than sendto drives concurrently; the
+# remaining requests are queued rather than failing.
+mark('many tickets')
+r1, r2 = cross_realms(2)
+svcs = []
+for i in range(40):
+    r2.addprinc('svc%d' % i)
+    svcs.append('svc%d@%s' % (i, r2.realm))
+out = r1.run(['./gcred', 'principal'] + svcs)
+if out.split() != svcs:
+    fail('unexpected gcred output for many tickets')
+stop(r1, r2)
+
 # Test the KDC domain walk for hierarchically arranged realms.  The
 # client in A.X will ask for a cross TGT to B.X, but A.X's KDC only
 # has a TGT for the intermediate realm X, so it will return that
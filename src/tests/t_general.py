@@ -1,3 +1,6 @@
+import socket
+import struct
+import threading
 from k5test import *
 
 for realm in multipass_realms(create_host=False):
@@ -61,4 +64,78 @@ expected_trace = ('Sending initial UDP request',
                   'Storing user@KRBTEST.COM')
 realm.kinit(realm.user_princ, password('user'), expected_trace=expected_trace)
 
-success('FAST kinit, trace logging')
+# Test that TCP connections to the KDC are reused within a context
+# when kdc_connection_idle_timeout is set.
+mark('KDC connection reuse')
+conf = {'libdefaults': {'udp_preference_limit': '1',
+                        'kdc_connection_idle_timeout': '1m'}}
+reuse_env = realm.special_env('reuse', False, krb5_conf=conf)
+realm.addprinc('svc1')
+realm.addprinc('svc2')
+expected_trace = ('Sending TCP request',
+                  'Keeping TCP connection to',
+                  'Reusing TCP connection to',
+                  'Received answer')
+realm.run([kvno, 'svc1', 'svc2'], env=reuse_env,
+          expected_trace=expected_trace)
+
+# Test that the KDC answers two requests sent on one TCP connection.
+# Capture an AS-REQ by pointing kinit at a listener which accepts one
+# TCP connection, then send it to the KDC twice.
+mark('KDC TCP connection with two requests')
+def recv_exact(sock, n):
+    data = b''
+    while len(data) < n:
+        chunk = sock.recv(n - len(data))
+        if not chunk:
+            fail('Unexpected EOF on KDC TCP connection')
+        data += chunk
+    return data
+
+def recv_msg(sock):
+    return recv_exact(sock, struct.unpack('>I', recv_exact(sock, 4))[0])
+
+captured = []
+def capture(listener):
+    conn, addr = listener.accept()
+    captured.append(recv_msg(conn))
+    conn.close()
+
+listener = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+listener.bind(('127.0.0.1', 0))
+listener.listen(1)
+thread = threading.Thread(target=capture, args=(listener,))
+thread.start()
+conf = {'realms': {'$realm': {'kdc': '127.0.0.1:%d' %
+                              listener.getsockname()[1]}},
+        'libdefaults': {'udp_preference_limit': '1'}}
+capture_env = realm.special_env('capture', False, krb5_conf=conf)
+realm.run([kinit, realm.user_princ], input=password('user') + '\n',
+          env=capture_env, expected_code=1)
+thread.join()
+listener.close()
+
+sock = socket.create_connection(('127.0.0.1', realm.portbase))
+for i in range(2):
+    sock.sendall(struct.pack('>I', len(captured[0])) + captured[0])
+    # Expect a complete AS-REP or KRB-ERROR each time.
+    reply = recv_msg(sock)
+    if reply[0] not in (0x6b, 0x7e):
+        fail('Bad reply to request %d on KDC TCP connection' % (i + 1))
+sock.close()
+
+# Test several initial and service ticket requests driven through
+# asynchronous KDC exchanges from a single poll loop.
+mark('asynchronous KDC exchanges')
+for princ in ('async1', 'async2', 'async3'):
+    realm.addprinc(princ, 'pw')
+out = realm.run(['./asyncreq', 'pw', 'svc1', 'async1', 'async2', 'async3'])
+if out != ('3 exchanges in progress at once\n'
+           'async1@KRBTEST.COM: svc1@KRBTEST.COM\n'
+           'async2@KRBTEST.COM: svc1@KRBTEST.COM\n'
+           'async3@KRBTEST.COM: svc1@KRBTEST.COM\n'):
+    fail('unexpected asyncreq output')
+realm.run(['./asyncreq', 'pw', 'svc2', 'async1'], env=reuse_env,
+          expected_trace=('Sending TCP request', 'Received answer'))
+
+success('FAST kinit, trace logging, KDC connection reuse, async exchanges')
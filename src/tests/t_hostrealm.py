@@ -10,7 +10,8 @@ conf = {'plugins': {'hostrealm': {'module': ['test1:' + plugin,
                                              'test2:' + plugin],
                                   'enable_only': ['test2', 'profile',
                                                   'domain', 'test1']}},
-        'domain_realm': {'.x': 'DOTMATCH', 'x': 'MATCH', '.1': 'NUMMATCH'}}
+        'domain_realm': {'.x': 'DOTMATCH', 'x': 'MATCH', '.1': 'NUMMATCH',
+                         'y.z': 'YZMATCH', '.z': 'DOTZMATCH'}}
 realm = K5Realm(krb5_conf=conf, create_kdb=False)
 
 def test(realm, args, expected_realms, msg, env=None):
@@ -59,6 +60,11 @@ testh(realm, '4.3.2.1', ['4', '3', '2', '1'], 'host_realm profile 4.3.2.1')
 testh(realm, 'b:c.x', ['b:c', 'x'], 'host_realm profile b:c.x')
 # hostname cleaning should convert "X." to "x" before matching.
 testh(realm, 'X.', ['MATCH'], 'host_realm profile X.')
+# Names without a leading period also match as suffixes following a
+# period, and the longest matching suffix wins.
+testh(realm, 'y.z', ['YZMATCH'], 'host_realm profile y.z')
+testh(realm, 'b.y.z', ['YZMATCH'], 'host_realm profile b.y.z')
+testh(realm, 'by.z', ['DOTZMATCH'], 'host_realm profile by.z')
 
 # The test1 module returns a list of the hostname components.
 mark('test1 module')
@@ -45,10 +45,15 @@ anchored_ipv4_krb5_conf = {'realms': {'$realm': {
                            'kdc': proxyurl4,
                            'kpasswd_server': proxyurl4,
                            'http_anchors': 'FILE:%s' % proxyca}}}
+reuse_krb5_conf = {'libdefaults': {'kdc_connection_idle_timeout': '1m'},
+                   'realms': {'$realm': {
+                       'kdc': proxyurl,
+                       'kpasswd_server': proxyurl,
+                       'http_anchors': 'FILE:%s' % proxyca}}}
 kpasswd_input = (password('user') + '\n' + password('user') + '\n' +
                  password('user') + '\n')
 
-def start_proxy(realm, keycertpem):
+def start_proxy(realm, keycertpem, keepalive=False):
     proxy_conf_path = os.path.join(realm.testdir, 'kdcproxy.conf')
     proxy_exec_path = os.path.join(srctop, 'util', 'wsgiref-kdcproxy.py')
     conf = open(proxy_conf_path, 'w')
@@ -59,6 +64,8 @@ def start_proxy(realm, keycertpem):
     realm.env['KDCPROXY_CONFIG'] = proxy_conf_path
     cmd = [sys.executable, proxy_exec_path, str(realm.server_port()),
            keycertpem]
+    if keepalive:
+        cmd.append('keepalive')
     return realm.start_server(cmd, sentinel='proxy server ready')
 
 # Fail: untrusted issuer and hostname doesn't match.
@@ -221,4 +228,39 @@ realm.run([kpasswd, realm.user_princ], input=kpasswd_input)
 stop_daemon(proxy)
 realm.stop()
 
+# Succeed: with connection reuse enabled and a proxy which keeps
+# connections alive, the second request uses the same HTTPS connection.
+mark('HTTPS keep-alive')
+output("running pass 16: HTTPS connection reused with keep-alive\n")
+realm = K5Realm(krb5_conf=reuse_krb5_conf, get_creds=False)
+proxy = start_proxy(realm, proxysubjectpem, keepalive=True)
+realm.addprinc('svc1')
+realm.kinit(realm.user_princ, password=password('user'))
+realm.run([kvno, realm.host_princ, 'svc1'],
+          expected_trace=('Sending HTTPS request',
+                          'Keeping TCP connection to',
+                          'Reusing TCP connection to',
+                          'Received answer'))
+stop_daemon(proxy)
+realm.stop()
+
+# Succeed: with connection reuse enabled and a proxy which closes each
+# connection, the second connection resumes the first TLS session.
+mark('TLS session resumption')
+output("running pass 17: TLS session resumed on a new connection\n")
+realm = K5Realm(krb5_conf=reuse_krb5_conf, get_creds=False)
+proxy = start_proxy(realm, proxysubjectpem)
+realm.addprinc('svc1')
+realm.kinit(realm.user_princ, password=password('user'))
+out, trace = realm.run([kvno, realm.host_princ, 'svc1'],
+                       expected_trace=('Sending HTTPS request',
+                                       'Resumed TLS session',
+                                       'Sending HTTPS request',
+                                       'Received answer'),
+                       return_trace=True)
+if 'Reusing TCP connection' in trace:
+    fail('connection reused without keep-alive')
+stop_daemon(proxy)
+realm.stop()
+
 success('MS-KKDCP proxy')
@@ -14,8 +14,11 @@ realm.addprinc(princ1)
 realm.addprinc(princ2)
 realm.addprinc(princ3)
 
-def test(tserver, server, expected):
-    args = ['./rdreq', tserver]
+def test(tserver, server, expected, prior=None):
+    args = ['./rdreq']
+    if prior is not None:
+        args += ['-p', prior]
+    args += [tserver]
     if server is not None:
         args += [server]
     out = realm.run(args)
@@ -135,4 +138,18 @@ test(princ4, None, '0 success')
 test(princ4, princ1, '0 success')
 test(princ4, matchprinc, '0 success')
 
+# Test decryption after another ticket has been decrypted with the same
+# context, so that the first key is cached and tried before other keytab
+# entries.
+mark('cached keys')
+os.remove(realm.keytab)
+realm.extract_keytab(princ2, realm.keytab)
+realm.extract_keytab(princ3, realm.keytab)
+test(princ3, None, '0 success', prior=princ2)
+test(princ2, None, '0 success', prior=princ3)
+test(princ2, matchprinc, '0 success', prior=princ2)
+test(princ3, matchprinc,
+     '35 Request ticket server HTTP/3@KRBTEST.COM found in keytab but does '
+     'not match server principal host/@', prior=princ2)
+
 success('krb5_rd_req tests')
@@ -0,0 +1,316 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/* util/profile/prof_cache.c - compiled profile cache */
+/*
+ * Copyright (C) 2020 by the Massachusetts Institute of Technology.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in
+ *   the documentation and/or other materials provided with the
+ *   distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * If the KRB5_PROFILE_CACHEDIR environment variable names a directory, the
+ * parse tree of each profile file is saved there in a compiled form after it
+ * is parsed, and later processes load the compiled tree instead of parsing
+ * the file again.  A compiled file records the device, inode, size, and
+ * modification time of every file and directory read while parsing (the
+ * profile itself and anything it includes), and is only used if all of them
+ * are unchanged.  Compiled files are private to the effective uid and are
+ * ignored if owned by anyone else.
+ *
+ * A compiled file contains, with integers in big-endian byte order:
+ *
+ *     magic (4 bytes) and version (4 bytes)
+ *     filespec length (4 bytes) and filespec
+ *     dependency count (4 bytes), and for each dependency:
+ *         path length (4 bytes) and path
+ *         device, inode, size, mtime seconds (8 bytes each)
+ *         mtime nanoseconds (4 bytes)
+ *     the parse tree, as marshalled by profile_marshal_tree()
+ */
+
+#include "prof_int.h"
+
+#ifndef _WIN32
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+
+#define CACHE_MAGIC 0x4B505243  /* "KPRC" */
+#define CACHE_VERSION 1
+#define STAMP_LEN 36
+
+/* Return the fractional part of st's modification time in nanoseconds. */
+static uint32_t mtime_nsec(const struct stat *st)
+{
+#if defined HAVE_STRUCT_STAT_ST_MTIMENSEC
+    return st->st_mtimensec;
+#elif defined HAVE_STRUCT_STAT_ST_MTIMESPEC_TV_NSEC
+    return st->st_mtimespec.tv_nsec;
+#elif defined HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC
+    return st->st_mtim.tv_nsec;
+#else
+    return 0;
+#endif
+}
+
+static void add_stamp(struct k5buf *buf, const struct stat *st)
+{
+    k5_buf_add_uint64_be(buf, st->st_dev);
+    k5_buf_add_uint64_be(buf, st->st_ino);
+    k5_buf_add_uint64_be(buf, st->st_size);
+    k5_buf_add_uint64_be(buf, st->st_mtime);
+    k5_buf_add_uint32_be(buf, mtime_nsec(st));
+}
+
+/*
+ * Record path as a dependency of the profile being parsed, if deps is not
+ * null.  If fp is not null, it is the open stream for path, and its status
+ * is used so that the stamp matches the contents being parsed.
+ */
+void profile_add_dep(struct profile_deps *deps, const char *path, FILE *fp)
+{
+    struct stat st;
+    int ret;
+
+    if (deps == NULL)
+        return;
+    ret = (fp != NULL) ? fstat(fileno(fp), &st) : stat(path, &st);
+    if (ret != 0) {
+        /* Put the buffer in an error state so the cache isn't written. */
+        k5_buf_free(&deps->buf);
+        return;
+    }
+    k5_buf_add_uint32_be(&deps->buf, strlen(path));
+    k5_buf_add(&deps->buf, path);
+    add_stamp(&deps->buf, &st);
+    deps->count++;
+}
+
+/* Return a 64-bit FNV-1a hash of str. */
+static uint64_t hash_string(const char *str)
+{
+    uint64_t h = 0xCBF29CE484222325ULL;
+
+    for (; *str != '\0'; str++) {
+        h ^= (unsigned char)*str;
+        h *= 0x100000001B3ULL;
+    }
+    return h;
+}
+
+/* Return the name of the compiled file for filespec, or NULL if caching is
+ * not enabled or memory is exhausted. */
+static char *cache_filename(const char *filespec)
+{
+    const char *dir;
+    char *fname;
+
+    dir = secure_getenv("KRB5_PROFILE_CACHEDIR");
+    if (dir == NULL || *dir == '\0')
+        return NULL;
+    if (asprintf(&fname, "%s/krb5_%lu_%016llx.profile", dir,
+                 (unsigned long)geteuid(),
+                 (unsigned long long)hash_string(filespec)) < 0)
+        return NULL;
+    return fname;
+}
+
+/* Return true if the dependency in in matches the file it names. */
+static int dep_current(struct k5input *in)
+{
+    struct stat st;
+    struct k5buf stamp;
+    const unsigned char *path, *expected;
+    char sbuf[STAMP_LEN + 1];
+    uint32_t len;
+    char *pathstr;
+    int ret;
+
+    len = k5_input_get_uint32_be(in);
+    path = k5_input_get_bytes(in, len);
+    expected = k5_input_get_bytes(in, STAMP_LEN);
+    if (in->status)
+        return 0;
+    pathstr = malloc(len + 1);
+    if (pathstr == NULL)
+        return 0;
+    memcpy(pathstr, path, len);
+    pathstr[len] = '\0';
+    ret = stat(pathstr, &st);
+    free(pathstr);
+    if (ret != 0)
+        return 0;
+    k5_buf_init_fixed(&stamp, sbuf, sizeof(sbuf));
+    add_stamp(&stamp, &st);
+    return stamp.len == STAMP_LEN && memcmp(sbuf, expected, STAMP_LEN) == 0;
+}
+
+/*
+ * Load the compiled tree for filespec into *root_out, if there is one and it
+ * is current.  Return an error if the profile must be parsed.
+ */
+errcode_t profile_read_cache(const char *filespec,
+                             struct profile_node **root_out)
+{
+    errcode_t retval = ENOENT;
+    struct k5input in;
+    struct stat st;
+    const unsigned char *name;
+    void *map = MAP_FAILED;
+    uint32_t len, count;
+    char *fname;
+    int fd = -1;
+
+    *root_out = NULL;
+    fname = cache_filename(filespec);
+    if (fname == NULL)
+        return ENOENT;
+    fd = open(fname, O_RDONLY | O_NOFOLLOW);
+    if (fd == -1)
+        goto cleanup;
+    set_cloexec_fd(fd);
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+        st.st_uid != geteuid() || (st.st_mode & 022) || st.st_size == 0)
+        goto cleanup;
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+        goto cleanup;
+
+    k5_input_init(&in, map, st.st_size);
+    if (k5_input_get_uint32_be(&in) != CACHE_MAGIC ||
+        k5_input_get_uint32_be(&in) != CACHE_VERSION)
+        goto cleanup;
+    len = k5_input_get_uint32_be(&in);
+    name = k5_input_get_bytes(&in, len);
+    if (in.status || len != strlen(filespec) ||
+        memcmp(name, filespec, len) != 0)
+        goto cleanup;
+    for (count = k5_input_get_uint32_be(&in); count > 0; count--) {
+        if (!dep_current(&in))
+            goto cleanup;
+    }
+    if (in.status)
+        goto cleanup;
+
+    retval = profile_unmarshal_tree(&in, root_out);
+    if (!retval && in.len != 0) {
+        profile_free_node(*root_out);
+        *root_out = NULL;
+        retval = PROF_BAD_LINK_LIST;
+    }
+
+cleanup:
+    if (map != MAP_FAILED)
+        munmap(map, st.st_size);
+    if (fd != -1)
+        close(fd);
+    free(fname);
+    return retval;
+}
+
+/* Save root as the compiled tree for filespec, if caching is enabled.  Errors
+ * are ignored, as the profile can always be parsed again. */
+void profile_write_cache(const char *filespec, struct profile_node *root,
+                         struct profile_deps *deps)
+{
+    struct k5buf buf;
+    char *fname, *tmpname = NULL;
+    ssize_t st;
+    int fd = -1;
+
+    if (k5_buf_status(&deps->buf) != 0)
+        return;
+    fname = cache_filename(filespec);
+    if (fname == NULL)
+        return;
+
+    k5_buf_init_dynamic(&buf);
+    k5_buf_add_uint32_be(&buf, CACHE_MAGIC);
+    k5_buf_add_uint32_be(&buf, CACHE_VERSION);
+    k5_buf_add_uint32_be(&buf, strlen(filespec));
+    k5_buf_add(&buf, filespec);
+    k5_buf_add_uint32_be(&buf, deps->count);
+    k5_buf_add_len(&buf, deps->buf.data, deps->buf.len);
+    profile_marshal_tree(root, &buf);
+    if (k5_buf_status(&buf) != 0)
+        goto cleanup;
+
+    if (asprintf(&tmpname, "%s.XXXXXX", fname) < 0) {
+        tmpname = NULL;
+        goto cleanup;
+    }
+    fd = mkstemp(tmpname);
+    if (fd < 0) {
+        free(tmpname);
+        tmpname = NULL;
+        goto cleanup;
+    }
+    set_cloexec_fd(fd);
+    st = write(fd, buf.data, buf.len);
+    if (st < 0 || (size_t)st != buf.len)
+        goto cleanup;
+    if (close(fd) != 0) {
+        fd = -1;
+        goto cleanup;
+    }
+    fd = -1;
+    if (rename(tmpname, fname) != 0)
+        goto cleanup;
+    free(tmpname);
+    tmpname = NULL;
+
+cleanup:
+    if (fd != -1)
+        close(fd);
+    if (tmpname != NULL) {
+        (void)unlink(tmpname);
+        free(tmpname);
+    }
+    k5_buf_free(&buf);
+    free(fname);
+}
+
+#else /* _WIN32 */
+
+void profile_add_dep(struct profile_deps *deps, const char *path, FILE *fp)
+{
+}
+
+errcode_t profile_read_cache(const char *filespec,
+                             struct profile_node **root_out)
+{
+    *root_out = NULL;
+    return ENOENT;
+}
+
+void profile_write_cache(const char *filespec, struct profile_node *root,
+                         struct profile_deps *deps)
+{
+}
+
+#endif /* _WIN32 */
@@ -271,7 +271,8 @@ errcode_t profile_update_file_data_locked(prf_data_t data, char **ret_modspec)
     time_t now;
 #endif
     FILE *f;
-    int isdir = 0;
+    int isdir = 0, cacheable = 0;
+    struct profile_deps deps;
 
     if ((data->flags & PROFILE_FILE_NO_RELOAD) && data->root != NULL)
         return 0;
@@ -320,6 +321,18 @@ errcode_t profile_update_file_data_locked(prf_data_t data, char **ret_modspec)
 
 #ifdef HAVE_STAT
     isdir = S_ISDIR(st.st_mode);
+    cacheable = isdir || S_ISREG(st.st_mode);
+
+    /* Use a compiled copy of the tree if one is current. */
+    if (cacheable && profile_read_cache(data->filespec, &data->root) == 0) {
+        /* The index only speeds up lookups, so failure is harmless. */
+        (void)profile_index_tree(data->root);
+        data->upd_serial++;
+        data->flags &= ~PROFILE_FILE_DIRTY;
+        data->timestamp = st.st_mtime;
+        data->frac_ts = frac;
+        return 0;
+    }
 #endif
     if (!isdir) {
         errno = 0;
@@ -332,16 +345,24 @@ errcode_t profile_update_file_data_locked(prf_data_t data, char **ret_modspec)
     data->upd_serial++;
     data->flags &= ~PROFILE_FILE_DIRTY;
 
+    deps.count = 0;
+    k5_buf_init_dynamic(&deps.buf);
     if (isdir) {
-        retval = profile_process_directory(data->filespec, &data->root);
+        retval = profile_process_directory(data->filespec, &data->root,
+                                           &deps);
     } else {
-        retval = profile_parse_file(f, &data->root, ret_modspec);
+        profile_add_dep(&deps, data->filespec, f);
+        retval = profile_parse_file(f, &data->root, ret_modspec, &deps);
         (void)fclose(f);
     }
+    if (!retval && cacheable)
+        profile_write_cache(data->filespec, data->root, &deps);
+    k5_buf_free(&deps.buf);
     if (retval) {
         return retval;
     }
     assert(data->root != NULL);
+    (void)profile_index_tree(data->root);
 #ifdef HAVE_STAT
     data->timestamp = st.st_mtime;
     data->frac_ts = frac;
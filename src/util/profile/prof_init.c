@@ -413,6 +413,35 @@ profile_is_modified(profile_t profile, int *modified)
     return 0;
 }
 
+errcode_t KRB5_CALLCONV
+profile_get_serial(profile_t profile, unsigned long *serial_out)
+{
+    prf_file_t file;
+    unsigned long serial = 0;
+
+    if (!profile || profile->magic != PROF_MAGIC_PROFILE)
+        return PROF_MAGIC_PROFILE;
+
+    if (!serial_out)
+        return EINVAL;
+    *serial_out = 0;
+
+    if (profile->vt)
+        return PROF_UNSUPPORTED;
+
+    /* Reload any changed files, as a lookup would, and sum their update
+     * serials, which only increase. */
+    for (file = profile->first_file; file; file = file->next) {
+        k5_mutex_lock(&file->data->lock);
+        (void)profile_update_file_locked(file, NULL);
+        serial += file->data->upd_serial;
+        k5_mutex_unlock(&file->data->lock);
+    }
+
+    *serial_out = serial;
+    return 0;
+}
+
 errcode_t KRB5_CALLCONV
 profile_flush(profile_t profile)
 {
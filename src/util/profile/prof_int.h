@@ -3,6 +3,8 @@
  */
 
 #include "k5-platform.h"
+#include "k5-buf.h"
+#include "k5-input.h"
 #include "k5-thread.h"
 #include "k5-plugin.h"
 
@@ -115,13 +117,24 @@ struct _profile_t {
 
 #define	PROFILE_LAST_FILESPEC(x) (((x) == NULL) || ((x)[0] == '\0'))
 
+/*
+ * A list of the files and directories read while parsing a profile, recorded
+ * so that a compiled copy of the parse tree can be validated against them.
+ */
+struct profile_deps {
+	struct k5buf	buf;
+	uint32_t	count;
+};
+
 /* profile_parse.c */
 
 errcode_t profile_parse_file
-	(FILE *f, struct profile_node **root, char **ret_modspec);
+	(FILE *f, struct profile_node **root, char **ret_modspec,
+	 struct profile_deps *deps);
 
 errcode_t profile_process_directory
-	(const char *dirname, struct profile_node **root);
+	(const char *dirname, struct profile_node **root,
+	 struct profile_deps *deps);
 
 errcode_t profile_write_tree_file
 	(struct profile_node *root, FILE *dstfile);
@@ -206,6 +219,27 @@ errcode_t profile_set_relation_value
 errcode_t profile_rename_node
 	(struct profile_node *node, const char *new_name);
 
+void profile_marshal_tree
+	(struct profile_node *node, struct k5buf *buf);
+
+errcode_t profile_unmarshal_tree
+	(struct k5input *in, struct profile_node **root_out);
+
+errcode_t profile_index_tree
+	(struct profile_node *section);
+
+/* prof_cache.c */
+
+void profile_add_dep
+	(struct profile_deps *deps, const char *path, FILE *fp);
+
+errcode_t profile_read_cache
+	(const char *filespec, struct profile_node **root_out);
+
+void profile_write_cache
+	(const char *filespec, struct profile_node *root,
+	 struct profile_deps *deps);
+
 /* prof_file.c */
 
 errcode_t KRB5_CALLCONV profile_copy (profile_t, profile_t *);
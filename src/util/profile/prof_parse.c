@@ -24,6 +24,7 @@ struct parse_state {
     int     group_level;
     struct profile_node *root_section;
     struct profile_node *current_section;
+    struct profile_deps *deps;
 };
 
 static errcode_t parse_file(FILE *f, struct parse_state *state,
@@ -200,7 +201,8 @@ static errcode_t parse_std_line(char *line, struct parse_state *state)
 
 /* Open and parse an included profile file. */
 static errcode_t parse_include_file(const char *filename,
-                                    struct profile_node *root_section)
+                                    struct profile_node *root_section,
+                                    struct profile_deps *deps)
 {
     FILE    *fp;
     errcode_t retval = 0;
@@ -212,10 +214,12 @@ static errcode_t parse_include_file(const char *filename,
     state.group_level = 0;
     state.root_section = root_section;
     state.current_section = NULL;
+    state.deps = deps;
 
     fp = fopen(filename, "r");
     if (fp == NULL)
         return PROF_FAIL_INCLUDE_FILE;
+    profile_add_dep(deps, filename, fp);
     retval = parse_file(fp, &state, NULL);
     fclose(fp);
     return retval;
@@ -249,12 +253,15 @@ static int valid_name(const char *filename)
  * files, and the like.  Files are processed in alphanumeric order.
  */
 static errcode_t parse_include_dir(const char *dirname,
-                                   struct profile_node *root_section)
+                                   struct profile_node *root_section,
+                                   struct profile_deps *deps)
 {
     errcode_t retval = 0;
     char **fnames, *pathname;
     int i;
 
+    /* Record the directory so that added or removed files are noticed. */
+    profile_add_dep(deps, dirname, NULL);
     if (k5_dir_filenames(dirname, &fnames) != 0)
         return PROF_FAIL_INCLUDE_DIR;
 
@@ -265,7 +272,7 @@ static errcode_t parse_include_dir(const char *dirname,
             retval = ENOMEM;
             break;
         }
-        retval = parse_include_file(pathname, root_section);
+        retval = parse_include_file(pathname, root_section, deps);
         free(pathname);
         if (retval)
             break;
@@ -282,12 +289,12 @@ static errcode_t parse_line(char *line, struct parse_state *state,
     if (strncmp(line, "include", 7) == 0 && isspace(line[7])) {
         cp = skip_over_blanks(line + 7);
         strip_line(cp);
-        return parse_include_file(cp, state->root_section);
+        return parse_include_file(cp, state->root_section, state->deps);
     }
     if (strncmp(line, "includedir", 10) == 0 && isspace(line[10])) {
         cp = skip_over_blanks(line + 10);
         strip_line(cp);
-        return parse_include_dir(cp, state->root_section);
+        return parse_include_dir(cp, state->root_section, state->deps);
     }
     switch (state->state) {
     case STATE_INIT_COMMENT:
@@ -398,7 +405,7 @@ static errcode_t parse_file(FILE *f, struct parse_state *state,
 }
 
 errcode_t profile_parse_file(FILE *f, struct profile_node **root,
-                             char **ret_modspec)
+                             char **ret_modspec, struct profile_deps *deps)
 {
     struct parse_state state;
     errcode_t retval;
@@ -409,6 +416,7 @@ errcode_t profile_parse_file(FILE *f, struct profile_node **root,
     state.state = STATE_INIT_COMMENT;
     state.group_level = 0;
     state.current_section = NULL;
+    state.deps = deps;
     retval = profile_create_node("(root)", 0, &state.root_section);
     if (retval)
         return retval;
@@ -423,7 +431,8 @@ errcode_t profile_parse_file(FILE *f, struct profile_node **root,
 }
 
 errcode_t profile_process_directory(const char *dirname,
-                                    struct profile_node **root)
+                                    struct profile_node **root,
+                                    struct profile_deps *deps)
 {
     errcode_t retval;
     struct profile_node *node;
@@ -432,7 +441,7 @@ errcode_t profile_process_directory(const char *dirname,
     retval = profile_create_node("(root)", 0, &node);
     if (retval)
         return retval;
-    retval = parse_include_dir(dirname, node);
+    retval = parse_include_dir(dirname, node, deps);
     if (retval) {
         profile_free_node(node);
         return retval;
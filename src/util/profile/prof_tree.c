@@ -15,6 +15,13 @@
  * A relation has as its value a pointer to allocated memory
  * containing a string.  Its first_child pointer must be null.
  *
+ * The children of a section are kept sorted by name.  Once a tree has been
+ * read from a file, sections with many children also carry a hash index
+ * mapping each child name to the first child with that name, so that lookups
+ * need not walk the whole list.  An index is discarded if its section's
+ * children are added to or renamed, and lookups in that section revert to
+ * walking the list.
+ *
  */
 
 
@@ -38,12 +45,113 @@ struct profile_node {
     struct profile_node *first_child;
     struct profile_node *parent;
     struct profile_node *next, *prev;
+    struct profile_node **index;    /* Open-addressed table of children */
+    unsigned int index_mask;        /* Table size minus one */
 };
 
+/* Only index sections with at least this many children. */
+#define INDEX_MIN_CHILDREN 8
+
 #define CHECK_MAGIC(node)                       \
     if ((node)->magic != PROF_MAGIC_NODE)       \
         return PROF_MAGIC_NODE;
 
+/* Return a 32-bit FNV-1a hash of str. */
+static unsigned int hash_name(const char *str)
+{
+    unsigned int h = 2166136261U;
+
+    for (; *str != '\0'; str++) {
+        h ^= (unsigned char)*str;
+        h *= 16777619U;
+    }
+    return h;
+}
+
+/* Discard the child index of section, if it has one. */
+static void drop_index(struct profile_node *section)
+{
+    free(section->index);
+    section->index = NULL;
+    section->index_mask = 0;
+}
+
+/*
+ * Return the first child of section named name, or NULL if there is none.
+ * Deleted children are not skipped.  Since children are sorted by name, the
+ * caller can find the rest of the children named name by following the next
+ * pointers until the name changes.
+ */
+static struct profile_node *first_named_child(struct profile_node *section,
+                                              const char *name)
+{
+    struct profile_node *p;
+    unsigned int i;
+    int cmp;
+
+    if (section->index != NULL) {
+        i = hash_name(name) & section->index_mask;
+        for (; section->index[i] != NULL; i = (i + 1) & section->index_mask) {
+            if (strcmp(section->index[i]->name, name) == 0)
+                return section->index[i];
+        }
+        return NULL;
+    }
+
+    for (p = section->first_child; p != NULL; p = p->next) {
+        cmp = strcmp(p->name, name);
+        if (cmp == 0)
+            return p;
+        if (cmp > 0)
+            break;
+    }
+    return NULL;
+}
+
+/* Return true if p sorts after name, so no further child can match it. */
+static inline int past_name(struct profile_node *p, const char *name)
+{
+    return name != NULL && strcmp(p->name, name) > 0;
+}
+
+/* Build a child name index for section and (recursively) its subsections. */
+errcode_t profile_index_tree(struct profile_node *section)
+{
+    struct profile_node *p;
+    unsigned int count = 0, size, i;
+    errcode_t retval;
+
+    CHECK_MAGIC(section);
+    drop_index(section);
+    for (p = section->first_child; p != NULL; p = p->next) {
+        if (p->value == NULL) {
+            retval = profile_index_tree(p);
+            if (retval)
+                return retval;
+        }
+        if (p->prev == NULL || strcmp(p->prev->name, p->name) != 0)
+            count++;
+    }
+    if (count < INDEX_MIN_CHILDREN)
+        return 0;
+
+    /* Keep the table at most half full. */
+    for (size = 16; size < count * 2; size *= 2);
+    section->index = calloc(size, sizeof(*section->index));
+    if (section->index == NULL)
+        return ENOMEM;
+    section->index_mask = size - 1;
+    for (p = section->first_child; p != NULL; p = p->next) {
+        if (p->prev != NULL && strcmp(p->prev->name, p->name) == 0)
+            continue;
+        i = hash_name(p->name) & section->index_mask;
+        while (section->index[i] != NULL)
+            i = (i + 1) & section->index_mask;
+        section->index[i] = p;
+    }
+    return 0;
+}
+
 /*
  * Free a node, and any children
  */
@@ -58,6 +166,7 @@ void profile_free_node(struct profile_node *node)
         free(node->name);
     if (node->value)
         free(node->value);
+    free(node->index);
 
     for (child=node->first_child; child; child = next) {
         next = child->next;
@@ -179,6 +288,7 @@ errcode_t profile_add_node(struct profile_node *section, const char *name,
     retval = profile_create_node(name, value, &new);
     if (retval)
         return retval;
+    drop_index(section);
     new->group_level = section->group_level+1;
     new->deleted = 0;
     new->parent = section;
@@ -258,10 +368,12 @@ errcode_t profile_find_node(struct profile_node *section, const char *name,
     p = *state;
     if (p) {
         CHECK_MAGIC(p);
+    } else if (name) {
+        p = first_named_child(section, name);
     } else
         p = section->first_child;
 
-    for (; p; p = p->next) {
+    for (; p && !past_name(p, name); p = p->next) {
         if (name && (strcmp(p->name, name)))
             continue;
         if (section_flag) {
@@ -280,7 +392,7 @@ errcode_t profile_find_node(struct profile_node *section, const char *name,
             *node = p;
         break;
     }
-    if (p == 0) {
+    if (p == 0 || past_name(p, name)) {
         *state = 0;
         return section_flag ? PROF_NO_SECTION : PROF_NO_RELATION;
     }
@@ -289,7 +401,7 @@ errcode_t profile_find_node(struct profile_node *section, const char *name,
      * one.  This way, if we return a non-zero state pointer,
      * there's guaranteed to be another match that's returned.
      */
-    for (p = p->next; p; p = p->next) {
+    for (p = p->next; p && !past_name(p, name); p = p->next) {
         if (name && (strcmp(p->name, name)))
             continue;
         if (section_flag) {
@@ -306,7 +418,7 @@ errcode_t profile_find_node(struct profile_node *section, const char *name,
         /* A match! */
         break;
     }
-    *state = p;
+    *state = (p != NULL && !past_name(p, name)) ? p : NULL;
     return 0;
 }
 
@@ -527,8 +639,12 @@ get_new_file:
         section = iter->file->data->root;
         assert(section != NULL);
         for (cpp = iter->names; cpp[iter->done_idx]; cpp++) {
-            for (p=section->first_child; p; p = p->next) {
-                if (!strcmp(p->name, *cpp) && !p->value && !p->deleted)
+            for (p = first_named_child(section, *cpp); p; p = p->next) {
+                if (past_name(p, *cpp)) {
+                    p = NULL;
+                    break;
+                }
+                if (!p->value && !p->deleted)
                     break;
             }
             if (!p) {
@@ -548,13 +664,20 @@ get_new_file:
             goto get_new_file;
         }
         iter->name = *cpp;
-        iter->node = section->first_child;
+        if (iter->name != NULL)
+            iter->node = first_named_child(section, iter->name);
+        else
+            iter->node = section->first_child;
     }
     /*
      * OK, now we know iter->node is set up correctly.  Let's do
      * the search.
      */
     for (p = iter->node; p; p = p->next) {
+        if (past_name(p, iter->name)) {
+            p = NULL;
+            break;
+        }
         if (iter->name && strcmp(p->name, iter->name))
             continue;
         if ((iter->flags & PROFILE_ITER_SECTIONS_ONLY) &&
@@ -656,6 +779,7 @@ errcode_t profile_rename_node(struct profile_node *node, const char *new_name)
     new_string = strdup(new_name);
     if (!new_string)
         return ENOMEM;
+    drop_index(node->parent);
 
     /*
      * Find the place to where the new node should go.  We look
@@ -698,3 +822,117 @@ errcode_t profile_rename_node(struct profile_node *node, const char *new_name)
     node->name = new_string;
     return 0;
 }
+
+/* Bound the nesting depth accepted by profile_unmarshal_tree(). */
+#define MAX_UNMARSHAL_DEPTH 64
+
+/*
+ * Marshal the tree rooted at node into buf, omitting deleted nodes.  Each
+ * node is written as a flags byte, its name and (for relations) its value as
+ * 32-bit big-endian lengths followed by bytes, and a 32-bit count of the
+ * children which follow it.
+ */
+void profile_marshal_tree(struct profile_node *node, struct k5buf *buf)
+{
+    struct profile_node *p;
+    uint32_t count = 0;
+    unsigned char flags;
+
+    flags = (node->final ? 1 : 0) | (node->value != NULL ? 2 : 0);
+    k5_buf_add_len(buf, &flags, 1);
+    k5_buf_add_uint32_be(buf, strlen(node->name));
+    k5_buf_add(buf, node->name);
+    if (node->value != NULL) {
+        k5_buf_add_uint32_be(buf, strlen(node->value));
+        k5_buf_add(buf, node->value);
+    }
+    for (p = node->first_child; p != NULL; p = p->next)
+        count += !p->deleted;
+    k5_buf_add_uint32_be(buf, count);
+    for (p = node->first_child; p != NULL; p = p->next) {
+        if (!p->deleted)
+            profile_marshal_tree(p, buf);
+    }
+}
+
+/* Read a counted string from in into a newly allocated C string. */
+static char *get_string(struct k5input *in)
+{
+    const unsigned char *bytes;
+    uint32_t len;
+    char *str;
+
+    len = k5_input_get_uint32_be(in);
+    bytes = k5_input_get_bytes(in, len);
+    if (bytes == NULL || memchr(bytes, '\0', len) != NULL)
+        return NULL;
+    str = malloc(len + 1);
+    if (str == NULL)
+        return NULL;
+    memcpy(str, bytes, len);
+    str[len] = '\0';
+    return str;
+}
+
+static errcode_t unmarshal_node(struct k5input *in, struct profile_node *parent,
+                                int depth, struct profile_node **node_out)
+{
+    errcode_t retval;
+    struct profile_node *node, *child, *last = NULL;
+    uint32_t count;
+    int flags;
+
+    *node_out = NULL;
+    if (depth > MAX_UNMARSHAL_DEPTH)
+        return PROF_BAD_GROUP_LVL;
+    node = calloc(1, sizeof(*node));
+    if (node == NULL)
+        return ENOMEM;
+    node->magic = PROF_MAGIC_NODE;
+    node->parent = parent;
+    node->group_level = (parent == NULL) ? 0 : parent->group_level + 1;
+
+    retval = PROF_BAD_LINK_LIST;
+    flags = k5_input_get_byte(in);
+    node->final = (flags & 1) != 0;
+    node->name = get_string(in);
+    if (node->name == NULL)
+        goto cleanup;
+    if (flags & 2) {
+        node->value = get_string(in);
+        if (node->value == NULL)
+            goto cleanup;
+    }
+    count = k5_input_get_uint32_be(in);
+    if (in->status || (node->value != NULL && count > 0))
+        goto cleanup;
+
+    /* Children were marshalled in sorted order, so append them. */
+    for (; count > 0; count--) {
+        retval = unmarshal_node(in, node, depth + 1, &child);
+        if (retval)
+            goto cleanup;
+        child->prev = last;
+        if (last != NULL)
+            last->next = child;
+        else
+            node->first_child = child;
+        last = child;
+    }
+
+    *node_out = node;
+    node = NULL;
+    retval = 0;
+
+cleanup:
+    if (node != NULL)
+        profile_free_node(node);
+    return retval;
+}
+
+/* Reconstruct a tree marshalled by profile_marshal_tree() from in. */
+errcode_t profile_unmarshal_tree(struct k5input *in,
+                                 struct profile_node **root_out)
+{
+    return unmarshal_node(in, NULL, 0, root_out);
+}
@@ -0,0 +1,133 @@
+/* -*- mode: c; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/* util/profile/test_lookup.c - Profile lookup benchmark */
+/*
+ * Copyright (C) 2020 by the Massachusetts Institute of Technology.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * * Redistributions of source code must retain the above copyright
+ *   notice, this list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright
+ *   notice, this list of conditions and the following disclaimer in
+ *   the documentation and/or other materials provided with the
+ *   distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT,
+ * INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
+ * OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * This program measures the cost of profile lookups in a large
+ * configuration.  It writes a profile with nrealms entries in each of the
+ * [realms] and [domain_realm] sections, and then looks up every realm's kdc
+ * and admin_server values and every host's realm iterations times, checking
+ * each result.  Sample usage:
+ *
+ *     ./test_lookup 300 1000
+ *
+ * Run the command under "time" to measure the lookup cost.
+ */
+
+#include "k5-platform.h"
+#include "profile.h"
+
+#define PROFILE_NAME "test_lookup.ini"
+
+static void
+write_profile(int nrealms)
+{
+    FILE *fp;
+    int i;
+
+    fp = fopen(PROFILE_NAME, "w");
+    assert(fp != NULL);
+    fprintf(fp, "[libdefaults]\n\tdefault_realm = R0.EXAMPLE\n\n");
+    fprintf(fp, "[realms]\n");
+    for (i = 0; i < nrealms; i++) {
+        fprintf(fp, "\tR%d.EXAMPLE = {\n", i);
+        fprintf(fp, "\t\tkdc = kdc1.r%d.example\n", i);
+        fprintf(fp, "\t\tkdc = kdc2.r%d.example\n", i);
+        fprintf(fp, "\t\tadmin_server = admin.r%d.example\n", i);
+        fprintf(fp, "\t}\n");
+    }
+    fprintf(fp, "\n[domain_realm]\n");
+    for (i = 0; i < nrealms; i++) {
+        fprintf(fp, "\t.r%d.example = R%d.EXAMPLE\n", i, i);
+        fprintf(fp, "\thost.r%d.example = R%d.EXAMPLE\n", i, i);
+    }
+    assert(fclose(fp) == 0);
+}
+
+static void
+lookup_realm(profile_t pr, int i)
+{
+    const char *names[4];
+    char realm[64], host[64], expected[64], **values;
+
+    snprintf(realm, sizeof(realm), "R%d.EXAMPLE", i);
+    names[0] = "realms";
+    names[1] = realm;
+    names[2] = "kdc";
+    names[3] = NULL;
+    assert(profile_get_values(pr, names, &values) == 0);
+    snprintf(expected, sizeof(expected), "kdc2.r%d.example", i);
+    assert(values[0] != NULL && values[1] != NULL && values[2] == NULL);
+    assert(strcmp(values[1], expected) == 0);
+    profile_free_list(values);
+
+    names[2] = "admin_server";
+    assert(profile_get_values(pr, names, &values) == 0);
+    snprintf(expected, sizeof(expected), "admin.r%d.example", i);
+    assert(strcmp(values[0], expected) == 0 && values[1] == NULL);
+    profile_free_list(values);
+
+    snprintf(host, sizeof(host), "host.r%d.example", i);
+    names[0] = "domain_realm";
+    names[1] = host;
+    names[2] = NULL;
+    assert(profile_get_values(pr, names, &values) == 0);
+    assert(strcmp(values[0], realm) == 0 && values[1] == NULL);
+    profile_free_list(values);
+
+    names[1] = "nosuchhost.example";
+    assert(profile_get_values(pr, names, &values) == PROF_NO_RELATION);
+}
+
+int
+main(int argc, char **argv)
+{
+    profile_t pr;
+    int nrealms, iterations, i, j;
+
+    if (argc != 3) {
+        fprintf(stderr, "Usage: test_lookup nrealms iterations\n");
+        exit(1);
+    }
+    nrealms = atoi(argv[1]);
+    iterations = atoi(argv[2]);
+    assert(nrealms > 0 && iterations > 0);
+
+    write_profile(nrealms);
+    assert(profile_init_path(PROFILE_NAME, &pr) == 0);
+    for (j = 0; j < iterations; j++) {
+        for (i = 0; i < nrealms; i++)
+            lookup_realm(pr, i);
+    }
+    profile_release(pr);
+    (void)unlink(PROFILE_NAME);
+    return 0;
+}
@@ -238,6 +238,7 @@ int main()
     char **values, *str, *name, *value;
     void *iter;
     int intval;
+    unsigned long serial;
 
     assert(profile_init_vtable(&basic_vtable, &basic_cbdata, &profile) == 0);
     assert(profile_get_values(profile, empty_names, &values) == 0);
@@ -251,6 +252,7 @@ int main()
     assert(intval == 0);
     assert(profile_is_modified(profile, &intval) == 0);
     assert(intval == 0);
+    assert(profile_get_serial(profile, &serial) == PROF_UNSUPPORTED);
     assert(profile_update_relation(profile, NULL, NULL, NULL) ==
            PROF_UNSUPPORTED);
     assert(profile_clear_relation(profile, NULL) == PROF_UNSUPPORTED);
@@ -96,12 +96,10 @@ static k5_mutex_t key_lock = K5_MUTEX_PARTIAL_INITIALIZER;
 static void (*destructors[K5_KEY_MAX])(void *);
 static unsigned char destructors_set[K5_KEY_MAX];
 
-/* This is not safe yet!
-
-   Thread termination concurrent with key deletion can cause two
-   threads to interfere.  It's a bit tricky, since one of the threads
-   will want to remove this structure from the list being walked by
-   the other.
+/* Thread termination and key deletion both hold key_lock while they
+   walk or modify the list of thread-specific data blocks, so a
+   terminating thread's block is either destroyed by the thread or
+   has its values destroyed by k5_key_delete, never both.
 
    Other cases, like looking up data while the library owning the key
    is in the process of being unloaded, we don't worry about.  */
@@ -111,6 +109,12 @@ struct tsd_block {
     void *values[K5_KEY_MAX];
 };
 
+/* The thread-specific data blocks of all threads, so that a key's values can
+ * be destroyed in every thread when the key is deleted.  When both locks are
+ * needed, key_lock is taken first. */
+static k5_mutex_t tsd_list_lock = K5_MUTEX_PARTIAL_INITIALIZER;
+static struct tsd_block *tsd_list;
+
 #ifdef HAVE_PRAGMA_WEAK_REF
 # pragma weak pthread_once
 # pragma weak pthread_mutex_lock
@@ -193,10 +197,20 @@ static void thread_termination(void *);
 static void thread_termination (void *tptr)
 {
     int i, pass, none_found;
-    struct tsd_block *t = tptr;
+    struct tsd_block *t = tptr, **tp;
 
     k5_mutex_lock(&key_lock);
 
+    /* Remove this thread's block from the global list. */
+    k5_mutex_lock(&tsd_list_lock);
+    for (tp = &tsd_list; *tp != NULL; tp = &(*tp)->next) {
+        if (*tp == t) {
+            *tp = t->next;
+            break;
+        }
+    }
+    k5_mutex_unlock(&tsd_list_lock);
+
     /*
      * Make multiple passes in case, for example, a libkrb5 cleanup
      * function wants to print out an error message, which causes
@@ -222,8 +236,6 @@ static void thread_termination (void *tptr)
     }
     free (t);
     k5_mutex_unlock(&key_lock);
-
-    /* remove thread from global linked list */
 }
 
 #endif /* no threads vs Win32 vs POSIX */
@@ -306,13 +318,15 @@ int k5_setspecific (k5_key_t keynum, void *value)
                 return ENOMEM;
             for (i = 0; i < K5_KEY_MAX; i++)
                 t->values[i] = 0;
-            /* add to global linked list */
-            t->next = 0;
             err = pthread_setspecific(key, t);
             if (err) {
                 free(t);
                 return err;
             }
+            k5_mutex_lock(&tsd_list_lock);
+            t->next = tsd_list;
+            tsd_list = t;
+            k5_mutex_unlock(&tsd_list_lock);
         }
     } else {
         t = GET_NO_PTHREAD_TSD();
@@ -384,9 +398,33 @@ int k5_key_delete (k5_key_t keynum)
 
 #else /* POSIX */
 
-    /* XXX RESOURCE LEAK: Need to destroy the allocated objects first!  */
+    struct tsd_block *t;
+    void *value;
+
     k5_mutex_lock(&key_lock);
     assert(destructors_set[keynum] == 1);
+
+    /* Destroy the key's value in each thread, one at a time so that the
+     * destructor is not called with tsd_list_lock held. */
+    if (!K5_PTHREADS_LOADED) {
+        t = GET_NO_PTHREAD_TSD();
+        value = t->values[keynum];
+        t->values[keynum] = NULL;
+        if (destructors[keynum] != NULL && value != NULL)
+            (*destructors[keynum])(value);
+    }
+    do {
+        value = NULL;
+        k5_mutex_lock(&tsd_list_lock);
+        for (t = tsd_list; t != NULL && value == NULL; t = t->next) {
+            value = t->values[keynum];
+            t->values[keynum] = NULL;
+        }
+        k5_mutex_unlock(&tsd_list_lock);
+        if (destructors[keynum] != NULL && value != NULL)
+            (*destructors[keynum])(value);
+    } while (value != NULL);
+
     destructors_set[keynum] = 0;
     destructors[keynum] = NULL;
     k5_mutex_unlock(&key_lock);
@@ -424,6 +462,9 @@ int krb5int_thread_support_init (void)
 #else /* POSIX */
 
     err = k5_mutex_finish_init(&key_lock);
+    if (err)
+        return err;
+    err = k5_mutex_finish_init(&tsd_list_lock);
     if (err)
         return err;
     if (K5_PTHREADS_LOADED) {
@@ -471,6 +512,7 @@ void krb5int_thread_support_fini (void)
     if (K5_PTHREADS_LOADED)
         pthread_key_delete(key);
     /* ... delete stuff ... */
+    k5_mutex_destroy(&tsd_list_lock);
     k5_mutex_destroy(&key_lock);
 
 #endif
@@ -2,7 +2,8 @@ import kdcproxy
 import os
 import ssl
 import sys
-from wsgiref.simple_server import make_server
+from wsgiref.simple_server import make_server, ServerHandler
+from wsgiref.simple_server import WSGIRequestHandler
 
 if len(sys.argv) > 1:
     port = int(sys.argv[1])
@@ -12,8 +13,36 @@ if len(sys.argv) > 2:
     pem = sys.argv[2]
 else:
     pem = '*'
+keepalive = len(sys.argv) > 3 and sys.argv[3] == 'keepalive'
 
-server = make_server('localhost', port, kdcproxy.Application())
+
+# With the keepalive argument, advertise HTTP keep-alive and serve further
+# requests on each connection until the client closes it.
+class KeepAliveServerHandler(ServerHandler):
+    def cleanup_headers(self):
+        ServerHandler.cleanup_headers(self)
+        self.headers['Connection'] = 'keep-alive'
+
+
+class KeepAliveRequestHandler(WSGIRequestHandler):
+    def handle(self):
+        while True:
+            self.raw_requestline = self.rfile.readline(65537)
+            if not self.raw_requestline or not self.parse_request():
+                return
+            handler = KeepAliveServerHandler(self.rfile, self.wfile,
+                                             self.get_stderr(),
+                                             self.get_environ(),
+                                             multithread=False)
+            handler.request_handler = self
+            handler.run(self.server.get_app())
+
+
+if keepalive:
+    server = make_server('localhost', port, kdcproxy.Application(),
+                         handler_class=KeepAliveRequestHandler)
+else:
+    server = make_server('localhost', port, kdcproxy.Application())
 server.socket = ssl.wrap_socket(server.socket, certfile=pem, server_side=True)
 os.write(sys.stdout.fileno(), b'proxy server ready\n')
 server.serve_forever()